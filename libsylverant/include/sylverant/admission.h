@@ -0,0 +1,78 @@
+/*
+    This file is part of Sylverant PSO Server.
+
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYLVERANT__ADMISSION_H
+#define SYLVERANT__ADMISSION_H
+
+#include <sys/socket.h>
+
+#include <sylverant/config.h>
+
+/* Connection admission control. This keeps a flood of clients (like the whole
+   population of a ship that just went down) from all starting their handshakes
+   at once. New connections are limited by a token bucket per source address and
+   one overall, and only so many connections may be in the middle of their
+   handshake at a time. Clients that are over the limit are either told to wait
+   (rate limited as well, since telling them costs an encryption setup) or just
+   dropped. */
+
+/* Defaults for anything not set in the configuration. Rates are in connections
+   per second, bursts are in connections. */
+#define SYLVERANT_ADMIT_GLOBAL_RATE     20.0
+#define SYLVERANT_ADMIT_GLOBAL_BURST    40.0
+#define SYLVERANT_ADMIT_ADDR_RATE       2.0
+#define SYLVERANT_ADMIT_ADDR_BURST      16.0
+#define SYLVERANT_ADMIT_NOTICE_RATE     10.0
+#define SYLVERANT_ADMIT_NOTICE_BURST    20.0
+
+/* Results from sylverant_admit_check. */
+#define SYLVERANT_ADMIT_OK      0   /* Go ahead with the connection. */
+#define SYLVERANT_ADMIT_WAIT    1   /* Tell the client to wait, then drop it. */
+#define SYLVERANT_ADMIT_DROP    2   /* Drop the connection right away. */
+
+typedef struct sylverant_admit sylverant_admit_t;
+
+struct _xmlNode;
+
+/* Mark everything in a set of admission settings as not given. */
+extern void sylverant_admit_cfg_init(sylverant_admitcfg_t *cfg);
+
+/* Read the attributes of an <admission> tag into a set of admission settings.
+   Returns 0 on success, or -1 if any of them are invalid. */
+extern int sylverant_admit_parse(struct _xmlNode *n,
+                                 sylverant_admitcfg_t *cfg);
+
+/* Create an admission controller with the given settings. If the configuration
+   doesn't say how many connections may be in their handshake at once,
+   def_pending is used. Returns NULL on failure. */
+extern sylverant_admit_t *sylverant_admit_new(const sylverant_admitcfg_t *cfg,
+                                              int def_pending);
+
+/* Destroy an admission controller. */
+extern void sylverant_admit_free(sylverant_admit_t *a);
+
+/* Decide what to do with a newly accepted connection. If this returns
+   SYLVERANT_ADMIT_OK, the connection counts as pending until it is passed to
+   sylverant_admit_done. Safe to call from multiple threads. */
+extern int sylverant_admit_check(sylverant_admit_t *a,
+                                 const struct sockaddr *addr);
+
+/* Mark a pending connection as done with its handshake (or disconnected). */
+extern void sylverant_admit_done(sylverant_admit_t *a);
+
+#endif /* !SYLVERANT__ADMISSION_H */
@@ -71,6 +71,18 @@ typedef struct sylverant_dbconfig {
     uint16_t port;
 } sylverant_dbconfig_t;
 
+/* Admission control settings, from the <admission> tag. Anything that isn't
+   given is negative, and uses the default (see admission.h). A rate or a
+   pending count of 0 turns that limit off. Rates are in connections per
+   second, bursts are in connections. */
+typedef struct sylverant_admitcfg {
+    int max_pending;
+    double rate;
+    double burst;
+    double addr_rate;
+    double addr_burst;
+} sylverant_admitcfg_t;
+
 typedef struct sylverant_info_file {
     char *desc;
     char *filename;
@@ -86,10 +98,12 @@ typedef struct sylverant_config {
     char *shipgate_cert;
     char *shipgate_key;
     char *shipgate_ca;
+    char *shipgate_ticket_key;
     char *quests_dir;
     char *limits_file;
     sylverant_info_file_t *info_files;
     int info_file_count;
+    sylverant_admitcfg_t admit;
 } sylverant_config_t;
 
 typedef struct sylverant_event {
@@ -142,6 +156,8 @@ typedef struct sylverant_shipcfg {
     int blocks;
     int info_file_count;
     int event_count;
+
+    sylverant_admitcfg_t admit;
 } sylverant_ship_t;
 
 /* Read the configuration for the login server, shipgate, and patch server. */
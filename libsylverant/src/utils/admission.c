@@ -0,0 +1,318 @@
+/*
+    This file is part of Sylverant PSO Server.
+
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+
+#include <libxml/tree.h>
+
+#include "sylverant/admission.h"
+#include "sylverant/debug.h"
+
+#define XC (const xmlChar *)
+
+#define ADDR_BUCKETS    1024
+
+/* Don't let a flood of distinct addresses eat all our memory. Once we're
+   tracking this many, new addresses only get checked against the global
+   limit. */
+#define MAX_ADDRS       65536
+
+typedef struct tbucket {
+    double tokens;
+    double last;
+} tbucket_t;
+
+typedef struct addr_ent {
+    TAILQ_ENTRY(addr_ent) qentry;
+    int family;
+    uint8_t addr[16];
+    tbucket_t tb;
+} addr_ent_t;
+
+TAILQ_HEAD(addr_queue, addr_ent);
+
+struct sylverant_admit {
+    pthread_mutex_t mutex;
+    int max_pending;
+    int pending;
+    double rate;
+    double burst;
+    double addr_rate;
+    double addr_burst;
+    int addr_count;
+    tbucket_t global;
+    tbucket_t notice;
+    struct addr_queue addrs[ADDR_BUCKETS];
+};
+
+static double now_secs(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+static void tb_refill(tbucket_t *tb, double rate, double burst, double now) {
+    /* If the clock went backwards, just start counting from now. */
+    if(now > tb->last)
+        tb->tokens += (now - tb->last) * rate;
+
+    if(tb->tokens > burst)
+        tb->tokens = burst;
+
+    tb->last = now;
+}
+
+/* Grab the raw address out of the sockaddr, returning its length. */
+static int get_addr(const struct sockaddr *addr, uint8_t out[16]) {
+    const struct sockaddr_in *a4;
+    const struct sockaddr_in6 *a6;
+
+    if(addr->sa_family == AF_INET) {
+        a4 = (const struct sockaddr_in *)addr;
+        memcpy(out, &a4->sin_addr.s_addr, 4);
+        return 4;
+    }
+    else if(addr->sa_family == AF_INET6) {
+        a6 = (const struct sockaddr_in6 *)addr;
+        memcpy(out, a6->sin6_addr.s6_addr, 16);
+        return 16;
+    }
+
+    return 0;
+}
+
+static uint32_t hash_addr(const uint8_t *addr, int len) {
+    uint32_t h = 2166136261U;
+    int i;
+
+    for(i = 0; i < len; ++i) {
+        h = (h ^ addr[i]) * 16777619U;
+    }
+
+    return h & (ADDR_BUCKETS - 1);
+}
+
+/* Find the bucket for an address, making one if needed. While we're walking
+   the chain, throw away anyone that has been idle long enough that their
+   bucket would be full again anyway. */
+static tbucket_t *find_addr(sylverant_admit_t *a, const struct sockaddr *addr,
+                            double now) {
+    uint8_t raw[16];
+    int len;
+    struct addr_queue *q;
+    addr_ent_t *i, *tmp, *rv = NULL;
+
+    if(!(len = get_addr(addr, raw)))
+        return NULL;
+
+    q = &a->addrs[hash_addr(raw, len)];
+    i = TAILQ_FIRST(q);
+
+    while(i) {
+        tmp = TAILQ_NEXT(i, qentry);
+
+        if(i->family == addr->sa_family && !memcmp(i->addr, raw, len)) {
+            rv = i;
+        }
+        else {
+            tb_refill(&i->tb, a->addr_rate, a->addr_burst, now);
+
+            if(i->tb.tokens >= a->addr_burst) {
+                TAILQ_REMOVE(q, i, qentry);
+                free(i);
+                --a->addr_count;
+            }
+        }
+
+        i = tmp;
+    }
+
+    if(rv) {
+        tb_refill(&rv->tb, a->addr_rate, a->addr_burst, now);
+        return &rv->tb;
+    }
+
+    if(a->addr_count >= MAX_ADDRS)
+        return NULL;
+
+    if(!(rv = (addr_ent_t *)malloc(sizeof(addr_ent_t))))
+        return NULL;
+
+    memset(rv, 0, sizeof(addr_ent_t));
+    rv->family = addr->sa_family;
+    memcpy(rv->addr, raw, len);
+    rv->tb.tokens = a->addr_burst;
+    rv->tb.last = now;
+    TAILQ_INSERT_HEAD(q, rv, qentry);
+    ++a->addr_count;
+
+    return &rv->tb;
+}
+
+void sylverant_admit_cfg_init(sylverant_admitcfg_t *cfg) {
+    cfg->max_pending = -1;
+    cfg->rate = -1.0;
+    cfg->burst = -1.0;
+    cfg->addr_rate = -1.0;
+    cfg->addr_burst = -1.0;
+}
+
+/* Parse one of the numeric attributes of the <admission> tag, leaving the
+   value alone if the attribute isn't there. */
+static int admit_attr(xmlNode *n, const char *name, double min, double *out) {
+    xmlChar *val;
+    char *end;
+    int rv = 0;
+
+    if(!(val = xmlGetProp(n, XC name)))
+        return 0;
+
+    *out = strtod((char *)val, &end);
+
+    if(*end || *out < min) {
+        debug(DBG_ERROR, "Invalid %s given for admission: %s\n", name,
+              (char *)val);
+        rv = -1;
+    }
+
+    xmlFree(val);
+    return rv;
+}
+
+int sylverant_admit_parse(xmlNode *n, sylverant_admitcfg_t *cfg) {
+    double pending = (double)cfg->max_pending;
+
+    if(admit_attr(n, "pending", 0.0, &pending) ||
+       admit_attr(n, "rate", 0.0, &cfg->rate) ||
+       admit_attr(n, "burst", 1.0, &cfg->burst) ||
+       admit_attr(n, "addr-rate", 0.0, &cfg->addr_rate) ||
+       admit_attr(n, "addr-burst", 1.0, &cfg->addr_burst))
+        return -1;
+
+    cfg->max_pending = (int)pending;
+    return 0;
+}
+
+sylverant_admit_t *sylverant_admit_new(const sylverant_admitcfg_t *cfg,
+                                       int def_pending) {
+    sylverant_admit_t *rv;
+    int i;
+
+    if(!(rv = (sylverant_admit_t *)malloc(sizeof(sylverant_admit_t))))
+        return NULL;
+
+    memset(rv, 0, sizeof(sylverant_admit_t));
+
+    if(pthread_mutex_init(&rv->mutex, NULL)) {
+        free(rv);
+        return NULL;
+    }
+
+    for(i = 0; i < ADDR_BUCKETS; ++i) {
+        TAILQ_INIT(&rv->addrs[i]);
+    }
+
+    rv->max_pending = cfg->max_pending >= 0 ? cfg->max_pending : def_pending;
+    rv->rate = cfg->rate >= 0.0 ? cfg->rate : SYLVERANT_ADMIT_GLOBAL_RATE;
+    rv->burst = cfg->burst >= 1.0 ? cfg->burst : SYLVERANT_ADMIT_GLOBAL_BURST;
+    rv->addr_rate = cfg->addr_rate >= 0.0 ? cfg->addr_rate :
+        SYLVERANT_ADMIT_ADDR_RATE;
+    rv->addr_burst = cfg->addr_burst >= 1.0 ? cfg->addr_burst :
+        SYLVERANT_ADMIT_ADDR_BURST;
+
+    rv->global.tokens = rv->burst;
+    rv->global.last = now_secs();
+    rv->notice.tokens = SYLVERANT_ADMIT_NOTICE_BURST;
+    rv->notice.last = rv->global.last;
+
+    return rv;
+}
+
+void sylverant_admit_free(sylverant_admit_t *a) {
+    addr_ent_t *i;
+    int j;
+
+    if(!a)
+        return;
+
+    for(j = 0; j < ADDR_BUCKETS; ++j) {
+        while((i = TAILQ_FIRST(&a->addrs[j]))) {
+            TAILQ_REMOVE(&a->addrs[j], i, qentry);
+            free(i);
+        }
+    }
+
+    pthread_mutex_destroy(&a->mutex);
+    free(a);
+}
+
+int sylverant_admit_check(sylverant_admit_t *a, const struct sockaddr *addr) {
+    double now = now_secs();
+    tbucket_t *tb;
+    int rv;
+
+    pthread_mutex_lock(&a->mutex);
+
+    tb_refill(&a->global, a->rate, a->burst, now);
+    tb_refill(&a->notice, SYLVERANT_ADMIT_NOTICE_RATE,
+              SYLVERANT_ADMIT_NOTICE_BURST, now);
+
+    /* A rate of 0 means there's no limit, so don't bother tracking anyone. */
+    tb = a->addr_rate > 0.0 ? find_addr(a, addr, now) : NULL;
+
+    if((!a->max_pending || a->pending < a->max_pending) &&
+       (a->rate <= 0.0 || a->global.tokens >= 1.0) &&
+       (!tb || tb->tokens >= 1.0)) {
+        if(a->rate > 0.0)
+            a->global.tokens -= 1.0;
+
+        ++a->pending;
+
+        if(tb)
+            tb->tokens -= 1.0;
+
+        rv = SYLVERANT_ADMIT_OK;
+    }
+    else if(a->notice.tokens >= 1.0) {
+        a->notice.tokens -= 1.0;
+        rv = SYLVERANT_ADMIT_WAIT;
+    }
+    else {
+        rv = SYLVERANT_ADMIT_DROP;
+    }
+
+    pthread_mutex_unlock(&a->mutex);
+
+    return rv;
+}
+
+void sylverant_admit_done(sylverant_admit_t *a) {
+    pthread_mutex_lock(&a->mutex);
+
+    if(a->pending > 0)
+        --a->pending;
+
+    pthread_mutex_unlock(&a->mutex);
+}
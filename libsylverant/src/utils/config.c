@@ -28,6 +28,7 @@
 
 #include "sylverant/config.h"
 #include "sylverant/debug.h"
+#include "sylverant/admission.h"
 
 #ifndef LIBXML_TREE_ENABLED
 #error You must have libxml2 with tree support built-in.
@@ -130,7 +131,7 @@ err:
 }
 
 static int handle_shipgate(xmlNode *n, sylverant_config_t *cur) {
-    xmlChar *port, *cert, *key, *ca;
+    xmlChar *port, *cert, *key, *ca, *ticket;
     int rv = 0;
     unsigned long rv2;
 
@@ -139,6 +140,7 @@ static int handle_shipgate(xmlNode *n, sylverant_config_t *cur) {
     cert = xmlGetProp(n, XC"cert");
     key = xmlGetProp(n, XC"key");
     ca = xmlGetProp(n, XC"ca-cert");
+    ticket = xmlGetProp(n, XC"ticket-key");
 
     /* Make sure we have what we need... */
     if(!port || !cert || !key || !ca) {
@@ -164,8 +166,12 @@ static int handle_shipgate(xmlNode *n, sylverant_config_t *cur) {
     cur->shipgate_key = (char *)key;
     cur->shipgate_ca = (char *)ca;
 
+    /* The session ticket key file is optional. */
+    cur->shipgate_ticket_key = (char *)ticket;
+
 err:
     if(rv < 0) {
+        xmlFree(ticket);
         xmlFree(ca);
         xmlFree(key);
         xmlFree(cert);
@@ -331,6 +337,7 @@ int sylverant_read_config(const char *f, sylverant_config_t **cfg) {
 
     /* Clear out the config. */
     memset(rv, 0, sizeof(sylverant_config_t));
+    sylverant_admit_cfg_init(&rv->admit);
 
     /* Create an XML Parsing context */
     cxt = xmlNewParserCtxt();
@@ -427,6 +434,12 @@ int sylverant_read_config(const char *f, sylverant_config_t **cfg) {
                 goto err_doc;
             }
         }
+        else if(!xmlStrcmp(n->name, XC"admission")) {
+            if(sylverant_admit_parse(n, &rv->admit)) {
+                irv = -14;
+                goto err_doc;
+            }
+        }
         else {
             debug(DBG_WARN, "Invalid Tag %s on line %hu\n", (char *)n->name,
                   n->line);
@@ -474,6 +487,7 @@ void sylverant_free_config(sylverant_config_t *cfg) {
         xmlFree(cfg->shipgate_cert);
         xmlFree(cfg->shipgate_key);
         xmlFree(cfg->shipgate_ca);
+        xmlFree(cfg->shipgate_ticket_key);
         xmlFree(cfg->quests_dir);
         xmlFree(cfg->limits_file);
 
@@ -31,6 +31,7 @@
 
 #include "sylverant/config.h"
 #include "sylverant/debug.h"
+#include "sylverant/admission.h"
 
 #ifndef LIBXML_TREE_ENABLED
 #error You must have libxml2 with tree support built-in.
@@ -996,6 +997,12 @@ static int handle_ship(xmlNode *n, sylverant_ship_t *cur) {
                 goto err;
             }
         }
+        else if(!xmlStrcmp(n2->name, XC"admission")) {
+            if(sylverant_admit_parse(n2, &cur->admit)) {
+                rv = -20;
+                goto err;
+            }
+        }
         else {
             debug(DBG_WARN, "Invalid Tag %s on line %hu\n", (char *)n2->name,
                   n2->line);
@@ -1036,6 +1043,7 @@ int sylverant_read_ship_config(const char *f, sylverant_ship_t **cfg) {
 
     /* Clear out the config. */
     memset(rv, 0, sizeof(sylverant_ship_t));
+    sylverant_admit_cfg_init(&rv->admit);
 
     /* Allocate space for the default event. */
     rv->events = (sylverant_event_t *)malloc(sizeof(sylverant_event_t));
@@ -0,0 +1,458 @@
+/*
+    Sylverant Login Server
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <openssl/sha.h>
+
+#include <sylverant/debug.h>
+#include <sylverant/database.h>
+#include <sylverant/md5.h>
+
+#include "auth.h"
+#include "worker.h"
+#include "login_packets.h"
+
+#define NEG_BUCKETS     1024
+#define NEG_HASH(k)     ((k)[0] | (((k)[1] & 0x03) << 8))
+
+/* A remembered failed login. The key is a digest of the credentials that were
+   tried, so we never keep the passwords themselves around. */
+typedef struct neg_ent {
+    TAILQ_ENTRY(neg_ent) qentry;
+    TAILQ_ENTRY(neg_ent) age;
+    uint8_t key[32];
+    time_t expires;
+    int result;
+} neg_ent_t;
+
+TAILQ_HEAD(neg_queue, neg_ent);
+
+/* The negative cache. The age list is in order of expiration, oldest first. */
+static struct neg_queue neg_buckets[NEG_BUCKETS];
+static struct neg_queue neg_age = TAILQ_HEAD_INITIALIZER(neg_age);
+static int neg_count = 0;
+static pthread_mutex_t neg_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The request queue and the threads that service it. */
+static struct auth_queue reqs = TAILQ_HEAD_INITIALIZER(reqs);
+static pthread_mutex_t req_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t req_cond = PTHREAD_COND_INITIALIZER;
+static volatile int auth_run = 0;
+static pthread_t auth_thds[AUTH_THREADS];
+static login_tdata_t auth_td[AUTH_THREADS];
+static int auth_count = 0;
+
+static void neg_key(auth_req_t *req, uint8_t key[32]) {
+    uint8_t buf[97];
+
+    buf[0] = (uint8_t)req->type;
+    memcpy(buf + 1, req->user, 32);
+    memcpy(buf + 33, req->key, 32);
+    memcpy(buf + 65, req->password, 32);
+    SHA256(buf, 97, key);
+    memset(buf, 0, 97);
+}
+
+static void neg_expire(time_t now) {
+    neg_ent_t *i;
+
+    while((i = TAILQ_FIRST(&neg_age)) && i->expires <= now) {
+        TAILQ_REMOVE(&neg_age, i, age);
+        TAILQ_REMOVE(&neg_buckets[NEG_HASH(i->key)], i, qentry);
+        free(i);
+        --neg_count;
+    }
+}
+
+/* Look for a failed login with the same credentials. Returns the result that
+   was found last time, or AUTH_OK if there isn't one. */
+static int neg_check(const uint8_t key[32]) {
+    neg_ent_t *i;
+    int rv = AUTH_OK;
+
+    pthread_mutex_lock(&neg_mutex);
+    neg_expire(time(NULL));
+
+    TAILQ_FOREACH(i, &neg_buckets[NEG_HASH(key)], qentry) {
+        if(!memcmp(i->key, key, 32)) {
+            rv = i->result;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&neg_mutex);
+
+    return rv;
+}
+
+static void neg_add(const uint8_t key[32], int result) {
+    neg_ent_t *i;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&neg_mutex);
+    neg_expire(now);
+
+    /* Toss the oldest one if we're full. */
+    if(neg_count >= AUTH_NEG_MAX && (i = TAILQ_FIRST(&neg_age))) {
+        TAILQ_REMOVE(&neg_age, i, age);
+        TAILQ_REMOVE(&neg_buckets[NEG_HASH(i->key)], i, qentry);
+        free(i);
+        --neg_count;
+    }
+
+    if((i = (neg_ent_t *)malloc(sizeof(neg_ent_t)))) {
+        memcpy(i->key, key, 32);
+        i->expires = now + AUTH_NEG_TTL;
+        i->result = result;
+        TAILQ_INSERT_TAIL(&neg_buckets[NEG_HASH(key)], i, qentry);
+        TAILQ_INSERT_TAIL(&neg_age, i, age);
+        ++neg_count;
+    }
+
+    pthread_mutex_unlock(&neg_mutex);
+}
+
+static void neg_cleanup(void) {
+    neg_ent_t *i;
+
+    pthread_mutex_lock(&neg_mutex);
+
+    while((i = TAILQ_FIRST(&neg_age))) {
+        TAILQ_REMOVE(&neg_age, i, age);
+        TAILQ_REMOVE(&neg_buckets[NEG_HASH(i->key)], i, qentry);
+        free(i);
+    }
+
+    neg_count = 0;
+    pthread_mutex_unlock(&neg_mutex);
+}
+
+/* Check a Gamecube client's serial number, access key, and password. */
+static int check_gc(login_tdata_t *td, auth_req_t *req) {
+    char query[256], serial[32], access[32];
+    void *result;
+    char **row;
+    unsigned char hash[16];
+    int i;
+
+    /* Escape all the important strings. */
+    sylverant_db_escape_str(&td->conn, serial, req->user, 8);
+    sylverant_db_escape_str(&td->conn, access, req->key, 12);
+
+    sprintf(query, "SELECT guildcard FROM gamecube_clients WHERE "
+            "serial_number='%s' AND access_key='%s'", serial, access);
+
+    if(sylverant_db_query(&td->conn, query) ||
+       !(result = sylverant_db_result_store(&td->conn))) {
+        return AUTH_ERROR;
+    }
+
+    if(!(row = sylverant_db_result_fetch(result))) {
+        sylverant_db_result_free(result);
+        return AUTH_NO_USER;
+    }
+
+    req->guildcard = (uint32_t)strtoul(row[0], NULL, 0);
+    sylverant_db_result_free(result);
+
+    /* We need the account to check the password... */
+    sprintf(query, "SELECT account_id FROM guildcards WHERE guildcard='%"
+            PRIu32 "'", req->guildcard);
+
+    if(sylverant_db_query(&td->conn, query) ||
+       !(result = sylverant_db_result_store(&td->conn))) {
+        return AUTH_ERROR;
+    }
+
+    if(!(row = sylverant_db_result_fetch(result))) {
+        sylverant_db_result_free(result);
+        return AUTH_ERROR;
+    }
+
+    req->account_id = (uint32_t)strtoul(row[0], NULL, 0);
+    sylverant_db_result_free(result);
+
+    sprintf(query, "SELECT password, regtime FROM account_data WHERE "
+            "account_id='%" PRIu32 "'", req->account_id);
+
+    if(sylverant_db_query(&td->conn, query) ||
+       !(result = sylverant_db_result_store(&td->conn))) {
+        return AUTH_ERROR;
+    }
+
+    if(!(row = sylverant_db_result_fetch(result))) {
+        sylverant_db_result_free(result);
+        return AUTH_NO_USER;
+    }
+
+    /* Check the password. */
+    sprintf(query, "%s_%s_salt", req->password, row[1]);
+    md5((unsigned char *)query, strlen(query), hash);
+
+    for(i = 0; i < 16; ++i) {
+        sprintf(query + (i << 1), "%02x", hash[i]);
+    }
+
+    for(i = 0; i < strlen(row[0]); ++i) {
+        row[0][i] = tolower(row[0][i]);
+    }
+
+    i = strcmp(row[0], query);
+    sylverant_db_result_free(result);
+
+    return i ? AUTH_BAD_PWD : AUTH_OK;
+}
+
+/* Check a Blue Burst client's username and password. */
+static int check_bb(login_tdata_t *td, auth_req_t *req) {
+    char query[256];
+    char tmp[64];
+    void *result;
+    char **row;
+    uint8_t hash[32];
+
+    sylverant_db_escape_str(&td->conn, tmp, req->user, strlen(req->user));
+    sprintf(query, "SELECT account_data.account_id, isbanned, teamid, "
+            "privlevel, guildcard, blueburst_clients.password, dressflag FROM "
+            "account_data INNER JOIN blueburst_clients ON "
+            "account_data.account_id = blueburst_clients.account_id WHERE "
+            "blueburst_clients.username='%s'", tmp);
+
+    if(sylverant_db_query(&td->conn, query) ||
+       !(result = sylverant_db_result_store(&td->conn))) {
+        return AUTH_ERROR;
+    }
+
+    if(!(row = sylverant_db_result_fetch(result))) {
+        sylverant_db_result_free(result);
+        return AUTH_NO_USER;
+    }
+
+    /* Make sure some simple checks pass first... */
+    if(atoi(row[1])) {
+        sylverant_db_result_free(result);
+        return AUTH_BANNED;
+    }
+
+    /* If we've gotten this far, we have an account! Check the password. */
+    sprintf(tmp, "%s_salt_%s", req->password, row[4]);
+    SHA256((unsigned char *)tmp, strlen(tmp), hash);
+
+    if(memcmp(hash, row[5], 32)) {
+        sylverant_db_result_free(result);
+        return AUTH_BAD_PWD;
+    }
+
+    /* Grab the rest of what we care about from the query... */
+    errno = 0;
+    req->account_id = (uint32_t)strtoul(row[0], NULL, 0);
+    req->team_id = (uint32_t)strtoul(row[2], NULL, 0);
+    req->priv = (uint32_t)strtoul(row[3], NULL, 0);
+    req->guildcard = (uint32_t)strtoul(row[4], NULL, 0);
+    req->flags = (uint32_t)strtoul(row[6], NULL, 0);
+    sylverant_db_result_free(result);
+
+    return errno ? AUTH_ERROR : AUTH_OK;
+}
+
+static void auth_check(login_tdata_t *td, auth_req_t *req) {
+    uint8_t key[32];
+
+    /* If these exact credentials failed recently, don't bother with the
+       database (or the hashing) again. */
+    neg_key(req, key);
+
+    if((req->result = neg_check(key)) != AUTH_OK) {
+        return;
+    }
+
+    if(req->type == AUTH_TYPE_GC)
+        req->result = check_gc(td, req);
+    else
+        req->result = check_bb(td, req);
+
+    /* Only remember wrong passwords. A user that doesn't exist might be about
+       to be registered, and shouldn't have to wait to be able to log in. */
+    if(req->result == AUTH_BAD_PWD)
+        neg_add(key, req->result);
+}
+
+static void *auth_thd(void *d) {
+    login_tdata_t *td = (login_tdata_t *)d;
+    auth_req_t *req;
+
+    if(tdata_attach(td)) {
+        pthread_exit(NULL);
+    }
+
+    pthread_mutex_lock(&req_mutex);
+
+    while(auth_run) {
+        if(!(req = TAILQ_FIRST(&reqs))) {
+            pthread_cond_wait(&req_cond, &req_mutex);
+            continue;
+        }
+
+        TAILQ_REMOVE(&reqs, req, qentry);
+        pthread_mutex_unlock(&req_mutex);
+
+        auth_check(td, req);
+
+        /* We're done with the password, so don't leave it lying around. */
+        memset(req->password, 0, sizeof(req->password));
+
+        /* Hand it back to the worker that owns the client. */
+        worker_auth_done(req->c->worker, req);
+
+        pthread_mutex_lock(&req_mutex);
+    }
+
+    pthread_mutex_unlock(&req_mutex);
+    pthread_exit(NULL);
+}
+
+int auth_start(int count) {
+    int i;
+
+    if(count < 1)
+        count = 1;
+    else if(count > AUTH_THREADS)
+        count = AUTH_THREADS;
+
+    for(i = 0; i < NEG_BUCKETS; ++i) {
+        TAILQ_INIT(&neg_buckets[i]);
+    }
+
+    debug(DBG_LOG, "Starting %d authentication threads...\n", count);
+    auth_run = 1;
+
+    for(i = 0; i < count; ++i) {
+        if(tdata_init(&auth_td[i], NULL)) {
+            return -1;
+        }
+
+        if(pthread_create(&auth_thds[i], NULL, &auth_thd, &auth_td[i])) {
+            debug(DBG_ERROR, "Cannot start authentication thread %d!\n", i);
+            tdata_cleanup(&auth_td[i]);
+            return -1;
+        }
+
+        ++auth_count;
+    }
+
+    return 0;
+}
+
+void auth_stop(void) {
+    auth_req_t *req;
+    int i;
+
+    pthread_mutex_lock(&req_mutex);
+    auth_run = 0;
+    pthread_cond_broadcast(&req_cond);
+    pthread_mutex_unlock(&req_mutex);
+
+    for(i = 0; i < auth_count; ++i) {
+        pthread_join(auth_thds[i], NULL);
+        tdata_cleanup(&auth_td[i]);
+    }
+
+    auth_count = 0;
+
+    /* Anyone still waiting is about to be disconnected anyway. */
+    while((req = TAILQ_FIRST(&reqs))) {
+        TAILQ_REMOVE(&reqs, req, qentry);
+        free(req);
+    }
+
+    neg_cleanup();
+}
+
+auth_req_t *auth_req_new(login_client_t *c, int type, auth_cb_t cb) {
+    auth_req_t *rv;
+
+    if(!(rv = (auth_req_t *)malloc(sizeof(auth_req_t)))) {
+        debug(DBG_WARN, "Cannot allocate authentication request\n");
+        return NULL;
+    }
+
+    memset(rv, 0, sizeof(auth_req_t));
+    rv->c = c;
+    rv->type = type;
+    rv->cb = cb;
+
+    return rv;
+}
+
+void auth_submit(auth_req_t *req) {
+    req->c->auth_pending = 1;
+
+    pthread_mutex_lock(&req_mutex);
+    TAILQ_INSERT_TAIL(&reqs, req, qentry);
+    pthread_cond_signal(&req_cond);
+    pthread_mutex_unlock(&req_mutex);
+}
+
+int auth_bb_result(login_client_t *c, const auth_req_t *req) {
+    switch(req->result) {
+        case AUTH_OK:
+            return 0;
+
+        case AUTH_NO_USER:
+            send_bb_security(c, 0, LOGIN_93BB_NO_USER_RECORD, 0, NULL, 0);
+            return -3;
+
+        case AUTH_BANNED:
+            /* User is banned by account. */
+            send_bb_security(c, 0, LOGIN_93BB_BANNED, 0, NULL, 0);
+            return -4;
+
+        case AUTH_BAD_PWD:
+            send_bb_security(c, 0, LOGIN_93BB_BAD_USER_PWD, 0, NULL, 0);
+            return -6;
+
+        default:
+            send_bb_security(c, 0, LOGIN_93BB_UNKNOWN_ERROR, 0, NULL, 0);
+            return -2;
+    }
+}
+
+int auth_finish(auth_req_t *req) {
+    login_client_t *c = req->c;
+    int rv = 0;
+
+    c->auth_pending = 0;
+
+    /* The expensive part of logging in is done, so let someone else in. */
+    client_admit_done(c);
+
+    /* If the client went away while we were checking, don't bother. */
+    if(!c->disconnected) {
+        rv = req->cb(c, req);
+    }
+
+    free(req);
+    return rv;
+}
@@ -0,0 +1,97 @@
+/*
+    Sylverant Login Server
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "login.h"
+
+/* How many threads check passwords. These are kept separate from the client
+   threads so that a slow password hash never holds up anyone else's
+   packets. */
+#define AUTH_THREADS        4
+
+/* How long (in seconds) a wrong password is remembered, and how many are
+   remembered at once. Only the exact same credentials are refused from the
+   cache, so this can't be used to lock someone else out of their account. */
+#define AUTH_NEG_TTL        60
+#define AUTH_NEG_MAX        8192
+
+/* Types of logins. */
+#define AUTH_TYPE_GC        0
+#define AUTH_TYPE_BB        1
+
+/* Results of a login check. */
+#define AUTH_OK             0
+#define AUTH_NO_USER        1
+#define AUTH_BAD_PWD        2
+#define AUTH_BANNED         3
+#define AUTH_ERROR          4
+
+struct auth_req;
+
+/* Called on one of the client threads when the check is done. A non-zero
+   return disconnects the client. */
+typedef int (*auth_cb_t)(login_client_t *c, struct auth_req *req);
+
+typedef struct auth_req {
+    TAILQ_ENTRY(auth_req) qentry;
+    login_client_t *c;
+    auth_cb_t cb;
+    int type;
+
+    /* The credentials to check. For Gamecube, user and key are the serial
+       number and access key. For Blue Burst, only user is used. */
+    char user[32];
+    char key[32];
+    char password[32];
+
+    /* What we found out about the account. */
+    int result;
+    uint32_t account_id;
+    uint32_t guildcard;
+    uint32_t team_id;
+    uint32_t priv;
+    uint32_t flags;
+} auth_req_t;
+
+TAILQ_HEAD(auth_queue, auth_req);
+
+/* Start up and shut down the password checking threads. */
+int auth_start(int count);
+void auth_stop(void);
+
+/* Make a new request for the given client. */
+auth_req_t *auth_req_new(login_client_t *c, int type, auth_cb_t cb);
+
+/* Queue up a request to be checked. The client won't have any more packets
+   read from it until the callback has been run. */
+void auth_submit(auth_req_t *req);
+
+/* Tell a Blue Burst client why its login check failed, if it did. Returns 0 if
+   the check passed, otherwise a negative value (and the client should be
+   disconnected). */
+int auth_bb_result(login_client_t *c, const auth_req_t *req);
+
+/* Run the callback for a finished request and free it. This is called by a
+   client thread, once the worker that owns the client hands it over. */
+int auth_finish(auth_req_t *req);
+
+#endif /* !AUTH_H */
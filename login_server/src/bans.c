@@ -0,0 +1,397 @@
+/*
+    Sylverant Login Server
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+
+#include <sylverant/debug.h>
+#include <sylverant/database.h>
+
+#include "bans.h"
+#include "worker.h"
+
+#define BAN_BUCKETS     1024
+#define BAN_HASH(k)     ((k) & (BAN_BUCKETS - 1))
+
+/* IPv4 addresses are stored in network order, so hash on the last byte. */
+#define BAN_IP_HASH(a)  BAN_HASH(ntohl(a))
+
+typedef struct ban_ent {
+    TAILQ_ENTRY(ban_ent) qentry;
+    uint32_t ban_id;
+    time_t start;
+    time_t end;
+
+    /* What is banned, either a guildcard or an IPv4 address (in network
+       order). The database doesn't have any other kind of ban. */
+    int is_ip;
+    uint32_t key;
+
+    char reason[256];
+} ban_ent_t;
+
+TAILQ_HEAD(ban_queue, ban_ent);
+
+typedef struct ban_index {
+    struct ban_queue gc_bans[BAN_BUCKETS];
+    struct ban_queue ip_bans[BAN_BUCKETS];
+
+    uint32_t max_id;
+    time_t refreshed;
+    time_t loaded;
+
+    /* The ban version this was loaded at, if it could be read. */
+    unsigned long version;
+    int have_version;
+} ban_index_t;
+
+/* The current index. The rwlock protects the index itself, the mutex makes sure
+   only one thread at a time goes to the database to update it. */
+static ban_index_t *cur_idx = NULL;
+static pthread_rwlock_t idx_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int version_warned = 0;
+
+static void free_queue(struct ban_queue *q) {
+    ban_ent_t *i;
+
+    while((i = TAILQ_FIRST(q))) {
+        TAILQ_REMOVE(q, i, qentry);
+        free(i);
+    }
+}
+
+static ban_index_t *index_new(void) {
+    ban_index_t *rv;
+    int i;
+
+    if(!(rv = (ban_index_t *)malloc(sizeof(ban_index_t))))
+        return NULL;
+
+    memset(rv, 0, sizeof(ban_index_t));
+
+    for(i = 0; i < BAN_BUCKETS; ++i) {
+        TAILQ_INIT(&rv->gc_bans[i]);
+        TAILQ_INIT(&rv->ip_bans[i]);
+    }
+
+    return rv;
+}
+
+static void index_free(ban_index_t *idx) {
+    int i;
+
+    for(i = 0; i < BAN_BUCKETS; ++i) {
+        free_queue(&idx->gc_bans[i]);
+        free_queue(&idx->ip_bans[i]);
+    }
+
+    free(idx);
+}
+
+/* Add a ban to the index. The index takes ownership of the ban. */
+static void index_add(ban_index_t *idx, ban_ent_t *b) {
+    if(b->is_ip)
+        TAILQ_INSERT_TAIL(&idx->ip_bans[BAN_IP_HASH(b->key)], b, qentry);
+    else
+        TAILQ_INSERT_TAIL(&idx->gc_bans[BAN_HASH(b->key)], b, qentry);
+
+    if(b->ban_id > idx->max_id)
+        idx->max_id = b->ban_id;
+}
+
+/* Find an active ban on the given key. The caller must hold idx_lock. */
+static ban_ent_t *find_ban(struct ban_queue *q, uint32_t key, time_t now) {
+    ban_ent_t *i;
+
+    TAILQ_FOREACH(i, q, qentry) {
+        if(i->key == key && i->start <= now && i->end >= now)
+            return i;
+    }
+
+    return NULL;
+}
+
+/* Read the ban version. This gets bumped in the database whenever a ban is
+   changed or removed, so that the index can be thrown out right away when it
+   happens. */
+static int fetch_version(unsigned long *version) {
+    void *result;
+    char **row;
+    login_tdata_t *td = get_tdata();
+
+    if(sylverant_db_query(&td->conn, "SELECT version FROM ban_version") ||
+       !(result = sylverant_db_result_store(&td->conn))) {
+        /* Only complain once, not every time this gets called. */
+        if(!version_warned) {
+            debug(DBG_WARN, "Couldn't fetch ban version\n");
+            debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+            version_warned = 1;
+        }
+
+        return -1;
+    }
+
+    if((row = sylverant_db_result_fetch(result)) && row[0])
+        *version = strtoul(row[0], NULL, 0);
+    else
+        *version = 0;
+
+    sylverant_db_result_free(result);
+    version_warned = 0;
+
+    return 0;
+}
+
+/* Read any bans newer than the given ban id from the database. */
+static int fetch_bans(uint32_t since, struct ban_queue *q) {
+    char query[256];
+    void *result;
+    char **row;
+    ban_ent_t *b;
+    int ip;
+    login_tdata_t *td = get_tdata();
+
+    for(ip = 0; ip < 2; ++ip) {
+        sprintf(query, "SELECT ban_id, startdate, enddate, reason, %s FROM %s "
+                "NATURAL JOIN bans WHERE enddate >= UNIX_TIMESTAMP() AND "
+                "ban_id > '%" PRIu32 "'", ip ? "addr" : "guildcard",
+                ip ? "ip_bans" : "guildcard_bans", since);
+
+        if(sylverant_db_query(&td->conn, query)) {
+            debug(DBG_WARN, "Couldn't fetch bans\n");
+            debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+            return -1;
+        }
+
+        if(!(result = sylverant_db_result_store(&td->conn))) {
+            debug(DBG_WARN, "Couldn't fetch bans\n");
+            debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+            return -1;
+        }
+
+        while((row = sylverant_db_result_fetch(result))) {
+            if(!(b = (ban_ent_t *)malloc(sizeof(ban_ent_t)))) {
+                debug(DBG_WARN, "Cannot allocate ban\n");
+                sylverant_db_result_free(result);
+                return -1;
+            }
+
+            memset(b, 0, sizeof(ban_ent_t));
+            b->ban_id = (uint32_t)strtoul(row[0], NULL, 0);
+            b->start = (time_t)strtoul(row[1], NULL, 0);
+            b->end = (time_t)strtoul(row[2], NULL, 0);
+
+            if(row[3]) {
+                strncpy(b->reason, row[3], 255);
+            }
+
+            /* Addresses are stored exactly as they sit in a sockaddr_in, so
+               they're already in network order. */
+            b->is_ip = ip;
+            b->key = (uint32_t)strtoul(row[4], NULL, 0);
+
+            TAILQ_INSERT_TAIL(q, b, qentry);
+        }
+
+        sylverant_db_result_free(result);
+    }
+
+    return 0;
+}
+
+/* Bring the index up to date, if it needs it. */
+static int refresh_index(void) {
+    time_t now = time(NULL);
+    struct ban_queue q;
+    ban_ent_t *b;
+    ban_index_t *idx, *old;
+    uint32_t since = 0;
+    unsigned long version = 0;
+    int full, have_version, rv = 0;
+
+    pthread_rwlock_rdlock(&idx_lock);
+
+    if(cur_idx && now < cur_idx->refreshed + BAN_REFRESH_TIME) {
+        pthread_rwlock_unlock(&idx_lock);
+        return 0;
+    }
+
+    idx = cur_idx;
+    pthread_rwlock_unlock(&idx_lock);
+
+    /* If someone else is already updating it, just use what we have for now,
+       unless we don't have anything at all yet. */
+    if(idx) {
+        if(pthread_mutex_trylock(&refresh_mutex))
+            return 0;
+    }
+    else {
+        pthread_mutex_lock(&refresh_mutex);
+    }
+
+    /* Things might have changed while we were waiting. */
+    pthread_rwlock_rdlock(&idx_lock);
+
+    if(cur_idx && now < cur_idx->refreshed + BAN_REFRESH_TIME) {
+        pthread_rwlock_unlock(&idx_lock);
+        pthread_mutex_unlock(&refresh_mutex);
+        return 0;
+    }
+
+    pthread_rwlock_unlock(&idx_lock);
+
+    /* If any bans have been changed or removed, everything has to be loaded
+       again. If we can't tell, assume they have. Only the thread holding the
+       refresh mutex ever changes cur_idx, so it's safe to look at it here. */
+    have_version = !fetch_version(&version);
+    full = !cur_idx || now >= cur_idx->loaded + BAN_RELOAD_TIME ||
+        !have_version || !cur_idx->have_version ||
+        version != cur_idx->version;
+
+    if(!full)
+        since = cur_idx->max_id;
+
+    /* Go to the database for the new data. */
+    TAILQ_INIT(&q);
+
+    if(fetch_bans(since, &q)) {
+        free_queue(&q);
+
+        /* Don't hammer the database if it is having trouble, just use what
+           we've got until the next refresh. */
+        pthread_rwlock_wrlock(&idx_lock);
+
+        if(cur_idx)
+            cur_idx->refreshed = now;
+        else
+            rv = -1;
+
+        pthread_rwlock_unlock(&idx_lock);
+        pthread_mutex_unlock(&refresh_mutex);
+
+        return rv;
+    }
+
+    if(full) {
+        /* Build the whole new index before swapping it in. */
+        if(!(idx = index_new())) {
+            debug(DBG_WARN, "Cannot allocate ban index\n");
+            free_queue(&q);
+            pthread_mutex_unlock(&refresh_mutex);
+            return -1;
+        }
+
+        while((b = TAILQ_FIRST(&q))) {
+            TAILQ_REMOVE(&q, b, qentry);
+            index_add(idx, b);
+        }
+
+        idx->refreshed = idx->loaded = now;
+        idx->version = version;
+        idx->have_version = have_version;
+
+        pthread_rwlock_wrlock(&idx_lock);
+        old = cur_idx;
+        cur_idx = idx;
+        pthread_rwlock_unlock(&idx_lock);
+
+        if(old)
+            index_free(old);
+    }
+    else {
+        pthread_rwlock_wrlock(&idx_lock);
+
+        while((b = TAILQ_FIRST(&q))) {
+            TAILQ_REMOVE(&q, b, qentry);
+            index_add(cur_idx, b);
+        }
+
+        cur_idx->refreshed = now;
+        pthread_rwlock_unlock(&idx_lock);
+    }
+
+    pthread_mutex_unlock(&refresh_mutex);
+
+    return rv;
+}
+
+int ban_check_ip(struct sockaddr_storage *addr, time_t *until, char *reason) {
+    ban_ent_t *b;
+    time_t now = time(NULL);
+    uint32_t ip;
+    int rv = 0;
+
+    if(refresh_index())
+        return -1;
+
+    /* Only IPv4 addresses can be banned. */
+    if(addr->ss_family != AF_INET)
+        return 0;
+
+    ip = ((struct sockaddr_in *)addr)->sin_addr.s_addr;
+
+    pthread_rwlock_rdlock(&idx_lock);
+    b = find_ban(&cur_idx->ip_bans[BAN_IP_HASH(ip)], ip, now);
+
+    if(b) {
+        *until = b->end;
+        strcpy(reason, b->reason);
+        rv = 1;
+    }
+
+    pthread_rwlock_unlock(&idx_lock);
+
+    return rv;
+}
+
+int ban_check_gc(uint32_t gc, time_t *until, char *reason) {
+    ban_ent_t *b;
+    time_t now = time(NULL);
+    int rv = 0;
+
+    if(refresh_index())
+        return -1;
+
+    pthread_rwlock_rdlock(&idx_lock);
+
+    if((b = find_ban(&cur_idx->gc_bans[BAN_HASH(gc)], gc, now))) {
+        *until = b->end;
+        strcpy(reason, b->reason);
+        rv = 1;
+    }
+
+    pthread_rwlock_unlock(&idx_lock);
+
+    return rv;
+}
+
+void ban_cleanup(void) {
+    pthread_rwlock_wrlock(&idx_lock);
+
+    if(cur_idx) {
+        index_free(cur_idx);
+        cur_idx = NULL;
+    }
+
+    pthread_rwlock_unlock(&idx_lock);
+}
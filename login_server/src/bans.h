@@ -0,0 +1,40 @@
+/*
+    Sylverant Login Server
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BANS_H
+#define BANS_H
+
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* How often (in seconds) the database is checked for new bans, and how often
+   the whole index is rebuilt regardless. Changed or removed bans bump the
+   ban_version table, which makes the next check rebuild it right away. */
+#define BAN_REFRESH_TIME    15
+#define BAN_RELOAD_TIME     600
+
+/* Check the ban index for the given address or guildcard. Returns 1 if there
+   is an active ban (filling in when it ends and why), 0 if not, or -1 if the
+   index couldn't be loaded. The reason buffer must hold at least 256 bytes. */
+int ban_check_ip(struct sockaddr_storage *addr, time_t *until, char *reason);
+int ban_check_gc(uint32_t gc, time_t *until, char *reason);
+
+/* Throw away the ban index. */
+void ban_cleanup(void);
+
+#endif /* !BANS_H */
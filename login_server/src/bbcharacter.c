@@ -22,11 +22,11 @@
 #include <ctype.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include <zlib.h>
 
-#include <openssl/sha.h>
-
 #include <sylverant/checksum.h>
 #include <sylverant/debug.h>
 #include <sylverant/database.h>
@@ -36,6 +36,10 @@
 #include "player.h"
 #include "packets.h"
 #include "login_packets.h"
+#include "worker.h"
+#include "shipdir.h"
+#include "gccache.h"
+#include "auth.h"
 
 #define NUM_PARAM_FILES 9
 
@@ -230,89 +234,44 @@ const static uint8_t default_symbolchats[1248] = {
 
 #define MAX_PARAMS_SIZE 0x100000
 
+/* A set of Blue Burst parameter data, built into ready to send packets in one
+   read-only mapping that all the clients share. Clients keep a reference to the
+   set they got the header from, so reloading the data can't change it out from
+   under them partway through downloading it. */
+typedef struct param_set {
+    uint32_t gen;
+    int refcnt;
+    uint8_t *map;
+    size_t map_size;
+    bb_param_hdr_pkt *hdr;
+    int num_chunks;
+    bb_param_chunk_pkt *chunks[];
+} param_set_t;
+
+/* The current set of parameter data. The lock protects this and the reference
+   counts of all the sets. */
+static param_set_t *cur_params = NULL;
+static uint32_t param_gen = 0;
+static pthread_mutex_t params_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* This stuff is cached at the start of the program */
-static bb_param_hdr_pkt *param_hdr = NULL;
-static bb_param_chunk_pkt **param_chunks = NULL;
-static int num_param_chunks = 0;
 static sylverant_bb_db_char_t default_chars[12];
 static bb_level_table_t char_stats;
 
-static int handle_bb_login(login_client_t *c, bb_login_93_pkt *pkt) {
-    char query[256];
-    int len;
-    char tmp[32];
-    void *result;
-    char **row;
-    uint8_t hash[32];
-
-    /* Make sure the username string is sane... */
-    len = strlen(pkt->username);
-    if(len > 16 || strlen(pkt->password) > 16) {
-        send_bb_security(c, 0, LOGIN_93BB_FORCED_DISCONNECT, 0, NULL, 0);
-        return -1;
-    }
-
-    sylverant_db_escape_str(&conn, tmp, pkt->username, len);
-    sprintf(query, "SELECT account_data.account_id, isbanned, teamid, "
-            "privlevel, guildcard, blueburst_clients.password, dressflag FROM "
-            "account_data INNER JOIN blueburst_clients ON "
-            "account_data.account_id = blueburst_clients.account_id WHERE "
-            "blueburst_clients.username='%s'", tmp);
-
-    /* Query the database for the user... */
-    if(sylverant_db_query(&conn, query)) {
-        send_bb_security(c, 0, LOGIN_93BB_UNKNOWN_ERROR, 0, NULL, 0);
-        return -2;
-    }
-
-    result = sylverant_db_result_store(&conn);
-    if(!result) {
-        send_bb_security(c, 0, LOGIN_93BB_UNKNOWN_ERROR, 0, NULL, 0);
-        return -2;
-    }
+/* Called once the password check for a login is done. */
+static int bb_login_done(login_client_t *c, auth_req_t *req) {
+    int rv;
 
-    row = sylverant_db_result_fetch(result);
-    if(!row) {
-        send_bb_security(c, 0, LOGIN_93BB_NO_USER_RECORD, 0, NULL, 0);
-        sylverant_db_result_free(result);
-        return -3;
-    }
-
-    /* Make sure some simple checks pass first... */
-    if(atoi(row[1])) {
-        /* User is banned by account. */
-        send_bb_security(c, 0, LOGIN_93BB_BANNED, 0, NULL, 0);
-        sylverant_db_result_free(result);
-        return -4;
-    }
-
-    /* If we've gotten this far, we have an account! Check the password. */
-    sprintf(tmp, "%s_salt_%s", pkt->password, row[4]);
-    SHA256((unsigned char *)tmp, strlen(tmp), hash);
-
-    if(memcmp(hash, row[5], 32)) {
-        /* Password check failed... */
-        send_bb_security(c, 0, LOGIN_93BB_BAD_USER_PWD, 0, NULL, 0);
-        sylverant_db_result_free(result);
-        return -6;
-    }
-
-    /* Grab the rest of what we care about from the query... */
-    errno = 0;
-    c->team_id = (uint32_t)strtoul(row[2], NULL, 0);
-    c->is_gm = (uint32_t)strtoul(row[3], NULL, 0);
-    c->guildcard = (uint32_t)strtoul(row[4], NULL, 0);
-    c->account_id = (uint32_t)strtoul(row[0], NULL, 0);
-    c->flags = (uint32_t)strtoul(row[6], NULL, 0);
-    sylverant_db_result_free(result);
-
-    if(errno) {
-        send_bb_security(c, 0, LOGIN_93BB_UNKNOWN_ERROR, 0, NULL, 0);
-        return -2;
+    if((rv = auth_bb_result(c, req))) {
+        return rv;
     }
 
-    /* Copy in the security data */
-    memcpy(&c->sec_data, pkt->security_data, sizeof(bb_security_data_t));
+    /* Grab the rest of what we care about from the check... */
+    c->team_id = req->team_id;
+    c->is_gm = req->priv;
+    c->guildcard = req->guildcard;
+    c->account_id = req->account_id;
+    c->flags = req->flags;
 
     if(c->sec_data.magic != LE32(0xDEADBEEF)) {
         send_bb_security(c, 0, LOGIN_93BB_FORCED_DISCONNECT, 0, NULL, 0);
@@ -343,18 +302,46 @@ static int handle_bb_login(login_client_t *c, bb_login_93_pkt *pkt) {
     return 0;
 }
 
+static int handle_bb_login(login_client_t *c, bb_login_93_pkt *pkt) {
+    auth_req_t *req;
+
+    /* Make sure the username string is sane... */
+    if(strlen(pkt->username) > 16 || strlen(pkt->password) > 16) {
+        send_bb_security(c, 0, LOGIN_93BB_FORCED_DISCONNECT, 0, NULL, 0);
+        return -1;
+    }
+
+    /* The actual checking is done off on the authentication threads, so that
+       we don't hold everyone else up. */
+    if(!(req = auth_req_new(c, AUTH_TYPE_BB, &bb_login_done))) {
+        send_bb_security(c, 0, LOGIN_93BB_UNKNOWN_ERROR, 0, NULL, 0);
+        return -2;
+    }
+
+    /* Copy in the security data, it gets checked once the password has been
+       checked. */
+    memcpy(&c->sec_data, pkt->security_data, sizeof(bb_security_data_t));
+
+    strcpy(req->user, pkt->username);
+    strcpy(req->password, pkt->password);
+    auth_submit(req);
+
+    return 0;
+}
+
 static int handle_option_request(login_client_t *c) {
     char query[sizeof(sylverant_bb_db_opts_t) * 2 + 256];
     void *result;
     char **row;
     sylverant_bb_db_opts_t opts;
+    login_tdata_t *td = get_tdata();
 
     /* Look up the user's saved config */
     sprintf(query, "SELECT options FROM blueburst_options WHERE "
             "guildcard='%" PRIu32 "'", c->guildcard);
 
-    if(!sylverant_db_query(&conn, query)) {
-        result = sylverant_db_result_store(&conn);
+    if(!sylverant_db_query(&td->conn, query)) {
+        result = sylverant_db_result_store(&td->conn);
 
         /* See if we got a hit... */
         if(sylverant_db_result_rows(result)) {
@@ -369,15 +356,15 @@ static int handle_option_request(login_client_t *c) {
 
             sprintf(query, "INSERT INTO blueburst_options (guildcard, "
                     "options) VALUES ('%" PRIu32"', '", c->guildcard);
-            sylverant_db_escape_str(&conn, query + strlen(query),
+            sylverant_db_escape_str(&td->conn, query + strlen(query),
                                     (char *)&opts,
                                     sizeof(sylverant_bb_db_opts_t));
             strcat(query, "')");
 
-            if(sylverant_db_query(&conn, query)) {
+            if(sylverant_db_query(&td->conn, query)) {
                 debug(DBG_WARN, "Couldn't add key data to database for "
                       "guildcard %" PRIu32 "\n", c->guildcard);
-                debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+                debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
             }
         }
 
@@ -392,101 +379,263 @@ static int handle_option_request(login_client_t *c) {
     return send_bb_option_reply(c, opts.key_config);
 }
 
-static int handle_char_select(login_client_t *c, bb_char_select_pkt *pkt) {
+/* Build the character select preview for a full character. */
+static void make_mini_char(const sylverant_bb_db_char_t *cd,
+                           sylverant_bb_mini_char_t *mc) {
+    memset(mc, 0, sizeof(sylverant_bb_mini_char_t));
+    memcpy(mc->guildcard_str, cd->character.guildcard_str, 0x70);
+    mc->level = cd->character.level;
+    mc->exp = cd->character.exp;
+    mc->play_time = cd->character.play_time;
+}
+
+/* Store the preview of a character, so that the character select screen
+   doesn't have to go through the full character data. If fill_in is set, the
+   preview is only stored if there isn't one already, so that a preview built
+   from data that has since been replaced can't clobber a newer one. Otherwise,
+   if the new preview can't be stored, the old one is removed so that it gets
+   rebuilt from the character data the next time it's needed. */
+static int save_preview(uint32_t gc, uint8_t slot,
+                        const sylverant_bb_mini_char_t *mc, int fill_in) {
+    char query[sizeof(sylverant_bb_mini_char_t) * 2 + 256];
+    login_tdata_t *td = get_tdata();
+
+    sprintf(query, "%s INTO character_preview (guildcard, slot, data) "
+            "VALUES ('%" PRIu32 "', '%" PRIu8 "', '",
+            fill_in ? "INSERT IGNORE" : "REPLACE", gc, slot);
+    sylverant_db_escape_str(&td->conn, query + strlen(query), (char *)mc,
+                            sizeof(sylverant_bb_mini_char_t));
+    strcat(query, "')");
+
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "Couldn't save character preview (gc=%" PRIu32 ", "
+              "slot=%" PRIu8 "):\n%s\n", gc, slot,
+              sylverant_db_error(&td->conn));
+
+        if(!fill_in) {
+            sprintf(query, "DELETE FROM character_preview WHERE guildcard='%"
+                    PRIu32 "' AND slot='%" PRIu8 "'", gc, slot);
+            sylverant_db_query(&td->conn, query);
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Write out a character's data, along with its preview, in one transaction.
+   If create is set, anything already in the slot is replaced, otherwise the
+   existing character in the slot is updated. The preview can always be rebuilt
+   from the character data, so not being able to store it isn't fatal. */
+static int save_char(uint32_t gc, uint8_t slot,
+                     const sylverant_bb_db_char_t *cd, int create) {
+    char query[sizeof(sylverant_bb_db_char_t) * 2 + 256];
+    sylverant_bb_mini_char_t mc;
+    login_tdata_t *td = get_tdata();
+
+    if(sylverant_db_query(&td->conn, "START TRANSACTION")) {
+        debug(DBG_WARN, "Couldn't start transaction (gc=%" PRIu32 ", slot=%"
+              PRIu8 "):\n%s\n", gc, slot, sylverant_db_error(&td->conn));
+        return -1;
+    }
+
+    if(create) {
+        sprintf(query, "DELETE FROM character_data WHERE guildcard="
+                "'%" PRIu32 "' AND slot='%" PRIu8 "'", gc, slot);
+
+        if(sylverant_db_query(&td->conn, query)) {
+            debug(DBG_WARN, "Couldn't clear old character data (gc=%"
+                  PRIu32 ", slot=%" PRIu8 "):\n%s\n", gc, slot,
+                  sylverant_db_error(&td->conn));
+            goto err;
+        }
+
+        sprintf(query, "INSERT INTO character_data (guildcard, slot, data) "
+                "VALUES ('%" PRIu32"', '%" PRIu8 "', '", gc, slot);
+        sylverant_db_escape_str(&td->conn, query + strlen(query),
+                                (char *)cd, sizeof(sylverant_bb_db_char_t));
+        strcat(query, "')");
+    }
+    else {
+        strcpy(query, "UPDATE character_data SET data='");
+        sylverant_db_escape_str(&td->conn, query + strlen(query),
+                                (char *)cd, sizeof(sylverant_bb_db_char_t));
+        sprintf(query + strlen(query), "' WHERE guildcard='%" PRIu32 "' AND "
+                "slot='%" PRIu8 "'", gc, slot);
+    }
+
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "Couldn't save character data (gc=%" PRIu32 ", "
+              "slot=%" PRIu8 "):\n%s\n", gc, slot,
+              sylverant_db_error(&td->conn));
+        goto err;
+    }
+
+    make_mini_char(cd, &mc);
+    save_preview(gc, slot, &mc, 0);
+
+    if(sylverant_db_query(&td->conn, "COMMIT")) {
+        debug(DBG_WARN, "Couldn't commit character data (gc=%" PRIu32 ", "
+              "slot=%" PRIu8 "):\n%s\n", gc, slot,
+              sylverant_db_error(&td->conn));
+        goto err;
+    }
+
+    return 0;
+
+err:
+    sylverant_db_query(&td->conn, "ROLLBACK");
+    return -1;
+}
+
+/* Read the stored preview of a character. Returns 1 if it was found, 0 if not,
+   or -1 on error. */
+static int load_preview(uint32_t gc, uint8_t slot,
+                        sylverant_bb_mini_char_t *mc) {
     char query[256];
     void *result;
     char **row;
-    unsigned long *len, sz;
+    unsigned long *len;
     int rv = 0;
-    sylverant_bb_db_char_t *char_data;
-    sylverant_bb_mini_char_t mc;
-    uLong sz2;
+    login_tdata_t *td = get_tdata();
 
-    /* Make sure the slot is sane */
-    if(pkt->slot > 3) {
+    sprintf(query, "SELECT data FROM character_preview WHERE guildcard='%"
+            PRIu32 "' AND slot='%" PRIu8 "'", gc, slot);
+
+    if(sylverant_db_query(&td->conn, query)) {
+        return -1;
+    }
+
+    if(!(result = sylverant_db_result_store(&td->conn))) {
         return -1;
     }
 
+    if((row = sylverant_db_result_fetch(result))) {
+        len = sylverant_db_result_lengths(result);
+
+        if(len && len[0] == sizeof(sylverant_bb_mini_char_t)) {
+            memcpy(mc, row[0], sizeof(sylverant_bb_mini_char_t));
+            rv = 1;
+        }
+    }
+
+    sylverant_db_result_free(result);
+
+    return rv;
+}
+
+/* Build the preview of a character from the full character data, saving the
+   preview for next time. Returns 1 if the character exists, 0 if not, or a
+   negative value on error. */
+static int load_char_preview(login_client_t *c, uint8_t slot,
+                             sylverant_bb_mini_char_t *mc) {
+    char query[256];
+    void *result;
+    char **row;
+    unsigned long *len, sz;
+    sylverant_bb_db_char_t *char_data;
+    uLong sz2;
+    login_tdata_t *td = get_tdata();
+
     /* Query the database for the data */
     sprintf(query, "SELECT data, size FROM character_data WHERE guildcard='%"
-            PRIu32 "' AND slot='%d'", c->guildcard, (int)pkt->slot);
+            PRIu32 "' AND slot='%d'", c->guildcard, (int)slot);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         return -2;
     }
 
-    if(!(result = sylverant_db_result_store(&conn))) {
+    if(!(result = sylverant_db_result_store(&td->conn))) {
         return -3;
     }
 
-    row = sylverant_db_result_fetch(result);
+    if(!(row = sylverant_db_result_fetch(result))) {
+        sylverant_db_result_free(result);
+        return 0;
+    }
 
-    if(pkt->reason == 0) {
-        /* The client wants the preview data for character select... */
-        if(row) {
-            /* Grab the length of the character data */
-            if(!(len = sylverant_db_result_lengths(result))) {
-                sylverant_db_result_free(result);
-                debug(DBG_WARN, "Couldn't get length of character data\n");
-                debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-                return -1;
-            }
+    /* Grab the length of the character data */
+    if(!(len = sylverant_db_result_lengths(result))) {
+        sylverant_db_result_free(result);
+        debug(DBG_WARN, "Couldn't get length of character data\n");
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+        return -1;
+    }
 
-            sz = len[0];
-            char_data =
-                (sylverant_bb_db_char_t*)malloc(sizeof(sylverant_bb_db_char_t));
+    sz = len[0];
+    char_data = (sylverant_bb_db_char_t*)malloc(sizeof(sylverant_bb_db_char_t));
 
-            if(!char_data) {
-                debug(DBG_WARN, "Couldn't allocate space for char data\n");
-                debug(DBG_WARN, "%s\n", strerror(errno));
-                sylverant_db_result_free(result);
-                return -2;
-            }
+    if(!char_data) {
+        debug(DBG_WARN, "Couldn't allocate space for char data\n");
+        debug(DBG_WARN, "%s\n", strerror(errno));
+        sylverant_db_result_free(result);
+        return -2;
+    }
 
-            if(row[1]) {
-                if(atoi(row[1]) != sizeof(sylverant_bb_db_char_t)) {
-                    sylverant_db_result_free(result);
-                    free(char_data);
-                    debug(DBG_WARN, "Invalid character data length!\n");
-                    return -2;
-                }
-
-                sz2 = sizeof(sylverant_bb_db_char_t);
-
-                if(uncompress((Bytef *)char_data, &sz2, (Bytef *)row[0],
-                              (uLong)sz) != Z_OK) {
-                    sylverant_db_result_free(result);
-                    free(char_data);
-                    debug(DBG_WARN, "Can't uncompress character data\n");
-                    return -3;
-                }
-            }
-            else {
-                if(sz != sizeof(sylverant_bb_db_char_t)) {
-                    sylverant_db_result_free(result);
-                    free(char_data);
-                    debug(DBG_WARN, "Invalid (unc) character data length!\n");
-                    return -2;
-                }
-
-                memcpy(char_data, row[0], sizeof(sylverant_bb_db_char_t));
-            }
+    if(row[1]) {
+        if(atoi(row[1]) != sizeof(sylverant_bb_db_char_t)) {
+            sylverant_db_result_free(result);
+            free(char_data);
+            debug(DBG_WARN, "Invalid character data length!\n");
+            return -2;
+        }
 
-            /* We've got it... Copy it out of the row retrieved. */
-            memcpy(mc.guildcard_str, char_data->character.guildcard_str, 0x70);
-            mc.level = char_data->character.level;
-            mc.exp = char_data->character.exp;
-            mc.play_time = char_data->character.play_time;
-            mc.unused[11] = mc.unused[12] = mc.unused[13] = mc.unused[14] = 0;
+        sz2 = sizeof(sylverant_bb_db_char_t);
 
+        if(uncompress((Bytef *)char_data, &sz2, (Bytef *)row[0],
+                      (uLong)sz) != Z_OK) {
+            sylverant_db_result_free(result);
             free(char_data);
-
-            rv = send_bb_char_preview(c, &mc, pkt->slot);
+            debug(DBG_WARN, "Can't uncompress character data\n");
+            return -3;
         }
-        else {
-            /* No data's there, so let the client know */
-            rv = send_bb_char_ack(c, pkt->slot, BB_CHAR_ACK_NONEXISTANT);
+    }
+    else {
+        if(sz != sizeof(sylverant_bb_db_char_t)) {
+            sylverant_db_result_free(result);
+            free(char_data);
+            debug(DBG_WARN, "Invalid (unc) character data length!\n");
+            return -2;
+        }
+
+        memcpy(char_data, row[0], sizeof(sylverant_bb_db_char_t));
+    }
+
+    sylverant_db_result_free(result);
+
+    /* We've got it... Build the preview and save it for later. */
+    make_mini_char(char_data, mc);
+    free(char_data);
+    save_preview(c->guildcard, slot, mc, 1);
+
+    return 1;
+}
+
+static int handle_char_select(login_client_t *c, bb_char_select_pkt *pkt) {
+    int rv = 0;
+    sylverant_bb_mini_char_t mc;
+
+    /* Make sure the slot is sane */
+    if(pkt->slot > 3) {
+        return -1;
+    }
+
+    if(pkt->reason == 0) {
+        /* The client wants the preview data for character select. Use the
+           stored preview if there is one, otherwise go to the full data. */
+        if(load_preview(c->guildcard, pkt->slot, &mc) != 1) {
+            if((rv = load_char_preview(c, pkt->slot, &mc)) < 0) {
+                return rv;
+            }
+            else if(!rv) {
+                /* No data's there, so let the client know */
+                return send_bb_char_ack(c, pkt->slot,
+                                        BB_CHAR_ACK_NONEXISTANT);
+            }
         }
+
+        rv = send_bb_char_preview(c, &mc, pkt->slot);
     }
     else {
         /* The client is actually selecting the character to play with. Update
@@ -503,8 +652,6 @@ static int handle_char_select(login_client_t *c, bb_char_select_pkt *pkt) {
         }
     }
 
-    sylverant_db_result_free(result);
-
     return rv;
 }
 
@@ -520,7 +667,9 @@ static int handle_guild_request(login_client_t *c) {
     unsigned long *lengths;
     uint32_t checksum;
     int i = 0;
-    uint32_t gc;
+    uint32_t gc, version;
+    int have_ver;
+    login_tdata_t *td = get_tdata();
 
     if(!c->gc_data) {
         c->gc_data = (bb_gc_data_t *)malloc(sizeof(bb_gc_data_t));
@@ -531,6 +680,13 @@ static int handle_guild_request(login_client_t *c) {
         }
     }
 
+    /* If nothing has changed since we last read this account's data, there's
+       no need to go through the database for it again. */
+    have_ver = !gc_cache_version(c->guildcard, &version);
+
+    if(have_ver && gc_cache_get(c->guildcard, version, c->gc_data, &checksum))
+        return send_bb_guild_header(c, checksum);
+
     /* Clear it out */
     memset(c->gc_data, 0, sizeof(bb_gc_data_t));
 
@@ -539,17 +695,17 @@ static int handle_guild_request(login_client_t *c) {
             "section_id, class, comment FROM blueburst_guildcards WHERE "
             "guildcard='%" PRIu32 "' ORDER BY priority ASC", c->guildcard);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         /* Should send an error message to the user */
         debug(DBG_WARN, "Couldn't fetch guildcards (gc=%" PRIu32 "):\n"
-              "%s\n", c->guildcard, sylverant_db_error(&conn));
+              "%s\n", c->guildcard, sylverant_db_error(&td->conn));
         return -1;
     }
 
-    if(!(result = sylverant_db_result_store(&conn))) {
+    if(!(result = sylverant_db_result_store(&td->conn))) {
         /* Should send an error message to the user */
         debug(DBG_WARN, "Couldn't store guildcard result (gc=%" PRIu32 "):\n"
-              "%s\n", c->guildcard, sylverant_db_error(&conn));
+              "%s\n", c->guildcard, sylverant_db_error(&td->conn));
         return -1;
     }
 
@@ -579,17 +735,17 @@ static int handle_guild_request(login_client_t *c) {
             "section_id, class FROM blueburst_blacklist WHERE guildcard='%"
             PRIu32 "' ORDER BY blocked_gc ASC", c->guildcard);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         /* Should send an error message to the user */
         debug(DBG_WARN, "Couldn't fetch blaclist (gc=%" PRIu32 "):\n"
-              "%s\n", c->guildcard, sylverant_db_error(&conn));
+              "%s\n", c->guildcard, sylverant_db_error(&td->conn));
         return -1;
     }
 
-    if(!(result = sylverant_db_result_store(&conn))) {
+    if(!(result = sylverant_db_result_store(&td->conn))) {
         /* Should send an error message to the user */
         debug(DBG_WARN, "Couldn't store blacklist result (gc=%" PRIu32 "):\n"
-              "%s\n", c->guildcard, sylverant_db_error(&conn));
+              "%s\n", c->guildcard, sylverant_db_error(&td->conn));
         return -1;
     }
 
@@ -618,6 +774,9 @@ static int handle_guild_request(login_client_t *c) {
     /* Calculate the checksum, and send the header */
     checksum = sylverant_crc32((uint8_t *)c->gc_data, sizeof(bb_gc_data_t));
 
+    if(have_ver)
+        gc_cache_add(c->guildcard, version, c->gc_data, checksum);
+
     return send_bb_guild_header(c, checksum);
 }
 
@@ -636,15 +795,42 @@ static int handle_guild_chunk(login_client_t *c, bb_guildcard_req_pkt *pkt) {
     return 0;
 }
 
+static param_set_t *get_param_data(void) {
+    param_set_t *rv;
+
+    pthread_mutex_lock(&params_mutex);
+
+    if((rv = cur_params)) {
+        ++rv->refcnt;
+    }
+
+    pthread_mutex_unlock(&params_mutex);
+
+    return rv;
+}
+
 static int handle_param_hdr_req(login_client_t *c) {
-    return send_bb_pkt(c, (bb_pkt_hdr_t *)param_hdr);
+    /* Start the client on the newest set of data. */
+    if(c->params) {
+        put_param_data(c->params);
+    }
+
+    if(!(c->params = get_param_data())) {
+        return -1;
+    }
+
+    return send_bb_pkt(c, (bb_pkt_hdr_t *)c->params->hdr);
 }
 
 static int handle_param_chunk_req(login_client_t *c, bb_pkt_hdr_t *pkt) {
     uint32_t chunk = LE32(pkt->flags);
 
-    if(chunk < num_param_chunks) {
-        return send_bb_pkt(c, (bb_pkt_hdr_t *)param_chunks[chunk]);
+    if(!c->params && !(c->params = get_param_data())) {
+        return -1;
+    }
+
+    if(chunk < c->params->num_chunks) {
+        return send_bb_pkt(c, (bb_pkt_hdr_t *)c->params->chunks[chunk]);
     }
 
     return -1;
@@ -653,15 +839,16 @@ static int handle_param_chunk_req(login_client_t *c, bb_pkt_hdr_t *pkt) {
 static int handle_setflag(login_client_t *c, bb_setflag_pkt *pkt) {
     uint32_t val = LE32(pkt->flags);
     char query[256];
+    login_tdata_t *td = get_tdata();
 
     sprintf(query, "UPDATE account_data SET dressflag='%" PRIu32 "' WHERE "
             "account_id='%" PRIu32 "'", val, c->account_id);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         /* Should send an error message to the user */
         debug(DBG_WARN, "Couldn't set flags (account=%" PRIu32 ", flags=%"
               PRIu8 "):\n%s\n", c->account_id, val,
-              sylverant_db_error(&conn));
+              sylverant_db_error(&td->conn));
         return -1;
     }
 
@@ -672,9 +859,10 @@ static int handle_update_char(login_client_t *c, bb_char_preview_pkt *pkt) {
     uint32_t flags = c->flags;
     sylverant_bb_db_char_t char_data;
     uint8_t cl = pkt->data.ch_class;
-    static char query[sizeof(sylverant_bb_db_char_t) * 2 + 256];
+    char query[256];
     void *result;
     char **row;
+    login_tdata_t *td = get_tdata();
 
     if(flags & 0x00000001) {
         /* Copy in the default data */
@@ -688,33 +876,10 @@ static int handle_update_char(login_client_t *c, bb_char_preview_pkt *pkt) {
         memcpy(char_data.character.guildcard_str, pkt->data.guildcard_str,
                0x70);
 
-        sprintf(query, "DELETE FROM character_data WHERE guildcard="
-                "'%" PRIu32 "' AND slot='%" PRIu8 "'", c->guildcard,
-                pkt->slot);
-
-        if(sylverant_db_query(&conn, query)) {
-            debug(DBG_WARN, "Couldn't clear old character data (gc=%"
-                  PRIu32 ", slot=%" PRIu8 "):\n%s\n", c->guildcard, pkt->slot,
-                  sylverant_db_error(&conn));
+        if(save_char(c->guildcard, pkt->slot, &char_data, 1)) {
             /* XXXX: Send the user an error message */
             return -1;
         }
-
-        sprintf(query, "INSERT INTO character_data (guildcard, slot, data) "
-                "VALUES ('%" PRIu32"', '%" PRIu8 "', '", c->guildcard,
-                pkt->slot);
-        sylverant_db_escape_str(&conn, query + strlen(query),
-                                (char *)&char_data,
-                                sizeof(sylverant_bb_db_char_t));
-        strcat(query, "')");
-
-        if(sylverant_db_query(&conn, query)) {
-            debug(DBG_WARN, "Couldn't clear create character data (gc=%"
-                  PRIu32 ", slot=%" PRIu8 "):\n%s\n", c->guildcard, pkt->slot,
-                  sylverant_db_error(&conn));
-            /* XXXX: Send the user an error message */
-            return -2;
-        }
     }
     else if(flags & 0x00000002) {
         /* Using the dressing room */
@@ -722,15 +887,15 @@ static int handle_update_char(login_client_t *c, bb_char_preview_pkt *pkt) {
                 PRIu32 "' AND slot='%" PRIu8 "'", c->guildcard, pkt->slot);
 
         /* Grab the old data... */
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             debug(DBG_WARN, "Couldn't fetch character data (gc=%" PRIu32 ", "
                   "slot=%" PRIu8 "):\n%s\n", c->guildcard, pkt->slot,
-                  sylverant_db_error(&conn));
+                  sylverant_db_error(&td->conn));
             /* XXXX: Send the user an error message */
             return -3;
         }
 
-        if(!(result = sylverant_db_result_store(&conn))) {
+        if(!(result = sylverant_db_result_store(&td->conn))) {
             /* XXXX: Send the user an error message */
             return -4;
         }
@@ -748,17 +913,7 @@ static int handle_update_char(login_client_t *c, bb_char_preview_pkt *pkt) {
         memcpy(char_data.character.guildcard_str, pkt->data.guildcard_str,
                0x70);
 
-        strcpy(query, "UPDATE character_data SET data='");
-        sylverant_db_escape_str(&conn, query + strlen(query),
-                                (char *)&char_data,
-                                sizeof(sylverant_bb_db_char_t));
-        sprintf(query + strlen(query), "' WHERE guildcard='%" PRIu32 "' AND "
-                "slot='%" PRIu8 "'", c->guildcard, pkt->slot);
-
-        if(sylverant_db_query(&conn, query)) {
-            debug(DBG_WARN, "Couldn't update character data (gc=%" PRIu32 ", "
-                  "slot=%" PRIu8 "):\n%s\n", c->guildcard, pkt->slot,
-                  sylverant_db_error(&conn));
+        if(save_char(c->guildcard, pkt->slot, &char_data, 0)) {
             /* XXXX: Send the user an error message */
             return -6;
         }
@@ -767,10 +922,10 @@ static int handle_update_char(login_client_t *c, bb_char_preview_pkt *pkt) {
     sprintf(query, "UPDATE account_data SET dressflag='0' WHERE account_id='%"
             PRIu32 "'", c->account_id);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         /* XXXX: Send the user an error message */
         debug(DBG_WARN, "Couldn't clear flags (account=%" PRIu32 "):\n%s\n",
-              c->account_id, sylverant_db_error(&conn));
+              c->account_id, sylverant_db_error(&td->conn));
         return -7;
     }
 
@@ -791,11 +946,9 @@ static int handle_update_char(login_client_t *c, bb_char_preview_pkt *pkt) {
 static int handle_info_req(login_client_t *c, bb_select_pkt *pkt) {
     uint32_t menu_id = LE32(pkt->menu_id);
     uint32_t item_id = LE32(pkt->item_id);
-    uint16_t menu_code;
-    int ship_num;
     char str[256];
-    void *result;
-    char **row;
+    ship_dir_t *d;
+    const ship_dir_ent_t *s;
 
     switch(menu_id & 0xFF) {
         /* Ship */
@@ -805,43 +958,33 @@ static int handle_info_req(login_client_t *c, bb_select_pkt *pkt) {
                 return send_info_reply(c, __(c, "\tENothing here."));
             }
 
-            /* We should have a ship ID as the item_id at this point, so query
-               the db for the info we want. */
-            sprintf(str, "SELECT name, players, games, menu_code, ship_number "
-                    "FROM online_ships WHERE ship_id='%lu'",
-                    (unsigned long)item_id);
-
-            /* Query for what we're looking for */
-            if(sylverant_db_query(&conn, str)) {
+            /* We should have a ship ID as the item_id at this point, so look
+               up the info we want. */
+            if(!(d = ship_dir_get())) {
                 return -1;
             }
 
-            if(!(result = sylverant_db_result_store(&conn))) {
-                return -2;
-            }
-
-            /* If we don't have a row, then the ship is offline */
-            if(!(row = sylverant_db_result_fetch(result))) {
+            /* If we don't have it, then the ship is offline */
+            if(!(s = ship_dir_find(d, item_id))) {
+                ship_dir_put(d);
                 return send_info_reply(c, __(c, "\tE\tC4That ship is now\n"
                                              "offline."));
             }
 
-            /* Parse out the menu code */
-            menu_code = (uint16_t)atoi(row[3]);
-            ship_num = atoi(row[4]);
-
             /* Send the info reply */
-            if(!menu_code) {
-                sprintf(str, "%02X:%s\n%s %s\n%s %s", ship_num, row[0], row[1],
-                        __(c, "Users"), row[2], __(c, "Teams"));
+            if(!s->menu_code) {
+                sprintf(str, "%02X:%s\n%" PRIu32 " %s\n%" PRIu32 " %s",
+                        s->ship_number, s->name, s->players, __(c, "Users"),
+                        s->games, __(c, "Teams"));
             }
             else {
-                sprintf(str, "%02X:%c%c/%s\n%s %s\n%s %s", ship_num,
-                        (char)menu_code, (char)(menu_code >> 8), row[0], row[1],
-                        __(c, "Users"), row[2], __(c, "Teams"));
+                sprintf(str, "%02X:%c%c/%s\n%" PRIu32 " %s\n%" PRIu32 " %s",
+                        s->ship_number, (char)s->menu_code,
+                        (char)(s->menu_code >> 8), s->name, s->players,
+                        __(c, "Users"), s->games, __(c, "Teams"));
             }
 
-            sylverant_db_result_free(result);
+            ship_dir_put(d);
 
             return send_info_reply(c, str);
 
@@ -939,49 +1082,57 @@ int process_bbcharacter_packet(login_client_t *c, void *pkt) {
     }
 }
 
-int load_param_data(void) {
+static void free_param_set(param_set_t *p) {
+    munmap(p->map, p->map_size);
+    free(p);
+}
+
+void put_param_data(param_set_t *p) {
+    pthread_mutex_lock(&params_mutex);
+
+    if(!--p->refcnt) {
+        free_param_set(p);
+    }
+
+    pthread_mutex_unlock(&params_mutex);
+}
+
+/* Pad out a packet length so that every packet in the mapping stays nicely
+   aligned. */
+#define PARAM_ALIGN(x)  (((x) + 7) & ~7)
+
+static param_set_t *build_param_set(void) {
     FILE *fp2;
     const char *fn;
-    int i = 0, len;
-    long filelen;
+    char path[256];
+    int i = 0, len, hdr_len, num_chunks;
+    long filelen, sizes[NUM_PARAM_FILES];
     uint32_t checksum, offset = 0;
-    uint8_t *rawbuf;
+    uint8_t *rawbuf, *ptr;
+    param_set_t *rv;
+    size_t size;
+    long pgsize = sysconf(_SC_PAGESIZE);
+    bb_param_hdr_pkt *hdr;
+    bb_param_chunk_pkt *chunk;
 
     /* Allocate space for the buffer first */
     rawbuf = (uint8_t *)malloc(MAX_PARAMS_SIZE);
     if(!rawbuf) {
         debug(DBG_ERROR, "Couldn't allocate param buffer:\n%s\n",
               strerror(errno));
-        return -1;
+        return NULL;
     }
 
-    /* Allocate space for the parameter header */
-    len = 0x08 + (NUM_PARAM_FILES * 0x4C);
-    param_hdr = (bb_param_hdr_pkt *)malloc(len);
-    if(!param_hdr) {
-        debug(DBG_ERROR, "Couldn't allocate parameter header:\n%s\n",
-              strerror(errno));
-        free(rawbuf);
-        return -3;
-    }
-
-    /* Go to the parameter file directory... */
-    chdir("blueburst/param");
-
-    param_hdr->hdr.pkt_type = LE16(BB_PARAM_HEADER_TYPE);
-    param_hdr->hdr.pkt_len = LE16(len);
-    param_hdr->hdr.flags = LE32(NUM_PARAM_FILES);
-
-    /* Load each of the parameter files. */
+    /* Read in each of the parameter files. */
     for(i = 0; i < NUM_PARAM_FILES; ++i) {
         fn = param_files[i];
         debug(DBG_LOG, "Loading param file: %s\n", fn);
+        sprintf(path, "blueburst/param/%s", fn);
 
-        if(!(fp2 = fopen(fn, "rb"))) {
+        if(!(fp2 = fopen(path, "rb"))) {
             debug(DBG_WARN, "Couldn't open param file: %s\n", fn);
-            fclose(fp2);
             free(rawbuf);
-            return -3;
+            return NULL;
         }
 
         /* Figure out how long it is, and make sure its not going to overflow
@@ -991,10 +1142,10 @@ int load_param_data(void) {
         fseek(fp2, 0, SEEK_SET);
 
         if(filelen > 0x10000) {
-            debug(DBG_WARN, "Param file %s too long (%l)\n", fn, filelen);
+            debug(DBG_WARN, "Param file %s too long (%ld)\n", fn, filelen);
             fclose(fp2);
             free(rawbuf);
-            return -3;
+            return NULL;
         }
 
         /* Make sure we aren't going over the max size... */
@@ -1002,45 +1153,71 @@ int load_param_data(void) {
             debug(DBG_WARN, "Params buffer would overflow reading %s\n", fn);
             fclose(fp2);
             free(rawbuf);
-            return -3;
+            return NULL;
         }
 
         /* Read it in */
         fread(rawbuf + offset, 1, filelen, fp2);
         fclose(fp2);
-
-        /* Fill in the stuff in the header first */
-        checksum = sylverant_crc32(rawbuf + offset, filelen);
-
-        param_hdr->entries[i].size = LE32(((uint32_t)filelen));
-        param_hdr->entries[i].checksum = LE32(checksum);
-        param_hdr->entries[i].offset = LE32(offset);
-        strncpy(param_hdr->entries[i].filename, fn, 0x40);
-
+        sizes[i] = filelen;
         offset += filelen;
     }
 
-    /* Now that the header is built, time to make the chunks */
-    num_param_chunks = offset / 0x6800;
+    /* Figure out how big everything will be once its all built up */
+    hdr_len = 0x08 + (NUM_PARAM_FILES * 0x4C);
+    num_chunks = offset / 0x6800;
 
     if(offset % 0x6800) {
-        ++num_param_chunks;
+        ++num_chunks;
     }
 
-    /* Allocate space for the array of chunks */
-    param_chunks = (bb_param_chunk_pkt **)malloc(sizeof(bb_param_chunk_pkt *) *
-                                                 num_param_chunks);
-    if(!param_chunks) {
+    size = PARAM_ALIGN(hdr_len) + PARAM_ALIGN(0x680C) * num_chunks;
+    size = (size + pgsize - 1) & ~(pgsize - 1);
+
+    if(!(rv = (param_set_t *)malloc(sizeof(param_set_t) + num_chunks *
+                                    sizeof(bb_param_chunk_pkt *)))) {
         debug(DBG_ERROR, "Couldn't make param chunk array:\n%s\n",
               strerror(errno));
         free(rawbuf);
-        return -4;
+        return NULL;
+    }
+
+    rv->map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(rv->map == MAP_FAILED) {
+        debug(DBG_ERROR, "Couldn't map param data:\n%s\n", strerror(errno));
+        free(rv);
+        free(rawbuf);
+        return NULL;
     }
 
-    /* Scrub it, for safe-keeping */
-    memset(param_chunks, 0, sizeof(bb_param_chunk_pkt *) * num_param_chunks);
+    rv->map_size = size;
+    rv->num_chunks = num_chunks;
+    rv->refcnt = 1;
+
+    /* Build the header */
+    hdr = rv->hdr = (bb_param_hdr_pkt *)rv->map;
+    hdr->hdr.pkt_type = LE16(BB_PARAM_HEADER_TYPE);
+    hdr->hdr.pkt_len = LE16(hdr_len);
+    hdr->hdr.flags = LE32(NUM_PARAM_FILES);
+    offset = 0;
+
+    for(i = 0; i < NUM_PARAM_FILES; ++i) {
+        checksum = sylverant_crc32(rawbuf + offset, sizes[i]);
+
+        hdr->entries[i].size = LE32(((uint32_t)sizes[i]));
+        hdr->entries[i].checksum = LE32(checksum);
+        hdr->entries[i].offset = LE32(offset);
+        strncpy(hdr->entries[i].filename, param_files[i], 0x40);
 
-    for(i = 0; i < num_param_chunks; ++i) {
+        offset += sizes[i];
+    }
+
+    /* Now that the header is built, time to make the chunks */
+    ptr = rv->map + PARAM_ALIGN(hdr_len);
+
+    for(i = 0; i < num_chunks; ++i) {
         if(offset < (i + 1) * 0x6800) {
             len = (offset % 0x6800) + 0x0C;
         }
@@ -1048,43 +1225,62 @@ int load_param_data(void) {
             len = 0x680C;
         }
 
-        param_chunks[i] = (bb_param_chunk_pkt *)malloc(len);
-
-        if(!param_chunks[i]) {
-            debug(DBG_ERROR, "Couldn't make chunk:\n%s\n", strerror(errno));
-            free(rawbuf);
-            return -5;
-        }
+        chunk = rv->chunks[i] = (bb_param_chunk_pkt *)ptr;
 
         /* Fill in the chunk */
-        param_chunks[i]->hdr.pkt_type = LE16(BB_PARAM_CHUNK_TYPE);
-        param_chunks[i]->hdr.pkt_len = LE16(len);
-        param_chunks[i]->hdr.flags = 0;
-        param_chunks[i]->chunk = LE32(i);
-        memcpy(param_chunks[i]->data, rawbuf + (i * 0x6800), len - 0x0C);
+        chunk->hdr.pkt_type = LE16(BB_PARAM_CHUNK_TYPE);
+        chunk->hdr.pkt_len = LE16(len);
+        chunk->hdr.flags = 0;
+        chunk->chunk = LE32(i);
+        memcpy(chunk->data, rawbuf + (i * 0x6800), len - 0x0C);
+
+        ptr += PARAM_ALIGN(len);
     }
 
-    /* Cleanup time */
+    /* Nobody should be writing to this from now on. */
+    mprotect(rv->map, size, PROT_READ);
+
     free(rawbuf);
-    chdir("../..");
     debug(DBG_LOG, "Read %" PRIu32 " files into %d chunks\n", NUM_PARAM_FILES,
-          num_param_chunks);
+          num_chunks);
+
+    return rv;
+}
+
+int load_param_data(void) {
+    param_set_t *p, *old;
+
+    if(!(p = build_param_set())) {
+        return -1;
+    }
+
+    /* Swap in the new set. Anyone still downloading the old one keeps it until
+       they're done with it. */
+    pthread_mutex_lock(&params_mutex);
+    p->gen = ++param_gen;
+    old = cur_params;
+    cur_params = p;
+
+    if(old && !--old->refcnt) {
+        free_param_set(old);
+    }
+
+    pthread_mutex_unlock(&params_mutex);
+
+    debug(DBG_LOG, "Param data generation %" PRIu32 " loaded\n", p->gen);
 
     return 0;
 }
 
 void cleanup_param_data(void) {
-    int i;
+    pthread_mutex_lock(&params_mutex);
 
-    for(i = 0; i < num_param_chunks; ++i) {
-        free(param_chunks[i]);
+    if(cur_params && !--cur_params->refcnt) {
+        free_param_set(cur_params);
     }
 
-    free(param_chunks);
-    param_chunks = NULL;
-    num_param_chunks = 0;
-    free(param_hdr);
-    param_hdr = NULL;
+    cur_params = NULL;
+    pthread_mutex_unlock(&params_mutex);
 }
 
 int load_bb_char_data(void) {
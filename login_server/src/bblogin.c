@@ -21,7 +21,6 @@
 #include <string.h>
 #include <ctype.h>
 
-#include <openssl/sha.h>
 #include <sylverant/debug.h>
 #include <sylverant/database.h>
 
@@ -29,94 +28,53 @@
 #include "player.h"
 #include "packets.h"
 #include "login_packets.h"
+#include "worker.h"
+#include "auth.h"
 
-static int handle_bb_login(login_client_t *c, bb_login_93_pkt *pkt) {
-    char query[256];
-    int len;
-    char tmp[32];
-    void *result;
-    char **row;
-    uint8_t hash[32];
-    uint32_t teamid = 0, priv, guildcard;
+/* Called once the password check for a login is done. */
+static int bb_login_done(login_client_t *c, auth_req_t *req) {
+    int rv;
 
-    /* Make sure the username string is sane... */
-    len = strlen(pkt->username);
-    if(len > 16 || strlen(pkt->password) > 16) {
-        send_bb_security(c, 0, LOGIN_93BB_FORCED_DISCONNECT, 0, NULL, 0);
-        return -1;
-    }
-
-    sylverant_db_escape_str(&conn, tmp, pkt->username, len);
-    sprintf(query, "SELECT account_data.account_id, isbanned, teamid, "
-            "privlevel, guildcard, blueburst_clients.password FROM "
-            "account_data INNER JOIN blueburst_clients ON "
-            "account_data.account_id = blueburst_clients.account_id WHERE "
-            "blueburst_clients.username='%s'", tmp);
-
-    /* Query the database for the user... */
-    if(sylverant_db_query(&conn, query)) {
-        send_bb_security(c, 0, LOGIN_93BB_UNKNOWN_ERROR, 0, NULL, 0);
-        return -2;
+    if((rv = auth_bb_result(c, req))) {
+        return rv;
     }
 
-    result = sylverant_db_result_store(&conn);
-    if(!result) {
-        send_bb_security(c, 0, LOGIN_93BB_UNKNOWN_ERROR, 0, NULL, 0);
-        return -2;
-    }
+    /* Set up the security data (everything else is already 0'ed). */
+    c->sec_data.magic = LE32(0xDEADBEEF);
 
-    row = sylverant_db_result_fetch(result);
-    if(!row) {
-        send_bb_security(c, 0, LOGIN_93BB_NO_USER_RECORD, 0, NULL, 0);
-        sylverant_db_result_free(result);
-        return -3;
+    /* Send the security data packet */
+    if(send_bb_security(c, req->guildcard, LOGIN_93BB_OK, req->team_id,
+                        &c->sec_data, sizeof(bb_security_data_t))) {
+        return -7;
     }
 
-    /* Make sure some simple checks pass first... */
-    if(atoi(row[1])) {
-        /* User is banned by account. */
-        send_bb_security(c, 0, LOGIN_93BB_BANNED, 0, NULL, 0);
-        sylverant_db_result_free(result);
-        return -4;
-    }
+    /* Last step is to redirect them to the charater data port... */
+    return send_redirect(c, cfg->server_ip, 12001);
+}
 
-    /* If we've gotten this far, we have an account! Check the password. */
-    sprintf(tmp, "%s_salt_%s", pkt->password, row[4]);
-    SHA256((unsigned char *)tmp, strlen(tmp), hash);
+static int handle_bb_login(login_client_t *c, bb_login_93_pkt *pkt) {
+    auth_req_t *req;
 
-    if(memcmp(hash, row[5], 32)) {
-        /* Password check failed... */
-        send_bb_security(c, 0, LOGIN_93BB_BAD_USER_PWD, 0, NULL, 0);
-        sylverant_db_result_free(result);
-        return -6;
+    /* Make sure the username string is sane... */
+    if(strlen(pkt->username) > 16 || strlen(pkt->password) > 16) {
+        send_bb_security(c, 0, LOGIN_93BB_FORCED_DISCONNECT, 0, NULL, 0);
+        return -1;
     }
 
-    /* Grab the rest of what we care about from the query... */
-    errno = 0;
-    teamid = (uint32_t)strtoul(row[2], NULL, 0);
-    priv = (uint32_t)strtoul(row[3], NULL, 0);
-    guildcard = (uint32_t)strtoul(row[4], NULL, 0);
-    sylverant_db_result_free(result);
-
-    if(errno) {
+    /* The actual checking is done off on the authentication threads, so that
+       we don't hold everyone else up. */
+    if(!(req = auth_req_new(c, AUTH_TYPE_BB, &bb_login_done))) {
         send_bb_security(c, 0, LOGIN_93BB_UNKNOWN_ERROR, 0, NULL, 0);
         return -2;
     }
 
-    /* Set up the security data (everything else is already 0'ed). */
-    c->sec_data.magic = LE32(0xDEADBEEF);
-
-    /* Send the security data packet */
-    if(send_bb_security(c, guildcard, LOGIN_93BB_OK, teamid, &c->sec_data,
-                        sizeof(bb_security_data_t))) {
-        return -7;
-    }
+    strcpy(req->user, pkt->username);
+    strcpy(req->password, pkt->password);
+    auth_submit(req);
 
-    /* Last step is to redirect them to the charater data port... */
-    return send_redirect(c, cfg->server_ip, 12001);
+    return 0;
 }
 
-
 int process_bblogin_packet(login_client_t *c, void *pkt) {
     bb_pkt_hdr_t *bb = (bb_pkt_hdr_t *)pkt;
     uint16_t type = LE16(bb->pkt_type);
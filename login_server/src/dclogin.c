@@ -26,17 +26,20 @@
 #include <sylverant/debug.h>
 #include <sylverant/database.h>
 #include <sylverant/quest.h>
-#include <sylverant/md5.h>
 #include <sylverant/items.h>
 
 #include "login.h"
 #include "player.h"
 #include "login_packets.h"
+#include "worker.h"
+#include "shipdir.h"
+#include "bans.h"
+#include "auth.h"
 
 mini18n_t langs[CLIENT_LANG_COUNT];
 
-extern sylverant_dbconn_t conn;
 extern sylverant_quest_list_t qlist[CLIENT_TYPE_COUNT][CLIENT_LANG_COUNT];
+extern pthread_rwlock_t qlist_lock;
 extern sylverant_limits_t *limits;
 extern int shutting_down;
 
@@ -106,72 +109,12 @@ void print_packet(unsigned char *pkt, int len) {
 
 /* Check if an IP has been IP banned from the server. */
 static int is_ip_banned(login_client_t *c, time_t *until, char *reason) {
-    char query[256];
-    void *result;
-    char **row;
-    int rv = 0;
-    struct sockaddr_in *addr = (struct sockaddr_in *)&c->ip_addr;
-
-    /* XXXX: Need IPv6 bans too! */
-    if(c->is_ipv6) {
-        return 0;
-    }
-
-    /* Fill in the query. */
-    sprintf(query, "SELECT enddate, reason FROM ip_bans NATURAL JOIN bans "
-            "WHERE addr = '%u' AND enddate >= UNIX_TIMESTAMP() "
-            "AND startdate <= UNIX_TIMESTAMP()",
-            (unsigned int)addr->sin_addr.s_addr);
-
-    /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
-        return -1;
-    }
-
-    /* Grab the results. */
-    result = sylverant_db_result_store(&conn);
-
-    /* If there is a result, then the user is banned. */
-    if((row = sylverant_db_result_fetch(result))) {
-        rv = 1;
-        *until = (time_t)strtoul(row[0], NULL, 0);
-        strcpy(reason, row[1]);
-    }
-
-    sylverant_db_result_free(result);
-    return rv;
+    return ban_check_ip(&c->ip_addr, until, reason);
 }
 
 /* Check if a user is banned by guildcard. */
 static int is_gc_banned(uint32_t gc, time_t *until, char *reason) {
-    char query[256];
-    void *result;
-    char **row;
-    int rv = 0;
-
-    /* Fill in the query. */
-    sprintf(query, "SELECT enddate, reason FROM guildcard_bans "
-            "NATURAL JOIN bans WHERE guildcard = '%u' AND "
-            "enddate >= UNIX_TIMESTAMP() AND "
-            "startdate <= UNIX_TIMESTAMP()", (unsigned int)gc);
-
-    /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
-        return -1;
-    }
-
-    /* Grab the results. */
-    result = sylverant_db_result_store(&conn);
-
-    /* If there is a result, then the user is banned. */
-    if((row = sylverant_db_result_fetch(result))) {
-        rv = 1;
-        *until = (time_t)strtoul(row[0], NULL, 0);
-        strcpy(reason, row[1]);
-    }
-
-    sylverant_db_result_free(result);
-    return rv;
+    return ban_check_gc(gc, until, reason);
 }
 
 static int send_ban_msg(login_client_t *c, time_t until, const char *reason) {
@@ -202,18 +145,19 @@ static int is_gc_online(uint32_t gc) {
     void *result;
     char **row;
     int rv = 0;
+    login_tdata_t *td = get_tdata();
 
     /* Fill in the query. */
     sprintf(query, "SELECT guildcard FROM online_clients WHERE guildcard='%u'",
             (unsigned int)gc);
 
     /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         return -1;
     }
 
     /* Grab the results. */
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     /* If there is a result, then the user is already online. */
     if((row = sylverant_db_result_fetch(result))) {
@@ -231,6 +175,7 @@ static int handle_ntelogin(login_client_t *c, dcnte_login_88_pkt *pkt) {
     char **row;
     time_t banlen;
     int banned = is_ip_banned(c, &banlen, query), resp = LOGIN_88_NEW_USER;
+    login_tdata_t *td = get_tdata();
 
     /* Make sure the user isn't IP banned. */
     if(banned == -1) {
@@ -244,20 +189,20 @@ static int handle_ntelogin(login_client_t *c, dcnte_login_88_pkt *pkt) {
     }
 
     /* Escape all the important strings. */
-    sylverant_db_escape_str(&conn, serial, pkt->serial, 16);
-    sylverant_db_escape_str(&conn, access, pkt->access_key, 16);
+    sylverant_db_escape_str(&td->conn, serial, pkt->serial, 16);
+    sylverant_db_escape_str(&td->conn, access, pkt->access_key, 16);
 
     sprintf(query, "SELECT guildcard FROM dreamcast_nte_clients WHERE "
             "serial_number='%s' AND access_key='%s'", serial, access);
 
     /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                              "Please try again later."));
         return -1;
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if((row = sylverant_db_result_fetch(result))) {
         /* We have seen this client before, set the response code properly. */
@@ -284,24 +229,25 @@ static int handle_ntelogin8a(login_client_t *c, dcnte_login_8a_pkt *pkt) {
     char **row;
     int banned;
     time_t banlen;
+    login_tdata_t *td = get_tdata();
 
     /* Escape all the important strings. */
-    sylverant_db_escape_str(&conn, dc_id, pkt->dc_id, 8);
-    sylverant_db_escape_str(&conn, serial, c->serial, 16);
-    sylverant_db_escape_str(&conn, access, c->access_key, 16);
+    sylverant_db_escape_str(&td->conn, dc_id, pkt->dc_id, 8);
+    sylverant_db_escape_str(&td->conn, serial, c->serial, 16);
+    sylverant_db_escape_str(&td->conn, access, c->access_key, 16);
 
     sprintf(query, "SELECT guildcard FROM dreamcast_nte_clients WHERE "
             "(dc_id='%s' OR dc_id IS NULL) AND serial_number='%s' AND "
             "access_key='%s'", dc_id, serial, access);
 
     /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                              "Please try again later."));
         return -1;
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if((row = sylverant_db_result_fetch(result))) {
         /* We have seen this client before, save their guildcard for use. */
@@ -314,21 +260,21 @@ static int handle_ntelogin8a(login_client_t *c, dcnte_login_8a_pkt *pkt) {
         /* Assign a nice fresh new guildcard number to the client. */
         sprintf(query, "INSERT INTO guildcards (account_id) VALUES (NULL)");
 
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                                  "Please try again later."));
             return -1;
         }
 
         /* Grab the new guildcard for the user. */
-        gc = (uint32_t)sylverant_db_insert_id(&conn);
+        gc = (uint32_t)sylverant_db_insert_id(&td->conn);
 
         /* Add the client into our database. */
         sprintf(query, "INSERT INTO dreamcast_nte_clients (guildcard, "
                 "serial_number, access_key, dc_id) VALUES ('%u', '%s', '%s', "
                 "'%s')", gc, serial, access, dc_id);
 
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                                  "Please try again later."));
             return -1;
@@ -365,13 +311,13 @@ static int handle_ntelogin8a(login_client_t *c, dcnte_login_8a_pkt *pkt) {
     sprintf(query, "SELECT privlevel FROM account_data NATURAL JOIN guildcards "
             "WHERE guildcard='%u'", gc);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                              "Please try again later."));
         return -1;
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if(result) {
         if((row = sylverant_db_result_fetch(result))) {
@@ -392,24 +338,25 @@ static int handle_ntelogin8b(login_client_t *c, dcnte_login_8b_pkt *pkt) {
     char **row;
     int banned;
     time_t banlen;
+    login_tdata_t *td = get_tdata();
 
     /* Escape all the important strings. */
-    sylverant_db_escape_str(&conn, dc_id, (char *)pkt->dc_id, 8);
-    sylverant_db_escape_str(&conn, serial, pkt->serial, 16);
-    sylverant_db_escape_str(&conn, access, pkt->access_key, 16);
+    sylverant_db_escape_str(&td->conn, dc_id, (char *)pkt->dc_id, 8);
+    sylverant_db_escape_str(&td->conn, serial, pkt->serial, 16);
+    sylverant_db_escape_str(&td->conn, access, pkt->access_key, 16);
 
     sprintf(query, "SELECT guildcard FROM dreamcast_nte_clients WHERE "
             "(dc_id='%s' OR dc_id IS NULL) AND serial_number='%s' AND "
             "access_key='%s'", dc_id, serial, access);
 
     /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                              "Please try again later."));
         return -1;
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if((row = sylverant_db_result_fetch(result))) {
         /* We have seen this client before, save their guildcard for use. */
@@ -453,13 +400,13 @@ static int handle_ntelogin8b(login_client_t *c, dcnte_login_8b_pkt *pkt) {
     sprintf(query, "SELECT privlevel FROM account_data NATURAL JOIN guildcards "
             "WHERE guildcard='%u'", gc);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                              "Please try again later."));
         return -1;
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if(result) {
         if((row = sylverant_db_result_fetch(result))) {
@@ -469,6 +416,7 @@ static int handle_ntelogin8b(login_client_t *c, dcnte_login_8b_pkt *pkt) {
         sylverant_db_result_free(result);
     }
 
+    client_admit_done(c);
     send_dc_security(c, gc, NULL, 0);
     return send_ship_list(c, 0);
 }
@@ -480,6 +428,7 @@ static int handle_login0(login_client_t *c, dc_login_90_pkt *pkt) {
     uint8_t resp = LOGIN_90_OK;
     time_t banlen;
     int banned = is_ip_banned(c, &banlen, query);
+    login_tdata_t *td = get_tdata();
 
     /* Make sure the user isn't IP banned. */
     if(banned == -1) {
@@ -493,20 +442,20 @@ static int handle_login0(login_client_t *c, dc_login_90_pkt *pkt) {
     }
 
     /* Escape all the important strings. */
-    sylverant_db_escape_str(&conn, serial, pkt->serial, 8);
-    sylverant_db_escape_str(&conn, access, pkt->access_key, 8);
+    sylverant_db_escape_str(&td->conn, serial, pkt->serial, 8);
+    sylverant_db_escape_str(&td->conn, access, pkt->access_key, 8);
 
     sprintf(query, "SELECT guildcard FROM dreamcast_clients WHERE "
             "serial_number='%s' AND access_key='%s'", serial, access);
 
     /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                        "Please try again later."));
         return -1;
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if(!(row = sylverant_db_result_fetch(result))) {
         /* We've not seen this client before, get them to send us a 0x92. */
@@ -527,26 +476,27 @@ static int handle_login3(login_client_t *c, dc_login_93_pkt *pkt) {
     char **row;
     int banned;
     time_t banlen;
+    login_tdata_t *td = get_tdata();
 
     c->language_code = pkt->language_code;
 
     /* Escape all the important strings. */
-    sylverant_db_escape_str(&conn, dc_id, pkt->dc_id, 8);
-    sylverant_db_escape_str(&conn, serial, pkt->serial, 8);
-    sylverant_db_escape_str(&conn, access, pkt->access_key, 8);
+    sylverant_db_escape_str(&td->conn, dc_id, pkt->dc_id, 8);
+    sylverant_db_escape_str(&td->conn, serial, pkt->serial, 8);
+    sylverant_db_escape_str(&td->conn, access, pkt->access_key, 8);
 
     sprintf(query, "SELECT guildcard FROM dreamcast_clients WHERE (dc_id='%s' "
             "OR dc_id IS NULL) AND serial_number='%s' AND access_key='%s'",
             dc_id, serial, access);
 
     /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                        "Please try again later."));
         return -1;
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if((row = sylverant_db_result_fetch(result))) {
         /* We have seen this client before, save their guildcard for use. */
@@ -559,21 +509,21 @@ static int handle_login3(login_client_t *c, dc_login_93_pkt *pkt) {
         /* Assign a nice fresh new guildcard number to the client. */
         sprintf(query, "INSERT INTO guildcards (account_id) VALUES (NULL)");
 
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                            "Please try again later."));
             return -1;
         }
 
         /* Grab the new guildcard for the user. */
-        gc = (uint32_t)sylverant_db_insert_id(&conn);
+        gc = (uint32_t)sylverant_db_insert_id(&td->conn);
 
         /* Add the client into our database. */
         sprintf(query, "INSERT INTO dreamcast_clients (guildcard, "
                 "serial_number, access_key, dc_id) VALUES ('%u', '%s', '%s', "
                 "'%s')", gc, serial, access, dc_id);
 
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                            "Please try again later."));
             return -1;
@@ -610,13 +560,13 @@ static int handle_login3(login_client_t *c, dc_login_93_pkt *pkt) {
     sprintf(query, "SELECT privlevel FROM account_data NATURAL JOIN guildcards "
             "WHERE guildcard='%u'", gc);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         send_large_msg(c, __(c, "\tEInternal Server Error.\n"
                        "Please try again later."));
         return -1;
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if(result) {
         if((row = sylverant_db_result_fetch(result))) {
@@ -626,6 +576,7 @@ static int handle_login3(login_client_t *c, dc_login_93_pkt *pkt) {
         sylverant_db_result_free(result);
     }
 
+    client_admit_done(c);
     return send_dc_security(c, gc, NULL, 0);
 }
 
@@ -638,6 +589,7 @@ static int handle_logina(login_client_t *c, dcv2_login_9a_pkt *pkt) {
     char **row;
     time_t banlen;
     int banned = is_ip_banned(c, &banlen, query);
+    login_tdata_t *td = get_tdata();
 
     /* Make sure the user isn't IP banned. */
     if(banned == -1) {
@@ -651,9 +603,9 @@ static int handle_logina(login_client_t *c, dcv2_login_9a_pkt *pkt) {
     c->version = SYLVERANT_QUEST_V1 | SYLVERANT_QUEST_V2;
 
     /* Escape all the important strings. */
-    sylverant_db_escape_str(&conn, dc_id, pkt->dc_id, 8);
-    sylverant_db_escape_str(&conn, serial, pkt->serial, 8);
-    sylverant_db_escape_str(&conn, access, pkt->access_key, 8);
+    sylverant_db_escape_str(&td->conn, dc_id, pkt->dc_id, 8);
+    sylverant_db_escape_str(&td->conn, serial, pkt->serial, 8);
+    sylverant_db_escape_str(&td->conn, access, pkt->access_key, 8);
 
     if(c->type != CLIENT_TYPE_PC) {
         sprintf(query, "SELECT guildcard FROM dreamcast_clients WHERE "
@@ -666,11 +618,11 @@ static int handle_logina(login_client_t *c, dcv2_login_9a_pkt *pkt) {
     }
 
     /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         return send_simple(c, LOGIN_9A_TYPE, LOGIN_9A_ERROR);
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if((row = sylverant_db_result_fetch(result))) {
         /* We have seen this client before, save their guildcard for use. */
@@ -692,19 +644,19 @@ static int handle_logina(login_client_t *c, dcv2_login_9a_pkt *pkt) {
         /* Assign a nice fresh new guildcard number to the client. */
         sprintf(query, "INSERT INTO guildcards (account_id) VALUES (NULL)");
 
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             return send_simple(c, LOGIN_9A_TYPE, LOGIN_9A_ERROR);
         }
 
         /* Grab the new guildcard for the user. */
-        gc = (uint32_t)sylverant_db_insert_id(&conn);
+        gc = (uint32_t)sylverant_db_insert_id(&td->conn);
 
         /* Add the client into our database. */
         sprintf(query, "INSERT INTO dreamcast_clients (guildcard, "
                 "serial_number, access_key, dc_id) VALUES ('%u', '%s', '%s', "
                 "'%s')", gc, serial, access, dc_id);
 
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             return send_simple(c, LOGIN_9A_TYPE, LOGIN_9A_ERROR);
         }
     }
@@ -735,11 +687,11 @@ static int handle_logina(login_client_t *c, dcv2_login_9a_pkt *pkt) {
     sprintf(query, "SELECT privlevel FROM account_data NATURAL JOIN guildcards "
             "WHERE guildcard='%u'", gc);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         return send_simple(c, LOGIN_9A_TYPE, LOGIN_9A_ERROR);
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if(result) {
         if((row = sylverant_db_result_fetch(result))) {
@@ -765,6 +717,7 @@ static int handle_gchlcheck(login_client_t *c, gc_hlcheck_pkt *pkt) {
     char **row;
     time_t banlen;
     int banned = is_ip_banned(c, &banlen, query);
+    login_tdata_t *td = get_tdata();
 
     /* Check the version code of the connecting client since some clients seem
        to want to connect on wonky ports... */
@@ -801,18 +754,18 @@ static int handle_gchlcheck(login_client_t *c, gc_hlcheck_pkt *pkt) {
     }
 
     /* Escape all the important strings. */
-    sylverant_db_escape_str(&conn, serial, pkt->serial, 8);
-    sylverant_db_escape_str(&conn, access, pkt->access_key, 12);
+    sylverant_db_escape_str(&td->conn, serial, pkt->serial, 8);
+    sylverant_db_escape_str(&td->conn, access, pkt->access_key, 12);
 
     sprintf(query, "SELECT guildcard FROM gamecube_clients WHERE "
             "serial_number='%s' AND access_key='%s'", serial, access);
 
     /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         return send_simple(c, LOGIN_9A_TYPE, LOGIN_DB_CONN_ERROR);
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if((row = sylverant_db_result_fetch(result))) {
         gc = (uint32_t)strtoul(row[0], NULL, 0);
@@ -845,11 +798,11 @@ static int handle_gchlcheck(login_client_t *c, gc_hlcheck_pkt *pkt) {
         sprintf(query, "SELECT account_id FROM guildcards WHERE guildcard='%u'",
                 gc);
 
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             return send_simple(c, LOGIN_9A_TYPE, LOGIN_DB_CONN_ERROR);
         }
 
-        result = sylverant_db_result_store(&conn);
+        result = sylverant_db_result_store(&td->conn);
 
         if(!(row = sylverant_db_result_fetch(result))) {
             return send_simple(c, LOGIN_9A_TYPE, LOGIN_DB_CONN_ERROR);
@@ -862,11 +815,11 @@ static int handle_gchlcheck(login_client_t *c, gc_hlcheck_pkt *pkt) {
                 "account_id='%u'", account);
 
         /* If we can't query the DB, fail. */
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             return send_simple(c, LOGIN_9A_TYPE, LOGIN_DB_CONN_ERROR);
         }
 
-        result = sylverant_db_result_store(&conn);
+        result = sylverant_db_result_store(&td->conn);
 
         if((row = sylverant_db_result_fetch(result))) {
             c->is_gm = atoi(row[0]);
@@ -880,89 +833,36 @@ static int handle_gchlcheck(login_client_t *c, gc_hlcheck_pkt *pkt) {
     return send_simple(c, LOGIN_9A_TYPE, LOGIN_DB_CONN_ERROR);
 }
 
-static int handle_gcloginc(login_client_t *c, gc_login_9c_pkt *pkt) {
-    uint32_t account, gc;
-    char query[256], serial[32], access[32];
-    void *result;
-    char **row;
-    unsigned char hash[16];
-    int i;
-
-    /* Escape all the important strings. */
-    sylverant_db_escape_str(&conn, serial, pkt->serial, 8);
-    sylverant_db_escape_str(&conn, access, pkt->access_key, 12);
-
-    sprintf(query, "SELECT guildcard FROM gamecube_clients WHERE "
-            "serial_number='%s' AND access_key='%s'", serial, access);
-
-    /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
-        return -1;
-    }
-
-    result = sylverant_db_result_store(&conn);
-
-    if((row = sylverant_db_result_fetch(result))) {
-        /* The client has at least registered, check the password. */
-        gc = (uint32_t)strtoul(row[0], NULL, 0);
-
-        sylverant_db_result_free(result);
-
-        /* We need the account to do that though... */
-        sprintf(query, "SELECT account_id FROM guildcards WHERE guildcard='%u'",
-                gc);
-
-        if(sylverant_db_query(&conn, query)) {
-            return -1;
-        }
+/* Called once the password check for a 0x9C packet is done. */
+static int gcloginc_done(login_client_t *c, auth_req_t *req) {
+    switch(req->result) {
+        case AUTH_OK:
+            return send_simple(c, LOGIN_9C_TYPE, LOGIN_9CGC_OK);
 
-        result = sylverant_db_result_store(&conn);
+        case AUTH_BAD_PWD:
+            return send_simple(c, LOGIN_9C_TYPE, LOGIN_9CGC_BAD_PWD);
 
-        if(!(row = sylverant_db_result_fetch(result))) {
-            return -1;
-        }
-
-        account = (uint32_t)strtoul(row[0], NULL, 0);
-        sylverant_db_result_free(result);
-
-        sprintf(query, "SELECT password, regtime FROM account_data WHERE "
-                "account_id='%u'", account);
-
-        /* If we can't query the DB, fail. */
-        if(sylverant_db_query(&conn, query)) {
+        default:
+            /* If we get here, we didn't find them, bail out. */
             return -1;
-        }
-
-        result = sylverant_db_result_store(&conn);
-
-        if((row = sylverant_db_result_fetch(result))) {
-            /* Check the password. */
-            sprintf(query, "%s_%s_salt", pkt->password, row[1]);
-            md5((unsigned char *)query, strlen(query), hash);
-
-            query[0] = '\0';
-            for(i = 0; i < 16; ++i) {
-                sprintf(query, "%s%02x", query, hash[i]);
-            }
+    }
+}
 
-            for(i = 0; i < strlen(row[0]); ++i) {
-                row[0][i] = tolower(row[0][i]);
-            }
+static int handle_gcloginc(login_client_t *c, gc_login_9c_pkt *pkt) {
+    auth_req_t *req;
 
-            if(!strcmp(row[0], query)) {
-                sylverant_db_result_free(result);
-                return send_simple(c, LOGIN_9C_TYPE, LOGIN_9CGC_OK);
-            }
-            else {
-                return send_simple(c, LOGIN_9C_TYPE, LOGIN_9CGC_BAD_PWD);
-            }
-        }
+    /* The actual checking is done off on the authentication threads, so that
+       we don't hold everyone else up. */
+    if(!(req = auth_req_new(c, AUTH_TYPE_GC, &gcloginc_done))) {
+        return -1;
     }
 
-    sylverant_db_result_free(result);
+    memcpy(req->user, pkt->serial, 8);
+    memcpy(req->key, pkt->access_key, 12);
+    memcpy(req->password, pkt->password, 16);
+    auth_submit(req);
 
-    /* If we get here, we didn't find them, bail out. */
-    return -1;
+    return 0;
 }
 
 static int handle_gclogine(login_client_t *c, gc_login_9e_pkt *pkt) {
@@ -970,28 +870,30 @@ static int handle_gclogine(login_client_t *c, gc_login_9e_pkt *pkt) {
     char query[256], serial[32], access[32];
     void *result;
     char **row;
+    login_tdata_t *td = get_tdata();
 
     c->language_code = pkt->language_code;
 
     /* Escape all the important strings. */
-    sylverant_db_escape_str(&conn, serial, pkt->serial, 8);
-    sylverant_db_escape_str(&conn, access, pkt->access_key, 12);
+    sylverant_db_escape_str(&td->conn, serial, pkt->serial, 8);
+    sylverant_db_escape_str(&td->conn, access, pkt->access_key, 12);
 
     sprintf(query, "SELECT guildcard FROM gamecube_clients WHERE "
             "serial_number='%s' AND access_key='%s'", serial, access);
 
     /* If we can't query the database, fail. */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         return -1;
     }
 
-    result = sylverant_db_result_store(&conn);
+    result = sylverant_db_result_store(&td->conn);
 
     if((row = sylverant_db_result_fetch(result))) {
         /* Grab the client's guildcard number. */
         gc = (uint32_t)strtoul(row[0], NULL, 0);
         sylverant_db_result_free(result);
 
+        client_admit_done(c);
         return send_dc_security(c, gc, NULL, 0);
     }
 
@@ -1006,6 +908,7 @@ static int handle_logind(login_client_t *c, dcv2_login_9d_pkt *pkt) {
        code... All the real checking has been done elsewhere. */
     c->language_code = pkt->language_code;
 
+    client_admit_done(c);
     return send_dc_security(c, c->guildcard, NULL, 0);
 }
 
@@ -1028,9 +931,15 @@ static int handle_ship_select(login_client_t *c, dc_select_pkt *pkt) {
                 return send_ship_list(c, 0);
             }
             else if(item_id == ITEM_ID_INIT_DOWNLOAD) {
+                pthread_rwlock_rdlock(&qlist_lock);
+
                 if(l->cat_count == 1) {
-                    return send_quest_list(c, &l->cats[0]);
+                    rv = send_quest_list(c, &l->cats[0]);
+                    pthread_rwlock_unlock(&qlist_lock);
+                    return rv;
                 }
+
+                pthread_rwlock_unlock(&qlist_lock);
             }
             else if(item_id == ITEM_ID_INIT_INFO) {
                 return send_info_list(c);
@@ -1054,9 +963,12 @@ static int handle_ship_select(login_client_t *c, dc_select_pkt *pkt) {
 
         /* Quest */
         case MENU_ID_QUEST:
+            pthread_rwlock_rdlock(&qlist_lock);
+
             /* Make sure the item is valid */
             if(item_id < l->cats[0].quest_count) {
                 rv = send_quest(c, &l->cats[0].quests[item_id]);
+                pthread_rwlock_unlock(&qlist_lock);
 
                 if(c->type == CLIENT_TYPE_PC) {
                     rv |= send_initial_menu(c);
@@ -1065,6 +977,7 @@ static int handle_ship_select(login_client_t *c, dc_select_pkt *pkt) {
                 return rv;
             }
             else {
+                pthread_rwlock_unlock(&qlist_lock);
                 return -1;
             }
 
@@ -1175,11 +1088,9 @@ static int handle_char_data(login_client_t *c, dc_char_data_pkt *pkt) {
 static int handle_info_req(login_client_t *c, dc_select_pkt *pkt) {
     uint32_t menu_id = LE32(pkt->menu_id);
     uint32_t item_id = LE32(pkt->item_id);
-    uint16_t menu_code;
-    int ship_num;
     char str[256];
-    void *result;
-    char **row;
+    ship_dir_t *d;
+    const ship_dir_ent_t *s;
 
     switch(menu_id & 0xFF) {
         /* Ship */
@@ -1189,43 +1100,33 @@ static int handle_info_req(login_client_t *c, dc_select_pkt *pkt) {
                 return send_info_reply(c, __(c, "\tENothing here."));
             }
 
-            /* We should have a ship ID as the item_id at this point, so query
-               the db for the info we want. */
-            sprintf(str, "SELECT name, players, games, menu_code, ship_number "
-                    "FROM online_ships WHERE ship_id='%lu'",
-                    (unsigned long)item_id);
-
-            /* Query for what we're looking for */
-            if(sylverant_db_query(&conn, str)) {
+            /* We should have a ship ID as the item_id at this point, so look
+               up the info we want. */
+            if(!(d = ship_dir_get())) {
                 return -1;
             }
 
-            if(!(result = sylverant_db_result_store(&conn))) {
-                return -2;
-            }
-
-            /* If we don't have a row, then the ship is offline */
-            if(!(row = sylverant_db_result_fetch(result))) {
+            /* If we don't have it, then the ship is offline */
+            if(!(s = ship_dir_find(d, item_id))) {
+                ship_dir_put(d);
                 return send_info_reply(c, __(c, "\tE\tC4That ship is now\n"
                                              "offline."));
             }
 
-            /* Parse out the menu code */
-            menu_code = (uint16_t)atoi(row[3]);
-            ship_num = atoi(row[4]);
-
             /* Send the info reply */
-            if(!menu_code) {
-                sprintf(str, "%02X:%s\n%s %s\n%s %s", ship_num, row[0], row[1],
-                        __(c, "Users"), row[2], __(c, "Teams"));
+            if(!s->menu_code) {
+                sprintf(str, "%02X:%s\n%" PRIu32 " %s\n%" PRIu32 " %s",
+                        s->ship_number, s->name, s->players, __(c, "Users"),
+                        s->games, __(c, "Teams"));
             }
             else {
-                sprintf(str, "%02X:%c%c/%s\n%s %s\n%s %s", ship_num,
-                        (char)menu_code, (char)(menu_code >> 8), row[0], row[1],
-                        __(c, "Users"), row[2], __(c, "Teams"));
+                sprintf(str, "%02X:%c%c/%s\n%" PRIu32 " %s\n%" PRIu32 " %s",
+                        s->ship_number, (char)s->menu_code,
+                        (char)(s->menu_code >> 8), s->name, s->players,
+                        __(c, "Users"), s->games, __(c, "Teams"));
             }
 
-            sylverant_db_result_free(result);
+            ship_dir_put(d);
 
             return send_info_reply(c, str);
 
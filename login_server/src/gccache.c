@@ -0,0 +1,190 @@
+/*
+    Sylverant Login Server
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include <sylverant/debug.h>
+#include <sylverant/database.h>
+
+#include "gccache.h"
+#include "worker.h"
+
+#define GC_CACHE_BUCKETS    1024
+
+typedef struct gc_cache_ent {
+    TAILQ_ENTRY(gc_cache_ent) qentry;
+    TAILQ_ENTRY(gc_cache_ent) lru;
+    uint32_t guildcard;
+    uint32_t version;
+    uint32_t checksum;
+    bb_gc_data_t data;
+} gc_cache_ent_t;
+
+TAILQ_HEAD(gc_cache_queue, gc_cache_ent);
+
+/* Every entry is the same size, so the byte limit is really a count. */
+#define GC_CACHE_MAX        (GC_CACHE_BYTES / sizeof(gc_cache_ent_t))
+
+/* The hash buckets are keyed on the guildcard number. The LRU list has the most
+   recently used entries at the head. The mutex protects all of it. */
+static struct gc_cache_queue buckets[GC_CACHE_BUCKETS];
+static struct gc_cache_queue lru_list = TAILQ_HEAD_INITIALIZER(lru_list);
+static int ent_count = 0;
+static int initialized = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_buckets(void) {
+    int i;
+
+    for(i = 0; i < GC_CACHE_BUCKETS; ++i) {
+        TAILQ_INIT(&buckets[i]);
+    }
+
+    initialized = 1;
+}
+
+static gc_cache_ent_t *find_ent(uint32_t gc) {
+    gc_cache_ent_t *i;
+
+    TAILQ_FOREACH(i, &buckets[gc & (GC_CACHE_BUCKETS - 1)], qentry) {
+        if(i->guildcard == gc)
+            return i;
+    }
+
+    return NULL;
+}
+
+int gc_cache_version(uint32_t gc, uint32_t *version) {
+    char query[256];
+    void *result;
+    char **row;
+    login_tdata_t *td = get_tdata();
+
+    sprintf(query, "SELECT version FROM blueburst_gc_versions WHERE "
+            "guildcard='%" PRIu32 "'", gc);
+
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "Couldn't fetch guildcard version (gc=%" PRIu32 "):\n"
+              "%s\n", gc, sylverant_db_error(&td->conn));
+        return -1;
+    }
+
+    if(!(result = sylverant_db_result_store(&td->conn))) {
+        debug(DBG_WARN, "Couldn't store guildcard version (gc=%" PRIu32 "):\n"
+              "%s\n", gc, sylverant_db_error(&td->conn));
+        return -1;
+    }
+
+    /* No row just means nothing has ever been changed for this account. */
+    if((row = sylverant_db_result_fetch(result)))
+        *version = (uint32_t)strtoul(row[0], NULL, 0);
+    else
+        *version = 0;
+
+    sylverant_db_result_free(result);
+
+    return 0;
+}
+
+int gc_cache_get(uint32_t gc, uint32_t version, bb_gc_data_t *data,
+                 uint32_t *checksum) {
+    gc_cache_ent_t *i;
+    int rv = 0;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    if(initialized && (i = find_ent(gc)) && i->version == version) {
+        memcpy(data, &i->data, sizeof(bb_gc_data_t));
+        *checksum = i->checksum;
+
+        TAILQ_REMOVE(&lru_list, i, lru);
+        TAILQ_INSERT_HEAD(&lru_list, i, lru);
+        rv = 1;
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    return rv;
+}
+
+void gc_cache_add(uint32_t gc, uint32_t version, const bb_gc_data_t *data,
+                  uint32_t checksum) {
+    gc_cache_ent_t *i;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    if(!initialized)
+        init_buckets();
+
+    if(!(i = find_ent(gc))) {
+        /* Reuse the least recently used entry if we're full. */
+        if((size_t)ent_count >= GC_CACHE_MAX) {
+            i = TAILQ_LAST(&lru_list, gc_cache_queue);
+            TAILQ_REMOVE(&lru_list, i, lru);
+            TAILQ_REMOVE(&buckets[i->guildcard & (GC_CACHE_BUCKETS - 1)], i,
+                         qentry);
+        }
+        else if((i = (gc_cache_ent_t *)malloc(sizeof(gc_cache_ent_t)))) {
+            ++ent_count;
+        }
+        else {
+            debug(DBG_WARN, "Cannot allocate guildcard cache entry\n");
+            pthread_mutex_unlock(&cache_mutex);
+            return;
+        }
+
+        i->guildcard = gc;
+        TAILQ_INSERT_HEAD(&buckets[gc & (GC_CACHE_BUCKETS - 1)], i, qentry);
+    }
+    else {
+        /* Don't let a slow reader replace newer data with older data. */
+        if((int32_t)(version - i->version) < 0) {
+            pthread_mutex_unlock(&cache_mutex);
+            return;
+        }
+
+        TAILQ_REMOVE(&lru_list, i, lru);
+    }
+
+    TAILQ_INSERT_HEAD(&lru_list, i, lru);
+    i->version = version;
+    i->checksum = checksum;
+    memcpy(&i->data, data, sizeof(bb_gc_data_t));
+
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void gc_cache_cleanup(void) {
+    gc_cache_ent_t *i;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    while((i = TAILQ_FIRST(&lru_list))) {
+        TAILQ_REMOVE(&lru_list, i, lru);
+        TAILQ_REMOVE(&buckets[i->guildcard & (GC_CACHE_BUCKETS - 1)], i,
+                     qentry);
+        free(i);
+    }
+
+    ent_count = 0;
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,48 @@
+/*
+    Sylverant Login Server
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GCCACHE_H
+#define GCCACHE_H
+
+#include <stdint.h>
+
+#include "player.h"
+
+/* How much memory (in bytes) the cached guildcard data can use. Each account's
+   data is over 50KiB, so this holds a bit over 600 of them. The least recently
+   used account gets tossed when the cache fills up. */
+#define GC_CACHE_BYTES      (32 * 1024 * 1024)
+
+/* Look up the current version stamp of an account's guildcard data (bumped by
+   the shipgate every time it changes the guildcards or blacklist). Returns 0 on
+   success, or -1 if the stamp can't be read (in which case, the cache must not
+   be used for this request). */
+int gc_cache_version(uint32_t gc, uint32_t *version);
+
+/* Copy out the cached guildcard data and its checksum for the account, if the
+   cached copy is from the given version. Returns 1 on a hit, 0 on a miss. */
+int gc_cache_get(uint32_t gc, uint32_t version, bb_gc_data_t *data,
+                 uint32_t *checksum);
+
+/* Save a copy of an account's guildcard data, read at the given version. */
+void gc_cache_add(uint32_t gc, uint32_t version, const bb_gc_data_t *data,
+                  uint32_t checksum);
+
+/* Throw away everything in the cache. */
+void gc_cache_cleanup(void);
+
+#endif /* !GCCACHE_H */
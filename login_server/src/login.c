@@ -28,24 +28,35 @@
 
 #include "login.h"
 #include "login_packets.h"
+#include "worker.h"
 
-/* Storage for our client list. */
-struct client_queue clients = TAILQ_HEAD_INITIALIZER(clients);
-
-/* Create a new connection, storing it in the list of clients. */
+/* Create a new connection. The caller is responsible for handing it off to a
+   worker thread. */
 login_client_t *create_connection(int sock, int type, struct sockaddr *ip,
                                   socklen_t size) {
-    login_client_t *rv = (login_client_t *)malloc(sizeof(login_client_t));
+    login_client_t *rv;
     uint32_t client_seed_dc, server_seed_dc;
     uint8_t client_seed_bb[48], server_seed_bb[48];
-    int i;
+    int i, adm;
 
-    if(!rv) {
+    /* If we're being flooded with connections, don't bother setting up the
+       encryption for everyone that's over the limit. */
+    if((adm = sylverant_admit_check(admit, ip)) == SYLVERANT_ADMIT_DROP) {
+        debug(DBG_LOG, "Too many connections at once, dropping client\n");
+        return NULL;
+    }
+
+    if(!(rv = (login_client_t *)malloc(sizeof(login_client_t)))) {
         perror("malloc");
+
+        if(adm == SYLVERANT_ADMIT_OK)
+            sylverant_admit_done(admit);
+
         return NULL;
     }
 
     memset(rv, 0, sizeof(login_client_t));
+    rv->admitted = (adm == SYLVERANT_ADMIT_OK);
 
     /* Store basic parameters in the client structure. */
     rv->sock = sock;
@@ -70,9 +81,7 @@ login_client_t *create_connection(int sock, int type, struct sockaddr *ip,
 
             /* Send the client the welcome packet, or die trying. */
             if(send_dc_welcome(rv, server_seed_dc, client_seed_dc)) {
-                close(sock);
-                free(rv);
-                return NULL;
+                goto err;
             }
 
             break;
@@ -83,9 +92,7 @@ login_client_t *create_connection(int sock, int type, struct sockaddr *ip,
                way, because PSOPC users should disconnect immediately on getting
                this packet (and connect to port 9300 instead). */
             if(send_selective_redirect(rv)) {
-                close(sock);
-                free(rv);
-                return NULL;
+                goto err;
             }
 
             /* Fall through... */
@@ -102,9 +109,7 @@ login_client_t *create_connection(int sock, int type, struct sockaddr *ip,
 
             /* Send the client the welcome packet, or die trying. */
             if(send_dc_welcome(rv, server_seed_dc, client_seed_dc)) {
-                close(sock);
-                free(rv);
-                return NULL;
+                goto err;
             }
 
             break;
@@ -133,27 +138,63 @@ login_client_t *create_connection(int sock, int type, struct sockaddr *ip,
 
             /* Send the client the welcome packet, or die trying. */
             if(send_bb_welcome(rv, server_seed_bb, client_seed_bb)) {
-                close(sock);
-                free(rv);
-                return NULL;
+                goto err;
             }
 
             break;
     }
 
-    /* Insert it at the end of our list, and we're done. */
-    TAILQ_INSERT_TAIL(&clients, rv, qentry);
+    /* Let anyone over the limit know why they're being disconnected. Don't
+       disconnect them until the message is out, or they'll never see it. */
+    if(adm == SYLVERANT_ADMIT_WAIT) {
+        send_large_msg(rv, __(rv, "\tEThe server is very busy right now.\n\n"
+                              "Please wait a moment and try again."));
+
+        if(rv->sendbuf_cur)
+            rv->close_time = time(NULL) + CLIENT_CLOSE_WAIT;
+        else
+            rv->disconnected = 1;
+    }
+
     return rv;
+
+err:
+    /* The caller closes the socket. */
+    client_admit_done(rv);
+    free(rv);
+    return NULL;
 }
 
-/* Destroy a connection, closing the socket and removing it from the list. */
+void client_admit_done(login_client_t *c) {
+    if(c->admitted) {
+        c->admitted = 0;
+        sylverant_admit_done(admit);
+    }
+}
+
+/* Destroy a connection, closing the socket and removing it from its worker's
+   list. This must only be called from the worker that owns the client. */
 void destroy_connection(login_client_t *c) {
-    TAILQ_REMOVE(&clients, c, qentry);
+    login_worker_t *w = c->worker;
+
+    if(w) {
+        TAILQ_REMOVE(&w->clients, c, qentry);
+
+        pthread_mutex_lock(&w->mutex);
+        --w->client_count;
+        pthread_mutex_unlock(&w->mutex);
+    }
+
+    client_admit_done(c);
 
     if(c->gc_data) {
         free(c->gc_data);
     }
 
+    if(c->params) {
+        put_param_data(c->params);
+    }
+
     if(c->sock >= 0) {
         close(c->sock);
     }
@@ -18,12 +18,14 @@
 #ifndef LOGIN_H
 #define LOGIN_H
 
+#include <time.h>
 #include <sys/queue.h>
 #include <netinet/in.h>
 
 #include <sylverant/config.h>
 #include <sylverant/encryption.h>
 #include <sylverant/database.h>
+#include <sylverant/admission.h>
 
 #include "player.h"
 
@@ -74,15 +76,38 @@ typedef struct bb_level_table {
 
 #undef PACKED
 
+struct login_worker;
+struct param_set;
+struct auth_req;
+
+/* How long (in seconds) a client that is being turned away has to read what it
+   is being told before it is disconnected. */
+#define CLIENT_CLOSE_WAIT   5
+
 /* Login server client structure. */
 typedef struct login_client {
     TAILQ_ENTRY(login_client) qentry;
-    
+    struct login_worker *worker;
+
+    /* While busy is set, the client is being handled by one of the client
+       threads, and its worker leaves it alone. If job_auth is set, the job is
+       to finish that password check, otherwise it is to read from the
+       client. */
+    TAILQ_ENTRY(login_client) jentry;
+    int busy;
+    struct auth_req *job_auth;
+
     int type;
     int sock;
     int disconnected;
     int is_ipv6;
     int motd_wait;
+    int admitted;
+    int auth_pending;
+
+    /* If set, the client is disconnected once everything queued up for it has
+       been sent, or once this time has passed, whichever comes first. */
+    time_t close_time;
 
     struct sockaddr_storage ip_addr;
 
@@ -115,6 +140,9 @@ typedef struct login_client {
     bb_security_data_t sec_data;
     int hdr_read;
 
+    /* The parameter data this client is downloading (Blue Burst only) */
+    struct param_set *params;
+
     /* Only used for the Dreamcast Network Trial Edition */
     char serial[16];
     char access_key[16];
@@ -175,15 +203,22 @@ static const char *classes[12] __attribute__((unused)) = {
 };
 
 TAILQ_HEAD(client_queue, login_client);
-extern struct client_queue clients;
 
-extern sylverant_dbconn_t conn;
+/* How many clients may be in the middle of logging in at once before new ones
+   are turned away, unless the configuration says otherwise. A client stops
+   counting once its login has been checked. */
+#define LOGIN_MAX_PENDING           512
+
 extern sylverant_config_t *cfg;
+extern sylverant_admit_t *admit;
 
 login_client_t *create_connection(int sock, int type, struct sockaddr *ip,
                                   socklen_t size);
 void destroy_connection(login_client_t *c);
 
+/* Stop counting the client against the admission control limits. */
+void client_admit_done(login_client_t *c);
+
 int read_from_client(login_client_t *c);
 
 void disconnect_from_ships(uint32_t gcn);
@@ -205,6 +240,7 @@ int process_bblogin_packet(login_client_t *c, void *pkt);
 /* In bbcharacter.c */
 int process_bbcharacter_packet(login_client_t *c, void *pkt);
 int load_param_data(void);
+void put_param_data(struct param_set *p);
 void cleanup_param_data(void);
 int load_bb_char_data(void);
 
@@ -32,12 +32,12 @@
 #include <sylverant/quest.h>
 
 #include "login_packets.h"
+#include "worker.h"
+#include "shipdir.h"
 
-extern sylverant_dbconn_t conn;
 extern sylverant_config_t *cfg;
 extern sylverant_quest_list_t qlist[CLIENT_TYPE_COUNT][CLIENT_LANG_COUNT];
 
-uint8_t sendbuf[65536];
 
 static void ascii_to_utf16(const char *in, uint16_t *out, int maxlen) {
     while(*in && maxlen) {
@@ -52,6 +52,7 @@ static void ascii_to_utf16(const char *in, uint16_t *out, int maxlen) {
 
 /* Send a raw packet away. */
 static int send_raw(login_client_t *c, int len) {
+    uint8_t *sendbuf = get_sendbuf();
     ssize_t rv, total = 0;
     void *tmp;
 
@@ -104,6 +105,8 @@ static int send_raw(login_client_t *c, int len) {
 
 /* Encrypt and send a packet away. */
 static int crypt_send(login_client_t *c, int len) {
+    uint8_t *sendbuf = get_sendbuf();
+
     /* Expand it to be a multiple of 8/4 bytes long */
     while(len & (hdr_sizes[c->type] - 1)) {
         sendbuf[len++] = 0;
@@ -117,6 +120,7 @@ static int crypt_send(login_client_t *c, int len) {
 
 /* Send a Dreamcast/PC Welcome packet to the given client. */
 int send_dc_welcome(login_client_t *c, uint32_t svect, uint32_t cvect) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_welcome_pkt *pkt = (dc_welcome_pkt *)sendbuf;
 
     /* Scrub the buffer */
@@ -147,6 +151,7 @@ int send_dc_welcome(login_client_t *c, uint32_t svect, uint32_t cvect) {
 /* Send a Blue Burst Welcome packet to the given client. */
 int send_bb_welcome(login_client_t *c, const uint8_t svect[48],
                     const uint8_t cvect[48]) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_welcome_pkt *pkt = (bb_welcome_pkt *)sendbuf;
 
     /* Scrub the buffer */
@@ -168,6 +173,7 @@ int send_bb_welcome(login_client_t *c, const uint8_t svect[48],
 }
 
 static int send_large_msg_dc(login_client_t *c, const char msg[]) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_msg_box_pkt *pkt = (dc_msg_box_pkt *)sendbuf;
     int size = 4;
     iconv_t ic;
@@ -227,6 +233,7 @@ static int send_large_msg_dc(login_client_t *c, const char msg[]) {
 }
 
 static int send_msg_bb(login_client_t *c, const char msg[]) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_msg_box_pkt *pkt = (bb_msg_box_pkt *)sendbuf;
     int size = 8;
     iconv_t ic;
@@ -287,6 +294,7 @@ int send_large_msg(login_client_t *c, const char msg[]) {
 /* Send the Dreamcast security packet to the given client. */
 int send_dc_security(login_client_t *c, uint32_t gc, const void *data,
                      int data_len) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_security_pkt *pkt = (dc_security_pkt *)sendbuf;
 
     /* Wipe the packet */
@@ -318,6 +326,7 @@ int send_dc_security(login_client_t *c, uint32_t gc, const void *data,
 /* Send a Blue Burst security packet to the given client. */
 int send_bb_security(login_client_t *c, uint32_t gc, uint32_t err,
                      uint32_t team, const void *data, int data_len) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_security_pkt *pkt = (bb_security_pkt *)sendbuf;
 
     /* Make sure the data is sane */
@@ -349,6 +358,7 @@ int send_bb_security(login_client_t *c, uint32_t gc, uint32_t err,
 
 /* Send a redirect packet to the given client. */
 static int send_redirect_bb(login_client_t *c, in_addr_t ip, uint16_t port) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_redirect_pkt *pkt = (bb_redirect_pkt *)sendbuf;
 
     /* Wipe the packet */
@@ -367,6 +377,7 @@ static int send_redirect_bb(login_client_t *c, in_addr_t ip, uint16_t port) {
 }
 
 static int send_redirect_dc(login_client_t *c, in_addr_t ip, uint16_t port) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_redirect_pkt *pkt = (dc_redirect_pkt *)sendbuf;
 
     /* Wipe the packet */
@@ -458,6 +469,7 @@ int send_redirect6(login_client_t *c, const uint8_t ip[16], uint16_t port) {
    clients that might end up there. This must be sent before encryption is set
    up! */
 static int send_selective_redirect_ipv4(login_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_redirect_pkt *pkt = (dc_redirect_pkt *)sendbuf;
     dc_pkt_hdr_t *hdr2 = (dc_pkt_hdr_t *)(sendbuf + 0x19);
     in_addr_t addr = cfg->server_ip;
@@ -495,6 +507,7 @@ int send_selective_redirect(login_client_t *c) {
 
 /* Send a timestamp packet to the given client. */
 static int send_timestamp_dc(login_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_timestamp_pkt *pkt = (dc_timestamp_pkt *)sendbuf;
     struct timeval rawtime;
     struct tm cooked;
@@ -530,6 +543,7 @@ static int send_timestamp_dc(login_client_t *c) {
 }
 
 static int send_timestamp_bb(login_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_timestamp_pkt *pkt = (bb_timestamp_pkt *)sendbuf;
     struct timeval rawtime;
     struct tm cooked;
@@ -577,6 +591,7 @@ int send_timestamp(login_client_t *c) {
 /* Send the initial menu to clients, with the options of "Ship Select" and
    "Download". */
 static int send_initial_menu_dc(login_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_ship_list_pkt *pkt = (dc_ship_list_pkt *)sendbuf;
     int len = 0x58, count = 2;
 
@@ -622,6 +637,7 @@ static int send_initial_menu_dc(login_client_t *c) {
 }
 
 static int send_initial_menu_pc(login_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     pc_ship_list_pkt *pkt = (pc_ship_list_pkt *)sendbuf;
     int len = 0x88, count = 2;
 
@@ -668,6 +684,7 @@ static int send_initial_menu_pc(login_client_t *c) {
 }
 
 static int send_initial_menu_gc(login_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_ship_list_pkt *pkt = (dc_ship_list_pkt *)sendbuf;
     int count = 3, len = 0x74;
     
@@ -735,17 +752,16 @@ int send_initial_menu(login_client_t *c) {
     return -1;
 }
 
-/* Send the list of ships to the client. */
-static int send_ship_list_dc(login_client_t *c, uint16_t menu_code) {
-    dc_ship_list_pkt *pkt = (dc_ship_list_pkt *)sendbuf;
+/* Build the list of ships for DC/GC/Ep3 clients into buf. */
+static int build_ship_list_dc(uint8_t *buf, ship_dir_t *d, uint16_t menu_code,
+                              int flags, int gm) {
+    dc_ship_list_pkt *pkt = (dc_ship_list_pkt *)buf;
     char no_ship_msg[] = "No Ships";
-    char query[256];
     uint32_t num_ships = 0;
-    void *result;
-    char **row;
-    uint32_t ship_id, players;
-    int i, len = 0x20, gm_only, flags, ship_num;
-    char tmp[3] = { menu_code, menu_code >> 8, 0 };
+    uint16_t code;
+    int i, len = 0x20;
+    const ship_dir_ent_t *s;
+    char tmp[3];
 
     /* Clear the base packet */
     memset(pkt, 0, sizeof(dc_ship_list_pkt));
@@ -770,104 +786,50 @@ static int send_ship_list_dc(login_client_t *c, uint16_t menu_code) {
     pkt->entries[0].name[0x11] = 0x08;
     num_ships = 1;
 
-    /* Figure out what ships we might exclude by flags */
-    if(c->type == CLIENT_TYPE_GC) {
-        flags = 0x80;
-    }
-    else if(c->type == CLIENT_TYPE_EP3) {
-        flags = 0x100;
-    }
-    else if(c->type == CLIENT_TYPE_DCNTE) {
-        flags = 0x400;
-    }
-    else {
-        if(c->version == SYLVERANT_QUEST_V1) {
-            flags = 0x10;
-        }
-        else {
-            flags = 0x20;
-        }
-    }
-
-    /* Get ready to query the database */
-    sprintf(query, "SELECT ship_id, name, players, gm_only, ship_number FROM "
-            "online_ships WHERE menu_code='%hu' AND (flags & 0x%02x) = 0 ORDER "
-            "BY ship_number", menu_code, flags);
-
-    /* Query the database and see what we've got */
-    if(sylverant_db_query(&conn, query)) {
-        i = -1;
-        goto out;
-    }
-
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        i = -2;
-        goto out;
-    }
-
-    /* As long as we have some rows, go */
-    while((row = sylverant_db_result_fetch(result))) {
-        gm_only = atoi(row[3]);
-
-        if(!gm_only || IS_GLOBAL_GM(c)) {
-            /* Clear out the ship information */
-            memset(&pkt->entries[num_ships], 0, 0x1C);
-
-            /* Grab info from the row */
-            ship_id = (uint32_t)strtoul(row[0], NULL, 0);
-            players = (uint32_t)strtoul(row[2], NULL, 0);
-            ship_num = atoi(row[4]);
+    /* Add each ship on this menu that the client is allowed to see */
+    for(i = 0; i < d->ship_count; ++i) {
+        s = &d->ships[i];
 
-            /* Fill in what we have */
-            pkt->entries[num_ships].menu_id = LE32(0x00000001);
-            pkt->entries[num_ships].item_id = LE32(ship_id);
-            pkt->entries[num_ships].flags = LE16(0x0F04);
-
-            /* Create the name string */
-            if(menu_code) {
-                sprintf(pkt->entries[num_ships].name, "%02X:%c%c/%s", ship_num,
-                        (char)menu_code, (char)(menu_code >> 8), row[1]);
-            }
-            else {
-                sprintf(pkt->entries[num_ships].name, "%02X:%s", ship_num,
-                        row[1]);
-            }
-
-            /* We're done with this ship, increment the counter */
-            ++num_ships;
-            len += 0x1C;
+        if(s->menu_code != menu_code || (s->flags & flags) ||
+           (s->gm_only && !gm)) {
+            continue;
         }
-    }
 
-    sylverant_db_result_free(result);
+        /* Clear out the ship information */
+        memset(&pkt->entries[num_ships], 0, 0x1C);
 
-    /* Figure out any lists we need to allow to be seen */
-    sprintf(query, "SELECT DISTINCT menu_code FROM online_ships ORDER BY "
-            "menu_code");
+        /* Fill in what we have */
+        pkt->entries[num_ships].menu_id = LE32(0x00000001);
+        pkt->entries[num_ships].item_id = LE32(s->ship_id);
+        pkt->entries[num_ships].flags = LE16(0x0F04);
 
-    /* Query the database and see what we've got */
-    if(sylverant_db_query(&conn, query)) {
-        i = -3;
-        goto out;
-    }
+        /* Create the name string */
+        if(menu_code) {
+            sprintf(pkt->entries[num_ships].name, "%02X:%c%c/%s",
+                    s->ship_number, (char)menu_code, (char)(menu_code >> 8),
+                    s->name);
+        }
+        else {
+            sprintf(pkt->entries[num_ships].name, "%02X:%s", s->ship_number,
+                    s->name);
+        }
 
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        i = -4;
-        goto out;
+        /* We're done with this ship, increment the counter */
+        ++num_ships;
+        len += 0x1C;
     }
 
-    /* As long as we have some rows, go */
-    while((row = sylverant_db_result_fetch(result))) {
-        /* Grab info from the row */
-        ship_id = (uint16_t)strtoul(row[0], NULL, 0);
+    /* Add any other lists that need to be seen */
+    for(i = 0; i < d->menu_count; ++i) {
+        code = d->menu_codes[i];
 
         /* Skip the entry we're filling in now */
-        if(ship_id == menu_code) {
+        if(code == menu_code) {
             continue;
         }
 
-        tmp[0] = (char)(ship_id);
-        tmp[1] = (char)(ship_id >> 8);
+        tmp[0] = (char)(code);
+        tmp[1] = (char)(code >> 8);
         tmp[2] = '\0';
 
         /* Make sure the values are in-bounds */
@@ -879,7 +841,7 @@ static int send_ship_list_dc(login_client_t *c, uint16_t menu_code) {
         memset(&pkt->entries[num_ships], 0, 0x1C);
 
         /* Fill in what we have */
-        pkt->entries[num_ships].menu_id = LE32((0x00000001 | (ship_id << 8)));
+        pkt->entries[num_ships].menu_id = LE32((0x00000001 | (code << 8)));
         pkt->entries[num_ships].item_id = LE32(0x00000000);
         pkt->entries[num_ships].flags = LE16(0x0F04);
 
@@ -896,8 +858,6 @@ static int send_ship_list_dc(login_client_t *c, uint16_t menu_code) {
         len += 0x1C;
     }
 
-    sylverant_db_result_free(result);
-
     /* Make sure we have at least one ship... */
     if(num_ships == 1) {
         /* Clear out the ship information */
@@ -906,7 +866,7 @@ static int send_ship_list_dc(login_client_t *c, uint16_t menu_code) {
         pkt->entries[num_ships].item_id = LE32(0x00000000);
         pkt->entries[num_ships].flags = LE16(0x0000);
         strcpy(pkt->entries[num_ships].name, no_ship_msg);
-        
+
         ++num_ships;
         len += 0x1C;
     }
@@ -915,23 +875,19 @@ static int send_ship_list_dc(login_client_t *c, uint16_t menu_code) {
     pkt->hdr.pkt_len = LE16(len);
     pkt->hdr.flags = (uint8_t)(num_ships - 1);
 
-    /* Send the packet away */
-    return crypt_send(c, len);
-
-out:
-    return i;
+    return len;
 }
 
-/* Send the list of ships to the client. */
-static int send_ship_list_pc(login_client_t *c, uint16_t menu_code) {
-    pc_ship_list_pkt *pkt = (pc_ship_list_pkt *)sendbuf;
+/* Build the list of ships for PC clients into buf. */
+static int build_ship_list_pc(uint8_t *buf, ship_dir_t *d, uint16_t menu_code,
+                              int flags, int gm) {
+    pc_ship_list_pkt *pkt = (pc_ship_list_pkt *)buf;
     char no_ship_msg[] = "No Ships";
-    char query[256], tmp[18], tmp2[3];
+    char tmp[18], tmp2[3];
     uint32_t num_ships = 0;
-    void *result;
-    char **row;
-    uint32_t ship_id, players;
-    int i, len = 0x30, gm_only, ship_num;
+    uint16_t code;
+    int i, len = 0x30;
+    const ship_dir_ent_t *s;
     iconv_t ic = iconv_open("UTF-16LE", "UTF-8");
     size_t in, out;
     ICONV_CONST char *inptr;
@@ -962,91 +918,55 @@ static int send_ship_list_pc(login_client_t *c, uint16_t menu_code) {
 
     num_ships = 1;
 
-    /* Get ready to query the database */
-    sprintf(query, "SELECT ship_id, name, players, gm_only, ship_number FROM "
-            "online_ships WHERE menu_code='%hu' AND (flags & 0x40) = 0 ORDER "
-            "BY ship_number", menu_code);
-
-    /* Query the database and see what we've got */
-    if(sylverant_db_query(&conn, query)) {
-        i = -1;
-        goto out;
-    }
-
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        i = -2;
-        goto out;
-    }
-
-    /* As long as we have some rows, go */
-    while((row = sylverant_db_result_fetch(result))) {
-        gm_only = atoi(row[3]);
-
-        if(!gm_only || IS_GLOBAL_GM(c)) {
-            /* Clear out the ship information */
-            memset(&pkt->entries[num_ships], 0, 0x2C);
-
-            /* Grab info from the row */
-            ship_id = (uint32_t)strtoul(row[0], NULL, 0);
-            players = (uint32_t)strtoul(row[2], NULL, 0);
-            ship_num = atoi(row[4]);
+    /* Add each ship on this menu that the client is allowed to see */
+    for(i = 0; i < d->ship_count; ++i) {
+        s = &d->ships[i];
 
-            /* Fill in what we have */
-            pkt->entries[num_ships].menu_id = LE32(0x00000001);
-            pkt->entries[num_ships].item_id = LE32(ship_id);
-            pkt->entries[num_ships].flags = LE16(0x0F04);
+        if(s->menu_code != menu_code || (s->flags & flags) ||
+           (s->gm_only && !gm)) {
+            continue;
+        }
 
-            /* Create the name string (UTF-8) */
-            if(menu_code) {
-                sprintf(tmp, "%02X:%c%c/%s", ship_num, (char)menu_code,
-                        (char)(menu_code >> 8), row[1]);
-            }
-            else {
-                sprintf(tmp, "%02X:%s", ship_num, row[1]);
-            }
+        /* Clear out the ship information */
+        memset(&pkt->entries[num_ships], 0, 0x2C);
 
-            /* And convert to UTF-16 */
-            in = strlen(tmp);
-            out = 0x22;
-            inptr = tmp;
-            outptr = (char *)pkt->entries[num_ships].name;
-            iconv(ic, &inptr, &in, &outptr, &out);
+        /* Fill in what we have */
+        pkt->entries[num_ships].menu_id = LE32(0x00000001);
+        pkt->entries[num_ships].item_id = LE32(s->ship_id);
+        pkt->entries[num_ships].flags = LE16(0x0F04);
 
-            /* We're done with this ship, increment the counter */
-            ++num_ships;
-            len += 0x2C;
+        /* Create the name string (UTF-8) */
+        if(menu_code) {
+            sprintf(tmp, "%02X:%c%c/%s", s->ship_number, (char)menu_code,
+                    (char)(menu_code >> 8), s->name);
+        }
+        else {
+            sprintf(tmp, "%02X:%s", s->ship_number, s->name);
         }
-    }
-
-    sylverant_db_result_free(result);
-
-    /* Figure out any lists we need to allow to be seen */
-    sprintf(query, "SELECT DISTINCT menu_code FROM online_ships ORDER BY "
-            "menu_code");
 
-    /* Query the database and see what we've got */
-    if(sylverant_db_query(&conn, query)) {
-        i = -3;
-        goto out;
-    }
+        /* And convert to UTF-16 */
+        in = strlen(tmp);
+        out = 0x22;
+        inptr = tmp;
+        outptr = (char *)pkt->entries[num_ships].name;
+        iconv(ic, &inptr, &in, &outptr, &out);
 
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        i = -4;
-        goto out;
+        /* We're done with this ship, increment the counter */
+        ++num_ships;
+        len += 0x2C;
     }
 
-    /* As long as we have some rows, go */
-    while((row = sylverant_db_result_fetch(result))) {
-        /* Grab info from the row */
-        ship_id = (uint16_t)strtoul(row[0], NULL, 0);
+    /* Add any other lists that need to be seen */
+    for(i = 0; i < d->menu_count; ++i) {
+        code = d->menu_codes[i];
 
         /* Skip the entry we're filling in now */
-        if(ship_id == menu_code) {
+        if(code == menu_code) {
             continue;
         }
 
-        tmp2[0] = (char)(ship_id);
-        tmp2[1] = (char)(ship_id >> 8);
+        tmp2[0] = (char)(code);
+        tmp2[1] = (char)(code >> 8);
         tmp2[2] = '\0';
 
         /* Make sure the values are in-bounds */
@@ -1058,7 +978,7 @@ static int send_ship_list_pc(login_client_t *c, uint16_t menu_code) {
         memset(&pkt->entries[num_ships], 0, 0x2C);
 
         /* Fill in what we have */
-        pkt->entries[num_ships].menu_id = LE32((0x00000001 | (ship_id << 8)));
+        pkt->entries[num_ships].menu_id = LE32((0x00000001 | (code << 8)));
         pkt->entries[num_ships].item_id = LE32(0x00000000);
         pkt->entries[num_ships].flags = LE16(0x0F04);
 
@@ -1082,8 +1002,6 @@ static int send_ship_list_pc(login_client_t *c, uint16_t menu_code) {
         len += 0x2C;
     }
 
-    sylverant_db_result_free(result);
-
     /* Make sure we have at least one ship... */
     if(num_ships == 1) {
         /* Clear out the ship information */
@@ -1109,23 +1027,19 @@ static int send_ship_list_pc(login_client_t *c, uint16_t menu_code) {
 
     iconv_close(ic);
 
-    /* Send the packet away */
-    return crypt_send(c, len);
-
-out:
-    iconv_close(ic);
-    return i;
+    return len;
 }
 
-static int send_ship_list_bb(login_client_t *c, uint16_t menu_code) {
-    bb_ship_list_pkt *pkt = (bb_ship_list_pkt *)sendbuf;
+/* Build the list of ships for Blue Burst clients into buf. */
+static int build_ship_list_bb(uint8_t *buf, ship_dir_t *d, uint16_t menu_code,
+                              int flags, int gm) {
+    bb_ship_list_pkt *pkt = (bb_ship_list_pkt *)buf;
     char no_ship_msg[] = "No Ships";
-    char query[256], tmp[18], tmp2[3];
+    char tmp[18], tmp2[3];
     uint32_t num_ships = 0;
-    void *result;
-    char **row;
-    uint32_t ship_id, players;
-    int i, len = 0x34, gm_only, ship_num;
+    uint16_t code;
+    int i, len = 0x34;
+    const ship_dir_ent_t *s;
     iconv_t ic = iconv_open("UTF-16LE", "UTF-8");
     size_t in, out;
     ICONV_CONST char *inptr;
@@ -1156,91 +1070,55 @@ static int send_ship_list_bb(login_client_t *c, uint16_t menu_code) {
 
     num_ships = 1;
 
-    /* Get ready to query the database */
-    sprintf(query, "SELECT ship_id, name, players, gm_only, ship_number FROM "
-            "online_ships WHERE menu_code='%hu' AND (flags & 0x200) = 0 ORDER "
-            "BY ship_number", menu_code);
-
-    /* Query the database and see what we've got */
-    if(sylverant_db_query(&conn, query)) {
-        i = -1;
-        goto out;
-    }
-
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        i = -2;
-        goto out;
-    }
-
-    /* As long as we have some rows, go */
-    while((row = sylverant_db_result_fetch(result))) {
-        gm_only = atoi(row[3]);
-
-        if(!gm_only || IS_GLOBAL_GM(c)) {
-            /* Clear out the ship information */
-            memset(&pkt->entries[num_ships], 0, 0x2C);
+    /* Add each ship on this menu that the client is allowed to see */
+    for(i = 0; i < d->ship_count; ++i) {
+        s = &d->ships[i];
 
-            /* Grab info from the row */
-            ship_id = (uint32_t)strtoul(row[0], NULL, 0);
-            players = (uint32_t)strtoul(row[2], NULL, 0);
-            ship_num = atoi(row[4]);
-
-            /* Fill in what we have */
-            pkt->entries[num_ships].menu_id = LE32(0x00000001);
-            pkt->entries[num_ships].item_id = LE32(ship_id);
-            pkt->entries[num_ships].flags = LE16(0x0F04);
+        if(s->menu_code != menu_code || (s->flags & flags) ||
+           (s->gm_only && !gm)) {
+            continue;
+        }
 
-            /* Create the name string (UTF-8) */
-            if(menu_code) {
-                sprintf(tmp, "%02X:%c%c/%s", ship_num, (char)menu_code,
-                        (char)(menu_code >> 8), row[1]);
-            }
-            else {
-                sprintf(tmp, "%02X:%s", ship_num, row[1]);
-            }
+        /* Clear out the ship information */
+        memset(&pkt->entries[num_ships], 0, 0x2C);
 
-            /* And convert to UTF-16 */
-            in = strlen(tmp);
-            out = 0x22;
-            inptr = tmp;
-            outptr = (char *)pkt->entries[num_ships].name;
-            iconv(ic, &inptr, &in, &outptr, &out);
+        /* Fill in what we have */
+        pkt->entries[num_ships].menu_id = LE32(0x00000001);
+        pkt->entries[num_ships].item_id = LE32(s->ship_id);
+        pkt->entries[num_ships].flags = LE16(0x0F04);
 
-            /* We're done with this ship, increment the counter */
-            ++num_ships;
-            len += 0x2C;
+        /* Create the name string (UTF-8) */
+        if(menu_code) {
+            sprintf(tmp, "%02X:%c%c/%s", s->ship_number, (char)menu_code,
+                    (char)(menu_code >> 8), s->name);
+        }
+        else {
+            sprintf(tmp, "%02X:%s", s->ship_number, s->name);
         }
-    }
-
-    sylverant_db_result_free(result);
-
-    /* Figure out any lists we need to allow to be seen */
-    sprintf(query, "SELECT DISTINCT menu_code FROM online_ships ORDER BY "
-            "menu_code");
 
-    /* Query the database and see what we've got */
-    if(sylverant_db_query(&conn, query)) {
-        i = -3;
-        goto out;
-    }
+        /* And convert to UTF-16 */
+        in = strlen(tmp);
+        out = 0x22;
+        inptr = tmp;
+        outptr = (char *)pkt->entries[num_ships].name;
+        iconv(ic, &inptr, &in, &outptr, &out);
 
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        i = -4;
-        goto out;
+        /* We're done with this ship, increment the counter */
+        ++num_ships;
+        len += 0x2C;
     }
 
-    /* As long as we have some rows, go */
-    while((row = sylverant_db_result_fetch(result))) {
-        /* Grab info from the row */
-        ship_id = (uint16_t)strtoul(row[0], NULL, 0);
+    /* Add any other lists that need to be seen */
+    for(i = 0; i < d->menu_count; ++i) {
+        code = d->menu_codes[i];
 
         /* Skip the entry we're filling in now */
-        if(ship_id == menu_code) {
+        if(code == menu_code) {
             continue;
         }
 
-        tmp2[0] = (char)(ship_id);
-        tmp2[1] = (char)(ship_id >> 8);
+        tmp2[0] = (char)(code);
+        tmp2[1] = (char)(code >> 8);
         tmp2[2] = '\0';
 
         /* Make sure the values are in-bounds */
@@ -1252,7 +1130,7 @@ static int send_ship_list_bb(login_client_t *c, uint16_t menu_code) {
         memset(&pkt->entries[num_ships], 0, 0x2C);
 
         /* Fill in what we have */
-        pkt->entries[num_ships].menu_id = LE32((0x00000001 | (ship_id << 8)));
+        pkt->entries[num_ships].menu_id = LE32((0x00000001 | (code << 8)));
         pkt->entries[num_ships].item_id = LE32(0x00000000);
         pkt->entries[num_ships].flags = LE16(0x0F04);
 
@@ -1276,8 +1154,6 @@ static int send_ship_list_bb(login_client_t *c, uint16_t menu_code) {
         len += 0x2C;
     }
 
-    sylverant_db_result_free(result);
-
     /* Make sure we have at least one ship... */
     if(num_ships == 1) {
         /* Clear out the ship information */
@@ -1303,34 +1179,75 @@ static int send_ship_list_bb(login_client_t *c, uint16_t menu_code) {
 
     iconv_close(ic);
 
-    /* Send the packet away */
-    return crypt_send(c, len);
-
-out:
-    iconv_close(ic);
-    return i;
+    return len;
 }
 
 int send_ship_list(login_client_t *c, uint16_t menu_code) {
-    /* Call the appropriate function */
+    uint8_t *sendbuf = get_sendbuf();
+    int (*build)(uint8_t *, ship_dir_t *, uint16_t, int, int);
+    int flags, len, gm = IS_GLOBAL_GM(c);
+    ship_dir_t *d;
+
+    /* Figure out which ships to exclude by flags, and how to build the list */
     switch(c->type) {
         case CLIENT_TYPE_DCNTE:
+            flags = 0x400;
+            build = build_ship_list_dc;
+            break;
+
         case CLIENT_TYPE_DC:
+            flags = c->version == SYLVERANT_QUEST_V1 ? 0x10 : 0x20;
+            build = build_ship_list_dc;
+            break;
+
         case CLIENT_TYPE_GC:
+            flags = 0x80;
+            build = build_ship_list_dc;
+            break;
+
         case CLIENT_TYPE_EP3:
-            return send_ship_list_dc(c, menu_code);
+            flags = 0x100;
+            build = build_ship_list_dc;
+            break;
 
         case CLIENT_TYPE_PC:
-            return send_ship_list_pc(c, menu_code);
+            flags = 0x40;
+            build = build_ship_list_pc;
+            break;
 
         case CLIENT_TYPE_BB_CHARACTER:
-            return send_ship_list_bb(c, menu_code);
+            flags = 0x200;
+            build = build_ship_list_bb;
+            break;
+
+        default:
+            return -1;
     }
 
-    return -1;
+    if(!(d = ship_dir_get())) {
+        return -1;
+    }
+
+    /* If we've already built this list from the current snapshot, just use
+       that, otherwise build it now and save it for the next client. */
+    if((len = ship_dir_pkt_get(d, flags, menu_code, gm, sendbuf)) < 0) {
+        if((len = build(sendbuf, d, menu_code, flags, gm)) > 0) {
+            ship_dir_pkt_add(d, flags, menu_code, gm, sendbuf, len);
+        }
+    }
+
+    ship_dir_put(d);
+
+    if(len < 0) {
+        return -1;
+    }
+
+    /* Send the packet away */
+    return crypt_send(c, len);
 }
 
 static int send_info_reply_dc(login_client_t *c, const char msg[]) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_info_reply_pkt *pkt = (dc_info_reply_pkt *)sendbuf;
     iconv_t ic;
     size_t in, out;
@@ -1394,6 +1311,7 @@ static int send_info_reply_dc(login_client_t *c, const char msg[]) {
 
 static int send_info_reply_bb(login_client_t *c, const char msg[],
                               uint16_t type) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_info_reply_pkt *pkt = (bb_info_reply_pkt *)sendbuf;
     iconv_t ic;
     size_t in, out;
@@ -1466,6 +1384,7 @@ int send_scroll_msg(login_client_t *c, const char msg[]) {
 
 /* Send a simple (header-only) packet to the client */
 static int send_simple_dc(login_client_t *c, int type, int flags) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_pkt_hdr_t *pkt = (dc_pkt_hdr_t *)sendbuf;
 
     /* Fill in the header */
@@ -1478,6 +1397,7 @@ static int send_simple_dc(login_client_t *c, int type, int flags) {
 }
 
 static int send_simple_pc(login_client_t *c, int type, int flags) {
+    uint8_t *sendbuf = get_sendbuf();
     pc_pkt_hdr_t *pkt = (pc_pkt_hdr_t *)sendbuf;
 
     /* Fill in the header */
@@ -1508,6 +1428,7 @@ int send_simple(login_client_t *c, int type, int flags) {
 /* Send the list of quests in a category to the client. */
 static int send_dc_quest_list(login_client_t *c,
                               sylverant_quest_category_t *l, uint32_t ver) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_quest_list_pkt *pkt = (dc_quest_list_pkt *)sendbuf;
     int i, len = 0x04, entries = 0;
     iconv_t ic;
@@ -1576,6 +1497,7 @@ static int send_dc_quest_list(login_client_t *c,
 
 static int send_pc_quest_list(login_client_t *c,
                               sylverant_quest_category_t *l) {
+    uint8_t *sendbuf = get_sendbuf();
     pc_quest_list_pkt *pkt = (pc_quest_list_pkt *)sendbuf;
     int i, len = 0x04, entries = 0;
     iconv_t ic;
@@ -1634,6 +1556,7 @@ static int send_pc_quest_list(login_client_t *c,
 
 static int send_gc_quest_list(login_client_t *c,
                               sylverant_quest_category_t *l) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_quest_list_pkt *pkt = (dc_quest_list_pkt *)sendbuf;
     int i, len = 0x04, entries = 0;
     iconv_t ic;
@@ -1716,6 +1639,7 @@ int send_quest_list(login_client_t *c, sylverant_quest_category_t *l) {
 /* Send a quest to a client. This only supports the .qst format that Qedit spits
    out by default (Download quest format). */
 int send_quest(login_client_t *c, sylverant_quest_t *q) {
+    uint8_t *sendbuf = get_sendbuf();
     char filename[256];
     FILE *fp;
     long len;
@@ -1770,6 +1694,7 @@ int send_quest(login_client_t *c, sylverant_quest_t *q) {
 
 /* Send an Episode 3 rank update to a client. */
 int send_ep3_rank_update(login_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     ep3_rank_update_pkt *pkt = (ep3_rank_update_pkt *)sendbuf;
 
     /* XXXX: Need to actually do something with this in the future */
@@ -1785,6 +1710,7 @@ int send_ep3_rank_update(login_client_t *c) {
 
 /* Send the Episode 3 card list to a client. */
 int send_ep3_card_update(login_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     ep3_card_update_pkt *pkt = (ep3_card_update_pkt *)sendbuf;
     FILE *fp;
     long size;
@@ -1828,6 +1754,7 @@ int send_ep3_card_update(login_client_t *c) {
 
 /* Send a Blue Burst option reply to the client. */
 int send_bb_option_reply(login_client_t *c, const uint8_t keys[420]) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_opt_config_pkt *pkt = (bb_opt_config_pkt *)sendbuf;
 
     /* Clear it out first */
@@ -1851,6 +1778,7 @@ int send_bb_option_reply(login_client_t *c, const uint8_t keys[420]) {
 
 /* Send a Blue Burst character acknowledgement to the client. */
 int send_bb_char_ack(login_client_t *c, uint8_t slot, uint8_t code) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_char_ack_pkt *pkt = (bb_char_ack_pkt *)sendbuf;
 
     /* Clear it out first */
@@ -1868,6 +1796,7 @@ int send_bb_char_ack(login_client_t *c, uint8_t slot, uint8_t code) {
 
 /* Send a Blue Burst checksum acknowledgement to the client. */
 int send_bb_checksum_ack(login_client_t *c, uint32_t ack) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_checksum_ack_pkt *pkt = (bb_checksum_ack_pkt *)sendbuf;
 
     /* Clear it out first */
@@ -1884,6 +1813,7 @@ int send_bb_checksum_ack(login_client_t *c, uint32_t ack) {
 
 /* Send a Blue Burst guildcard header packet. */
 int send_bb_guild_header(login_client_t *c, uint32_t checksum) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_guildcard_hdr_pkt *pkt = (bb_guildcard_hdr_pkt *)sendbuf;
 
     /* Clear it out first */
@@ -1902,6 +1832,7 @@ int send_bb_guild_header(login_client_t *c, uint32_t checksum) {
 
 /* Send a Blue Burst guildcard chunk packet. */
 int send_bb_guild_chunk(login_client_t *c, uint32_t chunk) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_guildcard_chunk_pkt *pkt = (bb_guildcard_chunk_pkt *)sendbuf;
     uint32_t offset = (chunk * 0x6800);
     uint16_t size = sizeof(bb_gc_data_t) - offset;
@@ -1932,6 +1863,7 @@ int send_bb_guild_chunk(login_client_t *c, uint32_t chunk) {
 
 /* Send a prepared Blue Burst packet. */
 int send_bb_pkt(login_client_t *c, bb_pkt_hdr_t *hdr) {
+    uint8_t *sendbuf = get_sendbuf();
     uint16_t len = LE16(hdr->pkt_len);
 
     /* Copy it into our buffer */
@@ -1944,6 +1876,7 @@ int send_bb_pkt(login_client_t *c, bb_pkt_hdr_t *hdr) {
 /* Send a Blue Burst character preview packet. */
 int send_bb_char_preview(login_client_t *c, const sylverant_bb_mini_char_t *mc,
                          uint8_t slot) {
+    uint8_t *sendbuf = get_sendbuf();
     bb_char_preview_pkt *pkt = (bb_char_preview_pkt *)sendbuf;
 
     /* Fill in the header */
@@ -1962,6 +1895,7 @@ int send_bb_char_preview(login_client_t *c, const sylverant_bb_mini_char_t *mc,
 
 /* Send the content of the "Information" menu. */
 static int send_gc_info_list(login_client_t *c, uint32_t ver) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_block_list_pkt *pkt = (dc_block_list_pkt *)sendbuf;
     int i, len = 0x20, entries = 1;
     uint32_t lang = (1 << c->language_code);
@@ -2046,6 +1980,7 @@ int send_info_list(login_client_t *c) {
 /* Send a message to the client. */
 static int send_gc_message_box(login_client_t *c, const char *fmt,
                                va_list args) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_msg_box_pkt *pkt = (dc_msg_box_pkt *)sendbuf;
     int len;
 
@@ -2142,6 +2077,7 @@ int send_info_file(login_client_t *c, uint32_t entry) {
 
 /* Send the GM operations menu to the user. */
 static int send_gm_menu_dc(login_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     dc_ship_list_pkt *pkt = (dc_ship_list_pkt *)sendbuf;
     int len = 0x04, count = 0;
 
@@ -2195,6 +2131,7 @@ static int send_gm_menu_dc(login_client_t *c) {
 }
 
 static int send_gm_menu_pc(login_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     pc_ship_list_pkt *pkt = (pc_ship_list_pkt *)sendbuf;
     int len = 0x04, count = 0;
 
@@ -24,6 +24,7 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -42,6 +43,11 @@
 
 #include "login.h"
 #include "login_packets.h"
+#include "worker.h"
+#include "shipdir.h"
+#include "bans.h"
+#include "gccache.h"
+#include "auth.h"
 
 #ifndef ENABLE_IPV6
 #define NUM_DCSOCKS  3
@@ -116,16 +122,24 @@ static const int bbports[NUM_BBSOCKS][2] = {
 };
 
 /* Stuff read from the config files */
-sylverant_dbconn_t conn;
 sylverant_config_t *cfg;
 sylverant_limits_t *limits = NULL;
+sylverant_admit_t *admit = NULL;
 
+/* The quest list can be reread by a GM at any time, so it needs protecting from
+   the worker threads that are reading it. */
 sylverant_quest_list_t qlist[CLIENT_TYPE_COUNT][CLIENT_LANG_COUNT];
+pthread_rwlock_t qlist_lock = PTHREAD_RWLOCK_INITIALIZER;
 int shutting_down = 0;
 
 static const char *config_file = NULL;
 static const char *custom_dir = NULL;
 static int dont_daemonize = 0;
+static int thread_count = 0;
+static volatile sig_atomic_t rehash = 0;
+
+/* Per-thread data for the main thread. */
+static login_tdata_t main_td;
 
 /* Print information about this program to stdout. */
 static void print_program_info() {
@@ -155,6 +169,8 @@ static void print_help(const char *bin) {
            "                default one.\n"
            "-D directory    Use the specified directory as the root\n"
            "--nodaemon      Don't daemonize\n"
+           "-T threads      Use the specified number of worker threads. The\n"
+           "                default is the number of CPUs available.\n"
            "--help          Print this help and exit\n\n"
            "Note that if more than one verbosity level is specified, the last\n"
            "one specified will be used. The default is --verbose.\n", bin);
@@ -189,6 +205,16 @@ static void parse_command_line(int argc, char *argv[]) {
         else if(!strcmp(argv[i], "--nodaemon")) {
             dont_daemonize = 1;
         }
+        else if(!strcmp(argv[i], "-T")) {
+            /* Make sure there's actually a number given. */
+            if(i == argc - 1) {
+                printf("-T requires an argument!\n\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            thread_count = atoi(argv[++i]);
+        }
         else if(!strcmp(argv[i], "--help")) {
             print_help(argv[0]);
             exit(EXIT_SUCCESS);
@@ -205,7 +231,11 @@ void read_quests() {
     int i, j;
     char fn[512];
     sylverant_quest_list_t tmp;
-    static int read_quests = 0;
+
+    /* Which lists have been read in already, and thus need to be freed when
+       they're replaced. Only touched while holding the write lock, since GMs
+       on any of the worker threads can ask for the quests to be reread. */
+    static int read_quests[CLIENT_TYPE_COUNT][CLIENT_LANG_COUNT];
 
     debug(DBG_LOG, "Reading quests...\n");
 
@@ -220,16 +250,18 @@ void read_quests() {
                 }
 
                 /* Cleanup and move the new stuff in place. */
-                if(read_quests) {
+                pthread_rwlock_wrlock(&qlist_lock);
+
+                if(read_quests[i][j]) {
                     sylverant_quests_destroy(&qlist[i][j]);
                 }
 
                 qlist[i][j] = tmp;
+                read_quests[i][j] = 1;
+                pthread_rwlock_unlock(&qlist_lock);
             }
         }
     }
-
-    read_quests = 1;
 }
 
 /* Load the configuration file. */
@@ -262,74 +294,64 @@ static void load_config2() {
 
     debug(DBG_LOG, "Connecting to the database...\n");
 
-    if(sylverant_db_open(&cfg->dbcfg, &conn)) {
-        debug(DBG_ERROR, "Can't connect to the database\n");
+    if(tdata_init(&main_td, NULL) || tdata_attach(&main_td)) {
         exit(EXIT_FAILURE);
     }
 }
 
 int ship_transfer(login_client_t *c, uint32_t shipid) {
-    char query[256];
-    void *result;
-    char **row;
+    ship_dir_t *d;
+    const ship_dir_ent_t *s;
     in_addr_t ip;
     uint16_t port;
 #ifdef ENABLE_IPV6
-    uint64_t ip6_hi, ip6_lo;
     uint8_t ip6[16];
 #endif
 
-    /* Query the database for the ship in question */
-    sprintf(query, "SELECT ip, port, ship_ip6_high, ship_ip6_low FROM "
-            "online_ships WHERE ship_id='%lu'", (unsigned long)shipid);
-
-    if(sylverant_db_query(&conn, query))
+    /* Look up the ship in question */
+    if(!(d = ship_dir_get()))
         return -1;
 
-    if(!(result = sylverant_db_result_store(&conn)))
-        return -2;
-
-    if(!(row = sylverant_db_result_fetch(result)))
+    if(!(s = ship_dir_find(d, shipid))) {
+        ship_dir_put(d);
         return -3;
+    }
 
-    /* Grab the data from the row */
+    /* Grab the data from the directory */
     if(c->type < CLIENT_TYPE_BB_CHARACTER)
-        port = (uint16_t)strtoul(row[1], NULL, 0) + c->type;
+        port = s->port + c->type;
     else if(c->type == CLIENT_TYPE_DCNTE)
-        port = (uint16_t)strtoul(row[1], NULL, 0);
+        port = s->port;
     else
-        port = (uint16_t)strtoul(row[1], NULL, 0) + 4;
+        port = s->port + 4;
 
 #ifdef ENABLE_IPV6
-    if(row[2] && row[3]) {
-        ip6_hi = (uint64_t)strtoull(row[2], NULL, 0);
-        ip6_lo = (uint64_t)strtoull(row[3], NULL, 0);
-    }
-
-    if(!c->is_ipv6 || !row[2] || !row[3] || !ip6_hi) {
+    if(!c->is_ipv6 || !s->has_ip6 || !s->ip6_hi) {
 #endif
-        ip = htonl((in_addr_t)strtoul(row[0], NULL, 0));
+        ip = htonl((in_addr_t)s->ip);
+        ship_dir_put(d);
 
         return send_redirect(c, ip, port);
 #ifdef ENABLE_IPV6
     }
     else {
-        ip6[0] = (uint8_t)(ip6_hi >> 56);
-        ip6[1] = (uint8_t)(ip6_hi >> 48);
-        ip6[2] = (uint8_t)(ip6_hi >> 40);
-        ip6[3] = (uint8_t)(ip6_hi >> 32);
-        ip6[4] = (uint8_t)(ip6_hi >> 24);
-        ip6[5] = (uint8_t)(ip6_hi >> 16);
-        ip6[6] = (uint8_t)(ip6_hi >> 8);
-        ip6[7] = (uint8_t)(ip6_hi);
-        ip6[8] = (uint8_t)(ip6_lo >> 56);
-        ip6[9] = (uint8_t)(ip6_lo >> 48);
-        ip6[10] = (uint8_t)(ip6_lo >> 40);
-        ip6[11] = (uint8_t)(ip6_lo >> 32);
-        ip6[12] = (uint8_t)(ip6_lo >> 24);
-        ip6[13] = (uint8_t)(ip6_lo >> 16);
-        ip6[14] = (uint8_t)(ip6_lo >> 8);
-        ip6[15] = (uint8_t)(ip6_lo);
+        ip6[0] = (uint8_t)(s->ip6_hi >> 56);
+        ip6[1] = (uint8_t)(s->ip6_hi >> 48);
+        ip6[2] = (uint8_t)(s->ip6_hi >> 40);
+        ip6[3] = (uint8_t)(s->ip6_hi >> 32);
+        ip6[4] = (uint8_t)(s->ip6_hi >> 24);
+        ip6[5] = (uint8_t)(s->ip6_hi >> 16);
+        ip6[6] = (uint8_t)(s->ip6_hi >> 8);
+        ip6[7] = (uint8_t)(s->ip6_hi);
+        ip6[8] = (uint8_t)(s->ip6_lo >> 56);
+        ip6[9] = (uint8_t)(s->ip6_lo >> 48);
+        ip6[10] = (uint8_t)(s->ip6_lo >> 40);
+        ip6[11] = (uint8_t)(s->ip6_lo >> 32);
+        ip6[12] = (uint8_t)(s->ip6_lo >> 24);
+        ip6[13] = (uint8_t)(s->ip6_lo >> 16);
+        ip6[14] = (uint8_t)(s->ip6_lo >> 8);
+        ip6[15] = (uint8_t)(s->ip6_lo);
+        ship_dir_put(d);
 
         return send_redirect6(c, ip6, port);
     }
@@ -360,45 +382,41 @@ static const void *my_ntop(struct sockaddr_storage *addr,
 static void run_server(int dcsocks[NUM_DCSOCKS], int pcsocks[NUM_PCSOCKS],
                        int gcsocks[NUM_GCSOCKS], int websocks[NUM_WEBSOCKS],
                        int ep3socks[NUM_EP3SOCKS], int bbsocks[NUM_BBSOCKS]) {
-    fd_set readfds, writefds;
+    fd_set readfds;
     struct timeval timeout;
     socklen_t len;
     struct sockaddr_storage addr;
     struct sockaddr *addr_p = (struct sockaddr *)&addr;
     char ipstr[INET6_ADDRSTRLEN];
     int nfds, asock, j, type;
-    login_client_t *i, *tmp;
-    ssize_t sent;
+    login_client_t *c;
     uint32_t client_count;
 
-    for(;;) {        
+    for(;;) {
         /* Clear the fd_sets so we can use them. */
         FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        timeout.tv_sec = 9001;
+        timeout.tv_sec = 10;
         timeout.tv_usec = 0;
         nfds = 0;
-        client_count = 0;
-
-        /* Fill the sockets into the fd_set so we can use select below. */
-        TAILQ_FOREACH(i, &clients, qentry) {
-            FD_SET(i->sock, &readfds);
-
-            /* Only add to the writing fd_set if we have something to write. */
-            if(i->sendbuf_cur) {
-                FD_SET(i->sock, &writefds);
-            }
-
-            nfds = nfds > i->sock ? nfds : i->sock;
-            ++client_count;
-        }
 
         /* If we have a shutdown scheduled and nobody's connected, go ahead and
            do it. */
-        if(!client_count && shutting_down) {
+        if(shutting_down && !workers_client_count()) {
             return;
         }
 
+        /* If we've been asked to, reload the Blue Burst parameter data. Anyone
+           in the middle of downloading the old data keeps getting it. */
+        if(rehash) {
+            rehash = 0;
+            debug(DBG_LOG, "Reloading Blue Burst param data...\n");
+
+            if(load_param_data()) {
+                debug(DBG_WARN, "Couldn't reload param data, keeping the old "
+                      "data\n");
+            }
+        }
+
         /* Add the listening sockets for incoming connections to the fd_set. */
         for(j = 0; j < NUM_DCSOCKS; ++j) {
             FD_SET(dcsocks[j], &readfds);
@@ -430,7 +448,7 @@ static void run_server(int dcsocks[NUM_DCSOCKS], int pcsocks[NUM_PCSOCKS],
             nfds = nfds > websocks[j] ? nfds : websocks[j];
         }
 
-        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
+        if(select(nfds + 1, &readfds, NULL, NULL, &timeout) > 0) {
             /* See if we have an incoming client. */
             for(j = 0; j < NUM_DCSOCKS; ++j) {
                 if(FD_ISSET(dcsocks[j], &readfds)) {
@@ -444,11 +462,13 @@ static void run_server(int dcsocks[NUM_DCSOCKS], int pcsocks[NUM_PCSOCKS],
                     debug(DBG_LOG, "Accepted Dreamcast connection from %s "
                           "on port %d\n", ipstr, dcports[j][1]);
 
-                    if(!create_connection(asock, CLIENT_TYPE_DC, addr_p, len)) {
+                    c = create_connection(asock, CLIENT_TYPE_DC, addr_p, len);
+
+                    if(!c) {
                         close(asock);
                     }
                     else {
-                        ++client_count;
+                        worker_add_client(c);
                     }
                 }
             }
@@ -465,11 +485,13 @@ static void run_server(int dcsocks[NUM_DCSOCKS], int pcsocks[NUM_PCSOCKS],
                     debug(DBG_LOG, "Accepted PC connection from %s "
                           "on port %d\n", ipstr, pcports[j][1]);
 
-                    if(!create_connection(asock, CLIENT_TYPE_PC, addr_p, len)) {
+                    c = create_connection(asock, CLIENT_TYPE_PC, addr_p, len);
+
+                    if(!c) {
                         close(asock);
                     }
                     else {
-                        ++client_count;
+                        worker_add_client(c);
                     }
                 }
             }
@@ -486,11 +508,13 @@ static void run_server(int dcsocks[NUM_DCSOCKS], int pcsocks[NUM_PCSOCKS],
                     debug(DBG_LOG, "Accepted Gamecube connection from %s "
                           "on port %d\n", ipstr, gcports[j][1]);
 
-                    if(!create_connection(asock, CLIENT_TYPE_GC, addr_p, len)) {
+                    c = create_connection(asock, CLIENT_TYPE_GC, addr_p, len);
+
+                    if(!c) {
                         close(asock);
                     }
                     else {
-                        ++client_count;
+                        worker_add_client(c);
                     }
                 }
             }
@@ -507,12 +531,13 @@ static void run_server(int dcsocks[NUM_DCSOCKS], int pcsocks[NUM_PCSOCKS],
                     debug(DBG_LOG, "Accepted Episode 3 connection from %s "
                           "on port %d\n", ipstr, ep3ports[j][1]);
 
-                    if(!create_connection(asock, CLIENT_TYPE_EP3, addr_p,
-                                          len)) {
+                    c = create_connection(asock, CLIENT_TYPE_EP3, addr_p, len);
+
+                    if(!c) {
                         close(asock);
                     }
                     else {
-                        ++client_count;
+                        worker_add_client(c);
                     }
                 }
             }
@@ -536,11 +561,13 @@ static void run_server(int dcsocks[NUM_DCSOCKS], int pcsocks[NUM_PCSOCKS],
                         type = CLIENT_TYPE_BB_LOGIN;
                     }
 
-                    if(!create_connection(asock, type, addr_p, len)) {
+                    c = create_connection(asock, type, addr_p, len);
+
+                    if(!c) {
                         close(asock);
                     }
                     else {
-                        ++client_count;
+                        worker_add_client(c);
                     }
                 }
             }
@@ -555,65 +582,36 @@ static void run_server(int dcsocks[NUM_DCSOCKS], int pcsocks[NUM_PCSOCKS],
                     else {
                         /* Send the number of connected clients, and close the
                            socket. */
-                        client_count = LE32(client_count);
+                        client_count = LE32(workers_client_count());
                         send(asock, &client_count, 4, 0);
                         close(asock);
                     }
                 }
             }
+        }
+    }
+}
 
-            /* Handle the client connections, if any. */
-            TAILQ_FOREACH(i, &clients, qentry) {
-                /* Check if this connection was trying to send us something. */
-                if(FD_ISSET(i->sock, &readfds)) {
-                    if(read_from_client(i)) {
-                        i->disconnected = 1;
-                    }
-                }
+/* Signal handler registered to SIGHUP. Sending SIGHUP to the program will cause
+   it to reload the Blue Burst parameter data at its next earliest
+   convenience. */
+static void sig_handler(int signum) {
+    rehash = 1;
+}
 
-                /* If we have anything to write, check if we can right now. */
-                if(FD_ISSET(i->sock, &writefds)) {
-                    if(i->sendbuf_cur) {
-                        sent = send(i->sock, i->sendbuf + i->sendbuf_start,
-                                    i->sendbuf_cur - i->sendbuf_start, 0);
-
-                        /* If we fail to send, and the error isn't EAGAIN,
-                           bail. */
-                        if(sent == -1) {
-                            if(errno != EAGAIN) {
-                                i->disconnected = 1;
-                            }
-                        }
-                        else {
-                            i->sendbuf_start += sent;
-
-                            /* If we've sent everything, free the buffer. */
-                            if(i->sendbuf_start == i->sendbuf_cur) {
-                                free(i->sendbuf);
-                                i->sendbuf = NULL;
-                                i->sendbuf_cur = 0;
-                                i->sendbuf_size = 0;
-                                i->sendbuf_start = 0;
-                            }
-                        }
-                    }
-                }
-            }
-        }
+/* Install the signal handler for SIGHUP. Calls the above function. */
+static void install_signal_handler() {
+    struct sigaction sa;
 
-        /* Clean up any dead connections (its not safe to do a TAILQ_REMOVE in
-           the middle of a TAILQ_FOREACH, and destroy_connection does indeed
-           use TAILQ_REMOVE). */
-        i = TAILQ_FIRST(&clients);
-        while(i) {
-            tmp = TAILQ_NEXT(i, qentry);
+    sa.sa_handler = &sig_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
 
-            if(i->disconnected) {
-                destroy_connection(i);
-            }
+    debug(DBG_LOG, "Installing SIGHUP handler...\n");
 
-            i = tmp;
-        }
+    if(sigaction(SIGHUP, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
     }
 }
 
@@ -761,7 +759,7 @@ int main(int argc, char *argv[]) {
         dcsocks[i] = open_sock(dcports[i][0], dcports[i][1]);
 
         if(dcsocks[i] < 0) {
-            sylverant_db_close(&conn);
+            tdata_cleanup(&main_td);
             exit(EXIT_FAILURE);
         }
     }
@@ -772,7 +770,7 @@ int main(int argc, char *argv[]) {
         pcsocks[i] = open_sock(pcports[i][0], pcports[i][1]);
 
         if(pcsocks[i] < 0) {
-            sylverant_db_close(&conn);
+            tdata_cleanup(&main_td);
             exit(EXIT_FAILURE);
         }
     }
@@ -783,7 +781,7 @@ int main(int argc, char *argv[]) {
         gcsocks[i] = open_sock(gcports[i][0], gcports[i][1]);
 
         if(gcsocks[i] < 0) {
-            sylverant_db_close(&conn);
+            tdata_cleanup(&main_td);
             exit(EXIT_FAILURE);
         }
     }
@@ -794,7 +792,7 @@ int main(int argc, char *argv[]) {
         ep3socks[i] = open_sock(ep3ports[i][0], ep3ports[i][1]);
 
         if(ep3socks[i] < 0) {
-            sylverant_db_close(&conn);
+            tdata_cleanup(&main_td);
             exit(EXIT_FAILURE);
         }
     }
@@ -805,7 +803,7 @@ int main(int argc, char *argv[]) {
         bbsocks[i] = open_sock(bbports[i][0], bbports[i][1]);
 
         if(bbsocks[i] < 0) {
-            sylverant_db_close(&conn);
+            tdata_cleanup(&main_td);
             exit(EXIT_FAILURE);
         }
     }
@@ -816,14 +814,54 @@ int main(int argc, char *argv[]) {
         websocks[i] = open_sock(webports[i][0], webports[i][1]);
 
         if(websocks[i] < 0) {
-            sylverant_db_close(&conn);
+            tdata_cleanup(&main_td);
             exit(EXIT_FAILURE);
         }
     }
 
+    install_signal_handler();
+
+    /* Set up the admission control so a flood of clients (like when a ship
+       goes down) doesn't bury us. */
+    if(!(admit = sylverant_admit_new(&cfg->admit, LOGIN_MAX_PENDING))) {
+        debug(DBG_ERROR, "Cannot set up admission control\n");
+        tdata_cleanup(&main_td);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Start up the worker threads that will actually deal with the clients. */
+    if(!thread_count) {
+        thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if(workers_start(thread_count)) {
+        workers_stop();
+        tdata_cleanup(&main_td);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Password checking gets its own set of threads. */
+    if(auth_start(AUTH_THREADS)) {
+        auth_stop();
+        workers_stop();
+        tdata_cleanup(&main_td);
+        exit(EXIT_FAILURE);
+    }
+
     /* Run the login server. */
     run_server(dcsocks, pcsocks, gcsocks, websocks, ep3socks, bbsocks);
 
+    /* Disconnect anyone left and stop the workers. The password checking
+       threads have to go first, since they hand their results to the
+       workers. */
+    auth_stop();
+    workers_stop();
+    ship_dir_cleanup();
+    ban_cleanup();
+    gc_cache_cleanup();
+    cleanup_param_data();
+    sylverant_admit_free(admit);
+
     /* Clean up. */
     for(i = 0; i < NUM_DCSOCKS; ++i) {
         close(dcsocks[i]);
@@ -849,7 +887,7 @@ int main(int argc, char *argv[]) {
         close(websocks[i]);
     }
 
-    sylverant_db_close(&conn);
+    tdata_cleanup(&main_td);
 
     for(i = 0; i < CLIENT_TYPE_COUNT; ++i) {
         for(j = 0; j < CLIENT_LANG_COUNT; ++j) {
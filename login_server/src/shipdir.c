@@ -0,0 +1,272 @@
+/*
+    Sylverant Login Server
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sylverant/debug.h>
+#include <sylverant/database.h>
+
+#include "shipdir.h"
+#include "worker.h"
+
+/* The current snapshot. The lock protects this pointer, the refresh flag and
+   the reference counts of all snapshots. */
+static ship_dir_t *cur_dir = NULL;
+static int refreshing = 0;
+static pthread_mutex_t dir_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_dir(ship_dir_t *d) {
+    ship_dir_pkt_t *i;
+
+    while((i = TAILQ_FIRST(&d->pkts))) {
+        TAILQ_REMOVE(&d->pkts, i, qentry);
+        free(i);
+    }
+
+    pthread_mutex_destroy(&d->mutex);
+    free(d->menu_codes);
+    free(d->ships);
+    free(d);
+}
+
+/* Read a new snapshot in from the database. */
+static ship_dir_t *load_dir(void) {
+    ship_dir_t *d;
+    void *result;
+    char **row;
+    long rows;
+    int i, j;
+    ship_dir_ent_t *s;
+    login_tdata_t *td = get_tdata();
+
+    if(sylverant_db_query(&td->conn, "SELECT ship_id, name, players, games, "
+                          "gm_only, ship_number, menu_code, flags, ip, port, "
+                          "ship_ip6_high, ship_ip6_low FROM online_ships ORDER "
+                          "BY ship_number")) {
+        debug(DBG_WARN, "Couldn't fetch ship list\n");
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+        return NULL;
+    }
+
+    if(!(result = sylverant_db_result_store(&td->conn))) {
+        debug(DBG_WARN, "Couldn't fetch ship list\n");
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+        return NULL;
+    }
+
+    if(!(d = (ship_dir_t *)malloc(sizeof(ship_dir_t)))) {
+        debug(DBG_WARN, "Cannot allocate ship directory\n");
+        goto err_result;
+    }
+
+    memset(d, 0, sizeof(ship_dir_t));
+    rows = sylverant_db_result_rows(result);
+
+    /* Allocate at least one of each, just so we don't get NULL back for an
+       empty list. */
+    d->ships = (ship_dir_ent_t *)malloc(sizeof(ship_dir_ent_t) *
+                                       (rows ? rows : 1));
+    d->menu_codes = (uint16_t *)malloc(sizeof(uint16_t) * (rows ? rows : 1));
+
+    if(!d->ships || !d->menu_codes) {
+        debug(DBG_WARN, "Cannot allocate ship directory\n");
+        goto err_dir;
+    }
+
+    while((row = sylverant_db_result_fetch(result)) && d->ship_count < rows) {
+        s = &d->ships[d->ship_count++];
+        memset(s, 0, sizeof(ship_dir_ent_t));
+
+        s->ship_id = (uint32_t)strtoul(row[0], NULL, 0);
+        strncpy(s->name, row[1], 12);
+        s->players = (uint32_t)strtoul(row[2], NULL, 0);
+        s->games = (uint32_t)strtoul(row[3], NULL, 0);
+        s->gm_only = atoi(row[4]);
+        s->ship_number = atoi(row[5]);
+        s->menu_code = (uint16_t)strtoul(row[6], NULL, 0);
+        s->flags = (uint32_t)strtoul(row[7], NULL, 0);
+        s->ip = (uint32_t)strtoul(row[8], NULL, 0);
+        s->port = (uint16_t)strtoul(row[9], NULL, 0);
+
+        if(row[10] && row[11]) {
+            s->has_ip6 = 1;
+            s->ip6_hi = (uint64_t)strtoull(row[10], NULL, 0);
+            s->ip6_lo = (uint64_t)strtoull(row[11], NULL, 0);
+        }
+
+        /* Add the menu code to the list (in order), if it isn't there. */
+        for(i = 0; i < d->menu_count; ++i) {
+            if(d->menu_codes[i] >= s->menu_code)
+                break;
+        }
+
+        if(i == d->menu_count || d->menu_codes[i] != s->menu_code) {
+            for(j = d->menu_count; j > i; --j) {
+                d->menu_codes[j] = d->menu_codes[j - 1];
+            }
+
+            d->menu_codes[i] = s->menu_code;
+            ++d->menu_count;
+        }
+    }
+
+    sylverant_db_result_free(result);
+
+    pthread_mutex_init(&d->mutex, NULL);
+    TAILQ_INIT(&d->pkts);
+    d->fetched = time(NULL);
+    d->refcnt = 1;
+
+    return d;
+
+err_dir:
+    free(d->menu_codes);
+    free(d->ships);
+    free(d);
+err_result:
+    sylverant_db_result_free(result);
+    return NULL;
+}
+
+ship_dir_t *ship_dir_get(void) {
+    ship_dir_t *d, *n;
+
+    pthread_mutex_lock(&dir_mutex);
+    d = cur_dir;
+
+    /* Only one thread bothers refreshing an old snapshot, everyone else keeps
+       using the old one until it is done. */
+    if(!d || (time(NULL) >= d->fetched + SHIP_DIR_TTL && !refreshing)) {
+        refreshing = 1;
+        pthread_mutex_unlock(&dir_mutex);
+
+        n = load_dir();
+
+        pthread_mutex_lock(&dir_mutex);
+        refreshing = 0;
+
+        if(n) {
+            if(cur_dir && !--cur_dir->refcnt) {
+                free_dir(cur_dir);
+            }
+
+            cur_dir = n;
+        }
+
+        d = cur_dir;
+    }
+
+    if(d) {
+        ++d->refcnt;
+    }
+
+    pthread_mutex_unlock(&dir_mutex);
+
+    return d;
+}
+
+void ship_dir_put(ship_dir_t *d) {
+    pthread_mutex_lock(&dir_mutex);
+
+    if(!--d->refcnt) {
+        free_dir(d);
+    }
+
+    pthread_mutex_unlock(&dir_mutex);
+}
+
+const ship_dir_ent_t *ship_dir_find(ship_dir_t *d, uint32_t ship_id) {
+    int i;
+
+    for(i = 0; i < d->ship_count; ++i) {
+        if(d->ships[i].ship_id == ship_id)
+            return &d->ships[i];
+    }
+
+    return NULL;
+}
+
+int ship_dir_pkt_get(ship_dir_t *d, int flags, uint16_t menu_code, int gm,
+                     uint8_t *buf) {
+    ship_dir_pkt_t *i;
+    int rv = -1;
+
+    pthread_mutex_lock(&d->mutex);
+
+    TAILQ_FOREACH(i, &d->pkts, qentry) {
+        if(i->flags == flags && i->menu_code == menu_code && i->gm == gm) {
+            memcpy(buf, i->data, i->len);
+            rv = i->len;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&d->mutex);
+
+    return rv;
+}
+
+void ship_dir_pkt_add(ship_dir_t *d, int flags, uint16_t menu_code, int gm,
+                      const uint8_t *pkt, int len) {
+    ship_dir_pkt_t *i;
+    int j;
+
+    /* Don't let clients fill up the cache by asking for garbage menus. */
+    if(menu_code) {
+        for(j = 0; j < d->menu_count; ++j) {
+            if(d->menu_codes[j] == menu_code)
+                break;
+        }
+
+        if(j == d->menu_count)
+            return;
+    }
+
+    pthread_mutex_lock(&d->mutex);
+
+    /* Someone else might have beaten us to it... */
+    TAILQ_FOREACH(i, &d->pkts, qentry) {
+        if(i->flags == flags && i->menu_code == menu_code && i->gm == gm) {
+            pthread_mutex_unlock(&d->mutex);
+            return;
+        }
+    }
+
+    if((i = (ship_dir_pkt_t *)malloc(sizeof(ship_dir_pkt_t) + len))) {
+        i->flags = flags;
+        i->menu_code = menu_code;
+        i->gm = gm;
+        i->len = len;
+        memcpy(i->data, pkt, len);
+        TAILQ_INSERT_TAIL(&d->pkts, i, qentry);
+    }
+
+    pthread_mutex_unlock(&d->mutex);
+}
+
+void ship_dir_cleanup(void) {
+    pthread_mutex_lock(&dir_mutex);
+
+    if(cur_dir && !--cur_dir->refcnt) {
+        free_dir(cur_dir);
+    }
+
+    cur_dir = NULL;
+    pthread_mutex_unlock(&dir_mutex);
+}
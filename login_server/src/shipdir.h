@@ -0,0 +1,103 @@
+/*
+    Sylverant Login Server
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SHIPDIR_H
+#define SHIPDIR_H
+
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+/* How long (in seconds) a snapshot of the online ships is used before it gets
+   refreshed from the database. */
+#define SHIP_DIR_TTL        5
+
+typedef struct ship_dir_ent {
+    uint32_t ship_id;
+    char name[13];
+    uint32_t players;
+    uint32_t games;
+    int gm_only;
+    int ship_number;
+    uint16_t menu_code;
+    uint32_t flags;
+
+    /* Where to send clients that pick this ship. */
+    uint32_t ip;
+    uint16_t port;
+    int has_ip6;
+    uint64_t ip6_hi;
+    uint64_t ip6_lo;
+} ship_dir_ent_t;
+
+typedef struct ship_dir_pkt {
+    TAILQ_ENTRY(ship_dir_pkt) qentry;
+    int flags;
+    uint16_t menu_code;
+    int gm;
+    int len;
+    uint8_t data[];
+} ship_dir_pkt_t;
+
+TAILQ_HEAD(ship_dir_pkt_queue, ship_dir_pkt);
+
+/* A snapshot of the online_ships table. Nothing in here changes once the
+   snapshot is built, other than the packet cache (protected by the mutex) and
+   the reference count (protected by the directory's own lock). */
+typedef struct ship_dir {
+    int refcnt;
+    time_t fetched;
+
+    /* All the online ships, ordered by ship number. */
+    int ship_count;
+    ship_dir_ent_t *ships;
+
+    /* The distinct menu codes that have ships on them, in order. */
+    int menu_count;
+    uint16_t *menu_codes;
+
+    /* Ship list packets that have already been built from this snapshot. */
+    pthread_mutex_t mutex;
+    struct ship_dir_pkt_queue pkts;
+} ship_dir_t;
+
+/* Grab a reference to the current snapshot, refreshing it first if it is too
+   old. Returns NULL if there is no snapshot and one can't be read. Release it
+   with ship_dir_put when done. */
+ship_dir_t *ship_dir_get(void);
+
+/* Release a reference to a snapshot. */
+void ship_dir_put(ship_dir_t *d);
+
+/* Look up a ship in a snapshot by its id. */
+const ship_dir_ent_t *ship_dir_find(ship_dir_t *d, uint32_t ship_id);
+
+/* Copy out a previously built ship list packet into buf. Returns the length of
+   the packet, or -1 if it hasn't been built. */
+int ship_dir_pkt_get(ship_dir_t *d, int flags, uint16_t menu_code, int gm,
+                     uint8_t *buf);
+
+/* Save a built ship list packet for later requests. Packets for menu codes
+   that have no ships are not saved. */
+void ship_dir_pkt_add(ship_dir_t *d, int flags, uint16_t menu_code, int gm,
+                      const uint8_t *pkt, int len);
+
+/* Drop the current snapshot. */
+void ship_dir_cleanup(void);
+
+#endif /* !SHIPDIR_H */
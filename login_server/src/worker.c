@@ -0,0 +1,537 @@
+/*
+    Sylverant Login Server
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include <sylverant/debug.h>
+
+#include "worker.h"
+
+/* The key for accessing our thread-specific data. */
+static pthread_key_t tdata_key;
+static pthread_once_t tdata_once = PTHREAD_ONCE_INIT;
+
+/* The worker threads that are running. */
+static login_worker_t *workers[MAX_WORKERS];
+static int worker_count = 0;
+
+/* Clients waiting on the client threads, and the threads themselves. */
+static struct client_queue jobs = TAILQ_HEAD_INITIALIZER(jobs);
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static volatile int job_run = 0;
+static pthread_t job_thds[CLIENT_THREADS];
+static login_tdata_t job_td[CLIENT_THREADS];
+static int job_count = 0;
+
+static void make_tdata_key(void) {
+    if(pthread_key_create(&tdata_key, NULL)) {
+        perror("pthread_key_create");
+    }
+}
+
+/* Set up a set of per-thread data. */
+int tdata_init(login_tdata_t *td, login_worker_t *w) {
+    pthread_once(&tdata_once, &make_tdata_key);
+
+    td->worker = w;
+
+    /* Each thread gets its own connection to the database, since a connection
+       can't be used by more than one thread at a time. */
+    if(sylverant_db_open(&cfg->dbcfg, &td->conn)) {
+        debug(DBG_ERROR, "Can't connect to the database\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Clean up the per-thread data set up with tdata_init. */
+void tdata_cleanup(login_tdata_t *td) {
+    sylverant_db_close(&td->conn);
+}
+
+/* Make the given per-thread data the calling thread's own. */
+int tdata_attach(login_tdata_t *td) {
+    if(pthread_setspecific(tdata_key, td)) {
+        perror("pthread_setspecific");
+        return -1;
+    }
+
+    return 0;
+}
+
+login_tdata_t *get_tdata(void) {
+    return (login_tdata_t *)pthread_getspecific(tdata_key);
+}
+
+uint8_t *get_sendbuf(void) {
+    return get_tdata()->sendbuf;
+}
+
+static void worker_wake(login_worker_t *w) {
+    /* The pipe is non-blocking, so if it is full, there's already a wake up
+       pending anyway, so we don't care if this fails. */
+    if(write(w->pipes[1], "\xFF", 1) < 0 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+/* Hand one of our clients off to the client threads, either to read from it or
+   to finish a password check. The client is left alone until it comes back. */
+static void client_job(login_client_t *c, auth_req_t *req) {
+    c->busy = 1;
+    c->job_auth = req;
+
+    pthread_mutex_lock(&job_mutex);
+    TAILQ_INSERT_TAIL(&jobs, c, jentry);
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_mutex);
+}
+
+static void *client_thd(void *d) {
+    login_tdata_t *td = (login_tdata_t *)d;
+    login_client_t *c;
+    login_worker_t *w;
+    auth_req_t *req;
+
+    if(tdata_attach(td)) {
+        pthread_exit(NULL);
+    }
+
+    pthread_mutex_lock(&job_mutex);
+
+    while(job_run) {
+        if(!(c = TAILQ_FIRST(&jobs))) {
+            pthread_cond_wait(&job_cond, &job_mutex);
+            continue;
+        }
+
+        TAILQ_REMOVE(&jobs, c, jentry);
+        pthread_mutex_unlock(&job_mutex);
+
+        if((req = c->job_auth)) {
+            c->job_auth = NULL;
+
+            if(auth_finish(req)) {
+                c->disconnected = 1;
+            }
+        }
+        else if(read_from_client(c)) {
+            c->disconnected = 1;
+        }
+
+        /* Give the client back to its worker. */
+        w = c->worker;
+        pthread_mutex_lock(&w->mutex);
+        TAILQ_INSERT_TAIL(&w->jobs_done, c, jentry);
+        pthread_mutex_unlock(&w->mutex);
+        worker_wake(w);
+
+        pthread_mutex_lock(&job_mutex);
+    }
+
+    pthread_mutex_unlock(&job_mutex);
+    pthread_exit(NULL);
+}
+
+/* Move any clients the main thread has handed us into our own list. */
+static void worker_take_pending(login_worker_t *w) {
+    login_client_t *i;
+
+    pthread_mutex_lock(&w->mutex);
+
+    while((i = TAILQ_FIRST(&w->pending))) {
+        TAILQ_REMOVE(&w->pending, i, qentry);
+        TAILQ_INSERT_TAIL(&w->clients, i, qentry);
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+}
+
+/* Take back the clients the client threads are done with. */
+static void worker_take_jobs(login_worker_t *w) {
+    login_client_t *i;
+
+    pthread_mutex_lock(&w->mutex);
+
+    while((i = TAILQ_FIRST(&w->jobs_done))) {
+        TAILQ_REMOVE(&w->jobs_done, i, jentry);
+        i->busy = 0;
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+}
+
+/* Have the client threads finish up any password checks that have come back
+   for our clients. */
+static void worker_take_auth(login_worker_t *w) {
+    struct auth_queue done;
+    auth_req_t *i, *tmp;
+
+    TAILQ_INIT(&done);
+    pthread_mutex_lock(&w->mutex);
+
+    i = TAILQ_FIRST(&w->auth_done);
+    while(i) {
+        tmp = TAILQ_NEXT(i, qentry);
+
+        /* The check can come back before the client thread that asked for it
+           is done with the client, so it might have to wait a bit. */
+        if(!i->c->busy) {
+            TAILQ_REMOVE(&w->auth_done, i, qentry);
+            TAILQ_INSERT_TAIL(&done, i, qentry);
+        }
+
+        i = tmp;
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+
+    while((i = TAILQ_FIRST(&done))) {
+        TAILQ_REMOVE(&done, i, qentry);
+        client_job(i->c, i);
+    }
+}
+
+static void *worker_thd(void *d) {
+    login_worker_t *w = (login_worker_t *)d;
+    int nfds;
+    struct timeval timeout;
+    fd_set readfds, writefds;
+    login_client_t *i, *tmp;
+    ssize_t sent;
+    char junk[64];
+    time_t now;
+
+    if(tdata_attach(&w->td)) {
+        pthread_exit(NULL);
+    }
+
+    debug(DBG_LOG, "Worker %d: Up and running\n", w->idx);
+
+    while(w->run) {
+        worker_take_pending(w);
+        worker_take_jobs(w);
+        worker_take_auth(w);
+
+        /* Clear the fd_sets so we can use them. */
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        timeout.tv_sec = WORKER_SELECT_TIMEOUT;
+        timeout.tv_usec = 0;
+        nfds = 0;
+
+        /* Fill the sockets into the fd_set so we can use select below. */
+        TAILQ_FOREACH(i, &w->clients, qentry) {
+            /* Leave anyone a client thread is working on alone. */
+            if(i->busy) {
+                continue;
+            }
+
+            /* Don't read anything more from a client while its password is
+               being checked, or once it is just waiting to be disconnected. */
+            if(!i->auth_pending && !i->close_time) {
+                FD_SET(i->sock, &readfds);
+            }
+
+            /* Make sure we get back around in time to disconnect them. */
+            if(i->close_time) {
+                timeout.tv_sec = CLIENT_CLOSE_WAIT;
+            }
+
+            /* Only add to the writing fd_set if we have something to write. */
+            if(i->sendbuf_cur) {
+                FD_SET(i->sock, &writefds);
+            }
+
+            nfds = nfds > i->sock ? nfds : i->sock;
+        }
+
+        FD_SET(w->pipes[0], &readfds);
+        nfds = nfds > w->pipes[0] ? nfds : w->pipes[0];
+
+        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
+            /* Empty out the pipe, the actual work for whatever woke us up gets
+               done at the top of the loop. */
+            if(FD_ISSET(w->pipes[0], &readfds)) {
+                while(read(w->pipes[0], junk, 64) > 0) {
+                }
+            }
+
+            /* Handle the client connections, if any. */
+            TAILQ_FOREACH(i, &w->clients, qentry) {
+                if(i->busy) {
+                    continue;
+                }
+
+                /* If we have anything to write, check if we can right now. */
+                if(FD_ISSET(i->sock, &writefds)) {
+                    if(i->sendbuf_cur) {
+                        sent = send(i->sock, i->sendbuf + i->sendbuf_start,
+                                    i->sendbuf_cur - i->sendbuf_start, 0);
+
+                        /* If we fail to send, and the error isn't EAGAIN,
+                           bail. */
+                        if(sent == -1) {
+                            if(errno != EAGAIN) {
+                                i->disconnected = 1;
+                            }
+                        }
+                        else {
+                            i->sendbuf_start += sent;
+
+                            /* If we've sent everything, free the buffer. */
+                            if(i->sendbuf_start == i->sendbuf_cur) {
+                                free(i->sendbuf);
+                                i->sendbuf = NULL;
+                                i->sendbuf_cur = 0;
+                                i->sendbuf_size = 0;
+                                i->sendbuf_start = 0;
+                            }
+                        }
+                    }
+                }
+
+                /* If this connection was trying to send us something, have
+                   one of the client threads deal with it. */
+                if(FD_ISSET(i->sock, &readfds)) {
+                    client_job(i, NULL);
+                }
+            }
+        }
+
+        /* Clean up any dead connections (its not safe to do a TAILQ_REMOVE in
+           the middle of a TAILQ_FOREACH, and destroy_connection does indeed
+           use TAILQ_REMOVE). */
+        now = time(NULL);
+        i = TAILQ_FIRST(&w->clients);
+        while(i) {
+            tmp = TAILQ_NEXT(i, qentry);
+
+            /* Anyone waiting to be disconnected goes once everything has been
+               sent to them, or once they've waited long enough. */
+            if(i->close_time && !i->busy &&
+               (!i->sendbuf_cur || now >= i->close_time)) {
+                i->disconnected = 1;
+            }
+
+            /* If a password check is still out for the client, or a client
+               thread is working on it, we have to wait for that to be done
+               before getting rid of them. */
+            if(i->disconnected && !i->auth_pending && !i->busy) {
+                destroy_connection(i);
+            }
+
+            i = tmp;
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+/* Start up the given number of worker threads. */
+int workers_start(int count) {
+    login_worker_t *w;
+    int i;
+
+    if(count < 1)
+        count = 1;
+    else if(count > MAX_WORKERS)
+        count = MAX_WORKERS;
+
+    debug(DBG_LOG, "Starting %d worker threads...\n", count);
+
+    for(i = 0; i < count; ++i) {
+        if(!(w = (login_worker_t *)malloc(sizeof(login_worker_t)))) {
+            debug(DBG_ERROR, "Cannot allocate memory for worker!\n");
+            return -1;
+        }
+
+        memset(w, 0, sizeof(login_worker_t));
+        TAILQ_INIT(&w->clients);
+        TAILQ_INIT(&w->pending);
+        TAILQ_INIT(&w->auth_done);
+        TAILQ_INIT(&w->jobs_done);
+        pthread_mutex_init(&w->mutex, NULL);
+        w->idx = i;
+        w->run = 1;
+
+        /* Make our pipe */
+        if(pipe(w->pipes) == -1) {
+            debug(DBG_ERROR, "Cannot create pipe for worker %d!\n", i);
+            pthread_mutex_destroy(&w->mutex);
+            free(w);
+            return -1;
+        }
+
+        fcntl(w->pipes[0], F_SETFL, O_NONBLOCK);
+        fcntl(w->pipes[1], F_SETFL, O_NONBLOCK);
+
+        if(tdata_init(&w->td, w)) {
+            goto err_pipes;
+        }
+
+        if(pthread_create(&w->thd, NULL, &worker_thd, w)) {
+            debug(DBG_ERROR, "Cannot start worker thread %d!\n", i);
+            tdata_cleanup(&w->td);
+            goto err_pipes;
+        }
+
+        workers[worker_count++] = w;
+    }
+
+    debug(DBG_LOG, "Starting %d client threads...\n", CLIENT_THREADS);
+    job_run = 1;
+
+    for(i = 0; i < CLIENT_THREADS; ++i) {
+        if(tdata_init(&job_td[i], NULL)) {
+            return -1;
+        }
+
+        if(pthread_create(&job_thds[i], NULL, &client_thd, &job_td[i])) {
+            debug(DBG_ERROR, "Cannot start client thread %d!\n", i);
+            tdata_cleanup(&job_td[i]);
+            return -1;
+        }
+
+        ++job_count;
+    }
+
+    return 0;
+
+err_pipes:
+    close(w->pipes[0]);
+    close(w->pipes[1]);
+    pthread_mutex_destroy(&w->mutex);
+    free(w);
+    return -1;
+}
+
+/* Stop all worker threads, disconnecting any clients they own. */
+void workers_stop(void) {
+    int i;
+    login_client_t *c;
+    auth_req_t *r;
+
+    /* Tell each thread to stop and wait for them all to actually do so. */
+    for(i = 0; i < worker_count; ++i) {
+        workers[i]->run = 0;
+        worker_wake(workers[i]);
+    }
+
+    for(i = 0; i < worker_count; ++i) {
+        pthread_join(workers[i]->thd, NULL);
+    }
+
+    /* Then the client threads. Anything they hadn't gotten to yet just gets
+       dropped, since everyone is about to be disconnected. */
+    pthread_mutex_lock(&job_mutex);
+    job_run = 0;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_mutex);
+
+    for(i = 0; i < job_count; ++i) {
+        pthread_join(job_thds[i], NULL);
+        tdata_cleanup(&job_td[i]);
+    }
+
+    job_count = 0;
+
+    while((c = TAILQ_FIRST(&jobs))) {
+        TAILQ_REMOVE(&jobs, c, jentry);
+        free(c->job_auth);
+    }
+
+    /* Disconnect anyone that is still around and clean up the workers. The
+       password checking threads must already be stopped by now. */
+    for(i = 0; i < worker_count; ++i) {
+        worker_take_pending(workers[i]);
+        worker_take_jobs(workers[i]);
+
+        while((r = TAILQ_FIRST(&workers[i]->auth_done))) {
+            TAILQ_REMOVE(&workers[i]->auth_done, r, qentry);
+            free(r);
+        }
+
+        while((c = TAILQ_FIRST(&workers[i]->clients))) {
+            destroy_connection(c);
+        }
+
+        tdata_cleanup(&workers[i]->td);
+        close(workers[i]->pipes[0]);
+        close(workers[i]->pipes[1]);
+        pthread_mutex_destroy(&workers[i]->mutex);
+        free(workers[i]);
+        workers[i] = NULL;
+    }
+
+    worker_count = 0;
+}
+
+/* Hand off a newly connected client to the least loaded worker thread. */
+void worker_add_client(login_client_t *c) {
+    login_worker_t *w = NULL;
+    int i;
+
+    for(i = 0; i < worker_count; ++i) {
+        if(!w || workers[i]->client_count < w->client_count) {
+            w = workers[i];
+        }
+    }
+
+    c->worker = w;
+
+    pthread_mutex_lock(&w->mutex);
+    TAILQ_INSERT_TAIL(&w->pending, c, qentry);
+    ++w->client_count;
+    pthread_mutex_unlock(&w->mutex);
+
+    /* Poke the worker so it starts listening to the new client right away. */
+    worker_wake(w);
+}
+
+void worker_auth_done(login_worker_t *w, auth_req_t *req) {
+    pthread_mutex_lock(&w->mutex);
+    TAILQ_INSERT_TAIL(&w->auth_done, req, qentry);
+    pthread_mutex_unlock(&w->mutex);
+
+    worker_wake(w);
+}
+
+/* Count up the clients connected to all of the workers. */
+uint32_t workers_client_count(void) {
+    uint32_t rv = 0;
+    int i;
+
+    for(i = 0; i < worker_count; ++i) {
+        pthread_mutex_lock(&workers[i]->mutex);
+        rv += workers[i]->client_count;
+        pthread_mutex_unlock(&workers[i]->mutex);
+    }
+
+    return rv;
+}
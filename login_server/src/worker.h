@@ -0,0 +1,114 @@
+/*
+    Sylverant Login Server
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include <sylverant/database.h>
+
+#include "login.h"
+#include "auth.h"
+
+/* The most worker threads we'll ever start up. */
+#define MAX_WORKERS 64
+
+/* How many threads handle clients' packets. The workers only wait on the
+   sockets and send out whatever is queued up. Anything a packet needs,
+   database queries included, is done on one of these, so a slow query only
+   holds up the client that made it, not everyone else on the same worker. */
+#define CLIENT_THREADS 8
+
+/* How long (in seconds) a worker waits on its sockets at most. Anything that
+   needs a worker's attention wakes it up through its pipe, so this is only a
+   backstop. */
+#define WORKER_SELECT_TIMEOUT 60
+
+struct login_worker;
+
+/* Per-thread data. None of the things in here are safe to share between
+   threads, so the main thread and each worker thread get their own copy. */
+typedef struct login_tdata {
+    sylverant_dbconn_t conn;
+    uint8_t sendbuf[65536];
+
+    /* The worker this data belongs to (NULL for the main thread). */
+    struct login_worker *worker;
+} login_tdata_t;
+
+typedef struct login_worker {
+    pthread_t thd;
+    int idx;
+    volatile int run;
+
+    /* Used to wake the thread up when it is handed a new client. */
+    int pipes[2];
+
+    /* The clients this worker owns. Only the worker itself touches this
+       list. */
+    struct client_queue clients;
+
+    /* New clients handed to this worker by the main thread that it hasn't
+       picked up yet, and the total count of clients. Protected by the
+       mutex. */
+    pthread_mutex_t mutex;
+    struct client_queue pending;
+    int client_count;
+
+    /* Finished password checks for clients this worker owns, and clients the
+       client threads are done with. Protected by the mutex. */
+    struct auth_queue auth_done;
+    struct client_queue jobs_done;
+
+    login_tdata_t td;
+} login_worker_t;
+
+/* Set up a set of per-thread data for the given worker (or NULL for a thread
+   that isn't a worker). */
+int tdata_init(login_tdata_t *td, login_worker_t *w);
+
+/* Make the given per-thread data the calling thread's own. */
+int tdata_attach(login_tdata_t *td);
+
+/* Clean up the per-thread data set up with tdata_init. */
+void tdata_cleanup(login_tdata_t *td);
+
+/* Grab the calling thread's per-thread data. */
+login_tdata_t *get_tdata(void);
+
+/* Grab the calling thread's packet buffer. */
+uint8_t *get_sendbuf(void);
+
+/* Start up the given number of worker threads. */
+int workers_start(int count);
+
+/* Stop all worker threads, disconnecting any clients they own. */
+void workers_stop(void);
+
+/* Hand off a newly connected client to the least loaded worker thread. */
+void worker_add_client(login_client_t *c);
+
+/* Hand a finished password check back to the worker that owns the client. */
+void worker_auth_done(login_worker_t *w, auth_req_t *req);
+
+/* Count up the clients connected to all of the workers. */
+uint32_t workers_client_count(void);
+
+#endif /* !WORKER_H */
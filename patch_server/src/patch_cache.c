@@ -0,0 +1,164 @@
+/*
+    Sylverant Patch Server
+
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <sylverant/debug.h>
+#include <sylverant/checksum.h>
+
+#include "patch_cache.h"
+
+static patch_map_t *map_file(const char *fn, const char *dir) {
+    char realfn[strlen(fn) + strlen(dir) + 2];
+    patch_map_t *rv;
+    struct stat st;
+    void *data = NULL;
+    uint32_t i, sz;
+    int fd;
+
+    sprintf(realfn, "%s/%s", dir, fn);
+
+    if((fd = open(realfn, O_RDONLY)) < 0) {
+        debug(DBG_WARN, "Cannot open patch file %s: %s\n", realfn,
+              strerror(errno));
+        return NULL;
+    }
+
+    if(fstat(fd, &st)) {
+        debug(DBG_WARN, "Cannot stat patch file %s: %s\n", realfn,
+              strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    /* The client can't deal with anything this big anyway. */
+    if(st.st_size > 0xFFFFFFFF) {
+        debug(DBG_WARN, "Patch file %s is too large\n", realfn);
+        close(fd);
+        return NULL;
+    }
+
+    /* An empty file can't be mapped, but there's nothing to map anyway. */
+    if(st.st_size) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if(data == MAP_FAILED) {
+            debug(DBG_WARN, "Cannot map patch file %s: %s\n", realfn,
+                  strerror(errno));
+            close(fd);
+            return NULL;
+        }
+    }
+
+    /* We don't need the descriptor once the file is mapped. */
+    close(fd);
+
+    if(!(rv = (patch_map_t *)malloc(sizeof(patch_map_t)))) {
+        debug(DBG_WARN, "Cannot allocate patch map: %s\n", strerror(errno));
+        goto err;
+    }
+
+    rv->data = (const uint8_t *)data;
+    rv->size = (uint32_t)st.st_size;
+    rv->chunk_count = (rv->size + CHUNK_MAX - 1) / CHUNK_MAX;
+    rv->crcs = NULL;
+
+    if(rv->chunk_count) {
+        rv->crcs = (uint32_t *)malloc(sizeof(uint32_t) * rv->chunk_count);
+
+        if(!rv->crcs) {
+            debug(DBG_WARN, "Cannot allocate patch chunk checksums: %s\n",
+                  strerror(errno));
+            free(rv);
+            goto err;
+        }
+    }
+
+    /* Figure out the checksum of each chunk now, rather than every time one is
+       sent to someone. */
+    for(i = 0; i < rv->chunk_count; ++i) {
+        sz = rv->size - i * CHUNK_MAX;
+
+        if(sz > CHUNK_MAX)
+            sz = CHUNK_MAX;
+
+        rv->crcs[i] = sylverant_crc32((uint8_t *)data + i * CHUNK_MAX, (int)sz);
+    }
+
+    return rv;
+
+err:
+    if(data)
+        munmap(data, (size_t)st.st_size);
+
+    return NULL;
+}
+
+static void map_queue(struct file_queue *q, const char *dir, int *count,
+                      uint64_t *bytes) {
+    patch_file_t *i;
+    patch_file_entry_t *ent;
+
+    TAILQ_FOREACH(i, q, qentry) {
+        for(ent = i->entries; ent; ent = ent->next) {
+            if(!(ent->map = map_file(ent->filename, dir)))
+                continue;
+
+            if(ent->map->size != ent->size) {
+                debug(DBG_WARN, "Patch file %s/%s is %u bytes, but the "
+                      "configuration says %u\n", dir, ent->filename,
+                      ent->map->size, ent->size);
+            }
+
+            ++*count;
+            *bytes += ent->map->size;
+        }
+    }
+}
+
+void patch_cache_load(patch_config_t *cfg) {
+    int count = 0;
+    uint64_t bytes = 0;
+
+    if(cfg->pc_dir)
+        map_queue(&cfg->pc_files, cfg->pc_dir, &count, &bytes);
+
+    if(cfg->bb_dir)
+        map_queue(&cfg->bb_files, cfg->bb_dir, &count, &bytes);
+
+    debug(DBG_LOG, "Mapped %d patch files (%llu bytes)\n", count,
+          (unsigned long long)bytes);
+}
+
+void patch_map_free(patch_map_t *m) {
+    if(!m)
+        return;
+
+    if(m->data)
+        munmap((void *)m->data, (size_t)m->size);
+
+    free(m->crcs);
+    free(m);
+}
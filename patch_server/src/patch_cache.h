@@ -0,0 +1,50 @@
+/*
+    Sylverant Patch Server
+
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PATCH_CACHE_H
+#define PATCH_CACHE_H
+
+#include <stdint.h>
+
+#include "patch_server.h"
+
+/* The largest piece of a file sent in one data packet. */
+#define CHUNK_MAX 24576
+
+/* A patch file mapped into memory, along with the checksum of each chunk that
+   will be sent of it. These are made when the configuration is loaded, so that
+   sending a chunk never has to touch the filesystem. Patch files should be
+   replaced by renaming a new file over the old one (not by writing into the old
+   one) and then sending a SIGHUP, since the old mapping stays in use until the
+   last client using the old configuration is done with it. Truncating a mapped
+   file can crash the server with a SIGBUS. */
+typedef struct patch_map {
+    const uint8_t *data;
+    uint32_t size;
+    uint32_t chunk_count;
+    uint32_t *crcs;
+} patch_map_t;
+
+/* Map every file in the configuration. Files that can't be mapped are left
+   alone (with a warning) and will be read from the disk when they're sent. */
+void patch_cache_load(patch_config_t *cfg);
+
+/* Unmap one file. */
+void patch_map_free(patch_map_t *m);
+
+#endif /* !PATCH_CACHE_H */
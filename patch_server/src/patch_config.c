@@ -30,6 +30,10 @@
 #include <sylverant/debug.h>
 
 #include "patch_server.h"
+#include "patch_cache.h"
+#include "patch_packets.h"
+#include "patch_verify.h"
+#include "patch_stats.h"
 
 #ifndef LIBXML_TREE_ENABLED
 #error You must have libxml2 with tree support built-in.
@@ -43,15 +47,30 @@ static void patch_free_entry(patch_file_t *e) {
     ent = e->entries;
     while(ent) {
         tmp = ent->next;
+        patch_map_free(ent->map);
         xmlFree(ent->filename);
         free(ent);
         ent = tmp;
     }
 
+    free(e->dir);
     xmlFree(e->filename);
     free(e);
 }
 
+/* Hook each file up to its counters. */
+static int attach_stats(struct file_queue *q, const char *ver) {
+    patch_file_t *i;
+
+    TAILQ_FOREACH(i, q, qentry) {
+        if(!(i->stats = patch_stats_file(ver, i->filename))) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int handle_server(xmlNode *n, patch_config_t *cur) {
     xmlChar *ip, *ip6;
     int rv;
@@ -230,6 +249,54 @@ err:
     return rv;
 }
 
+static int handle_transfer(xmlNode *n, patch_config_t *cfg) {
+    xmlChar *window, *rate;
+    long w;
+    int rv = 0;
+
+    /* Grab the attributes of the tag. */
+    window = xmlGetProp(n, XC"window");
+    rate = xmlGetProp(n, XC"rate");
+
+    if(!window) {
+        debug(DBG_ERROR, "Window not specified for transfer\n");
+        rv = -1;
+        goto err;
+    }
+
+    errno = 0;
+    w = strtol((char *)window, NULL, 0);
+
+    if(errno || w < 1 || w > PATCH_MAX_WINDOW) {
+        debug(DBG_ERROR, "Invalid transfer window on line %hu: %s\n",
+              n->line, (char *)window);
+        rv = -2;
+        goto err;
+    }
+
+    cfg->window = (int)w;
+
+    /* The rate is optional, and is given in KiB per second. */
+    if(rate) {
+        errno = 0;
+        w = strtol((char *)rate, NULL, 0);
+
+        if(errno || w < 0 || w > 0x3FFFFF) {
+            debug(DBG_ERROR, "Invalid transfer rate on line %hu: %s\n",
+                  n->line, (char *)rate);
+            rv = -3;
+            goto err;
+        }
+
+        cfg->rate = (uint32_t)w * 1024;
+    }
+
+err:
+    xmlFree(rate);
+    xmlFree(window);
+    return rv;
+}
+
 static int handle_clientfile(xmlNode *n, patch_file_t *f) {
     xmlChar *fn;
 
@@ -387,6 +454,7 @@ static int handle_patch(xmlNode *n, struct file_queue *q) {
     patch_file_t *file = NULL;
     patch_file_entry_t *ent, *ent2;
     int have_cfile = 0, have_file = 0, have_checksum = 0, have_size = 0;
+    char *bn;
 
     /* Grab the attributes we're expecting */
     enabled = xmlGetProp(n, XC"enabled");
@@ -597,6 +665,24 @@ static int handle_patch(xmlNode *n, struct file_queue *q) {
         goto err;
     }
 
+    /* Split the client's filename up into the directory and the file itself,
+       so that we don't have to do it for each client. */
+    if((bn = strrchr(file->filename, '/'))) {
+        file->dir = strndup(file->filename, bn - file->filename);
+        file->base = bn + 1;
+    }
+    else {
+        file->dir = strdup("");
+        file->base = file->filename;
+    }
+
+    if(!file->dir) {
+        debug(DBG_ERROR, "Cannot allocate space for patch directory\n"
+              "%s\n", strerror(errno));
+        rv = -21;
+        goto err;
+    }
+
     /* We've got everything, store it */
     TAILQ_INSERT_TAIL(q, file, qentry);
     rv = 0;
@@ -693,6 +779,8 @@ int patch_read_config(const char *fn, patch_config_t **cfg) {
 
     /* Clear out the config. */
     memset(rv, 0, sizeof(patch_config_t));
+    rv->window = PATCH_DEFAULT_WINDOW;
+    rv->refcnt = 1;
     TAILQ_INIT(&rv->pc_files);
     TAILQ_INIT(&rv->bb_files);
 
@@ -768,6 +856,12 @@ int patch_read_config(const char *fn, patch_config_t **cfg) {
                 goto err_doc;
             }
         }
+        else if(!xmlStrcmp(n->name, XC"transfer")) {
+            if(handle_transfer(n, rv)) {
+                irv = -11;
+                goto err_doc;
+            }
+        }
         else {
             debug(DBG_WARN, "Invalid Tag %s on line %hu\n", (char *)n->name,
                   n->line);
@@ -776,6 +870,16 @@ int patch_read_config(const char *fn, patch_config_t **cfg) {
         n = n->next;
     }
 
+    /* Build the indexes and file info packets for each version. */
+    if(patch_list_build(&rv->pc_files, &rv->pc_list) ||
+       patch_list_build(&rv->bb_files, &rv->bb_list) ||
+       patch_verify_build(&rv->pc_list) || patch_verify_build(&rv->bb_list) ||
+       attach_stats(&rv->pc_files, "PC") || attach_stats(&rv->bb_files, "BB")) {
+        debug(DBG_ERROR, "Cannot build patch lists\n");
+        irv = -12;
+        goto err_doc;
+    }
+
     *cfg = rv;
 
     /* Cleanup/error handling below... */
@@ -806,6 +910,10 @@ void patch_free_config(patch_config_t *cfg) {
         free(cfg->bb_welcome);
         xmlFree(cfg->pc_dir);
         xmlFree(cfg->bb_dir);
+        patch_verify_free(&cfg->pc_list);
+        patch_verify_free(&cfg->bb_list);
+        patch_list_free(&cfg->pc_list);
+        patch_list_free(&cfg->bb_list);
 
         /* Clean up the file queues */
         i = TAILQ_FIRST(&cfg->pc_files);
@@ -830,3 +938,21 @@ void patch_free_config(patch_config_t *cfg) {
         free(cfg);
     }
 }
+
+patch_config_t *patch_config_ref(patch_config_t *cfg) {
+    if(cfg) {
+        ++cfg->refcnt;
+    }
+
+    return cfg;
+}
+
+void patch_config_unref(patch_config_t *cfg) {
+    /* Free everything (including all the mapped files) when the last user of
+       this configuration is done with it. */
+    if(cfg && --cfg->refcnt == 0) {
+        patch_verify_log(&cfg->pc_list, "PC");
+        patch_verify_log(&cfg->bb_list, "BB");
+        patch_free_config(cfg);
+    }
+}
@@ -22,18 +22,19 @@
 #include <errno.h>
 #include <sys/socket.h>
 
+#include <sylverant/debug.h>
 #include <sylverant/checksum.h>
 
 #include "patch_server.h"
 #include "patch_packets.h"
-
-#define CHUNK_MAX 24576
+#include "patch_cache.h"
 
 static uint8_t sendbuf[65536];
 
 /* Send a raw packet away. */
 static int send_raw(patch_client_t *c, int len) {
     ssize_t rv, total = 0;
+    int size;
     void *tmp;
 
     /* Keep trying until the whole thing's sent. */
@@ -50,6 +51,8 @@ static int send_raw(patch_client_t *c, int len) {
 
             total += rv;
         }
+
+        c->bytes_sent += total;
     }
 
     rv = len - total;
@@ -60,18 +63,27 @@ static int send_raw(patch_client_t *c, int len) {
             memmove(c->sendbuf, c->sendbuf + c->sendbuf_start,
                     c->sendbuf_cur - c->sendbuf_start);
             c->sendbuf_cur -= c->sendbuf_start;
+            c->sendbuf_start = 0;
         }
 
-        /* See if we need to reallocate the buffer. */
+        /* See if we need to reallocate the buffer. Grow it by at least double
+           each time, since a client receiving file data will usually have a
+           whole window of chunks queued up in here. */
         if(c->sendbuf_cur + rv > c->sendbuf_size) {
-            tmp = realloc(c->sendbuf, c->sendbuf_cur + rv);
+            size = c->sendbuf_size * 2;
+
+            if(size < c->sendbuf_cur + rv) {
+                size = c->sendbuf_cur + rv;
+            }
+
+            tmp = realloc(c->sendbuf, size);
 
             /* If we can't allocate the space, bail. */
             if(tmp == NULL) {
                 return -1;
             }
 
-            c->sendbuf_size = c->sendbuf_cur + rv;
+            c->sendbuf_size = size;
             c->sendbuf = (unsigned char *)tmp;
         }
 
@@ -210,27 +222,200 @@ int send_chdir(patch_client_t *c, const char dir[]) {
     return send_raw(c, PATCH_SET_DIRECTORY_LENGTH);
 }
 
-/* Send a file information packet to the given client. */
-int send_file_info(patch_client_t *c, uint32_t idx, const char fn[]) {
-    patch_file_info_pkt *pkt = (patch_file_info_pkt *)sendbuf;
+/* Add a packet to the end of a patch list. */
+static int list_add(patch_list_t *l, const void *pkt, uint16_t len) {
+    uint32_t size;
+    uint8_t *tmp;
+
+    if(l->pkts_len + len > l->pkts_size) {
+        size = l->pkts_size ? l->pkts_size * 2 : 4096;
+
+        if(!(tmp = (uint8_t *)realloc(l->pkts, size))) {
+            return -1;
+        }
+
+        l->pkts = tmp;
+        l->pkts_size = size;
+    }
+
+    memcpy(l->pkts + l->pkts_len, pkt, len);
+    l->pkts_len += len;
+
+    return 0;
+}
+
+static int list_simple(patch_list_t *l, uint16_t type) {
+    pkt_header_t pkt;
+
+    pkt.pkt_len = LE16(PACKET_HEADER_LENGTH);
+    pkt.pkt_type = LE16(type);
+
+    return list_add(l, &pkt, PACKET_HEADER_LENGTH);
+}
+
+static int list_chdir(patch_list_t *l, const char dir[]) {
+    patch_chdir_pkt pkt;
+
+    /* Make sure the directory name will fit. */
+    if(strlen(dir) > 64) {
+        debug(DBG_ERROR, "Patch directory name too long: %s\n", dir);
+        return -1;
+    }
+
+    memset(&pkt, 0, PATCH_SET_DIRECTORY_LENGTH);
+    pkt.hdr.pkt_len = LE16(PATCH_SET_DIRECTORY_LENGTH);
+    pkt.hdr.pkt_type = LE16(PATCH_SET_DIRECTORY);
+    strncpy(pkt.dir, dir, 64);
+
+    return list_add(l, &pkt, PATCH_SET_DIRECTORY_LENGTH);
+}
+
+/* Add the packets needed to get the client from the directory cur to dst. This
+   works the same way as change_directory in patch_server.c. */
+static int list_change_dir(patch_list_t *l, const char cur[],
+                           const char dst[]) {
+    char *s1, *s2, *d1, *d2, *t1, *t2;
+    int rv = 0;
+
+    if(!strcmp(cur, dst)) {
+        return 0;
+    }
+
+    s1 = strdup(cur);
+    s2 = strdup(dst);
+
+    if(!s1 || !s2) {
+        rv = -1;
+        goto out;
+    }
+
+    t1 = strtok_r(s1, "/", &d1);
+    t2 = strtok_r(s2, "/", &d2);
+
+    while(t1 && t2 && !strcmp(t1, t2)) {
+        t1 = strtok_r(NULL, "/", &d1);
+        t2 = strtok_r(NULL, "/", &d2);
+    }
+
+    while(t1) {
+        if(list_simple(l, PATCH_ONE_DIR_UP)) {
+            rv = -1;
+            goto out;
+        }
+
+        t1 = strtok_r(NULL, "/", &d1);
+    }
+
+    while(t2) {
+        if(list_chdir(l, t2)) {
+            rv = -1;
+            goto out;
+        }
+
+        t2 = strtok_r(NULL, "/", &d2);
+    }
+
+out:
+    free(s1);
+    free(s2);
+
+    return rv;
+}
+
+static int list_file_info(patch_list_t *l, uint32_t idx, const char fn[]) {
+    patch_file_info_pkt pkt;
 
     /* Make sure the filename will fit. */
     if(strlen(fn) > 32) {
+        debug(DBG_ERROR, "Patch filename too long: %s\n", fn);
         return -1;
     }
 
-    /* Fill in the header, and copy the file name */
-    memset(pkt, 0, PATCH_FILE_INFO_LENGTH);
-    pkt->hdr.pkt_len = LE16(PATCH_FILE_INFO_LENGTH);
-    pkt->hdr.pkt_type = LE16(PATCH_FILE_INFO);
-    pkt->patch_id = LE32(idx);
-    strcpy(pkt->filename, fn);
+    memset(&pkt, 0, PATCH_FILE_INFO_LENGTH);
+    pkt.hdr.pkt_len = LE16(PATCH_FILE_INFO_LENGTH);
+    pkt.hdr.pkt_type = LE16(PATCH_FILE_INFO);
+    pkt.patch_id = LE32(idx);
+    strncpy(pkt.filename, fn, 32);
 
-    /* Encrypt the packet. */
-    CRYPT_CryptData(&c->server_cipher, pkt, PATCH_FILE_INFO_LENGTH, 1);
+    return list_add(l, &pkt, PATCH_FILE_INFO_LENGTH);
+}
 
-    /* Send the packet away. */
-    return send_raw(c, PATCH_FILE_INFO_LENGTH);
+int patch_list_build(struct file_queue *q, patch_list_t *l) {
+    patch_file_t *i;
+    const char *dir = "";
+
+    memset(l, 0, sizeof(patch_list_t));
+
+    TAILQ_FOREACH(i, q, qentry) {
+        ++l->count;
+    }
+
+    if(l->count) {
+        l->files = (patch_file_t **)malloc(sizeof(patch_file_t *) * l->count);
+
+        if(!l->files) {
+            return -1;
+        }
+    }
+
+    /* Start out with the initial chdir "." packet. */
+    if(list_chdir(l, ".")) {
+        return -1;
+    }
+
+    /* Add the appropriate packets for each patch file. */
+    l->count = 0;
+
+    TAILQ_FOREACH(i, q, qentry) {
+        if(list_change_dir(l, dir, i->dir) ||
+           list_file_info(l, l->count, i->base)) {
+            return -1;
+        }
+
+        l->files[l->count++] = i;
+        dir = i->dir;
+    }
+
+    /* Change back to the base directory. Tethealla always preceeds the done
+       packet with a one-directory up packet, so we probably should too. */
+    if(list_change_dir(l, dir, "") || list_simple(l, PATCH_ONE_DIR_UP) ||
+       list_simple(l, PATCH_INFO_FINISHED)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void patch_list_free(patch_list_t *l) {
+    free(l->files);
+    free(l->pkts);
+    memset(l, 0, sizeof(patch_list_t));
+}
+
+/* Send the list of files to check for patching to the client. */
+int send_file_list(patch_client_t *c, const patch_list_t *l) {
+    uint32_t pos = 0, len;
+
+    /* All of the packets are a multiple of 4 bytes long, so they can be
+       encrypted in as big of a block as will fit in the buffer. */
+    while(pos < l->pkts_len) {
+        len = l->pkts_len - pos;
+
+        if(len > sizeof(sendbuf)) {
+            len = sizeof(sendbuf);
+        }
+
+        memcpy(sendbuf, l->pkts + pos, len);
+        CRYPT_CryptData(&c->server_cipher, sendbuf, len, 1);
+
+        if(send_raw(c, (int)len)) {
+            return -1;
+        }
+
+        pos += len;
+    }
+
+    return 0;
 }
 
 /* Send a file-send information packet to the given client. */
@@ -274,15 +459,13 @@ int send_file_send(patch_client_t *c, uint32_t size, const char fn[]) {
     return send_raw(c, PATCH_FILE_SEND_LENGTH);
 }
 
-/* Send a part of a file to the given client (dividing it into chunks). */
-int send_file_chunk(patch_client_t *c, const char fn[], const char dir[]) {
+/* Read a chunk of a file that isn't in the patch cache from the disk. Returns 1
+   if this was the end of the file, 0 if not, or -1 on error. */
+static int read_chunk(patch_client_t *c, const char fn[], const char dir[],
+                      uint32_t *sz, uint32_t *cks) {
     char realfn[strlen(fn) + strlen(dir) + 2];
     FILE *fp;
-    uint32_t sz;
-    patch_data_send_pkt *pkt = (patch_data_send_pkt *)sendbuf;
-    uint32_t cks;
-    uint16_t len;
-    int rv = 0;
+    int rv;
 
     /* Open up the file */
     sprintf(realfn, "%s/%s", dir, fn);
@@ -295,16 +478,56 @@ int send_file_chunk(patch_client_t *c, const char fn[], const char dir[]) {
     /* Move to where we need to be to send the current chunk. */
     fseek(fp, c->cur_pos, SEEK_SET);
 
-    /* Read the data from the file, and calculate the checksum and length. */
-    sz = (uint32_t)fread(sendbuf + PATCH_DATA_SEND_LENGTH, 1, CHUNK_MAX, fp);
+    /* Read the data from the file, and calculate the checksum. */
+    *sz = (uint32_t)fread(sendbuf + PATCH_DATA_SEND_LENGTH, 1, CHUNK_MAX, fp);
 
     /* If we don't have anything, there's been some kind of error... */
-    if(sz == 0) {
+    if(*sz == 0) {
         fclose(fp);
         return -1;
     }
 
-    cks = sylverant_crc32(sendbuf + PATCH_DATA_SEND_LENGTH, (int)sz);
+    *cks = sylverant_crc32(sendbuf + PATCH_DATA_SEND_LENGTH, (int)*sz);
+
+    /* Figure out if we've read the end of the file. */
+    rv = !!feof(fp);
+    fclose(fp);
+
+    return rv;
+}
+
+/* Send a part of a file to the given client (dividing it into chunks). */
+int send_file_chunk(patch_client_t *c, patch_file_entry_t *ent,
+                    const char dir[]) {
+    patch_map_t *m = ent->map;
+    uint32_t sz;
+    patch_data_send_pkt *pkt = (patch_data_send_pkt *)sendbuf;
+    uint32_t cks;
+    uint16_t len;
+    int rv = 0;
+
+    if(m) {
+        /* If we don't have anything, there's been some kind of error... */
+        if((uint32_t)c->cur_pos >= m->size) {
+            return -1;
+        }
+
+        /* Grab the chunk straight out of the mapping. The checksum was already
+           worked out when the file was mapped. */
+        sz = m->size - (uint32_t)c->cur_pos;
+
+        if(sz > CHUNK_MAX) {
+            sz = CHUNK_MAX;
+        }
+
+        memcpy(sendbuf + PATCH_DATA_SEND_LENGTH, m->data + c->cur_pos, sz);
+        cks = m->crcs[c->cur_pos / CHUNK_MAX];
+        rv = ((uint32_t)c->cur_pos + sz == m->size);
+    }
+    else if((rv = read_chunk(c, ent->filename, dir, &sz, &cks)) < 0) {
+        return -1;
+    }
+
     len = ((uint16_t)sz + PATCH_DATA_SEND_LENGTH);
 
     /* Round to a nice even 4-byte boundary. */
@@ -324,7 +547,6 @@ int send_file_chunk(patch_client_t *c, const char fn[], const char dir[]) {
 
     /* Send the chunk away. */
     if(send_raw(c, len)) {
-        fclose(fp);
         return -2;
     }
 
@@ -332,12 +554,6 @@ int send_file_chunk(patch_client_t *c, const char fn[], const char dir[]) {
     ++c->cur_chunk;
     c->cur_pos += sz;
 
-    /* Figure out if we've read the end of the file. */
-    rv = !!feof(fp);
-
-    /* We're done, close the file, and return success. */
-    fclose(fp);
-
     return rv;
 }
 
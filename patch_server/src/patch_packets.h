@@ -194,8 +194,15 @@ int send_redirect6(patch_client_t *c, const uint8_t ip[16], uint16_t port);
 /* Send a change directory packet to the given client. */
 int send_chdir(patch_client_t *c, const char dir[]);
 
-/* Send a file information packet to the given client. */
-int send_file_info(patch_client_t *c, uint32_t idx, const char fn[]);
+/* Build the list of packets asking the client about each file in the queue,
+   along with the index of the files. */
+int patch_list_build(struct file_queue *q, patch_list_t *l);
+
+/* Free a list made by patch_list_build. */
+void patch_list_free(patch_list_t *l);
+
+/* Send the list of files to check for patching to the client. */
+int send_file_list(patch_client_t *c, const patch_list_t *l);
 
 /* Send a file-send information packet to the given client. */
 int send_send_info(patch_client_t *c, uint32_t size, uint32_t files);
@@ -204,7 +211,8 @@ int send_send_info(patch_client_t *c, uint32_t size, uint32_t files);
 int send_file_send(patch_client_t *c, uint32_t size, const char fn[]);
 
 /* Send a part of a file to the given client (dividing it into chunks). */
-int send_file_chunk(patch_client_t *c, const char fn[], const char dir[]);
+int send_file_chunk(patch_client_t *c, patch_file_entry_t *ent,
+                    const char dir[]);
 
 /* Send a file done packet to the given client. */
 int send_file_done(patch_client_t *c);
@@ -36,12 +36,12 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <setjmp.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
@@ -53,17 +53,21 @@
 
 #include "patch_packets.h"
 #include "patch_server.h"
+#include "patch_cache.h"
+#include "patch_verify.h"
+#include "patch_stats.h"
 
 #ifdef ENABLE_IPV6
-#define NUM_PORTS 10
+#define NUM_PORTS 12
 #else
-#define NUM_PORTS 5
+#define NUM_PORTS 6
 #endif
 
 /* The ports to listen on. */
 #define PC_PATCH_PORT   10000
 #define PC_DATA_PORT    10001
 #define WEB_PORT        10002
+#define METRICS_PORT    10004
 #define BB_PATCH_PORT   11000
 #define BB_DATA_PORT    11001
 
@@ -71,12 +75,14 @@ static const int ports[NUM_PORTS][3] = {
     { AF_INET , PC_PATCH_PORT, CLIENT_TYPE_PC_PATCH },
     { AF_INET , PC_DATA_PORT , CLIENT_TYPE_PC_DATA  },
     { AF_INET , WEB_PORT     , CLIENT_TYPE_WEB      },
+    { AF_INET , METRICS_PORT , CLIENT_TYPE_METRICS  },
     { AF_INET , BB_PATCH_PORT, CLIENT_TYPE_BB_PATCH },
     { AF_INET , BB_DATA_PORT , CLIENT_TYPE_BB_DATA  },
 #ifdef ENABLE_IPV6
     { AF_INET6, PC_PATCH_PORT, CLIENT_TYPE_PC_PATCH },
     { AF_INET6, PC_DATA_PORT , CLIENT_TYPE_PC_DATA  },
     { AF_INET6, WEB_PORT     , CLIENT_TYPE_WEB      },
+    { AF_INET6, METRICS_PORT , CLIENT_TYPE_METRICS  },
     { AF_INET6, BB_PATCH_PORT, CLIENT_TYPE_BB_PATCH },
     { AF_INET6, BB_DATA_PORT , CLIENT_TYPE_BB_DATA  }
 #endif
@@ -87,18 +93,74 @@ static patch_config_t *cfg;
 static struct client_queue clients = TAILQ_HEAD_INITIALIZER(clients);
 static int client_count = 0;
 
-static sigjmp_buf jmpbuf;
-static volatile sig_atomic_t rehash = 0;
-static volatile sig_atomic_t canjump = 0;
 static int dont_daemonize = 0;
 
-/* Forward declaration... */
-static void rehash_files();
+/* The epoll instance the main loop waits on, and the signalfd that SIGHUP is
+   delivered to. */
+static int epfd = -1;
+static int sigfd = -1;
 
-/* Create a new connection, storing it in the list of clients. */
+/* Clients, indexed by their socket. */
+static patch_client_t **fd_clients = NULL;
+static int fd_clients_size = 0;
+
+/* Clients that have used up their sending budget. */
+static struct client_queue throttled = TAILQ_HEAD_INITIALIZER(throttled);
+
+/* Web clients asking for the metrics. */
+static int web_clients = 0;
+
+/* How long to wait before checking on throttled clients (in milliseconds), and
+   how often to work out the transfer rate (in seconds). */
+#define THROTTLE_CHECK_MS   100
+#define STATS_INTERVAL      60
+
+/* How big a request we'll take from a web client, and how long (in seconds) we
+   give it to send the whole thing. */
+#define WEB_MAX_REQUEST     4096
+#define WEB_TIMEOUT         10
+
+static double now_secs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/* Work out which events we need to know about for the client, and let epoll
+   know if that has changed. */
+static int update_events(patch_client_t *c) {
+    struct epoll_event ev;
+    uint32_t events = c->close_after_send ? 0 : EPOLLIN;
+
+    /* Only ask about writing if we have something to send. */
+    if(c->sendbuf_cur || (c->sending_data && !c->throttled)) {
+        events |= EPOLLOUT;
+    }
+
+    if(events == c->events) {
+        return 0;
+    }
+
+    ev.events = events;
+    ev.data.fd = c->sock;
+
+    if(epoll_ctl(epfd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->sock,
+                 &ev)) {
+        debug(DBG_WARN, "epoll_ctl: %s\n", strerror(errno));
+        return -1;
+    }
+
+    c->events = events;
+    return 0;
+}
+
+/* Create a new connection, storing it in the list of clients. The client holds
+   onto the current configuration until it disconnects, so that reloading the
+   configuration doesn't pull the files out from under it. */
 static patch_client_t *create_connection(int sock, int type,
                                          struct sockaddr *ip, socklen_t size) {
-    patch_client_t *rv;
+    patch_client_t *rv, **tmp;
     uint32_t svect, cvect;
 
     /* Allocate the space for the new client. */
@@ -110,6 +172,14 @@ static patch_client_t *create_connection(int sock, int type,
 
     memset(rv, 0, sizeof(patch_client_t));
 
+    /* Don't let a slow client block everyone else when we're sending to it,
+       anything that doesn't fit gets queued up in its send buffer. */
+    if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        free(rv);
+        return NULL;
+    }
+
     /* Store basic parameters in the client structure. */
     rv->sock = sock;
     rv->type = type;
@@ -120,16 +190,45 @@ static patch_client_t *create_connection(int sock, int type,
         rv->is_ipv6 = 1;
     }
 
-    /* Generate the encryption keys for the client and server. */
-    cvect = (uint32_t)genrand_int32();
-    svect = (uint32_t)genrand_int32();
+    rv->connect_time = now_secs();
 
-    CRYPT_CreateKeys(&rv->client_cipher, &cvect, CRYPT_PC);
-    CRYPT_CreateKeys(&rv->server_cipher, &svect, CRYPT_PC);
+    /* Make sure we have space to find the client by its socket. */
+    if(sock >= fd_clients_size) {
+        tmp = (patch_client_t **)realloc(fd_clients, sizeof(patch_client_t *) *
+                                         (sock + 64));
 
-    /* Send the client the welcome packet, or die trying. */
-    if(send_welcome(rv, svect, cvect)) {
-        close(sock);
+        if(!tmp) {
+            free(rv);
+            return NULL;
+        }
+
+        memset(tmp + fd_clients_size, 0, sizeof(patch_client_t *) *
+               (sock + 64 - fd_clients_size));
+        fd_clients = tmp;
+        fd_clients_size = sock + 64;
+    }
+
+    /* Web clients don't speak the patch protocol, so they don't get any keys
+       or a welcome packet. */
+    if(type != CLIENT_TYPE_METRICS) {
+        /* Generate the encryption keys for the client and server. */
+        cvect = (uint32_t)genrand_int32();
+        svect = (uint32_t)genrand_int32();
+
+        CRYPT_CreateKeys(&rv->client_cipher, &cvect, CRYPT_PC);
+        CRYPT_CreateKeys(&rv->server_cipher, &svect, CRYPT_PC);
+
+        /* Send the client the welcome packet, or die trying. */
+        if(send_welcome(rv, svect, cvect)) {
+            free(rv->sendbuf);
+            free(rv);
+            return NULL;
+        }
+    }
+
+    /* Start watching for data from the client. */
+    if(update_events(rv)) {
+        free(rv->sendbuf);
         free(rv);
         return NULL;
     }
@@ -137,10 +236,21 @@ static patch_client_t *create_connection(int sock, int type,
     /* Initialize the file list */
     TAILQ_INIT(&rv->files);
 
+    rv->cfg = patch_config_ref(cfg);
+    rv->tokens = (double)rv->cfg->window * CHUNK_MAX;
+    rv->last_refill = now_secs();
+
     /* Insert it at the end of our list, and we're done. */
     TAILQ_INSERT_TAIL(&clients, rv, qentry);
+    fd_clients[sock] = rv;
+    patch_stats.queued_bytes += rv->sendbuf_cur;
 
-    ++client_count;
+    if(type == CLIENT_TYPE_METRICS) {
+        ++web_clients;
+    }
+    else {
+        ++client_count;
+    }
 
     return rv;
 }
@@ -151,6 +261,18 @@ static void destroy_connection(patch_client_t *c) {
 
     TAILQ_REMOVE(&clients, c, qentry);
 
+    if(c->throttled) {
+        TAILQ_REMOVE(&throttled, c, tqentry);
+    }
+
+    if(c->sending_data) {
+        --patch_stats.active_transfers;
+    }
+
+    patch_stats.queued_bytes -= c->sendbuf_cur - c->sendbuf_start;
+    patch_stats.bytes_sent += c->bytes_sent - c->bytes_counted;
+    fd_clients[c->sock] = NULL;
+
     i = TAILQ_FIRST(&c->files);
 
     while(i) {
@@ -171,9 +293,15 @@ static void destroy_connection(patch_client_t *c) {
         free(c->sendbuf);
     }
 
-    free(c);
+    if(c->type == CLIENT_TYPE_METRICS) {
+        --web_clients;
+    }
+    else {
+        --client_count;
+    }
 
-    --client_count;
+    patch_config_unref(c->cfg);
+    free(c);
 }
 
 /* Send the patch packets needed to change the client's current directory to the
@@ -231,147 +359,41 @@ out:
     return rv;
 }
 
-/* Send the list of files to check for patching to the client. */
-static int send_file_list(patch_client_t *c, struct file_queue *q) {
-    uint32_t filenum = 0;
-    patch_file_t *i;
-    char dir[PATH_MAX], dir2[PATH_MAX];
-    char *bn;
-    int dlen;
-
-    /* Send the initial chdir "." packet */
-    if(send_chdir(c, ".")) {
-        return -1;
-    }
-
-    strcpy(dir, "");
-
-    /* Loop through each patch file, sending the appropriate packets for it. */
-    TAILQ_FOREACH(i, q, qentry) {
-        bn = strrchr(i->filename, '/');
-
-        if(bn) {
-            bn += 1;
-            dlen = strlen(i->filename) - strlen(bn) - 1;
-        }
-        else {
-            dlen = 0;
-            bn = i->filename;
-        }
-
-        /* Copy over the directory that the file exists in. */
-        strncpy(dir2, i->filename, dlen);
-        dir2[dlen] = 0;
-
-        /* Change the directory the client is in, if appropriate. */
-        if(change_directory(c, dir, dir2)) {
-            return -3;
-        }
-
-        /* Send the file info request. */
-        if(send_file_info(c, filenum, bn)) {
-            return -2;
-        }
-
-        /* We're now in dir2, so save it for the next pass. */
-        strcpy(dir, dir2);
-        ++filenum;
-    }
-
-    /* Change back to the base directory. */
-    if(change_directory(c, dir, "")) {
-        return -3;
-    }
-
-    /* Tethealla always preceeds the done packet with a one-directory up packet,
-       so we probably should too. */
-    if(send_simple(c, PATCH_ONE_DIR_UP)) {
-        return -1;
-    }
-
-    /* Send the file list complete marker. */
-    if(send_simple(c, PATCH_INFO_FINISHED)) {
-        return -1;
-    }
-
-    return 0;
-}
-
-/* Fetch the given patch index. */
-static patch_file_t *fetch_patch(uint32_t idx, struct file_queue *q) {
-    patch_file_t *i = TAILQ_FIRST(q);
-
-    while(i && idx) {
-        i = TAILQ_NEXT(i, qentry);
-        --idx;
-    }
-
-    return i;
-}
-
 /* Save the file info sent by the client in their list. */
 static int store_file(patch_client_t *c, patch_file_info_reply *pkt) {
     patch_cfile_t *n;
-    patch_file_t *f;
     patch_file_entry_t *ent;
+    patch_list_t *l;
+    uint32_t idx = LE32(pkt->patch_id);
 
     if(c->type == CLIENT_TYPE_PC_DATA) {
-        f = fetch_patch(LE32(pkt->patch_id), &cfg->pc_files);
+        l = &c->cfg->pc_list;
     }
     else {
-        f = fetch_patch(LE32(pkt->patch_id), &cfg->bb_files);
+        l = &c->cfg->bb_list;
     }
 
-    if(!f) {
+    if(idx >= l->count) {
         return -1;
     }
 
     /* Add it to the list only if we need to send it. */
-    if(f->flags & PATCH_FLAG_NO_IF) {
-        /* With a single entry, this is easy... */
-        if(f->entries->checksum != LE32(pkt->checksum) ||
-           f->entries->size != LE32(pkt->size)) {
-            n = (patch_cfile_t *)malloc(sizeof(patch_cfile_t));
-
-            if(!n) {
-                perror("malloc");
-                return -1;
-            }
+    ent = patch_verify(l, idx, LE32(pkt->checksum), LE32(pkt->size));
 
-            /* Store the file info. */
-            n->file = f;
-            n->ent = f->entries;
+    if(ent) {
+        n = (patch_cfile_t *)malloc(sizeof(patch_cfile_t));
 
-            /* Add it to the list. */
-            TAILQ_INSERT_TAIL(&c->files, n, qentry);
+        if(!n) {
+            perror("malloc");
+            return -1;
         }
-    }
-    else {
-        ent = f->entries;
-
-        while(ent) {
-            if(ent->client_checksum == LE32(pkt->checksum) ||
-               ((f->flags & PATCH_FLAG_HAS_ELSE) && !ent->next &&
-                 (ent->checksum != LE32(pkt->checksum) ||
-                  ent->size != LE32(pkt->size)))) {
-                n = (patch_cfile_t *)malloc(sizeof(patch_cfile_t));
-
-                if(!n) {
-                    perror("malloc");
-                    return -1;
-                }
-
-                /* Store the file info. */
-                n->file = f;
-                n->ent = ent;
 
-                /* Add it to the list. */
-                TAILQ_INSERT_TAIL(&c->files, n, qentry);
-                break;
-            }
+        /* Store the file info. */
+        n->file = l->files[idx];
+        n->ent = ent;
 
-            ent = ent->next;
-        }
+        /* Add it to the list. */
+        TAILQ_INSERT_TAIL(&c->files, n, qentry);
     }
 
     return 0;
@@ -381,18 +403,34 @@ static int store_file(patch_client_t *c, patch_file_info_reply *pkt) {
 static int handle_list_done(patch_client_t *c) {
     uint32_t files = 0, size = 0;
     patch_cfile_t *i, *tmp;
-    char dir[PATH_MAX], dir2[PATH_MAX];
-    char *bn;
-    int dlen;
+    const char *dir = "";
+    int rv, pos = c->cur_pos;
+    patch_list_t *l;
+    double start;
+
+    if(c->type == CLIENT_TYPE_PC_DATA) {
+        l = &c->cfg->pc_list;
+    }
+    else {
+        l = &c->cfg->bb_list;
+    }
 
-    /* If we don't have anything to send, send out the send done packet. */
+    /* If we don't have anything to send, the client is already up to date, so
+       send out the send done packet. */
     if(TAILQ_EMPTY(&c->files)) {
+        if(!c->sending_data) {
+            ++l->clients_current;
+        }
+
         goto done;
     }
 
     /* If we've got files to send and we haven't started yet, start out. */
     if(c->sending_data == 0) {
         c->sending_data = 1;
+        c->xfer_start = now_secs();
+        c->xfer_bytes = c->bytes_sent;
+        ++l->clients_outdated;
 
         /* Look through the list, and tabulate the data we need to send. */
         TAILQ_FOREACH(i, &c->files, qentry) {
@@ -418,23 +456,8 @@ static int handle_list_done(patch_client_t *c) {
 
     /* Figure out if this is the first file to go, and if we need to figure out
        the current directory. */
-    if(c->sending_data == 1) {
-        strcpy(dir, "");
-    }
-    else if(c->sending_data == 2) {
-        bn = strrchr(i->file->filename, '/');
-
-        if(bn) {
-            bn += 1;
-            dlen = strlen(i->file->filename) - strlen(bn) - 1;
-        }
-        else {
-            bn = i->file->filename;
-            dlen = 0;
-        }
-
-        strncpy(dir, i->file->filename, dlen);
-        dir[dlen] = 0;
+    if(c->sending_data == 2) {
+        dir = i->file->dir;
 
         /* Figure out what the file is we're going to send. */
         tmp = TAILQ_NEXT(i, qentry);
@@ -446,47 +469,48 @@ static int handle_list_done(patch_client_t *c) {
     }
     /* If we're just starting on a file, change the directory if appropriate. */
     if(c->sending_data < 3 && i) {
-        bn = strrchr(i->file->filename, '/');
-
-        if(bn) {
-            bn += 1;
-            dlen = strlen(i->file->filename) - strlen(bn) - 1;
-        }
-        else {
-            bn = i->file->filename;
-            dlen = 0;
-        }
-
-        /* Copy over the directory that the file exists in. */
-        strncpy(dir2, i->file->filename, dlen);
-        dir2[dlen] = 0;
-
         /* Change the directory the client is in, if appropriate. */
-        if(change_directory(c, dir, dir2)) {
+        if(change_directory(c, dir, i->file->dir)) {
             return -3;
         }
 
         c->sending_data = 3;
 
         /* Send the file header. */
-        return send_file_send(c, i->ent->size, bn);
+        return send_file_send(c, i->ent->size, i->file->base);
     }
 
     /* If we've got this far and we have a file to send still, send the current
        chunk of the file. */
     if(i) {
+        start = now_secs();
+
         if(c->type == CLIENT_TYPE_PC_DATA) {
-            dlen = send_file_chunk(c, i->ent->filename, cfg->pc_dir);
+            rv = send_file_chunk(c, i->ent, c->cfg->pc_dir);
+        }
+        else {
+            rv = send_file_chunk(c, i->ent, c->cfg->bb_dir);
+        }
+
+        patch_stats_chunk(now_secs() - start);
+
+        if(i->ent->map) {
+            ++patch_stats.cache_hits;
         }
         else {
-            dlen = send_file_chunk(c, i->ent->filename, cfg->bb_dir);
+            ++patch_stats.cache_misses;
         }
 
-        if(dlen < 0) {
+        if(rv >= 0) {
+            i->file->stats->bytes_sent += c->cur_pos - pos;
+            ++i->file->stats->chunks_sent;
+        }
+
+        if(rv < 0) {
             /* Something went wrong, bail. */
             return -4;
         }
-        else if(dlen > 0) {
+        else if(rv > 0) {
             /* We're done with this file. */
             c->sending_data = 2;
             c->cur_chunk = 0;
@@ -510,10 +534,36 @@ static int handle_list_done(patch_client_t *c) {
     }
 
 done:
+    /* Keep track of how fast the client got everything. This counts what was
+       handed to the kernel, so the last window of it may still be in flight. */
+    if(c->sending_data) {
+        patch_stats_transfer(c->bytes_sent + c->sendbuf_cur -
+                             c->sendbuf_start - c->xfer_bytes,
+                             now_secs() - c->xfer_start);
+    }
+
     c->sending_data = 0;
     return send_simple(c, PATCH_SEND_DONE);
 }
 
+/* Queue up file data for a client until it has a full window of it waiting to
+   go out, so that there's always something in flight on slow links. This is
+   also bounded by the number of packets made, so that one client with a fast
+   link can't keep us here forever. */
+static int fill_window(patch_client_t *c) {
+    int window = c->cfg->window * CHUNK_MAX;
+    int count = c->cfg->window;
+
+    while(c->sending_data && count-- > 0 &&
+          c->sendbuf_cur - c->sendbuf_start < window) {
+        if(handle_list_done(c)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 /* Print information about this program to stdout. */
 static void print_program_info() {
     printf("Sylverant Patch Server version %s\n", VERSION);
@@ -593,13 +643,17 @@ static void load_config() {
         }
         else {
             debug(DBG_ERROR, "Using old configuration\n");
+            return;
         }
     }
 
-    if(cfg) {
-        patch_free_config(cfg);
-    }
+    /* Map all the patch files in, so that we don't have to read them from the
+       disk over and over while clients are downloading them. */
+    patch_cache_load(tmp);
 
+    /* Clients that are already connected keep using the old configuration.
+       It'll go away when the last of them does. */
+    patch_config_unref(cfg);
     cfg = tmp;
 }
 
@@ -615,13 +669,14 @@ static int process_patch_packet(patch_client_t *c, pkt_header_t *pkt) {
         case PATCH_LOGIN_TYPE:
             /* TODO: Process login? */
             if(c->type == CLIENT_TYPE_PC_PATCH) {
-                if(send_message(c, cfg->pc_welcome, cfg->pc_welcome_size)) {
+                if(send_message(c, c->cfg->pc_welcome,
+                                c->cfg->pc_welcome_size)) {
                     return -2;
                 }
 
 #ifdef ENABLE_IPV6
                 if(c->is_ipv6) {
-                    if(send_redirect6(c, cfg->server_ip6,
+                    if(send_redirect6(c, c->cfg->server_ip6,
                                       htons(PC_DATA_PORT))) {
                         return -2;
                     }
@@ -631,18 +686,19 @@ static int process_patch_packet(patch_client_t *c, pkt_header_t *pkt) {
                 }
 #endif
 
-                if(send_redirect(c, cfg->server_ip, htons(PC_DATA_PORT))) {
+                if(send_redirect(c, c->cfg->server_ip, htons(PC_DATA_PORT))) {
                     return -2;
                 }
             }
             else {
-                if(send_message(c, cfg->bb_welcome, cfg->bb_welcome_size)) {
+                if(send_message(c, c->cfg->bb_welcome,
+                                c->cfg->bb_welcome_size)) {
                     return -2;
                 }
 
 #ifdef ENABLE_IPV6
                 if(c->is_ipv6) {
-                    if(send_redirect6(c, cfg->server_ip6,
+                    if(send_redirect6(c, c->cfg->server_ip6,
                                       htons(BB_DATA_PORT))) {
                         return -2;
                     }
@@ -652,7 +708,7 @@ static int process_patch_packet(patch_client_t *c, pkt_header_t *pkt) {
                 }
 #endif
 
-                if(send_redirect(c, cfg->server_ip, htons(BB_DATA_PORT))) {
+                if(send_redirect(c, c->cfg->server_ip, htons(BB_DATA_PORT))) {
                     return -2;
                 }
             }
@@ -686,12 +742,12 @@ static int process_data_packet(patch_client_t *c, pkt_header_t *pkt) {
 
             /* Send the list of patches. */
             if(c->type == CLIENT_TYPE_PC_DATA) {
-                if(send_file_list(c, &cfg->pc_files)) {
+                if(send_file_list(c, &c->cfg->pc_list)) {
                     return -2;
                 }
             }
             else {
-                if(send_file_list(c, &cfg->bb_files)) {
+                if(send_file_list(c, &c->cfg->bb_list)) {
                     return -2;
                 }
             }
@@ -719,12 +775,104 @@ static int process_data_packet(patch_client_t *c, pkt_header_t *pkt) {
     return 0;
 }
 
+/* Queue up the reply to a web client. The client is disconnected once all of it
+   has been sent. */
+static int send_web_reply(patch_client_t *c, const char *status,
+                          const char *body, size_t len) {
+    char hdr[256];
+    int hlen;
+
+    hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %lu\r\n"
+                    "Connection: close\r\n\r\n", status,
+                    (unsigned long)len);
+
+    if(!(c->sendbuf = (unsigned char *)malloc(hlen + len))) {
+        debug(DBG_WARN, "malloc: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memcpy(c->sendbuf, hdr, hlen);
+    memcpy(c->sendbuf + hlen, body, len);
+    c->sendbuf_size = c->sendbuf_cur = hlen + len;
+    c->sendbuf_start = 0;
+    c->close_after_send = 1;
+
+    return 0;
+}
+
+/* Read a request from a web client, and answer it with the metrics once all of
+   it is here. Anything but a GET of the metrics gets a 404. */
+static int read_web_request(patch_client_t *c) {
+    ssize_t sz;
+    char *path, *end, *out;
+    size_t len;
+    int rv;
+
+    /* We stop reading once we've answered, so this is an error or hangup. */
+    if(c->close_after_send) {
+        return -1;
+    }
+
+    if(!c->recvbuf &&
+       !(c->recvbuf = (unsigned char *)malloc(WEB_MAX_REQUEST + 1))) {
+        debug(DBG_WARN, "malloc: %s\n", strerror(errno));
+        return -1;
+    }
+
+    sz = recv(c->sock, c->recvbuf + c->pkt_cur, WEB_MAX_REQUEST - c->pkt_cur,
+              0);
+
+    if(sz <= 0) {
+        if(sz == -1)
+            debug(DBG_WARN, "recv: %s\n", strerror(errno));
+        return -1;
+    }
+
+    c->pkt_cur += sz;
+    c->recvbuf[c->pkt_cur] = 0;
+
+    /* Wait for the rest of the headers, unless there isn't room for them. */
+    if(!strstr((char *)c->recvbuf, "\r\n\r\n") &&
+       !strstr((char *)c->recvbuf, "\n\n")) {
+        return c->pkt_cur < WEB_MAX_REQUEST ? 0 : -1;
+    }
+
+    path = (char *)c->recvbuf + 4;
+
+    if(strncmp((char *)c->recvbuf, "GET ", 4) ||
+       !(end = strpbrk(path, " ?\r\n"))) {
+        return send_web_reply(c, "404 Not Found", "Not found\n", 10);
+    }
+
+    *end = 0;
+
+    if(strcmp(path, "/") && strcmp(path, "/metrics")) {
+        return send_web_reply(c, "404 Not Found", "Not found\n", 10);
+    }
+
+    if(patch_stats_render(client_count, &out, &len)) {
+        debug(DBG_WARN, "Cannot render patch server metrics\n");
+        return -1;
+    }
+
+    rv = send_web_reply(c, "200 OK", out, len);
+    free(out);
+
+    return rv;
+}
+
 /* Read data from a client that is connected to either port. */
 static int read_from_client(patch_client_t *c) {
     ssize_t sz;
     int pkt_sz = c->pkt_sz, pkt_cur = c->pkt_cur, rv;
     pkt_header_t tmp_hdr;
 
+    if(c->type == CLIENT_TYPE_METRICS) {
+        return read_web_request(c);
+    }
+
     if(!c->recvbuf) {
         /* Read in a new header... */
         if((sz = recv(c->sock, &tmp_hdr, 4, 0)) < 4) {
@@ -848,172 +996,202 @@ static const void *my_ntop(struct sockaddr_storage *addr,
     return NULL;
 }
 
-/* Connection handling loop... */
-static void handle_connections(int sockets[NUM_PORTS]) {
-    int sock, nfds, j;
-    socklen_t len;
-    struct sockaddr_storage addr;
-    struct sockaddr *addr_p = (struct sockaddr *)&addr;
-    char ipstr[INET6_ADDRSTRLEN];
-    fd_set readfds, writefds;
-    struct timeval timeout;
-    patch_client_t *i, *tmp;
+/* Take anything sent to the client since we last looked out of its budget, and
+   refill the budget for the time that has gone by. */
+static void update_budget(patch_client_t *c, double now) {
+    uint64_t sent = c->bytes_sent - c->bytes_counted;
+    double burst = (double)c->cfg->window * CHUNK_MAX;
+
+    c->bytes_counted = c->bytes_sent;
+    patch_stats.bytes_sent += sent;
+
+    if(!c->cfg->rate) {
+        return;
+    }
+
+    if(now > c->last_refill) {
+        c->tokens += (now - c->last_refill) * c->cfg->rate;
+    }
+
+    c->tokens -= (double)sent;
+    c->last_refill = now;
+
+    if(c->tokens > burst) {
+        c->tokens = burst;
+    }
+}
+
+/* Send whatever is queued up for the client. */
+static int send_queued(patch_client_t *c) {
     ssize_t sent;
-    
-    for(;;) {
-        /* Set this up in case a signal comes in during the time between calling
-           this and the select(). */
-        if(!sigsetjmp(jmpbuf, 1)) {
-            canjump = 1;
-        }
 
-        /* If we need to, rehash the patches and welcome message. */
-        if(rehash && client_count == 0) {
-            canjump = 0;
-            rehash_files();
-            rehash = 0;
-            canjump = 1;
-        }
+    sent = send(c->sock, c->sendbuf + c->sendbuf_start,
+                c->sendbuf_cur - c->sendbuf_start, 0);
 
-        /* Clear out the fd_sets and set the timeout value for select. */
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        nfds = 0;
+    /* If we fail to send, and the error isn't EAGAIN, bail. */
+    if(sent == -1) {
+        return errno == EAGAIN ? 0 : -1;
+    }
 
-        /* Set the timeout differently if we're waiting on a rehash. */
-        if(!rehash) {
-            timeout.tv_sec = 9001;
-        }
-        else {
-            timeout.tv_sec = 10;
+    c->sendbuf_start += sent;
+    c->bytes_sent += sent;
+
+    /* If we've sent everything, free the buffer (unless we're about to fill it
+       up again). */
+    if(c->sendbuf_start == c->sendbuf_cur) {
+        if(!c->sending_data) {
+            free(c->sendbuf);
+            c->sendbuf = NULL;
+            c->sendbuf_size = 0;
         }
 
-        timeout.tv_usec = 0;
+        c->sendbuf_cur = 0;
+        c->sendbuf_start = 0;
+    }
 
-        /* Fill the sockets into the fd_set so we can use select below. */
-        TAILQ_FOREACH(i, &clients, qentry) {
-            FD_SET(i->sock, &readfds);
+    return 0;
+}
 
-            /* Only add to the write fd_set if we have something to send. */
-            if(i->sendbuf_cur || i->sending_data) {
-                FD_SET(i->sock, &writefds);
-            }
+/* Deal with whatever epoll told us about the client. */
+static void handle_client(patch_client_t *c, uint32_t events, double now) {
+    int sending = !!c->sending_data;
+    int queued = c->sendbuf_cur - c->sendbuf_start;
 
-            nfds = nfds > i->sock ? nfds : i->sock;
+    /* Check if this connection was trying to send us something. */
+    if(events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        if(read_from_client(c)) {
+            c->disconnected = 1;
         }
+    }
 
-        /* Add the listening sockets to the read fd_set if we aren't waiting on
-           all clients to disconnect for a rehash operation. Since they won't be
-           in the fd_set if we are waiting, we don't have to worry about clients
-           connecting while we're trying to do a rehash operation. */
-        if(!rehash) {
-            for(j = 0; j < NUM_PORTS; ++j) {
-                FD_SET(sockets[j], &readfds);
-                nfds = nfds > sockets[j] ? nfds : sockets[j];
+    /* If we have anything to write, send it, and then top up the window of
+       file data for the client if it still has the budget for it. */
+    if(!c->disconnected && (events & EPOLLOUT)) {
+        if(c->sendbuf_cur && send_queued(c)) {
+            c->disconnected = 1;
+        }
+
+        update_budget(c, now);
+
+        if(!c->disconnected && c->sending_data &&
+           (!c->cfg->rate || c->tokens > 0.0)) {
+            if(fill_window(c)) {
+                c->disconnected = 1;
             }
         }
+    }
 
-        /* Wait to see if we get any incoming data. */
-        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
-            /* Make sure a rehash event doesn't interrupt any of this stuff,
-               it will get handled the next time through the loop. */
-            canjump = 0;
+    /* Web clients are done once they've been sent their reply. */
+    if(c->close_after_send && !c->sendbuf_cur) {
+        c->disconnected = 1;
+    }
 
-            /* Check the listening sockets first. */
-            for(j = 0; j < NUM_PORTS; ++j) {
-                if(FD_ISSET(sockets[j], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
+    update_budget(c, now);
+    patch_stats.active_transfers += !!c->sending_data - sending;
+    patch_stats.queued_bytes += (c->sendbuf_cur - c->sendbuf_start) - queued;
 
-                    if((sock = accept(sockets[j], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-                    else {
-                        if(ports[j][2] == CLIENT_TYPE_WEB) {
-                            /* Send the number of connected clients, and close
-                               the socket. */
-                            nfds = LE32(client_count);
-                            send(sock, &nfds, 4, 0);
-                            close(sock);
-                            continue;
-                        }
-
-                        if(!create_connection(sock, ports[j][2], addr_p, len)) {
-                            close(sock);
-                        }
-                        else {
-                            my_ntop(&addr, ipstr);
-                            if(ports[j][2] == CLIENT_TYPE_PC_PATCH ||
-                               ports[j][2] == CLIENT_TYPE_BB_PATCH) {
-                                debug(DBG_LOG, "Accepted PATCH connection "
-                                      "from %s\n", ipstr);
-                            }
-                            else {
-                                debug(DBG_LOG, "Accepted DATA connection "
-                                      "from %s\n", ipstr);
-                            }
-                        }
-                    }
-                }
-            }
+    if(c->disconnected) {
+        destroy_connection(c);
+        return;
+    }
 
-            TAILQ_FOREACH(i, &clients, qentry) {
-                /* Check if this connection was trying to send us something. */
-                if(FD_ISSET(i->sock, &readfds)) {
-                    if(read_from_client(i)) {
-                        i->disconnected = 1;
-                    }
-                }
+    /* If the client has used up its budget, stop sending it file data until
+       it has been refilled. */
+    if(c->sending_data && !c->throttled && c->cfg->rate && c->tokens <= 0.0) {
+        c->throttled = 1;
+        TAILQ_INSERT_TAIL(&throttled, c, tqentry);
+    }
 
-                /* If we have anything to write, check if we can right now. */
-                if(FD_ISSET(i->sock, &writefds)) {
-                    if(i->sendbuf_cur) {
-                        sent = send(i->sock, i->sendbuf + i->sendbuf_start,
-                                    i->sendbuf_cur - i->sendbuf_start, 0);
-
-                        /* If we fail to send, and the error isn't EAGAIN,
-                           bail. */
-                        if(sent == -1) {
-                            if(errno != EAGAIN) {
-                                i->disconnected = 1;
-                            }
-                        }
-                        else {
-                            i->sendbuf_start += sent;
-
-                            /* If we've sent everything, free the buffer. */
-                            if(i->sendbuf_start == i->sendbuf_cur) {
-                                free(i->sendbuf);
-                                i->sendbuf = NULL;
-                                i->sendbuf_cur = 0;
-                                i->sendbuf_size = 0;
-                                i->sendbuf_start = 0;
-                            }
-                        }
-                    }
-                    else if(i->sending_data) {
-                        if(handle_list_done(i)) {
-                            i->disconnected = 1;
-                        }
-                    }
-                }
-            }
-        }
+    if(update_events(c)) {
+        destroy_connection(c);
+    }
+}
 
-        /* Clean up any dead connections (its not safe to do a TAILQ_REMOVE in
-           the middle of a TAILQ_FOREACH, and destroy_connection does indeed
-           use TAILQ_REMOVE). */
-        canjump = 0;
-        i = TAILQ_FIRST(&clients);
+/* Refill the budgets of throttled clients, and let them go again if they have
+   anything in their budget. */
+static void check_throttled(double now) {
+    patch_client_t *i, *tmp;
+
+    i = TAILQ_FIRST(&throttled);
 
-        while(i) {
-            tmp = TAILQ_NEXT(i, qentry);
+    while(i) {
+        tmp = TAILQ_NEXT(i, tqentry);
+        update_budget(i, now);
 
-            if(i->disconnected) {
+        if(i->tokens > 0.0 || !i->sending_data) {
+            TAILQ_REMOVE(&throttled, i, tqentry);
+            i->throttled = 0;
+
+            if(update_events(i)) {
                 destroy_connection(i);
             }
+        }
+
+        i = tmp;
+    }
+}
+
+/* Drop any web clients that have been sitting around too long without sending
+   us a whole request, or without reading their reply. */
+static void check_web_clients(double now) {
+    patch_client_t *i, *tmp;
+
+    if(!web_clients) {
+        return;
+    }
+
+    i = TAILQ_FIRST(&clients);
+
+    while(i) {
+        tmp = TAILQ_NEXT(i, qentry);
 
-            i = tmp;
+        if(i->type == CLIENT_TYPE_METRICS &&
+           now - i->connect_time > WEB_TIMEOUT) {
+            destroy_connection(i);
         }
+
+        i = tmp;
+    }
+}
+
+static void handle_accept(int lsock, int type) {
+    int sock;
+    socklen_t len = sizeof(struct sockaddr_storage);
+    struct sockaddr_storage addr;
+    struct sockaddr *addr_p = (struct sockaddr *)&addr;
+    char ipstr[INET6_ADDRSTRLEN];
+    uint32_t count;
+
+    if((sock = accept(lsock, addr_p, &len)) < 0) {
+        perror("accept");
+        return;
+    }
+
+    if(type == CLIENT_TYPE_WEB) {
+        /* Send the number of connected clients, and close the socket. */
+        count = LE32(client_count);
+        send(sock, &count, 4, 0);
+        close(sock);
+        return;
+    }
+
+    if(!create_connection(sock, type, addr_p, len)) {
+        close(sock);
+        return;
+    }
+
+    /* Don't fill up the log every time the metrics are scraped. */
+    if(type == CLIENT_TYPE_METRICS) {
+        return;
+    }
+
+    my_ntop(&addr, ipstr);
+
+    if(type == CLIENT_TYPE_PC_PATCH || type == CLIENT_TYPE_BB_PATCH) {
+        debug(DBG_LOG, "Accepted PATCH connection from %s\n", ipstr);
+    }
+    else {
+        debug(DBG_LOG, "Accepted DATA connection from %s\n", ipstr);
     }
 }
 
@@ -1022,35 +1200,157 @@ static void rehash_files() {
     load_config();
 }
 
-/* Signal handler registered to SIGHUP. Sending SIGHUP to the program will cause
-   it to rehash its configuration and rescan the patches directory at its next
-   earliest convenience. */
-static void sig_handler(int signum) {
-    rehash = 1;
+/* Read any signals that have come in. Sending SIGHUP to the program will cause
+   it to rehash its configuration and rescan the patches directory. Clients
+   connected at the time finish up with the old configuration, new clients get
+   the new one. */
+static void handle_signals(void) {
+    struct signalfd_siginfo si;
+    int rehash = 0;
+
+    while(read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+        if(si.ssi_signo == SIGHUP) {
+            rehash = 1;
+        }
+    }
+
+    if(rehash) {
+        rehash_files();
+    }
+}
+
+static void update_stats(double now, double *last, uint64_t *last_bytes) {
+    if(now - *last < STATS_INTERVAL) {
+        return;
+    }
+
+    patch_stats.bytes_per_sec =
+        (uint64_t)((patch_stats.bytes_sent - *last_bytes) / (now - *last));
+    *last = now;
+    *last_bytes = patch_stats.bytes_sent;
+
+    if(patch_stats.active_transfers || patch_stats.bytes_per_sec) {
+        debug(DBG_LOG, "%d active transfers, %llu bytes/sec, %llu bytes "
+              "queued\n", patch_stats.active_transfers,
+              (unsigned long long)patch_stats.bytes_per_sec,
+              (unsigned long long)patch_stats.queued_bytes);
+    }
+}
+
+/* Connection handling loop... */
+static void handle_connections(int sockets[NUM_PORTS]) {
+    struct epoll_event evs[64];
+    struct epoll_event ev;
+    int nev, i, j, timeout;
+    patch_client_t *c;
+    double now, last_stats;
+    uint64_t last_bytes = 0;
+
+    if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Watch the listening sockets and the signalfd. */
+    for(j = 0; j < NUM_PORTS; ++j) {
+        ev.events = EPOLLIN;
+        ev.data.fd = sockets[j];
+
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, sockets[j], &ev)) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = sigfd;
+
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev)) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    last_stats = now_secs();
+
+    for(;;) {
+        /* Wake up every so often to check on throttled clients, and to keep
+           the transfer rate up to date. */
+        if(!TAILQ_EMPTY(&throttled)) {
+            timeout = THROTTLE_CHECK_MS;
+        }
+        else if(web_clients) {
+            timeout = 1000;
+        }
+        else {
+            timeout = STATS_INTERVAL * 1000;
+        }
+
+        nev = epoll_wait(epfd, evs, 64, timeout);
+
+        if(nev < 0) {
+            if(errno != EINTR) {
+                perror("epoll_wait");
+                exit(EXIT_FAILURE);
+            }
+
+            continue;
+        }
+
+        now = now_secs();
+
+        /* Deal with clients first. Any clients that are disconnected here are
+           cleaned up right away, so don't accept any new ones (which might get
+           the same socket) until we're done with them. */
+        for(i = 0; i < nev; ++i) {
+            if(evs[i].data.fd == sigfd) {
+                handle_signals();
+            }
+            else if(evs[i].data.fd < fd_clients_size &&
+                    (c = fd_clients[evs[i].data.fd])) {
+                handle_client(c, evs[i].events, now);
+            }
+        }
+
+        for(i = 0; i < nev; ++i) {
+            for(j = 0; j < NUM_PORTS; ++j) {
+                if(evs[i].data.fd == sockets[j]) {
+                    handle_accept(sockets[j], ports[j][2]);
+                    break;
+                }
+            }
+        }
 
-    if(canjump) {
-        canjump = 0;
-        siglongjmp(jmpbuf, 1);
+        check_throttled(now);
+        check_web_clients(now);
+        update_stats(now, &last_stats, &last_bytes);
     }
 }
 
-/* Install the signal handler for SIGHUP. Calls the above function. */
+/* Set up the signals we care about. SIGHUP is read from a signalfd in the main
+   loop, rather than being handled asynchronously. */
 static void install_signal_handler() {
     struct sigaction sa;
-
-    sa.sa_handler = &sig_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
+    sigset_t mask;
 
     debug(DBG_LOG, "Installing SIGHUP handler...\n");
 
-    if(sigaction(SIGHUP, &sa, NULL) == -1) {
-        perror("sigaction");
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+
+    if(sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        perror("sigprocmask");
+        exit(EXIT_FAILURE);
+    }
+
+    if((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        perror("signalfd");
         exit(EXIT_FAILURE);
     }
 
     /* Ignore SIGPIPEs */
     sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
 
     if(sigaction(SIGPIPE, &sa, NULL) == -1) {
         perror("sigaction");
@@ -1152,13 +1452,17 @@ int main(int argc, char *argv[]) {
     int sockets[NUM_PORTS];
     int i;
 
-    /* Parse the command line and read our configuration. */
+    /* Parse the command line. */
     parse_command_line(argc, argv);
-    load_config();
 
-    /* Change to the Sylverant data directory for all future stuff. */
+    /* Change to the Sylverant data directory for all future stuff. This has to
+       happen before the configuration is read, since the patch directories are
+       relative to it. */
     chdir(sylverant_directory);
 
+    /* Read our configuration. */
+    load_config();
+
     /* If we're still alive and we're supposed to daemonize, do it now. */
     if(!dont_daemonize) {
         open_log();
@@ -1191,7 +1495,8 @@ int main(int argc, char *argv[]) {
     handle_connections(sockets);
 
     /* Clean up after ourselves... */
-    patch_free_config(cfg);
+    patch_config_unref(cfg);
+    patch_stats_cleanup();
 
     return 0;
 }
@@ -31,6 +31,10 @@
 
 #define PACKED __attribute__((packed))
 
+/* Default and maximum sizes of the transfer window, in chunks. */
+#define PATCH_DEFAULT_WINDOW    8
+#define PATCH_MAX_WINDOW        64
+
 /* The common packet header on top of all packets. */
 typedef struct pkt_header {
     uint16_t pkt_len;
@@ -45,6 +49,9 @@ typedef struct patch_file_entry {
     uint32_t checksum;
     uint32_t client_checksum;
 
+    /* The file, as mapped into memory by the patch cache (or NULL). */
+    struct patch_map *map;
+
     struct patch_file_entry *next;
 } patch_file_entry_t;
 
@@ -55,6 +62,19 @@ typedef struct patch_file {
     uint32_t flags;
     char *filename;
 
+    /* The directory part of the filename ("" if there is none), and the name
+       of the file within that directory. */
+    char *dir;
+    const char *base;
+
+    /* How many clients have had this file up to date, and how many have needed
+       something sent for it. */
+    uint32_t current;
+    uint32_t outdated;
+
+    /* Counters for the file that last across reloads (see patch_stats.c). */
+    struct patch_file_stats *stats;
+
     patch_file_entry_t *entries;
 } patch_file_t;
 
@@ -94,10 +114,35 @@ typedef struct patch_client {
     int sendbuf_size;
     int sendbuf_start;
 
+    struct patch_config *cfg;
+
     struct cfile_queue files;
     int sending_data;
     int cur_chunk;
     int cur_pos;
+
+    /* The events we're waiting on for the client in the main loop. */
+    uint32_t events;
+
+    /* Everything sent to the client, and how much of that has been taken out
+       of its sending budget so far. */
+    uint64_t bytes_sent;
+    uint64_t bytes_counted;
+
+    /* The client's sending budget, in bytes. When this runs out, the client
+       is throttled until it has been refilled. */
+    double tokens;
+    double last_refill;
+    int throttled;
+    TAILQ_ENTRY(patch_client) tqentry;
+
+    /* When the client connected, and when its current transfer started. */
+    double connect_time;
+    double xfer_start;
+    uint64_t xfer_bytes;
+
+    /* Set on web clients once their response has been queued up. */
+    int close_after_send;
 } patch_client_t;
 
 #define CLIENT_TYPE_PC_PATCH 0
@@ -105,10 +150,32 @@ typedef struct patch_client {
 #define CLIENT_TYPE_WEB      2
 #define CLIENT_TYPE_BB_PATCH 3
 #define CLIENT_TYPE_BB_DATA  4
+#define CLIENT_TYPE_METRICS  5
 
 TAILQ_HEAD(client_queue, patch_client);
 TAILQ_HEAD(file_queue, patch_file);
 
+/* The list of patches for one version, indexed by the patch id sent to the
+   client, along with the (unencrypted) packets that ask the client about each
+   of them. The packets are the same for every client, so they're built once
+   when the configuration is loaded. */
+typedef struct patch_list {
+    patch_file_t **files;
+    uint32_t count;
+
+    uint8_t *pkts;
+    uint32_t pkts_len;
+    uint32_t pkts_size;
+
+    /* Known versions of each file (see patch_verify.c). */
+    struct patch_verify_ent **vtable;
+    uint32_t vtable_mask;
+
+    /* How many clients have been up to date, and how many needed patches. */
+    uint32_t clients_current;
+    uint32_t clients_outdated;
+} patch_list_t;
+
 /* Patch server configuration structure. */
 typedef struct patch_config {
     uint8_t server_ip6[16];
@@ -125,12 +192,27 @@ typedef struct patch_config {
     char *pc_dir;
     char *bb_dir;
 
+    /* How many chunks of file data to keep queued up for each client, and how
+       fast (in bytes per second) each client may be sent data (0 if there is
+       no limit). */
+    int window;
+    uint32_t rate;
+
     struct file_queue pc_files;
     struct file_queue bb_files;
+
+    patch_list_t pc_list;
+    patch_list_t bb_list;
+
+    /* The server holds a reference to the current configuration, and each
+       client holds one to the configuration it connected under. */
+    int refcnt;
 } patch_config_t;
 
 /* In patch_config.c */
 int patch_read_config(const char *fn, patch_config_t **cfg);
 void patch_free_config(patch_config_t *cfg);
+patch_config_t *patch_config_ref(patch_config_t *cfg);
+void patch_config_unref(patch_config_t *cfg);
 
 #endif /* !PATCH_SERVER_H */
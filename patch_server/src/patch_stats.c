@@ -0,0 +1,310 @@
+/*
+    Sylverant Patch Server
+
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "patch_stats.h"
+
+#define FILE_BUCKETS    256
+
+patch_stats_t patch_stats;
+
+static patch_file_stats_t *files[FILE_BUCKETS];
+
+static const double chunk_bounds[PATCH_STATS_CHUNK_BUCKETS] = {
+    0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+
+typedef struct outbuf {
+    char *buf;
+    size_t len;
+    size_t size;
+    int err;
+} outbuf_t;
+
+static uint32_t hash_name(const char *ver, const char *name) {
+    uint32_t h = 2166136261U;
+
+    while(*ver)
+        h = (h ^ (uint8_t)*ver++) * 16777619U;
+
+    while(*name)
+        h = (h ^ (uint8_t)*name++) * 16777619U;
+
+    return h & (FILE_BUCKETS - 1);
+}
+
+patch_file_stats_t *patch_stats_file(const char *ver, const char *name) {
+    uint32_t h = hash_name(ver, name);
+    patch_file_stats_t *i;
+
+    for(i = files[h]; i; i = i->next) {
+        if(!strcmp(i->ver, ver) && !strcmp(i->name, name))
+            return i;
+    }
+
+    if(!(i = (patch_file_stats_t *)malloc(sizeof(patch_file_stats_t))))
+        return NULL;
+
+    memset(i, 0, sizeof(patch_file_stats_t));
+
+    if(!(i->name = strdup(name))) {
+        free(i);
+        return NULL;
+    }
+
+    i->ver = ver;
+    i->next = files[h];
+    files[h] = i;
+
+    return i;
+}
+
+void patch_stats_chunk(double secs) {
+    int i;
+
+    for(i = 0; i < PATCH_STATS_CHUNK_BUCKETS; ++i) {
+        if(secs <= chunk_bounds[i]) {
+            ++patch_stats.chunk_buckets[i];
+            break;
+        }
+    }
+
+    ++patch_stats.chunk_count;
+    patch_stats.chunk_time += secs;
+}
+
+void patch_stats_transfer(uint64_t bytes, double secs) {
+    double tput;
+
+    /* Don't let a really fast transfer blow up the numbers. */
+    if(secs < 0.001)
+        secs = 0.001;
+
+    tput = (double)bytes / secs;
+    patch_stats.tput[patch_stats.tput_count % PATCH_STATS_TPUT_SAMPLES] = tput;
+    ++patch_stats.tput_count;
+    patch_stats.tput_sum += tput;
+}
+
+static void out_printf(outbuf_t *o, const char *fmt, ...) {
+    va_list args;
+    size_t size;
+    char *tmp;
+    int len;
+
+    if(o->err)
+        return;
+
+    for(;;) {
+        va_start(args, fmt);
+        len = vsnprintf(o->buf + o->len, o->size - o->len, fmt, args);
+        va_end(args);
+
+        if(len < 0) {
+            o->err = 1;
+            return;
+        }
+
+        if(o->len + len < o->size) {
+            o->len += len;
+            return;
+        }
+
+        size = o->size ? o->size * 2 : 8192;
+
+        while(size <= o->len + len)
+            size *= 2;
+
+        if(!(tmp = (char *)realloc(o->buf, size))) {
+            o->err = 1;
+            return;
+        }
+
+        o->buf = tmp;
+        o->size = size;
+    }
+}
+
+/* Write out a label value, escaped the way Prometheus wants it. */
+static void out_label(outbuf_t *o, const char *str) {
+    for(; *str; ++str) {
+        if(*str == '\\' || *str == '"')
+            out_printf(o, "\\%c", *str);
+        else if(*str == '\n')
+            out_printf(o, "\\n");
+        else
+            out_printf(o, "%c", *str);
+    }
+}
+
+static void out_header(outbuf_t *o, const char *name, const char *type,
+                       const char *help) {
+    out_printf(o, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void out_file_counter(outbuf_t *o, const char *name, const char *help,
+                             size_t off) {
+    patch_file_stats_t *i;
+    int j;
+
+    out_header(o, name, "counter", help);
+
+    for(j = 0; j < FILE_BUCKETS; ++j) {
+        for(i = files[j]; i; i = i->next) {
+            out_printf(o, "%s{version=\"%s\",file=\"", name, i->ver);
+            out_label(o, i->name);
+            out_printf(o, "\"} %llu\n",
+                       (unsigned long long)*(uint64_t *)((char *)i + off));
+        }
+    }
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void out_tput(outbuf_t *o) {
+    double sorted[PATCH_STATS_TPUT_SAMPLES];
+    int count, i, idx;
+    const char *name = "patch_client_throughput_bytes_per_second";
+
+    out_header(o, name, "summary", "Throughput of finished transfers.");
+
+    count = patch_stats.tput_count < PATCH_STATS_TPUT_SAMPLES ?
+        (int)patch_stats.tput_count : PATCH_STATS_TPUT_SAMPLES;
+
+    if(count) {
+        memcpy(sorted, patch_stats.tput, sizeof(double) * count);
+        qsort(sorted, count, sizeof(double), cmp_double);
+
+        for(i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+            idx = (int)(quantiles[i] * (count - 1) + 0.5);
+            out_printf(o, "%s{quantile=\"%g\"} %.0f\n", name, quantiles[i],
+                       sorted[idx]);
+        }
+    }
+
+    out_printf(o, "%s_sum %.0f\n%s_count %llu\n", name, patch_stats.tput_sum,
+               name, (unsigned long long)patch_stats.tput_count);
+}
+
+static void out_chunks(outbuf_t *o) {
+    uint64_t total = 0;
+    const char *name = "patch_chunk_send_seconds";
+    int i;
+
+    out_header(o, name, "histogram", "Time taken to make and send one chunk.");
+
+    for(i = 0; i < PATCH_STATS_CHUNK_BUCKETS; ++i) {
+        total += patch_stats.chunk_buckets[i];
+        out_printf(o, "%s_bucket{le=\"%g\"} %llu\n", name, chunk_bounds[i],
+                   (unsigned long long)total);
+    }
+
+    out_printf(o, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %g\n%s_count %llu\n",
+               name, (unsigned long long)patch_stats.chunk_count, name,
+               patch_stats.chunk_time, name,
+               (unsigned long long)patch_stats.chunk_count);
+}
+
+static void out_value(outbuf_t *o, const char *name, const char *type,
+                      const char *help, unsigned long long val) {
+    out_header(o, name, type, help);
+    out_printf(o, "%s %llu\n", name, val);
+}
+
+int patch_stats_render(int clients, char **out, size_t *len) {
+    outbuf_t o = { NULL, 0, 0, 0 };
+
+    out_value(&o, "patch_clients", "gauge", "Clients connected.",
+              (unsigned long long)clients);
+    out_value(&o, "patch_active_transfers", "gauge",
+              "Clients being sent files right now.",
+              (unsigned long long)patch_stats.active_transfers);
+    out_value(&o, "patch_queued_bytes", "gauge",
+              "Bytes waiting in client send buffers.",
+              (unsigned long long)patch_stats.queued_bytes);
+    out_value(&o, "patch_bytes_sent_total", "counter",
+              "Bytes sent to clients.",
+              (unsigned long long)patch_stats.bytes_sent);
+    out_value(&o, "patch_bytes_per_second", "gauge",
+              "Bytes sent per second over the last interval.",
+              (unsigned long long)patch_stats.bytes_per_sec);
+    out_value(&o, "patch_cache_hits_total", "counter",
+              "Chunks sent from the patch cache.",
+              (unsigned long long)patch_stats.cache_hits);
+    out_value(&o, "patch_cache_misses_total", "counter",
+              "Chunks read from the disk.",
+              (unsigned long long)patch_stats.cache_misses);
+    out_value(&o, "patch_verify_hits_total", "counter",
+              "File info replies found in the verification table.",
+              (unsigned long long)patch_stats.verify_hits);
+    out_value(&o, "patch_verify_misses_total", "counter",
+              "File info replies not found in the verification table.",
+              (unsigned long long)patch_stats.verify_misses);
+
+    out_chunks(&o);
+    out_tput(&o);
+
+    out_file_counter(&o, "patch_file_bytes_sent_total", "Bytes sent per file.",
+                     offsetof(patch_file_stats_t, bytes_sent));
+    out_file_counter(&o, "patch_file_chunks_sent_total",
+                     "Chunks sent per file.",
+                     offsetof(patch_file_stats_t, chunks_sent));
+    out_file_counter(&o, "patch_file_current_total",
+                     "Clients that had the file up to date.",
+                     offsetof(patch_file_stats_t, current));
+    out_file_counter(&o, "patch_file_outdated_total",
+                     "Clients that needed the file.",
+                     offsetof(patch_file_stats_t, outdated));
+
+    if(o.err) {
+        free(o.buf);
+        return -1;
+    }
+
+    *out = o.buf;
+    *len = o.len;
+    return 0;
+}
+
+void patch_stats_cleanup(void) {
+    patch_file_stats_t *i, *tmp;
+    int j;
+
+    for(j = 0; j < FILE_BUCKETS; ++j) {
+        i = files[j];
+
+        while(i) {
+            tmp = i->next;
+            free(i->name);
+            free(i);
+            i = tmp;
+        }
+
+        files[j] = NULL;
+    }
+}
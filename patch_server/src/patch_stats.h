@@ -0,0 +1,94 @@
+/*
+    Sylverant Patch Server
+
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PATCH_STATS_H
+#define PATCH_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* The patch server does everything on one thread, so none of these need any
+   locking. They're only ever touched from the main loop. */
+
+/* How many buckets there are in the chunk send time histogram. */
+#define PATCH_STATS_CHUNK_BUCKETS   8
+
+/* How many of the most recent transfers the throughput percentiles are worked
+   out from. */
+#define PATCH_STATS_TPUT_SAMPLES    1024
+
+/* Counters for one file. These are kept by version and client filename, and
+   stick around across configuration reloads. */
+typedef struct patch_file_stats {
+    struct patch_file_stats *next;
+
+    const char *ver;
+    char *name;
+
+    uint64_t bytes_sent;
+    uint64_t chunks_sent;
+    uint64_t current;
+    uint64_t outdated;
+} patch_file_stats_t;
+
+/* Counters about the transfers going on right now, and everything that has
+   been done since the server started. */
+typedef struct patch_stats {
+    uint64_t bytes_sent;
+    uint64_t bytes_per_sec;
+    uint64_t queued_bytes;
+    int active_transfers;
+
+    /* Chunks sent out of the patch cache, and chunks read from the disk. */
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+
+    /* File info replies found in the verification table, and not. */
+    uint64_t verify_hits;
+    uint64_t verify_misses;
+
+    /* How long it takes to make and send one chunk. */
+    uint64_t chunk_buckets[PATCH_STATS_CHUNK_BUCKETS];
+    uint64_t chunk_count;
+    double chunk_time;
+
+    /* Throughput (in bytes per second) of finished transfers. */
+    double tput[PATCH_STATS_TPUT_SAMPLES];
+    uint64_t tput_count;
+    double tput_sum;
+} patch_stats_t;
+
+extern patch_stats_t patch_stats;
+
+/* Find the counters for the given file, making them if needed. */
+patch_file_stats_t *patch_stats_file(const char *ver, const char *name);
+
+/* Record how long it took to send one chunk. */
+void patch_stats_chunk(double secs);
+
+/* Record the throughput of a finished transfer. */
+void patch_stats_transfer(uint64_t bytes, double secs);
+
+/* Write out all the counters in the Prometheus text format. The buffer
+   returned must be freed by the caller. */
+int patch_stats_render(int clients, char **out, size_t *len);
+
+/* Free all the per-file counters. */
+void patch_stats_cleanup(void);
+
+#endif /* !PATCH_STATS_H */
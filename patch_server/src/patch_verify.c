@@ -0,0 +1,260 @@
+/*
+    Sylverant Patch Server
+
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sylverant/debug.h>
+
+#include "patch_verify.h"
+#include "patch_stats.h"
+
+typedef struct patch_verify_ent {
+    struct patch_verify_ent *next;
+
+    uint32_t idx;
+    uint32_t checksum;
+
+    /* What to send to a client with this checksum, or NULL for nothing. A
+       client whose file is also exactly the given size gets same_ent instead,
+       since that is the version we have (and would be sending). If more than
+       one entry has this checksum with different sizes, slow is set and the
+       entries are checked one by one. */
+    uint32_t size;
+    patch_file_entry_t *ent;
+    patch_file_entry_t *same_ent;
+    int slow;
+} patch_verify_ent_t;
+
+static uint32_t hash_key(uint32_t idx, uint32_t checksum) {
+    uint32_t h = checksum ^ (idx * 0x85EBCA6BU);
+
+    h ^= h >> 16;
+    h *= 0x7FEB352DU;
+    h ^= h >> 15;
+
+    return h;
+}
+
+static inline int same_ver(const patch_file_entry_t *ent, uint32_t checksum,
+                           const uint32_t *size) {
+    return ent->checksum == checksum && size && ent->size == *size;
+}
+
+/* Work out what needs to be sent for a file the slow way, by walking through
+   each of its entries. If size is NULL, the client's file is taken to be a
+   size that doesn't match any of the entries. */
+static patch_file_entry_t *check_file(patch_file_t *f, uint32_t checksum,
+                                      const uint32_t *size) {
+    patch_file_entry_t *ent;
+
+    /* With a single entry, this is easy... */
+    if(f->flags & PATCH_FLAG_NO_IF) {
+        if(!same_ver(f->entries, checksum, size))
+            return f->entries;
+
+        return NULL;
+    }
+
+    for(ent = f->entries; ent; ent = ent->next) {
+        if(ent->client_checksum == checksum ||
+           ((f->flags & PATCH_FLAG_HAS_ELSE) && !ent->next &&
+            !same_ver(ent, checksum, size))) {
+            return ent;
+        }
+    }
+
+    return NULL;
+}
+
+static patch_verify_ent_t *find_ent(patch_list_t *l, uint32_t idx,
+                                    uint32_t checksum) {
+    patch_verify_ent_t *i;
+
+    if(!l->vtable)
+        return NULL;
+
+    i = l->vtable[hash_key(idx, checksum) & l->vtable_mask];
+
+    for(; i; i = i->next) {
+        if(i->idx == idx && i->checksum == checksum)
+            return i;
+    }
+
+    return NULL;
+}
+
+/* Put the answer for clients with the given checksum of a file in the table,
+   if it isn't there already. */
+static int add_ent(patch_list_t *l, uint32_t idx, uint32_t checksum) {
+    patch_file_t *f = l->files[idx];
+    patch_file_entry_t *ent, *cur = NULL;
+    patch_verify_ent_t *v;
+    uint32_t h;
+
+    if(find_ent(l, idx, checksum))
+        return 0;
+
+    if(!(v = (patch_verify_ent_t *)malloc(sizeof(patch_verify_ent_t)))) {
+        debug(DBG_ERROR, "Cannot allocate patch verification entry\n");
+        return -1;
+    }
+
+    memset(v, 0, sizeof(patch_verify_ent_t));
+    v->idx = idx;
+    v->checksum = checksum;
+
+    /* Is this one of the versions that we have? */
+    for(ent = f->entries; ent; ent = ent->next) {
+        if(ent->checksum != checksum)
+            continue;
+
+        if(!cur)
+            cur = ent;
+        else if(ent->size != cur->size)
+            v->slow = 1;
+    }
+
+    v->ent = check_file(f, checksum, NULL);
+
+    if(cur) {
+        v->size = cur->size;
+        v->same_ent = check_file(f, checksum, &cur->size);
+    }
+    else {
+        v->same_ent = v->ent;
+    }
+
+    h = hash_key(idx, checksum) & l->vtable_mask;
+    v->next = l->vtable[h];
+    l->vtable[h] = v;
+
+    return 0;
+}
+
+int patch_verify_build(patch_list_t *l) {
+    uint32_t i, count = 0, buckets = 16;
+    patch_file_entry_t *ent;
+
+    for(i = 0; i < l->count; ++i) {
+        for(ent = l->files[i]->entries; ent; ent = ent->next) {
+            count += 2;
+        }
+    }
+
+    /* Keep the table about half full. */
+    while(buckets < count * 2) {
+        buckets <<= 1;
+    }
+
+    l->vtable = (patch_verify_ent_t **)calloc(buckets,
+                                              sizeof(patch_verify_ent_t *));
+
+    if(!l->vtable) {
+        debug(DBG_ERROR, "Cannot allocate patch verification table\n");
+        return -1;
+    }
+
+    l->vtable_mask = buckets - 1;
+
+    /* Clients will usually have either one of the versions we have, or one of
+       the older versions that the entries are there to replace. */
+    for(i = 0; i < l->count; ++i) {
+        for(ent = l->files[i]->entries; ent; ent = ent->next) {
+            if(add_ent(l, i, ent->checksum))
+                return -1;
+
+            if(!(l->files[i]->flags & PATCH_FLAG_NO_IF) &&
+               add_ent(l, i, ent->client_checksum))
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+void patch_verify_free(patch_list_t *l) {
+    patch_verify_ent_t *i, *tmp;
+    uint32_t j;
+
+    if(!l->vtable)
+        return;
+
+    for(j = 0; j <= l->vtable_mask; ++j) {
+        i = l->vtable[j];
+
+        while(i) {
+            tmp = i->next;
+            free(i);
+            i = tmp;
+        }
+    }
+
+    free(l->vtable);
+    l->vtable = NULL;
+    l->vtable_mask = 0;
+}
+
+patch_file_entry_t *patch_verify(patch_list_t *l, uint32_t idx,
+                                 uint32_t checksum, uint32_t size) {
+    patch_verify_ent_t *v;
+    patch_file_entry_t *rv;
+    patch_file_t *f = l->files[idx];
+
+    /* Anything that isn't in the table is a version of the file that we don't
+       know about, so fall back to checking it against each entry. */
+    if((v = find_ent(l, idx, checksum)) && !v->slow) {
+        rv = size == v->size ? v->same_ent : v->ent;
+        ++patch_stats.verify_hits;
+    }
+    else {
+        rv = check_file(f, checksum, &size);
+        ++patch_stats.verify_misses;
+    }
+
+    if(rv) {
+        ++f->outdated;
+        ++f->stats->outdated;
+    }
+    else {
+        ++f->current;
+        ++f->stats->current;
+    }
+
+    return rv;
+}
+
+void patch_verify_log(patch_list_t *l, const char *ver) {
+    uint32_t i;
+    patch_file_t *f;
+
+    if(!l->clients_current && !l->clients_outdated)
+        return;
+
+    debug(DBG_LOG, "%s patch clients: %u up to date, %u needed patches\n",
+          ver, l->clients_current, l->clients_outdated);
+
+    for(i = 0; i < l->count; ++i) {
+        f = l->files[i];
+
+        if(f->outdated) {
+            debug(DBG_LOG, "    %s: %u up to date, %u outdated\n",
+                  f->filename, f->current, f->outdated);
+        }
+    }
+}
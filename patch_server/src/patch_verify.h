@@ -0,0 +1,46 @@
+/*
+    Sylverant Patch Server
+
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PATCH_VERIFY_H
+#define PATCH_VERIFY_H
+
+#include <stdint.h>
+
+#include "patch_server.h"
+
+/* Build the verification table for a patch list. Every version of each file
+   that the configuration knows about is put into the table (by the checksum
+   that a client with it would report), along with what we'd have to send a
+   client that has that version. That covers both the versions we have and the
+   older ones that an if entry is there to replace, so checking the usual
+   replies from clients is just one lookup. */
+int patch_verify_build(patch_list_t *l);
+
+/* Free the verification table of a patch list. */
+void patch_verify_free(patch_list_t *l);
+
+/* Figure out what needs to be sent to a client that has the given version of
+   the patch at index idx. Returns NULL if the client's file is fine as it is.
+   This also updates the counters of the file. */
+patch_file_entry_t *patch_verify(patch_list_t *l, uint32_t idx,
+                                 uint32_t checksum, uint32_t size);
+
+/* Log how many clients were up to date (or not) for each file in the list. */
+void patch_verify_log(patch_list_t *l, const char *ver);
+
+#endif /* !PATCH_VERIFY_H */
@@ -94,10 +94,11 @@ int kill_guildcard(ship_client_t *c, uint32_t gc, const char *reason) {
 int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
     sylverant_quest_list_t qlist[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT];
     quest_map_t qmap;
+    quest_menus_t *menus, *old_menus;
     int i, j;
     char fn[512];
 
-    TAILQ_INIT(&qmap);
+    quest_map_init(&qmap);
 
     /* Read the quest files in... */
     if(cfg->quests_dir && cfg->quests_dir[0]) {
@@ -119,6 +120,27 @@ int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
             }
         }
 
+        /* Build the menus before taking the lock, so nobody has to wait on
+           that. The menus have to match the lists, so if they can't be built,
+           keep the old quests (if there are any) around instead. */
+        if(!(menus = quest_menus_build(qlist))) {
+            debug(DBG_WARN, "Unable to build quest menus, keeping the old "
+                  "quests!\n");
+
+            for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
+                for(j = 0; j < CLIENT_LANG_COUNT; ++j) {
+                    sylverant_quests_destroy(&qlist[i][j]);
+                }
+            }
+
+            quest_cleanup(&qmap);
+
+            if(initial)
+                quest_map_init(&s->qmap);
+
+            return -1;
+        }
+
         /* Lock the mutex to prevent anyone from trying anything funny. */
         pthread_rwlock_wrlock(&s->qlock);
 
@@ -143,6 +165,8 @@ int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
             quest_cleanup(&s->qmap);
 
         s->qmap = qmap;
+        old_menus = s->qmenus;
+        s->qmenus = menus;
 
         /* XXXX: Hopefully this doesn't fail... >_> */
         if(quest_cache_maps(s, &s->qmap, cfg->quests_dir))
@@ -150,6 +174,11 @@ int load_quests(ship_t *s, sylverant_ship_t *cfg, int initial) {
 
         /* Unlock the lock, we're done. */
         pthread_rwlock_unlock(&s->qlock);
+        quest_menus_free(old_menus);
+
+        /* The files might have changed, so read them in again as needed. Any
+           quests still being sent hold onto the old ones until they're done. */
+        quest_payload_flush();
 
         return 0;
     }
@@ -169,6 +198,10 @@ void clean_quests(ship_t *s) {
     }
 
     quest_cleanup(&s->qmap);
+    quest_menus_free(s->qmenus);
+    s->qmenus = NULL;
+    quest_payload_flush();
+    quest_cache_cleanup();
 }
 
 int refresh_quests(ship_client_t *c, msgfunc f) {
@@ -128,7 +128,7 @@ static void *block_thd(void *d) {
             FD_SET(it->sock, &readfds);
 
             /* Only add to the write fd set if we have something to send out. */
-            if(it->sendbuf_cur) {
+            if(it->sendbuf_cur || it->qstream) {
                 FD_SET(it->sock, &writefds);
             }
 
@@ -290,6 +290,16 @@ static void *block_thd(void *d) {
                             }
                         }
                     }
+
+                    /* Once everything else is out, keep feeding the client the
+                       quest it's being sent (if any). */
+                    if(it->qstream && !it->sendbuf_cur) {
+                        if(send_quest_stream(it)) {
+                            it->flags |= CLIENT_FLAG_DISCONNECTED;
+                            pthread_mutex_unlock(&it->mutex);
+                            continue;
+                        }
+                    }
                 }
 
                 pthread_mutex_unlock(&it->mutex);
@@ -1122,6 +1132,10 @@ static int dc_process_char(ship_client_t *c, dc_char_data_pkt *pkt) {
             return -3;
         }
 
+        /* They're all logged in now, so they don't count against anyone else
+           that is trying to log in anymore. */
+        client_admit_done(c);
+
         /* Do a few things that should only be done once per session... */
         if(!(c->flags & CLIENT_FLAG_SENT_MOTD)) {
             /* Notify the shipgate */
@@ -1203,6 +1217,10 @@ static int bb_process_char(ship_client_t *c, bb_char_data_pkt *pkt) {
             return -3;
         }
 
+        /* They're all logged in now, so they don't count against anyone else
+           that is trying to log in anymore. */
+        client_admit_done(c);
+
         /* Do a few things that should only be done once per session... */
         if(!(c->flags & CLIENT_FLAG_SENT_MOTD)) {
             /* Notify the shipgate */
@@ -2321,7 +2339,7 @@ static int process_menu(ship_client_t *c, uint32_t menu_id, uint32_t item_id,
             pthread_rwlock_rdlock(&ship->qlock);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(!TAILQ_EMPTY(&ship->qmap.list)) {
                 lang = (menu_id >> 24) & 0xFF;
                 rv = send_quest_list(c, (int)item_id, lang);
             }
@@ -2348,7 +2366,7 @@ static int process_menu(ship_client_t *c, uint32_t menu_id, uint32_t item_id,
             pthread_rwlock_rdlock(&ship->qlock);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(!TAILQ_EMPTY(&ship->qmap.list)) {
                 c->cur_lobby->flags |= LOBBY_FLAG_QUESTING;
 
                 /* Send the clients' kill counts if any of them have kill
@@ -2516,7 +2534,7 @@ static int process_info_req(ship_client_t *c, uint32_t menu_id,
             pthread_rwlock_rdlock(&ship->qlock);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(!TAILQ_EMPTY(&ship->qmap.list)) {
                 rv = send_quest_info(c->cur_lobby, item_id, lang);
             }
             else {
@@ -2944,7 +2962,7 @@ static int dc_process_pkt(ship_client_t *c, uint8_t *pkt) {
             pthread_mutex_lock(&c->cur_lobby->mutex);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(!TAILQ_EMPTY(&ship->qmap.list)) {
                 c->cur_lobby->flags |= LOBBY_FLAG_QUESTSEL;
                 rv = send_quest_categories(c, c->q_lang);
             }
@@ -3194,7 +3212,7 @@ static int bb_process_pkt(ship_client_t *c, uint8_t *pkt) {
             pthread_mutex_lock(&c->cur_lobby->mutex);
 
             /* Do we have quests configured? */
-            if(!TAILQ_EMPTY(&ship->qmap)) {
+            if(!TAILQ_EMPTY(&ship->qmap.list)) {
                 c->cur_lobby->flags |= LOBBY_FLAG_QUESTSEL;
                 rv = send_quest_categories(c, c->q_lang);
             }
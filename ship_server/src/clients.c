@@ -32,6 +32,7 @@
 #include <sylverant/mtwist.h>
 #include <sylverant/debug.h>
 #include <sylverant/prs.h>
+#include <sylverant/admission.h>
 
 #include "ship.h"
 #include "utils.h"
@@ -59,6 +60,9 @@ pthread_key_t recvbuf_key;
 /* The key for accessing our thread-specific send buffer. */
 pthread_key_t sendbuf_key;
 
+/* Admission control for new connections, shared by the ship and all blocks. */
+static sylverant_admit_t *admit = NULL;
+
 /* Destructor for the thread-specific receive buffer */
 static void buf_dtor(void *rb) {
     free(rb);
@@ -76,6 +80,11 @@ int client_init(sylverant_ship_t *cfg) {
         return -1;
     }
 
+    if(!(admit = sylverant_admit_new(&cfg->admit, CLIENT_MAX_PENDING))) {
+        debug(DBG_ERROR, "Cannot set up admission control\n");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -83,6 +92,15 @@ int client_init(sylverant_ship_t *cfg) {
 void client_shutdown(void) {
     pthread_key_delete(recvbuf_key);
     pthread_key_delete(sendbuf_key);
+    sylverant_admit_free(admit);
+    admit = NULL;
+}
+
+void client_admit_done(ship_client_t *c) {
+    if(c->flags & CLIENT_FLAG_ADMITTED) {
+        c->flags &= ~CLIENT_FLAG_ADMITTED;
+        sylverant_admit_done(admit);
+    }
 }
 
 /* Create a new connection, storing it in the list of clients. */
@@ -90,27 +108,42 @@ ship_client_t *client_create_connection(int sock, int version, int type,
                                         struct client_queue *clients,
                                         ship_t *ship, block_t *block,
                                         struct sockaddr *ip, socklen_t size) {
-    ship_client_t *rv = (ship_client_t *)malloc(sizeof(ship_client_t));
+    ship_client_t *rv;
     uint32_t client_seed_dc, server_seed_dc;
     uint8_t client_seed_bb[48], server_seed_bb[48];
-    int i;
+    int i, adm;
     pthread_mutexattr_t attr;
     struct mt19937_state *rng;
 
-    if(!rv) {
+    /* If we're being flooded with connections, don't bother setting up the
+       encryption for everyone that's over the limit. */
+    if((adm = sylverant_admit_check(admit, ip)) == SYLVERANT_ADMIT_DROP) {
+        debug(DBG_LOG, "Too many connections at once, dropping client\n");
+        return NULL;
+    }
+
+    if(!(rv = (ship_client_t *)malloc(sizeof(ship_client_t)))) {
         perror("malloc");
+
+        if(adm == SYLVERANT_ADMIT_OK)
+            sylverant_admit_done(admit);
+
         return NULL;
     }
 
     memset(rv, 0, sizeof(ship_client_t));
 
+    if(adm == SYLVERANT_ADMIT_OK) {
+        rv->flags |= CLIENT_FLAG_ADMITTED;
+    }
+
     if(type == CLIENT_TYPE_BLOCK) {
         rv->pl = (player_t *)malloc(sizeof(player_t));
 
         if(!rv->pl) {
             perror("malloc");
+            client_admit_done(rv);
             free(rv);
-            close(sock);
             return NULL;
         }
 
@@ -119,8 +152,8 @@ ship_client_t *client_create_connection(int sock, int version, int type,
         if(!(rv->enemy_kills = (uint32_t *)malloc(sizeof(uint32_t) * 0x60))) {
             perror("malloc");
             free(rv->pl);
+            client_admit_done(rv);
             free(rv);
-            close(sock);
             return NULL;
         }
 
@@ -131,8 +164,8 @@ ship_client_t *client_create_connection(int sock, int version, int type,
             if(!rv->bb_pl) {
                 perror("malloc");
                 free(rv->pl);
+                client_admit_done(rv);
                 free(rv);
-                close(sock);
                 return NULL;
             }
 
@@ -143,8 +176,8 @@ ship_client_t *client_create_connection(int sock, int version, int type,
                 perror("malloc");
                 free(rv->bb_pl);
                 free(rv->pl);
+                client_admit_done(rv);
                 free(rv);
-                close(sock);
                 return NULL;
             }
 
@@ -262,6 +295,14 @@ ship_client_t *client_create_connection(int sock, int version, int type,
             break;
     }
 
+    /* Let anyone over the limit know why they're being disconnected. */
+    if(adm == SYLVERANT_ADMIT_WAIT) {
+        send_message_box(rv, "%s\n\n%s",
+                         __(rv, "\tEThe ship is very busy right now."),
+                         __(rv, "Please wait a moment and try again."));
+        rv->flags |= CLIENT_FLAG_DISCONNECTED;
+    }
+
     /* Insert it at the end of our list, and we're done. */
     if(type == CLIENT_TYPE_BLOCK) {
         pthread_rwlock_wrlock(&block->lock);
@@ -278,7 +319,8 @@ ship_client_t *client_create_connection(int sock, int version, int type,
     return rv;
 
 err:
-    close(sock);
+    /* The caller closes the socket. */
+    client_admit_done(rv);
 
     if(type == CLIENT_TYPE_BLOCK) {
         free(rv->enemy_kills);
@@ -304,6 +346,7 @@ void client_destroy_connection(ship_client_t *c,
     char tstr[26];
 
     TAILQ_REMOVE(clients, c, qentry);
+    client_admit_done(c);
 
     /* If the client was on Blue Burst, update their db character */
     if(c->version == CLIENT_VERSION_BB &&
@@ -363,6 +406,14 @@ void client_destroy_connection(ship_client_t *c,
         free(c->sendbuf);
     }
 
+    if(c->qstream) {
+        quest_payload_unref(c->qstream);
+    }
+
+    if(c->qdefer) {
+        free(c->qdefer);
+    }
+
     if(c->autoreply) {
         free(c->autoreply);
     }
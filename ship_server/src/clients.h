@@ -52,6 +52,7 @@
 
 /* Forward declarations. */
 struct lobby;
+struct quest_payload;
 
 #ifndef LOBBY_DEFINED
 #define LOBBY_DEFINED
@@ -139,6 +140,11 @@ struct ship_client {
 
     unsigned char *recvbuf;
     unsigned char *sendbuf;
+    struct quest_payload *qstream;      /* Quest still being sent out. */
+    uint32_t qstream_pos;
+    unsigned char *qdefer;              /* Packets held back until the quest */
+    int qdefer_cur;                     /* is done being sent. */
+    int qdefer_size;
     void *autoreply;
     FILE *logfile;
 
@@ -248,6 +254,12 @@ extern pthread_key_t sendbuf_key;
 #define CLIENT_FLAG_IS_DCNTE        0x00010000
 #define CLIENT_FLAG_TRACK_INVENTORY 0x00020000
 #define CLIENT_FLAG_TRACK_KILLS     0x00040000
+#define CLIENT_FLAG_ADMITTED        0x00080000
+
+/* How many clients may be in the middle of logging in to the ship (including
+   its blocks) at once before new ones are turned away, unless the ship's
+   configuration says otherwise. */
+#define CLIENT_MAX_PENDING          128
 
 /* The list of language codes for the quest directories. */
 static const char language_codes[][3] __attribute__((unused)) = {
@@ -276,6 +288,9 @@ ship_client_t *client_create_connection(int sock, int version, int type,
                                         ship_t *ship, block_t *block,
                                         struct sockaddr *ip, socklen_t size);
 
+/* Let the admission control know that a client is done logging in. */
+void client_admit_done(ship_client_t *c);
+
 /* Destroy a connection, closing the socket and removing it from the list. */
 void client_destroy_connection(ship_client_t *c, struct client_queue *clients);
 
@@ -119,8 +119,8 @@ struct lobby {
     struct lobby_item_queue item_queue;
     time_t create_time;
 
-    game_enemies_t *map_enemies;
-    game_objs_t *map_objs;
+    game_map_enemies_t *map_enemies;
+    game_map_objs_t *map_objs;
     bb_battle_param_t *bb_params;
 
     int num_mtypes;
@@ -21,9 +21,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <sylverant/debug.h>
 #include <sylverant/prs.h>
+#include <sylverant/checksum.h>
 
 #include "mapdata.h"
 #include "lobby.h"
@@ -652,12 +657,11 @@ static int parse_map(map_enemy_t *en, int en_ct, game_enemies_t *game,
 static int read_bb_map_set(int solo, int i, int j) {
     int srv;
     char fn[256];
-    int k, l, nmaps, nvars, m;
+    int k, l, nmaps, nvars;
     FILE *fp;
     long sz;
     map_enemy_t *en;
     map_object_t *obj;
-    game_object_t *gobj;
     game_enemies_t *tmp;
     game_objs_t *tmp2;
 
@@ -840,25 +844,10 @@ static int read_bb_map_set(int solo, int i, int j) {
             /* We're done with the file, so close it */
             fclose(fp);
 
-            /* Make space for the game object representation. */
-            gobj = (game_object_t *)malloc((sz / 0x44) * sizeof(game_object_t));
-            if(!gobj) {
-                debug(DBG_ERROR, "Cannot allocate game objects: %s\n",
-                      strerror(errno));
-                free(obj);
-                fclose(fp);
-                return 9;
-            }
-
-            /* Store what we'll actually use later... */
-            for(m = 0; m < sz / 0x44; ++m) {
-                gobj[m].data = obj[m];
-                gobj[m].flags = 0;
-            }
-
-            /* Save it into the struct */
+            /* Save it into the struct. Games use the objects straight out of
+               here, so nothing touches them after this point. */
             tmp2[k * nvars + l].count = sz / 0x44;
-            tmp2[k * nvars + l].objs = gobj;
+            tmp2[k * nvars + l].objs = obj;
         }
     }
 
@@ -868,12 +857,11 @@ static int read_bb_map_set(int solo, int i, int j) {
 static int read_v2_map_set(int j, int gcep) {
     int srv, ep;
     char fn[256];
-    int k, l, nmaps, nvars, i;
+    int k, l, nmaps, nvars;
     FILE *fp;
     long sz;
     map_enemy_t *en;
     map_object_t *obj;
-    game_object_t *gobj;
     game_enemies_t *tmp;
     game_objs_t *tmp2;
 
@@ -1051,25 +1039,10 @@ static int read_v2_map_set(int j, int gcep) {
             /* We're done with the file, so close it */
             fclose(fp);
 
-            /* Make space for the game object representation. */
-            gobj = (game_object_t *)malloc((sz / 0x44) * sizeof(game_object_t));
-            if(!gobj) {
-                debug(DBG_ERROR, "Cannot allocate game objects: %s\n",
-                      strerror(errno));
-                free(obj);
-                fclose(fp);
-                return 9;
-            }
-
-            /* Store what we'll actually use later... */
-            for(i = 0; i < sz / 0x44; ++i) {
-                gobj[i].data = obj[i];
-                gobj[i].flags = 0;
-            }
-
-            /* Save it into the struct */
+            /* Save it into the struct. Games use the objects straight out of
+               here, so nothing touches them after this point. */
             tmp2[k * nvars + l].count = sz / 0x44;
-            tmp2[k * nvars + l].objs = gobj;
+            tmp2[k * nvars + l].objs = obj;
         }
     }
 
@@ -1386,210 +1359,93 @@ void gc_free_params(void) {
     }
 }
 
-int bb_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
-    int solo = (l->flags & LOBBY_FLAG_SINGLEPLAYER) ? 1 : 0, i;
-    uint32_t enemies = 0, index, objects = 0, index2;
-    parsed_map_t *maps;
-    parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
-
-    /* Figure out the parameter set that will be in use first... */
-    l->bb_params = battle_params[solo][l->episode - 1][l->difficulty];
-
-    /* Figure out the total number of enemies that the game will have... */
-    for(i = 0; i < 0x20; i += 2) {
-        maps = &bb_parsed_maps[solo][l->episode - 1][i >> 1];
-        objs = &bb_parsed_objs[solo][l->episode - 1][i >> 1];
-
-        /* If we hit zeroes, then we're done already... */
-        if(maps->map_count == 0 && maps->variation_count == 0) {
-            sets[i >> 1] = NULL;
-            break;
-        }
-
-        /* Sanity Check! */
-        if(l->maps[i] > maps->map_count ||
-           l->maps[i + 1] > maps->variation_count) {
-            debug(DBG_ERROR, "Invalid map set generated for level %d (ep %d): "
-                  "(%d %d)\n", i, l->episode, l->maps[i], l->maps[i + 1]);
-            return -1;
-        }
-
-        index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
-        sets[i >> 1] = &maps->data[index];
-        osets[i >> 1] = &objs->data[index];
+/* Figure out what Rappies turn into for the lobby's event. */
+static int event_rappy_rt(lobby_t *l) {
+    switch(l->event) {
+        case LOBBY_EVENT_CHRISTMAS:
+            return 79;
+        case LOBBY_EVENT_EASTER:
+            return 81;
+        case LOBBY_EVENT_HALLOWEEN:
+            return 80;
+        default:
+            return 51;
     }
+}
 
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
+/* Set up the enemies and objects for a game from the parsed map data for each
+   area. Nothing is copied out of the parsed data, the game just points into it
+   and keeps track of the state of each enemy and object itself. */
+static int load_game_map(lobby_t *l, parsed_map_t *maps, parsed_objs_t *objs,
+                         int rappy_rt) {
+    game_map_enemies_t *en;
+    game_map_objs_t *ob;
+    int i;
+    uint32_t enemies = 0, index, objects = 0;
+
+    /* Allocate space for the enemy and object sets. */
+    if(!(en = (game_map_enemies_t *)malloc(sizeof(game_map_enemies_t)))) {
         debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
         return -2;
     }
 
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
-    }
-
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
+    if(!(ob = (game_map_objs_t *)malloc(sizeof(game_map_objs_t)))) {
         debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
         free(en);
         return -4;
     }
 
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
-    }
+    memset(en, 0, sizeof(game_map_enemies_t));
+    memset(ob, 0, sizeof(game_map_objs_t));
 
-    en->count = enemies;
-    ob->count = objects;
-    index = index2 = 0;
-
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
-
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
-    }
-
-    /* Fixup Dark Falz' data for difficulties other than normal and the special
-       Rappy data too... */
-    for(i = 0; i < en->count; ++i) {
-        if(en->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            en->enemies[i].bp_entry = 0x38;
-        }
-        else if(en->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    en->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    en->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    en->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    en->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
-    }
-
-    /* Done! */
-    l->map_enemies = en;
-    l->map_objs = ob;
-    return 0;
-}
-
-int v2_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
-    int i;
-    uint32_t enemies = 0, index, objects = 0, index2;
-    parsed_map_t *maps;
-    parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
-
-    /* Figure out the total number of enemies that the game will have... */
+    /* Figure out which set of enemies and objects each area uses... */
     for(i = 0; i < 0x20; i += 2) {
-        maps = &v2_parsed_maps[i >> 1];
-        objs = &v2_parsed_objs[i >> 1];
-
         /* If we hit zeroes, then we're done already... */
-        if(maps->map_count == 0 && maps->variation_count == 0) {
-            sets[i >> 1] = NULL;
+        if(maps[i >> 1].map_count == 0 && maps[i >> 1].variation_count == 0)
             break;
-        }
 
         /* Sanity Check! */
-        if(l->maps[i] > maps->map_count ||
-           l->maps[i + 1] > maps->variation_count) {
+        if(l->maps[i] > maps[i >> 1].map_count ||
+           l->maps[i + 1] > maps[i >> 1].variation_count) {
             debug(DBG_ERROR, "Invalid map set generated for level %d (ep %d): "
                   "(%d %d)\n", i, l->episode, l->maps[i], l->maps[i + 1]);
+            free(ob);
+            free(en);
             return -1;
         }
 
-        index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
-        sets[i >> 1] = &maps->data[index];
-        osets[i >> 1] = &objs->data[index];
-    }
+        index = l->maps[i] * maps[i >> 1].variation_count + l->maps[i + 1];
 
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
-        return -2;
+        enemies += maps[i >> 1].data[index].count;
+        en->sets[en->set_count] = maps[i >> 1].data[index].enemies;
+        en->set_end[en->set_count++] = enemies;
+
+        objects += objs[i >> 1].data[index].count;
+        ob->sets[ob->set_count] = objs[i >> 1].data[index].objs;
+        ob->set_end[ob->set_count++] = objects;
     }
 
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
+    /* The only thing each game needs its own copy of is the state. */
+    if(!(en->state = (game_enemy_state_t *)calloc(enemies ? enemies : 1,
+                                                 sizeof(game_enemy_state_t)))) {
         debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
+        free(ob);
         free(en);
         return -3;
     }
 
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
-        return -4;
-    }
-
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
+    if(!(ob->flags = (uint8_t *)calloc(objects ? objects : 1, 1))) {
         debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
+        free(en->state);
         free(ob);
-        free(en->enemies);
         free(en);
         return -5;
     }
 
     en->count = enemies;
+    en->difficulty = l->difficulty;
+    en->rappy_rt = rappy_rt;
     ob->count = objects;
-    index = index2 = 0;
-
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
-
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
-
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
-    }
-
-    /* Fixup Dark Falz' data for difficulties other than normal... */
-    for(i = 0; i < en->count; ++i) {
-        if(en->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            en->enemies[i].bp_entry = 0x38;
-        }
-    }
 
     /* Done! */
     l->map_enemies = en;
@@ -1597,132 +1453,82 @@ int v2_load_game_enemies(lobby_t *l) {
     return 0;
 }
 
-int gc_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
-    int i;
-    uint32_t enemies = 0, index, objects = 0, index2;
-    parsed_map_t *maps;
-    parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
+int bb_load_game_enemies(lobby_t *l) {
+    int solo = (l->flags & LOBBY_FLAG_SINGLEPLAYER) ? 1 : 0;
 
-    /* Figure out the total number of enemies that the game will have... */
-    for(i = 0; i < 0x20; i += 2) {
-        maps = &gc_parsed_maps[l->episode - 1][i >> 1];
-        objs = &gc_parsed_objs[l->episode - 1][i >> 1];
+    /* Figure out the parameter set that will be in use first... */
+    l->bb_params = battle_params[solo][l->episode - 1][l->difficulty];
 
-        /* If we hit zeroes, then we're done already... */
-        if(maps->map_count == 0 && maps->variation_count == 0) {
-            sets[i >> 1] = NULL;
-            break;
-        }
+    return load_game_map(l, bb_parsed_maps[solo][l->episode - 1],
+                         bb_parsed_objs[solo][l->episode - 1],
+                         event_rappy_rt(l));
+}
 
-        /* Sanity Check! */
-        if(l->maps[i] > maps->map_count ||
-           l->maps[i + 1] > maps->variation_count) {
-            debug(DBG_ERROR, "Invalid map set generated for level %d (ep %d): "
-                  "(%d %d)\n", i, l->episode, l->maps[i], l->maps[i + 1]);
-            return -1;
-        }
+int v2_load_game_enemies(lobby_t *l) {
+    return load_game_map(l, v2_parsed_maps, v2_parsed_objs, -1);
+}
 
-        index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
-        sets[i >> 1] = &maps->data[index];
-        osets[i >> 1] = &objs->data[index];
-    }
+int gc_load_game_enemies(lobby_t *l) {
+    return load_game_map(l, gc_parsed_maps[l->episode - 1],
+                         gc_parsed_objs[l->episode - 1], event_rappy_rt(l));
+}
 
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
-        return -2;
+void free_game_enemies(lobby_t *l) {
+    if(l->map_enemies) {
+        quest_cache_unref(l->map_enemies->qcache);
+        free(l->map_enemies->state);
+        free(l->map_enemies);
     }
 
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
+    if(l->map_objs) {
+        quest_cache_unref(l->map_objs->qcache);
+        free(l->map_objs->flags);
+        free(l->map_objs);
     }
 
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
-        return -4;
-    }
+    l->map_enemies = NULL;
+    l->map_objs = NULL;
+    l->bb_params = NULL;
+}
 
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
-    }
+int game_enemy_lookup(const game_map_enemies_t *m, uint32_t mid,
+                      game_enemy_t *rv) {
+    uint32_t i;
 
-    en->count = enemies;
-    ob->count = objects;
-    index = index2 = 0;
+    if(mid >= m->count)
+        return -1;
 
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
+    /* Find the set the enemy is in. There's only one per area, so this is
+       never very far to look. */
+    i = 0;
 
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
+    while(mid >= m->set_end[i])
+        ++i;
 
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
-    }
+    *rv = m->sets[i][mid - (i ? m->set_end[i - 1] : 0)];
 
     /* Fixup Dark Falz' data for difficulties other than normal and the special
        Rappy data too... */
-    for(i = 0; i < en->count; ++i) {
-        if(en->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            en->enemies[i].bp_entry = 0x38;
-        }
-        else if(en->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    en->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    en->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    en->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    en->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
-    }
+    if(rv->bp_entry == 0x37 && m->difficulty)
+        rv->bp_entry = 0x38;
+    else if(rv->rt_index == (uint8_t)-1 && m->rappy_rt != -1)
+        rv->rt_index = (uint8_t)m->rappy_rt;
 
-    /* Done! */
-    l->map_enemies = en;
-    l->map_objs = ob;
     return 0;
 }
 
-void free_game_enemies(lobby_t *l) {
-    if(l->map_enemies) {
-        free(l->map_enemies->enemies);
-        free(l->map_enemies);
-    }
+const map_object_t *game_object_lookup(const game_map_objs_t *m, uint32_t id) {
+    uint32_t i;
 
-    if(l->map_objs) {
-        free(l->map_objs->objs);
-        free(l->map_objs);
-    }
+    if(id >= m->count)
+        return NULL;
 
-    l->map_enemies = NULL;
-    l->bb_params = NULL;
+    i = 0;
+
+    while(id >= m->set_end[i])
+        ++i;
+
+    return &m->sets[i][id - (i ? m->set_end[i - 1] : 0)];
 }
 
 int map_have_v2_maps(void) {
@@ -1770,62 +1576,90 @@ static void parse_quest_objects(const uint8_t *data, uint32_t len,
     *obj_cnt = obj_count;
 }
 
-int cache_quest_enemies(const char *ofn, const uint8_t *dat, uint32_t sz,
-                        int episode) {
+/* Make sure there's room for sz more bytes of data in the cache being built. */
+static int build_reserve(quest_cache_build_t *b, uint32_t sz) {
+    uint32_t size = b->size ? b->size : 65536;
+    void *tmp;
+
+    while(size < b->len + sz)
+        size <<= 1;
+
+    if(size != b->size) {
+        if(!(tmp = realloc(b->data, size))) {
+            debug(DBG_WARN, "Cannot allocate quest cache: %s\n",
+                  strerror(errno));
+            return -1;
+        }
+
+        b->data = (uint8_t *)tmp;
+        b->size = size;
+    }
+
+    return 0;
+}
+
+/* Make sure there's room for cnt more index entries in the cache being
+   built. */
+static int build_reserve_ents(quest_cache_build_t *b, uint32_t cnt) {
+    uint32_t size = b->ents_size ? b->ents_size : 64;
+    void *tmp;
+
+    while(size < b->count + cnt)
+        size <<= 1;
+
+    if(size != b->ents_size) {
+        if(!(tmp = realloc(b->ents, sizeof(quest_cache_ent_t) * size))) {
+            debug(DBG_WARN, "Cannot allocate quest cache index: %s\n",
+                  strerror(errno));
+            return -1;
+        }
+
+        b->ents = (quest_cache_ent_t *)tmp;
+        b->ents_size = size;
+    }
+
+    return 0;
+}
+
+int quest_cache_add(quest_cache_build_t *b, uint32_t qid, const uint8_t *dat,
+                    uint32_t sz, int episode, const quest_cache_src_t *src) {
     int i, alt;
-    uint32_t index, area, objects, j;
+    uint32_t area, objects, enemies = 0, start;
     const quest_dat_hdr_t *ptrs[2][17] = { { 0 } };
     game_enemies_t tmp_en;
-    FILE *fp;
     const quest_dat_hdr_t *hdr;
-    off_t offs;
+    quest_cache_ent_t *ent;
 
-    /* Open the cache file... */
-    if(!(fp = fopen(ofn, "wb"))) {
-        debug(DBG_WARN, "Cannot open cache file \"%s\" for writing: %s\n", ofn,
-              strerror(errno));
+    /* Make room for the index entry. */
+    if(build_reserve_ents(b, 1))
         return -1;
-    }
 
-    /* Figure out the total number of enemies that the quest has... */
+    /* Figure out the total number of objects that the quest has... */
     parse_quest_objects(dat, sz, &objects, ptrs);
+    start = b->len;
 
-    /* Write out the objects in exactly the same form that they'll be needed
-       when loaded later on. */
-    objects = LE32(objects);
-    if(fwrite(&objects, 1, 4, fp) != 4) {
-        debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n", ofn,
-              strerror(errno));
-        fclose(fp);
+    if(build_reserve(b, objects * sizeof(map_object_t)))
         return -2;
-    }
 
-    /* Run through each area and write them in order. */
+    /* Copy the objects in exactly the same form that they'll be needed when
+       loaded later on, in area order. */
     for(i = 0; i < 17; ++i) {
         if((hdr = ptrs[0][i])) {
-            sz = LE32(hdr->size);
-            objects = sz / sizeof(map_object_t);
-
-            for(j = 0; j < objects; ++j) {
-                /* Write the object itself. */
-                if(fwrite(hdr->data + j * sizeof(map_object_t), 1,
-                          sizeof(map_object_t), fp) != sizeof(map_object_t)) {
-                    debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n",
-                          ofn, strerror(errno));
-                    fclose(fp);
-                    return -3;
-                }
-            }
+            sz = (LE32(hdr->size) / sizeof(map_object_t)) *
+                sizeof(map_object_t);
+            memcpy(b->data + b->len, hdr->data, sz);
+            b->len += sz;
         }
     }
 
-    /* Save our position, as we don't know in advance how many parsed enemies
-       we will have... */
-    offs = ftello(fp);
-    fseeko(fp, 4, SEEK_CUR);
-    index = 0;
+    ent = &b->ents[b->count];
+    ent->qid = qid;
+    ent->obj_offset = start;
+    ent->obj_count = (b->len - start) / sizeof(map_object_t);
+    ent->enemy_offset = b->len;
+    ent->src = *src;
 
-    /* Copy in the enemy data. */
+    /* Parse and copy in the enemy data. */
     for(i = 0; i < 17; ++i) {
         if((hdr = ptrs[1][i])) {
             /* XXXX: Ugly! */
@@ -1839,48 +1673,431 @@ int cache_quest_enemies(const char *ofn, const uint8_t *dat, uint32_t sz,
             if(parse_map((map_enemy_t *)(hdr->data), sz / sizeof(map_enemy_t),
                          &tmp_en, episode, alt)) {
                 debug(DBG_WARN, "Canot parse map for cache!\n");
-                fclose(fp);
-                return -4;
+                b->len = start;
+                return -3;
             }
 
             sz = tmp_en.count * sizeof(game_enemy_t);
-            if(fwrite(tmp_en.enemies, 1, sz, fp) != sz) {
-                debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n", ofn,
-                      strerror(errno));
+
+            if(build_reserve(b, sz)) {
                 free(tmp_en.enemies);
-                fclose(fp);
-                return -5;
+                b->len = start;
+                return -4;
             }
 
-            index += tmp_en.count;
+            memcpy(b->data + b->len, tmp_en.enemies, sz);
+            b->len += sz;
+            enemies += tmp_en.count;
             free(tmp_en.enemies);
         }
     }
 
-    /* Go back and write the amount of enemies we have. */
-    fseeko(fp, offs, SEEK_SET);
-    index = LE32(index);
+    ent->enemy_count = enemies;
+    ++b->count;
+
+    return 0;
+}
+
+int quest_cache_copy(quest_cache_build_t *b, const quest_cache_t *c,
+                     const quest_cache_ent_t *ent,
+                     const quest_cache_src_t *src) {
+    uint32_t osz = LE32(ent->obj_count) * sizeof(map_object_t);
+    uint32_t esz = LE32(ent->enemy_count) * sizeof(game_enemy_t);
+    quest_cache_ent_t *nent;
+
+    if(build_reserve_ents(b, 1) || build_reserve(b, osz + esz))
+        return -1;
+
+    nent = &b->ents[b->count++];
+    nent->qid = LE32(ent->qid);
+    nent->obj_offset = b->len;
+    nent->obj_count = LE32(ent->obj_count);
+    memcpy(b->data + b->len, c->data + LE32(ent->obj_offset), osz);
+    b->len += osz;
+
+    nent->enemy_offset = b->len;
+    nent->enemy_count = LE32(ent->enemy_count);
+    memcpy(b->data + b->len, c->data + LE32(ent->enemy_offset), esz);
+    b->len += esz;
+
+    nent->src = *src;
+
+    return 0;
+}
+
+int quest_cache_merge(quest_cache_build_t *b, quest_cache_build_t *src) {
+    uint32_t i;
+    int rv = -1;
+
+    if(build_reserve_ents(b, src->count) || build_reserve(b, src->len))
+        goto out;
+
+    for(i = 0; i < src->count; ++i) {
+        b->ents[b->count] = src->ents[i];
+        b->ents[b->count].obj_offset += b->len;
+        b->ents[b->count].enemy_offset += b->len;
+        ++b->count;
+    }
+
+    memcpy(b->data + b->len, src->data, src->len);
+    b->len += src->len;
+    rv = 0;
+
+out:
+    quest_cache_build_free(src);
+    return rv;
+}
+
+static uint32_t cache_hash(uint32_t qid) {
+    return (qid * 0x9E3779B1U) ^ (qid >> 16);
+}
+
+const quest_cache_ent_t *quest_cache_find(const quest_cache_t *c,
+                                          uint32_t qid) {
+    uint32_t i = cache_hash(qid) & c->index_mask;
+
+    while(c->index[i].used) {
+        if(LE32(c->index[i].qid) == qid)
+            return &c->index[i];
 
-    if(fwrite(&index, 1, 4, fp) != 4) {
-        debug(DBG_WARN, "Error writing to cache file \"%s\": %s\n", ofn,
+        i = (i + 1) & c->index_mask;
+    }
+
+    return NULL;
+}
+
+/* The current cache for each version, and the lock that protects them and the
+   reference counts of all the caches. */
+static quest_cache_t *quest_caches[CLIENT_VERSION_COUNT];
+static pthread_mutex_t qcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void cache_free(quest_cache_t *c) {
+    if(c->mapped)
+        munmap(c->data, c->size);
+    else
+        free(c->data);
+
+    free(c);
+}
+
+static quest_cache_t *cache_ref(quest_cache_t *c) {
+    pthread_mutex_lock(&qcache_mutex);
+    ++c->refcnt;
+    pthread_mutex_unlock(&qcache_mutex);
+
+    return c;
+}
+
+/* Make a cache the current one for the version, handing over the caller's
+   reference to it. */
+static void cache_install(quest_cache_t *c, int ver) {
+    quest_cache_t *old;
+
+    pthread_mutex_lock(&qcache_mutex);
+    old = quest_caches[ver];
+    quest_caches[ver] = c;
+
+    if(old && !--old->refcnt)
+        cache_free(old);
+
+    pthread_mutex_unlock(&qcache_mutex);
+}
+
+/* Check over a cache. The cache takes ownership of the data either way. */
+static quest_cache_t *cache_check(uint8_t *data, size_t size, int mapped,
+                                  const char *fn) {
+    const quest_cache_hdr_t *hdr = (const quest_cache_hdr_t *)data;
+    const quest_cache_ent_t *ent;
+    quest_cache_t *c;
+    uint32_t i, isz, end, cnt = 0;
+
+    if(!(c = (quest_cache_t *)malloc(sizeof(quest_cache_t)))) {
+        debug(DBG_WARN, "Cannot allocate quest cache: %s\n", strerror(errno));
+        goto err;
+    }
+
+    c->refcnt = 1;
+    c->mapped = mapped;
+    c->data = data;
+    c->size = size;
+
+    /* Make sure the file is sane before anything goes anywhere near it. */
+    if(size < sizeof(quest_cache_hdr_t) ||
+       LE32(hdr->magic) != QUEST_CACHE_MAGIC ||
+       LE32(hdr->version) != QUEST_CACHE_VERSION ||
+       LE32(hdr->data_size) != size - sizeof(quest_cache_hdr_t)) {
+        debug(DBG_WARN, "Quest cache \"%s\" is invalid\n", fn);
+        goto err_free;
+    }
+
+    isz = LE32(hdr->index_size);
+
+    if(!isz || (isz & (isz - 1)) || isz > (size - sizeof(quest_cache_hdr_t)) /
+       sizeof(quest_cache_ent_t)) {
+        debug(DBG_WARN, "Quest cache \"%s\" has a bad index\n", fn);
+        goto err_free;
+    }
+
+    if(sylverant_crc32(data + sizeof(quest_cache_hdr_t),
+                       size - sizeof(quest_cache_hdr_t)) !=
+       LE32(hdr->checksum)) {
+        debug(DBG_WARN, "Quest cache \"%s\" is corrupt\n", fn);
+        goto err_free;
+    }
+
+    c->index = (const quest_cache_ent_t *)(data + sizeof(quest_cache_hdr_t));
+    c->index_mask = isz - 1;
+    c->count = LE32(hdr->quest_count);
+    end = sizeof(quest_cache_hdr_t) + isz * sizeof(quest_cache_ent_t);
+
+    /* Check every quest's data once here, so nothing needs to be checked when
+       a quest is loaded. */
+    for(i = 0; i < isz; ++i) {
+        ent = &c->index[i];
+
+        if(!ent->used)
+            continue;
+
+        if(LE32(ent->obj_offset) < end || LE32(ent->enemy_offset) < end ||
+           LE32(ent->obj_offset) > size || LE32(ent->enemy_offset) > size ||
+           (LE32(ent->obj_offset) & 3) || (LE32(ent->enemy_offset) & 3) ||
+           LE32(ent->obj_count) > (size - LE32(ent->obj_offset)) /
+           sizeof(map_object_t) ||
+           LE32(ent->enemy_count) > (size - LE32(ent->enemy_offset)) /
+           sizeof(game_enemy_t)) {
+            debug(DBG_WARN, "Quest cache \"%s\" has a bad entry\n", fn);
+            goto err_free;
+        }
+
+        ++cnt;
+    }
+
+    if(cnt != LE32(hdr->quest_count) || cnt == isz) {
+        debug(DBG_WARN, "Quest cache \"%s\" has a bad index\n", fn);
+        goto err_free;
+    }
+
+    return c;
+
+err_free:
+    cache_free(c);
+    return NULL;
+
+err:
+    if(mapped)
+        munmap(data, size);
+    else
+        free(data);
+
+    return NULL;
+}
+
+quest_cache_t *quest_cache_open(const char *fn) {
+    struct stat st;
+    void *data;
+    int fd;
+
+    if((fd = open(fn, O_RDONLY)) < 0) {
+        /* Not having a cache yet is perfectly normal. */
+        if(errno != ENOENT)
+            debug(DBG_WARN, "Cannot open quest cache \"%s\": %s\n", fn,
+                  strerror(errno));
+        return NULL;
+    }
+
+    if(fstat(fd, &st) || !st.st_size) {
+        debug(DBG_WARN, "Cannot stat quest cache \"%s\"\n", fn);
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(data == MAP_FAILED) {
+        debug(DBG_WARN, "Cannot map quest cache \"%s\": %s\n", fn,
+              strerror(errno));
+        return NULL;
+    }
+
+    return cache_check((uint8_t *)data, (size_t)st.st_size, 1, fn);
+}
+
+void quest_cache_set(quest_cache_t *c, int ver) {
+    cache_install(cache_ref(c), ver);
+}
+
+void quest_cache_clear(const char *fn, int ver) {
+    cache_install(NULL, ver);
+
+    if(unlink(fn) && errno != ENOENT) {
+        debug(DBG_WARN, "Cannot remove quest cache \"%s\": %s\n", fn,
+              strerror(errno));
+    }
+}
+
+int quest_cache_finish(quest_cache_build_t *b, const char *fn, int ver) {
+    quest_cache_hdr_t *hdr;
+    quest_cache_ent_t *idx;
+    uint32_t i, j, isz = 16, dstart, size;
+    uint8_t *buf = NULL;
+    char tfn[strlen(fn) + 5];
+    quest_cache_t *c;
+    FILE *fp;
+    int rv = -1;
+
+    /* Keep the index no more than half full. */
+    while(isz < b->count * 2)
+        isz <<= 1;
+
+    dstart = sizeof(quest_cache_hdr_t) + isz * sizeof(quest_cache_ent_t);
+    size = dstart + b->len;
+
+    if(!(buf = (uint8_t *)malloc(size))) {
+        debug(DBG_WARN, "Cannot allocate quest cache: %s\n", strerror(errno));
+        goto out;
+    }
+
+    memset(buf, 0, dstart);
+    memcpy(buf + dstart, b->data, b->len);
+    hdr = (quest_cache_hdr_t *)buf;
+    idx = (quest_cache_ent_t *)(buf + sizeof(quest_cache_hdr_t));
+
+    /* Fill in the index. */
+    for(i = 0; i < b->count; ++i) {
+        j = cache_hash(b->ents[i].qid) & (isz - 1);
+
+        while(idx[j].used && LE32(idx[j].qid) != b->ents[i].qid)
+            j = (j + 1) & (isz - 1);
+
+        idx[j].qid = LE32(b->ents[i].qid);
+        idx[j].used = LE32(1);
+        idx[j].obj_offset = LE32(b->ents[i].obj_offset + dstart);
+        idx[j].obj_count = LE32(b->ents[i].obj_count);
+        idx[j].enemy_offset = LE32(b->ents[i].enemy_offset + dstart);
+        idx[j].enemy_count = LE32(b->ents[i].enemy_count);
+        idx[j].src.mtime = LE64(b->ents[i].src.mtime);
+        idx[j].src.size = LE32(b->ents[i].src.size);
+        idx[j].src.checksum = LE32(b->ents[i].src.checksum);
+    }
+
+    hdr->magic = LE32(QUEST_CACHE_MAGIC);
+    hdr->version = LE32(QUEST_CACHE_VERSION);
+    hdr->index_size = LE32(isz);
+    hdr->data_size = LE32(size - sizeof(quest_cache_hdr_t));
+
+    for(i = 0; i < isz; ++i) {
+        if(idx[i].used)
+            ++hdr->quest_count;
+    }
+
+    hdr->quest_count = LE32(hdr->quest_count);
+    hdr->checksum = LE32(sylverant_crc32(buf + sizeof(quest_cache_hdr_t),
+                                         size - sizeof(quest_cache_hdr_t)));
+
+    /* Write it out to a temporary file and move it into place, so that a
+       cache that is already mapped in is never modified. */
+    sprintf(tfn, "%s.tmp", fn);
+
+    if(!(fp = fopen(tfn, "wb"))) {
+        debug(DBG_WARN, "Cannot open quest cache \"%s\" for writing: %s\n",
+              tfn, strerror(errno));
+        goto use_buf;
+    }
+
+    if(fwrite(buf, 1, size, fp) != size) {
+        debug(DBG_WARN, "Error writing quest cache \"%s\": %s\n", tfn,
               strerror(errno));
         fclose(fp);
-        return -6;
+        unlink(tfn);
+        goto use_buf;
     }
 
-    /* We're done with the cache file now, so clean up and return. */
-    fclose(fp);
-    return 0;
+    if(fclose(fp) || rename(tfn, fn)) {
+        debug(DBG_WARN, "Error writing quest cache \"%s\": %s\n", fn,
+              strerror(errno));
+        unlink(tfn);
+        goto use_buf;
+    }
+
+    if((c = quest_cache_open(fn))) {
+        cache_install(c, ver);
+        rv = 0;
+        goto out;
+    }
+
+use_buf:
+    /* If we couldn't use the file for some reason, keep the cache around in
+       memory instead. */
+    if((c = cache_check(buf, size, 0, fn))) {
+        cache_install(c, ver);
+        rv = 0;
+    }
+
+    buf = NULL;
+
+out:
+    free(buf);
+    quest_cache_build_free(b);
+
+    return rv;
+}
+
+void quest_cache_build_free(quest_cache_build_t *b) {
+    free(b->ents);
+    free(b->data);
+    memset(b, 0, sizeof(quest_cache_build_t));
+}
+
+quest_cache_t *quest_cache_get(int ver) {
+    quest_cache_t *rv;
+
+    pthread_mutex_lock(&qcache_mutex);
+
+    if((rv = quest_caches[ver]))
+        ++rv->refcnt;
+
+    pthread_mutex_unlock(&qcache_mutex);
+
+    return rv;
+}
+
+void quest_cache_unref(quest_cache_t *c) {
+    if(!c)
+        return;
+
+    pthread_mutex_lock(&qcache_mutex);
+
+    if(!--c->refcnt)
+        cache_free(c);
+
+    pthread_mutex_unlock(&qcache_mutex);
+}
+
+void quest_cache_cleanup(void) {
+    int i;
+
+    pthread_mutex_lock(&qcache_mutex);
+
+    for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
+        if(quest_caches[i] && !--quest_caches[i]->refcnt)
+            cache_free(quest_caches[i]);
+
+        quest_caches[i] = NULL;
+    }
+
+    pthread_mutex_unlock(&qcache_mutex);
 }
 
 int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
-    FILE *fp;
-    size_t dlen = strlen(ship->cfg->quests_dir);
-    char fn[dlen + 40];
-    void *tmp;
-    uint32_t cnt, i;
+    uint32_t ocnt, ecnt, i;
     sylverant_quest_t *q;
     quest_map_elem_t *el;
+    game_map_enemies_t *en = l->map_enemies;
+    game_map_objs_t *ob = l->map_objs;
+    quest_cache_t *qc;
+    const quest_cache_ent_t *ent;
+    void *tmp;
 
     /* If we aren't doing server-side drops on this game, don't bother. */
     if(!(l->flags & LOBBY_FLAG_SERVER_DROPS))
@@ -1894,96 +2111,62 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
         ver = CLIENT_VERSION_DCV2;
 
     /* Figure out where we're looking... */
-    sprintf(fn, "%s/.mapcache/%s/%08x", ship->cfg->quests_dir,
-            version_codes[ver], qid);
-
-    if(!(fp = fopen(fn, "rb"))) {
-        debug(DBG_WARN, "Cannot open file \"%s\": %s\n", fn, strerror(errno));
+    if(!(qc = quest_cache_get(ver))) {
+        debug(DBG_WARN, "No quest map cache for %s\n", version_codes[ver]);
         return -1;
     }
 
-    /* Start by reading in the objects array. */
-    if(fread(&cnt, 1, 4, fp) != 4) {
-        debug(DBG_WARN, "Cannot read file \"%s\": %s\n", fn, strerror(errno));
-        fclose(fp);
+    if(!(ent = quest_cache_find(qc, qid))) {
+        debug(DBG_WARN, "Quest %08x not in the %s map cache\n", qid,
+              version_codes[ver]);
+        quest_cache_unref(qc);
         return -2;
     }
 
-    /* Reallocate the objects array. */
-    l->map_objs->count = cnt = LE32(cnt);
-    if(!(tmp = realloc(l->map_objs->objs, cnt * sizeof(game_object_t)))) {
+    ocnt = LE32(ent->obj_count);
+    ecnt = LE32(ent->enemy_count);
+
+    /* Make room for the state of the quest's objects and enemies. */
+    if(!(tmp = realloc(ob->flags, ocnt + 1))) {
         debug(DBG_WARN, "Cannot reallocate objects array: %s\n",
               strerror(errno));
-        fclose(fp);
+        quest_cache_unref(qc);
         return -3;
     }
 
-    l->map_objs->objs = (game_object_t *)tmp;
+    ob->flags = (uint8_t *)tmp;
 
-    /* Read the objects in from the cache file. */
-    for(i = 0; i < cnt; ++i) {
-        if(fread(&l->map_objs->objs[i].data, 1, sizeof(map_object_t),
-                 fp) != sizeof(map_object_t)) {
-            debug(DBG_WARN, "Cannot read map cache: %s\n", strerror(errno));
-            fclose(fp);
-            return -4;
-        }
-
-        l->map_objs->objs[i].flags = 0;
-    }
-
-    if(fread(&cnt, 1, 4, fp) != 4) {
-        debug(DBG_WARN, "Cannot read file \"%s\": %s\n", fn, strerror(errno));
-        fclose(fp);
-        return -5;
-    }
-
-    /* Reallocate the enemies array. */
-    l->map_enemies->count = cnt = LE32(cnt);
-    if(!(tmp = realloc(l->map_enemies->enemies, cnt * sizeof(game_enemy_t)))) {
+    if(!(tmp = realloc(en->state, (ecnt + 1) * sizeof(game_enemy_state_t)))) {
         debug(DBG_WARN, "Cannot reallocate enemies array: %s\n",
               strerror(errno));
-        fclose(fp);
+        quest_cache_unref(qc);
         return -6;
     }
 
-    l->map_enemies->enemies = (game_enemy_t *)tmp;
+    en->state = (game_enemy_state_t *)tmp;
 
-    /* Read the enemies in from the cache file. */
-    if(fread(l->map_enemies->enemies, sizeof(game_enemy_t), cnt, fp) != cnt) {
-        debug(DBG_WARN, "Cannot read map cache: %s\n", strerror(errno));
-        fclose(fp);
-        return -7;
-    }
+    /* The quest's objects and enemies take the place of the ones from the
+       game's map, straight out of the cache. The Dark Falz and Rappy fixups
+       are done when the enemies are looked up, and quests always get the
+       Rappies for the event. */
+    memset(ob->flags, 0, ocnt);
+    quest_cache_unref(ob->qcache);
+    ob->qcache = qc;
+    ob->sets[0] = (const map_object_t *)(qc->data + LE32(ent->obj_offset));
+    ob->set_end[0] = ob->count = ocnt;
+    ob->set_count = 1;
 
-    /* Fixup Dark Falz' data for difficulties other than normal and the special
-       Rappy data too... */
-    for(i = 0; i < cnt; ++i) {
-        if(l->map_enemies->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            l->map_enemies->enemies[i].bp_entry = 0x38;
-        }
-        else if(l->map_enemies->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    l->map_enemies->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    l->map_enemies->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    l->map_enemies->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    l->map_enemies->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
-    }
+    memset(en->state, 0, ecnt * sizeof(game_enemy_state_t));
+    quest_cache_unref(en->qcache);
+    en->qcache = cache_ref(qc);
+    en->sets[0] = (const game_enemy_t *)(qc->data + LE32(ent->enemy_offset));
+    en->set_end[0] = en->count = ecnt;
+    en->set_count = 1;
+    en->rappy_rt = event_rappy_rt(l);
 
     /* Find the quest since we need to check the enemies later for drops... */
     if(!(el = quest_lookup(&ship->qmap, qid))) {
         debug(DBG_WARN, "Cannot look up quest?!\n");
-        fclose(fp);
         return -8;
     }
 
@@ -2007,7 +2190,6 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
     l->num_mtypes = q->num_monster_types;
     if(!(l->mtypes = (qenemy_t *)malloc(sizeof(qenemy_t) * l->num_mtypes))) {
         debug(DBG_WARN, "Cannot allocate monster types: %s\n", strerror(errno));
-        fclose(fp);
         l->num_mtypes = 0;
         return -9;
     }
@@ -2015,7 +2197,6 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
     l->num_mids = q->num_monster_ids;
     if(!(l->mids = (qenemy_t *)malloc(sizeof(qenemy_t) * l->num_mids))) {
         debug(DBG_WARN, "Cannot allocate monster ids: %s\n", strerror(errno));
-        fclose(fp);
         free(l->mtypes);
         l->mtypes = NULL;
         l->num_mtypes = 0;
@@ -2027,9 +2208,8 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
     memcpy(l->mids, q->monster_ids, sizeof(qenemy_t) * l->num_mids);
 
 done:
-    /* Re-set the server drops flag and clean up. */
+    /* Re-set the server drops flag and we're done. */
     l->flags |= LOBBY_FLAG_SERVER_DROPS;
-    fclose(fp);
 
     return 0;
 }
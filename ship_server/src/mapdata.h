@@ -107,13 +107,13 @@ typedef struct map_object {
     };
 } PACKED map_object_t;
 
-/* Enemy data as used in the game. */
+/* Enemy data as parsed from the map files. This is shared between all games
+   that use the same map variations, so it is never modified once it has been
+   parsed. The layout of this is also used in the quest map cache files. */
 typedef struct game_enemy {
     uint32_t bp_entry;
     uint8_t rt_index;
-    uint8_t clients_hit;
-    uint8_t last_client;
-    uint8_t drop_done;
+    uint8_t reserved[3];
 } game_enemy_t;
 
 typedef struct game_enemies {
@@ -127,15 +127,9 @@ typedef struct parsed_map {
     game_enemies_t *data;
 } parsed_map_t;
 
-/* Object data as used in the game. */
-typedef struct game_object {
-    map_object_t data;
-    uint32_t flags;
-} game_object_t;
-
 typedef struct game_objects {
     uint32_t count;
-    game_object_t *objs;
+    map_object_t *objs;
 } game_objs_t;
 
 typedef struct parsed_objects {
@@ -144,6 +138,113 @@ typedef struct parsed_objects {
     game_objs_t *data;
 } parsed_objs_t;
 
+/* The most sets of enemies/objects that a game's map can be made up of (one
+   per area). */
+#define GAME_MAP_MAX_SETS   0x11
+
+/* What has happened to an enemy in a game. */
+typedef struct game_enemy_state {
+    uint8_t clients_hit;
+    uint8_t last_client;
+    uint8_t drop_done;
+} game_enemy_state_t;
+
+/* The enemies in a game. The enemy data itself is referenced from the parsed
+   map data for each area (or from the quest's data), so the only thing that
+   each game gets its own copy of is the state of each enemy. */
+typedef struct game_map_enemies {
+    uint32_t count;
+    uint32_t set_count;
+    const game_enemy_t *sets[GAME_MAP_MAX_SETS];
+    uint32_t set_end[GAME_MAP_MAX_SETS];
+
+    /* Fixups for the game's difficulty and the current event, applied when an
+       enemy is looked up. rappy_rt is -1 if Rappies are left alone. */
+    int difficulty;
+    int rappy_rt;
+
+    /* The quest map cache the enemies came from, if they're from a quest. */
+    struct quest_cache *qcache;
+
+    game_enemy_state_t *state;
+} game_map_enemies_t;
+
+/* The objects in a game, shared in the same way as the enemies. */
+typedef struct game_map_objs {
+    uint32_t count;
+    uint32_t set_count;
+    const map_object_t *sets[GAME_MAP_MAX_SETS];
+    uint32_t set_end[GAME_MAP_MAX_SETS];
+
+    struct quest_cache *qcache;
+
+    /* Per-object flags for this game (0x01 = box opened). */
+    uint8_t *flags;
+} game_map_objs_t;
+
+/* The quest map cache. There is one cache file for each version, holding the
+   objects and enemies of every quest for that version and an index to find
+   each quest's data by its id. The file is mapped into memory, and games
+   playing a quest use the data straight out of the mapping. All values in the
+   header and index are little-endian. */
+#define QUEST_CACHE_MAGIC   0x43514D53      /* "SMQC" */
+#define QUEST_CACHE_VERSION 2
+
+typedef struct quest_cache_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t index_size;                    /* Slots in the index */
+    uint32_t quest_count;
+    uint32_t data_size;                     /* Bytes after the header */
+    uint32_t checksum;                      /* CRC32 of the same */
+    uint32_t reserved[2];
+} quest_cache_hdr_t;
+
+/* The quest file that a quest's data was parsed out of. When the cache is
+   rebuilt, a quest whose file still matches this is copied over as it is
+   instead of being parsed again. */
+typedef struct quest_cache_src {
+    uint64_t mtime;
+    uint32_t size;
+    uint32_t checksum;                      /* CRC32 of the whole file */
+} quest_cache_src_t;
+
+/* One slot in the index. The index is an open-addressed hash table keyed by
+   the quest id, with the offsets counted from the start of the file. */
+typedef struct quest_cache_ent {
+    uint32_t qid;
+    uint32_t used;
+    uint32_t obj_offset;
+    uint32_t obj_count;
+    uint32_t enemy_offset;
+    uint32_t enemy_count;
+    quest_cache_src_t src;
+} quest_cache_ent_t;
+
+/* A cache file that has been mapped in. Each game playing one of its quests
+   holds a reference to it, so it sticks around until the last of them is done
+   even if the quests are reloaded. */
+typedef struct quest_cache {
+    int refcnt;
+    int mapped;
+    uint8_t *data;
+    size_t size;
+    const quest_cache_ent_t *index;
+    uint32_t index_mask;
+    uint32_t count;                         /* Quests in the cache */
+} quest_cache_t;
+
+/* A cache file that is being built. */
+typedef struct quest_cache_build {
+    quest_cache_ent_t *ents;
+    uint32_t count;
+    uint32_t ents_size;
+
+    uint8_t *data;
+    uint32_t len;
+    uint32_t size;
+} quest_cache_build_t;
+
 #undef PACKED
 
 #ifndef LOBBY_DEFINED
@@ -169,11 +270,64 @@ int v2_load_game_enemies(lobby_t *l);
 int gc_load_game_enemies(lobby_t *l);
 void free_game_enemies(lobby_t *l);
 
+/* Look up an enemy in a game, with the game's fixups applied to it. Returns -1
+   if the game doesn't have the enemy. */
+int game_enemy_lookup(const game_map_enemies_t *m, uint32_t mid,
+                      game_enemy_t *rv);
+
+/* Look up an object in a game. Returns NULL if the game doesn't have it. */
+const map_object_t *game_object_lookup(const game_map_objs_t *m, uint32_t id);
+
 int map_have_v2_maps(void);
 int map_have_gc_maps(void);
 
 int load_quest_enemies(lobby_t *l, uint32_t qid, int ver);
-int cache_quest_enemies(const char *ofn, const uint8_t *dat, uint32_t sz,
-                        int episode);
+
+/* Parse the objects and enemies out of a quest's .dat data and add them to the
+   cache being built. This doesn't touch anything outside of the builder, so
+   separate builders can be filled in on separate threads. */
+int quest_cache_add(quest_cache_build_t *b, uint32_t qid, const uint8_t *dat,
+                    uint32_t sz, int episode, const quest_cache_src_t *src);
+
+/* Copy a quest's data from an existing cache into the cache being built,
+   recording the given source file for it. */
+int quest_cache_copy(quest_cache_build_t *b, const quest_cache_t *c,
+                     const quest_cache_ent_t *ent,
+                     const quest_cache_src_t *src);
+
+/* Move everything from one cache being built onto the end of another. The
+   source builder is emptied either way. */
+int quest_cache_merge(quest_cache_build_t *b, quest_cache_build_t *src);
+
+/* Write out the cache that has been built and map it in, replacing the current
+   cache for the version. The builder is emptied either way. */
+int quest_cache_finish(quest_cache_build_t *b, const char *fn, int ver);
+
+/* Throw away a cache that is being built. */
+void quest_cache_build_free(quest_cache_build_t *b);
+
+/* Map in and check over a cache file without using it for anything. Returns
+   NULL if the file doesn't exist or isn't usable. */
+quest_cache_t *quest_cache_open(const char *fn);
+
+/* Look up a quest in a cache. All values in the entry are little-endian. */
+const quest_cache_ent_t *quest_cache_find(const quest_cache_t *c,
+                                          uint32_t qid);
+
+/* Make a cache the current one for a version. This takes its own reference
+   to the cache. */
+void quest_cache_set(quest_cache_t *c, int ver);
+
+/* Drop the current cache for a version, and the file it was stored in, when
+   there are no quests to put in it anymore. */
+void quest_cache_clear(const char *fn, int ver);
+
+/* Grab a reference to the current cache for a version (NULL if there isn't
+   one), and drop a reference to a cache. */
+quest_cache_t *quest_cache_get(int ver);
+void quest_cache_unref(quest_cache_t *c);
+
+/* Drop all of the current caches. */
+void quest_cache_cleanup(void);
 
 #endif /* !MAPDATA_H */
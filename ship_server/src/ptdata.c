@@ -1352,7 +1352,7 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
     int area, do_rare = 1;
     struct mt19937_state *rng = &c->cur_block->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
+    game_enemy_state_t *enemy;
     int csr = 0;
     uint32_t qdrop = 0xFFFFFFFF;
 
@@ -1394,7 +1394,7 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Make sure the enemy's id is sane... */
     mid = LE16(req->req);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard, mid,
               l->map_enemies->count, l->qid);
@@ -1402,7 +1402,7 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
+    enemy = &l->map_enemies->state[mid];
     if(enemy->drop_done)
         return 0;
 
@@ -1592,8 +1592,8 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->v1.section;
     pt_v2_entry_t *ent = &v2_ptdata[l->difficulty][section];
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    uint8_t *flags;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, do_rare = 1;
     uint32_t item[4];
@@ -1608,18 +1608,18 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001)
+    flags = &l->map_objs->flags[obj_id];
+    if(*flags & 0x01)
         return 0;
 
-    obj = &gobj->data;
+    obj = game_object_lookup(l->map_objs, obj_id);
 
     /* Figure out the area we'll be worried with */
     area = c->cur_area;
@@ -1650,7 +1650,7 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --area;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    *flags |= 0x01;
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
@@ -1861,7 +1861,7 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
     int area, do_rare = 1;
     struct mt19937_state *rng = &c->cur_block->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
+    game_enemy_state_t *enemy;
     int csr = 0;
 
     /* Make sure the PT index in the packet is sane */
@@ -1940,7 +1940,7 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Make sure the enemy's id is sane... */
     mid = LE16(req->req);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard, mid,
               l->map_enemies->count, l->qid);
@@ -1948,7 +1948,7 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
+    enemy = &l->map_enemies->state[mid];
     if(enemy->drop_done)
         return 0;
 
@@ -2110,8 +2110,8 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->v1.section;
     pt_v3_entry_t *ent = &gc_ptdata[l->episode][l->difficulty][section];
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    uint8_t *flags;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, do_rare = 1;
     uint32_t item[4];
@@ -2125,18 +2125,18 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001)
+    flags = &l->map_objs->flags[obj_id];
+    if(*flags & 0x01)
         return 0;
 
-    obj = &gobj->data;
+    obj = game_object_lookup(l->map_objs, obj_id);
 
     /* Figure out the area we'll be worried with */
     area = c->cur_area;
@@ -2197,7 +2197,7 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --area;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    *flags |= 0x01;
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
@@ -2388,7 +2388,7 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
     int area, do_rare = 1;
     struct mt19937_state *rng = &c->cur_block->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
+    game_enemy_state_t *enemy;
     int csr = 0;
 
     /* XXXX: Handle Episode 4 */
@@ -2464,7 +2464,7 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Make sure the enemy's id is sane... */
     mid = LE16(req->req);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard, mid,
               l->map_enemies->count, l->qid);
@@ -2472,7 +2472,7 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
+    enemy = &l->map_enemies->state[mid];
     if(enemy->drop_done)
         return 0;
 
@@ -2634,8 +2634,8 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->bb.character.section;
     pt_v3_entry_t *ent;
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    uint8_t *flags;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, do_rare = 1;
     uint32_t item[4];
@@ -2655,18 +2655,18 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001)
+    flags = &l->map_objs->flags[obj_id];
+    if(*flags & 0x01)
         return 0;
 
-    obj = &gobj->data;
+    obj = game_object_lookup(l->map_objs, obj_id);
 
     /* Figure out the area we'll be worried with */
     area = c->cur_area;
@@ -2727,7 +2727,7 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --area;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    *flags |= 0x01;
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
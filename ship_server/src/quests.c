@@ -18,23 +18,47 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <iconv.h>
 
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <sylverant/debug.h>
 #include <sylverant/prs.h>
+#include <sylverant/checksum.h>
 
 #include "quests.h"
 #include "clients.h"
 #include "mapdata.h"
 #include "ship.h"
 #include "packets.h"
+#include "ship_packets.h"
+
+static uint32_t quest_hash(uint32_t qid) {
+    qid ^= qid >> 16;
+    qid *= 0x7FEB352DU;
+    qid ^= qid >> 15;
+
+    return qid;
+}
+
+void quest_map_init(quest_map_t *map) {
+    TAILQ_INIT(&map->list);
+    map->hash = NULL;
+    map->hash_mask = 0;
+    map->count = 0;
+}
 
 /* Find a quest by ID, if it exists */
 quest_map_elem_t *quest_lookup(quest_map_t *map, uint32_t qid) {
     quest_map_elem_t *i;
 
-    TAILQ_FOREACH(i, map, qentry) {
+    if(!map->hash)
+        return NULL;
+
+    for(i = map->hash[quest_hash(qid) & map->hash_mask]; i; i = i->hnext) {
         if(qid == i->qid) {
             return i;
         }
@@ -43,9 +67,39 @@ quest_map_elem_t *quest_lookup(quest_map_t *map, uint32_t qid) {
     return NULL;
 }
 
+/* Make the hash table bigger, keeping it no more than about full. */
+static int quest_rehash(quest_map_t *map) {
+    uint32_t size = map->hash ? (map->hash_mask + 1) << 1 : 64;
+    quest_map_elem_t **hash, *i;
+
+    hash = (quest_map_elem_t **)calloc(size, sizeof(quest_map_elem_t *));
+
+    if(!hash) {
+        return -1;
+    }
+
+    TAILQ_FOREACH(i, &map->list, qentry) {
+        i->hnext = hash[quest_hash(i->qid) & (size - 1)];
+        hash[quest_hash(i->qid) & (size - 1)] = i;
+    }
+
+    free(map->hash);
+    map->hash = hash;
+    map->hash_mask = size - 1;
+
+    return 0;
+}
+
 /* Add a quest to the list */
 quest_map_elem_t *quest_add(quest_map_t *map, uint32_t qid) {
     quest_map_elem_t *el;
+    uint32_t h;
+
+    if(!map->hash || map->count > map->hash_mask) {
+        if(quest_rehash(map)) {
+            return NULL;
+        }
+    }
 
     /* Create the element */
     el = (quest_map_elem_t *)malloc(sizeof(quest_map_elem_t));
@@ -58,8 +112,13 @@ quest_map_elem_t *quest_add(quest_map_t *map, uint32_t qid) {
     memset(el, 0, sizeof(quest_map_elem_t));
     el->qid = qid;
 
-    /* Add to the list */
-    TAILQ_INSERT_TAIL(map, el, qentry);
+    /* Add to the list and the hash table */
+    TAILQ_INSERT_TAIL(&map->list, el, qentry);
+    h = quest_hash(qid) & map->hash_mask;
+    el->hnext = map->hash[h];
+    map->hash[h] = el;
+    ++map->count;
+
     return el;
 }
 
@@ -68,7 +127,7 @@ void quest_cleanup(quest_map_t *map) {
     quest_map_elem_t *tmp, *i;
 
     /* Remove all elements, freeing them as we go along */
-    i = TAILQ_FIRST(map);
+    i = TAILQ_FIRST(&map->list);
     while(i) {
         tmp = TAILQ_NEXT(i, qentry);
 
@@ -76,8 +135,10 @@ void quest_cleanup(quest_map_t *map) {
         i = tmp;
     }
 
+    free(map->hash);
+
     /* Reinit the map, just in case we reuse it */
-    TAILQ_INIT(map);
+    quest_map_init(map);
 }
 
 /* Process an entire list of quests read in for a version/language combo. */
@@ -136,25 +197,6 @@ static uint32_t quest_cat_type(ship_t *s, int ver, int lang,
     return 0;
 }
 
-static int check_cache_age(const char *fn1, const char *fn2) {
-    struct stat s1, s2;
-
-    if(stat(fn1, &s1))
-        return -1;
-
-    if(stat(fn2, &s2))
-        /* Assume it doesn't exist */
-        return 1;
-
-    if(s1.st_mtime >= s2.st_mtime)
-        /* The quest file is newer than the cache, regenerate it. */
-        return 1;
-
-    /* The cache file is newer than the quest, so we should be safe to use what
-       we already have. */
-    return 0;
-}
-
 static uint8_t *decompress_dat(uint8_t *inbuf, uint32_t insz, uint32_t *osz) {
     uint8_t *rv;
     int sz;
@@ -168,10 +210,10 @@ static uint8_t *decompress_dat(uint8_t *inbuf, uint32_t insz, uint32_t *osz) {
     return rv;
 }
 
-static uint8_t *read_and_dec_dat(const char *fn, uint32_t *osz) {
+static uint8_t *read_quest_file(const char *fn, uint32_t *osz) {
     FILE *fp;
     off_t sz;
-    uint8_t *buf, *rv;
+    uint8_t *buf;
 
     /* Read the file in. */
     if(!(fp = fopen(fn, "rb"))) {
@@ -184,15 +226,15 @@ static uint8_t *read_and_dec_dat(const char *fn, uint32_t *osz) {
     sz = ftello(fp);
     fseeko(fp, 0, SEEK_SET);
 
-    if(!(buf = (uint8_t *)malloc(sz))) {
-        debug(DBG_WARN, "Cannot allocate memory to read dat: %s\n",
+    if(sz <= 0 || !(buf = (uint8_t *)malloc(sz))) {
+        debug(DBG_WARN, "Cannot allocate memory to read quest: %s\n",
               strerror(errno));
         fclose(fp);
         return NULL;
     }
 
     if(fread(buf, 1, sz, fp) != sz) {
-        debug(DBG_WARN, "Cannot read dat: %s\n", strerror(errno));
+        debug(DBG_WARN, "Cannot read quest: %s\n", strerror(errno));
         free(buf);
         fclose(fp);
         return NULL;
@@ -200,10 +242,8 @@ static uint8_t *read_and_dec_dat(const char *fn, uint32_t *osz) {
 
     fclose(fp);
 
-    /* Return it decompressed. */
-    rv = decompress_dat(buf, (uint32_t)sz, osz);
-    free(buf);
-    return rv;
+    *osz = (uint32_t)sz;
+    return buf;
 }
 
 static uint32_t qst_dat_size(const uint8_t *buf, int ver) {
@@ -434,50 +474,22 @@ static int copy_bb_qst_dat(const uint8_t *buf, uint8_t *rbuf, off_t sz,
     return 0;
 }
 
-static uint8_t *read_and_dec_qst(const char *fn, uint32_t *osz, int ver) {
-    FILE *fp;
-    off_t sz;
-    uint8_t *buf, *buf2, *rv;
+/* Pull the .dat out of a qst file that has been read in, and decompress it.
+   The qst data is left alone. */
+static uint8_t *dec_qst(const char *fn, const uint8_t *buf, uint32_t sz,
+                        uint32_t *osz, int ver) {
+    uint8_t *buf2, *rv;
     uint32_t dsz;
 
-    /* Read the file in. */
-    if(!(fp = fopen(fn, "rb"))) {
-        debug(DBG_WARN, "Cannot open quest file \"%s\": %s\n", fn,
-              strerror(errno));
-        return NULL;
-    }
-
-    fseeko(fp, 0, SEEK_END);
-    sz = ftello(fp);
-    fseeko(fp, 0, SEEK_SET);
-
     /* Make sure the file's size is sane. */
     if(sz < 120) {
         debug(DBG_WARN, "Quest file \"%s\" too small\n", fn);
-        fclose(fp);
-        return NULL;
-    }
-
-    if(!(buf = (uint8_t *)malloc(sz))) {
-        debug(DBG_WARN, "Cannot allocate memory to read qst: %s\n",
-              strerror(errno));
-        fclose(fp);
-        return NULL;
-    }
-
-    if(fread(buf, 1, sz, fp) != sz) {
-        debug(DBG_WARN, "Cannot read qst: %s\n", strerror(errno));
-        free(buf);
-        fclose(fp);
         return NULL;
     }
 
-    fclose(fp);
-
     /* Figure out how big the .dat portion is. */
     if(!(dsz = qst_dat_size(buf, ver))) {
         debug(DBG_WARN, "Cannot find dat size in qst \"%s\"\n", fn);
-        free(buf);
         return NULL;
     }
 
@@ -485,7 +497,6 @@ static uint8_t *read_and_dec_qst(const char *fn, uint32_t *osz, int ver) {
     if(!(buf2 = (uint8_t *)malloc(dsz))) {
         debug(DBG_WARN, "Cannot allocate memory to decode qst: %s\n",
               strerror(errno));
-        free(buf);
         return NULL;
     }
 
@@ -499,7 +510,6 @@ static uint8_t *read_and_dec_qst(const char *fn, uint32_t *osz, int ver) {
             if(copy_dc_qst_dat(buf, buf2, sz, dsz)) {
                 debug(DBG_WARN, "Error decoding qst \"%s\", see above.\n", fn);
                 free(buf2);
-                free(buf);
                 return NULL;
             }
 
@@ -509,7 +519,6 @@ static uint8_t *read_and_dec_qst(const char *fn, uint32_t *osz, int ver) {
             if(copy_pc_qst_dat(buf, buf2, sz, dsz)) {
                 debug(DBG_WARN, "Error decoding qst \"%s\", see above.\n", fn);
                 free(buf2);
-                free(buf);
                 return NULL;
             }
 
@@ -519,7 +528,6 @@ static uint8_t *read_and_dec_qst(const char *fn, uint32_t *osz, int ver) {
             if(copy_bb_qst_dat(buf, buf2, sz, dsz)) {
                 debug(DBG_WARN, "Error decoding qst \"%s\", see above.\n", fn);
                 free(buf2);
-                free(buf);
                 return NULL;
             }
 
@@ -527,32 +535,159 @@ static uint8_t *read_and_dec_qst(const char *fn, uint32_t *osz, int ver) {
 
         default:
             free(buf2);
-            free(buf);
             return NULL;
     }
 
-    /* We're done with the first buffer, so clean it up. */
-    free(buf);
-
     /* Return the dat decompressed. */
     rv = decompress_dat(buf2, (uint32_t)dsz, osz);
     free(buf2);
     return rv;
 }
 
-/* Build/rebuild the quest enemy/object data cache. */
+/* The most threads to parse quests on when building the map caches. */
+#define CACHE_MAX_THREADS   8
+
+#define CACHE_JOB_PENDING   0
+#define CACHE_JOB_REUSE     1
+#define CACHE_JOB_BUILT     2
+#define CACHE_JOB_FAILED    3
+
+/* One quest to be put into a map cache. */
+typedef struct cache_job {
+    char *fn;
+    uint32_t qid;
+    int episode;
+    int format;
+    int ver;
+    int state;
+
+    quest_cache_src_t src;
+    const quest_cache_ent_t *old;
+    quest_cache_build_t b;
+} cache_job_t;
+
+/* The quests for one version, shared between all of the threads. */
+typedef struct cache_work {
+    pthread_mutex_t mutex;
+    cache_job_t *jobs;
+    int count;
+    int next;
+} cache_work_t;
+
+static void cache_do_job(cache_job_t *j) {
+    uint8_t *buf, *dat;
+    uint32_t sz, dat_sz;
+
+    j->state = CACHE_JOB_FAILED;
+
+    if(!(buf = read_quest_file(j->fn, &sz)))
+        return;
+
+    j->src.size = sz;
+    j->src.checksum = sylverant_crc32(buf, sz);
+
+    /* If all that changed was the time on the file, the old data is still
+       good to use. */
+    if(j->old && LE32(j->old->src.size) == sz &&
+       LE32(j->old->src.checksum) == j->src.checksum) {
+        j->state = CACHE_JOB_REUSE;
+        free(buf);
+        return;
+    }
+
+    if(j->format == SYLVERANT_QUEST_BINDAT)
+        dat = decompress_dat(buf, sz, &dat_sz);
+    else
+        dat = dec_qst(j->fn, buf, sz, &dat_sz, j->ver);
+
+    free(buf);
+
+    if(!dat)
+        return;
+
+    if(!quest_cache_add(&j->b, j->qid, dat, dat_sz, j->episode, &j->src))
+        j->state = CACHE_JOB_BUILT;
+
+    free(dat);
+}
+
+static void *cache_thd(void *d) {
+    cache_work_t *w = (cache_work_t *)d;
+    int i;
+
+    for(;;) {
+        /* Grab the next quest that needs to be looked at. */
+        pthread_mutex_lock(&w->mutex);
+
+        while(w->next < w->count &&
+              w->jobs[w->next].state != CACHE_JOB_PENDING)
+            ++w->next;
+
+        i = w->next++;
+        pthread_mutex_unlock(&w->mutex);
+
+        if(i >= w->count)
+            return NULL;
+
+        cache_do_job(&w->jobs[i]);
+    }
+}
+
+/* Run all of the pending jobs, spread out over as many threads as make
+   sense. The calling thread does its share of the work too. Returns the
+   number of threads used. */
+static int cache_run_jobs(cache_work_t *w, int pending) {
+    pthread_t thds[CACHE_MAX_THREADS - 1];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, nthds;
+
+    if(ncpu < 1)
+        ncpu = 1;
+    else if(ncpu > CACHE_MAX_THREADS)
+        ncpu = CACHE_MAX_THREADS;
+
+    if(ncpu > pending)
+        ncpu = pending;
+
+    w->next = 0;
+
+    for(nthds = 0; nthds < ncpu - 1; ++nthds) {
+        if(pthread_create(&thds[nthds], NULL, &cache_thd, w)) {
+            debug(DBG_WARN, "Cannot start map cache thread\n");
+            break;
+        }
+    }
+
+    cache_thd(w);
+
+    for(i = 0; i < nthds; ++i) {
+        pthread_join(thds[i], NULL);
+    }
+
+    return nthds + 1;
+}
+
+/* Build/rebuild the quest enemy/object data cache. Quests that haven't
+   changed since the last time are copied over from the old cache, and the
+   rest are parsed on a handful of threads. */
 int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
     quest_map_elem_t *i;
     size_t dlen = strlen(dir);
-    char mdir[dlen + 20];
-    char *fn1, *fn2;
-    int j, k;
+    char mdir[dlen + 25];
+    char *fn1;
+    int j, k, n, count = 0, pending, reused, parsed, nthds, rv = 0;
     sylverant_quest_t *q;
     const static char exts[2][4] = { "dat", "qst" };
-    uint8_t *dat;
-    uint32_t dat_sz, tmp;
-
-    /* Make sure we have all the directories we'll need. */
+    uint32_t tmp;
+    quest_cache_build_t b;
+    quest_cache_t *old = NULL;
+    cache_work_t w;
+    cache_job_t *job;
+    struct stat st;
+    struct timeval start, end;
+    long msecs;
+
+    /* Make sure we have the directory we'll need. */
     sprintf(mdir, "%s/.mapcache", dir);
     if(mkdir(mdir, 0755) && errno != EEXIST) {
         debug(DBG_ERROR, "Error creating map cache directory: %s\n",
@@ -560,41 +695,52 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
         return -1;
     }
 
-    sprintf(mdir, "%s/.mapcache/v1", dir);
-    if(mkdir(mdir, 0755) && errno != EEXIST) {
-        debug(DBG_ERROR, "Error creating map cache directory: %s\n",
-              strerror(errno));
-        return -1;
-    }
+    memset(&b, 0, sizeof(quest_cache_build_t));
+    memset(&w, 0, sizeof(cache_work_t));
+    pthread_mutex_init(&w.mutex, NULL);
 
-    sprintf(mdir, "%s/.mapcache/v2", dir);
-    if(mkdir(mdir, 0755) && errno != EEXIST) {
-        debug(DBG_ERROR, "Error creating map cache directory: %s\n",
-              strerror(errno));
-        return -1;
+    /* There can't be any more quests than there are entries in the map. */
+    TAILQ_FOREACH(i, &map->list, qentry) {
+        ++w.count;
     }
 
-    sprintf(mdir, "%s/.mapcache/gc", dir);
-    if(mkdir(mdir, 0755) && errno != EEXIST) {
-        debug(DBG_ERROR, "Error creating map cache directory: %s\n",
-              strerror(errno));
-        return -1;
+    /* With no quests at all, any caches from before are just stale. */
+    if(!w.count) {
+        for(j = 0; j < CLIENT_VERSION_COUNT; ++j) {
+            if(j == CLIENT_VERSION_PC)
+                continue;
+
+            sprintf(mdir, "%s/.mapcache/%s.cache", dir, version_codes[j]);
+            quest_cache_clear(mdir, j);
+        }
+
+        goto out;
     }
 
-    sprintf(mdir, "%s/.mapcache/bb", dir);
-    if(mkdir(mdir, 0755) && errno != EEXIST) {
-        debug(DBG_ERROR, "Error creating map cache directory: %s\n",
-              strerror(errno));
-        return -1;
+    if(!(w.jobs = (cache_job_t *)malloc(sizeof(cache_job_t) * w.count))) {
+        debug(DBG_ERROR, "Error allocating memory: %s\n", strerror(errno));
+        rv = -1;
+        goto out;
     }
 
-    TAILQ_FOREACH(i, map, qentry) {
-        /* Process it. */
-        for(j = 0; j < CLIENT_VERSION_COUNT; ++j) {
-            /* Skip PC, it is the same as v2. */
-            if(j == CLIENT_VERSION_PC)
-                continue;
+    /* Build one cache file for each version with all of its quests in it. */
+    for(j = 0; j < CLIENT_VERSION_COUNT; ++j) {
+        /* Skip PC, it is the same as v2. */
+        if(j == CLIENT_VERSION_PC)
+            continue;
+
+        gettimeofday(&start, NULL);
+        sprintf(mdir, "%s/.mapcache/%s.cache", dir, version_codes[j]);
+
+        /* Whatever cache we have for the version already is where unchanged
+           quests are copied from. On startup, that's the one on the disk. */
+        if(!(old = quest_cache_get(j)))
+            old = quest_cache_open(mdir);
+
+        memset(w.jobs, 0, sizeof(cache_job_t) * w.count);
+        count = pending = 0;
 
+        TAILQ_FOREACH(i, &map->list, qentry) {
             for(k = 0; k < CLIENT_LANG_COUNT; ++k) {
                 if((q = i->qptr[j][k])) {
                     /* Don't bother with battle or challenge quests. */
@@ -606,47 +752,734 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
                     if(!(fn1 = (char *)malloc(dlen + 25 + strlen(q->prefix)))) {
                         debug(DBG_ERROR, "Error allocating memory: %s\n",
                               strerror(errno));
-                        return -1;
-                    }
-
-                    if(!(fn2 = (char *)malloc(dlen + 35))) {
-                        debug(DBG_ERROR, "Error allocating memory: %s\n",
-                              strerror(errno));
-                        free(fn1);
-                        return -1;
+                        rv = -1;
+                        goto err;
                     }
 
                     sprintf(fn1, "%s/%s-%s/%s.%s", dir, version_codes[j],
                             language_codes[k], q->prefix, exts[q->format]);
-                    sprintf(fn2, "%s/.mapcache/%s/%08x", dir, version_codes[j],
-                            q->qid);
-
-                    if(check_cache_age(fn1, fn2)) {
-                        debug(DBG_LOG, "Cache for %s-%s %d needs updating!\n",
-                              version_codes[j], language_codes[k], q->qid);
-                    }
 
-                    if(q->format == SYLVERANT_QUEST_BINDAT) {
-                        if((dat = read_and_dec_dat(fn1, &dat_sz))) {
-                            cache_quest_enemies(fn2, dat, dat_sz, q->episode);
-                            free(dat);
-                        }
+                    job = &w.jobs[count++];
+                    job->fn = fn1;
+                    job->qid = q->qid;
+                    job->episode = q->episode;
+                    job->format = q->format;
+                    job->ver = j;
+
+                    if(stat(fn1, &st))
+                        memset(&st, 0, sizeof(struct stat));
+
+                    job->src.mtime = (uint64_t)st.st_mtime;
+
+                    /* Don't even read the file if it looks the same as it did
+                       when the old cache was built. */
+                    if(old && (job->old = quest_cache_find(old, q->qid)) &&
+                       LE64(job->old->src.mtime) == job->src.mtime &&
+                       LE32(job->old->src.size) == (uint32_t)st.st_size) {
+                        job->src.size = LE32(job->old->src.size);
+                        job->src.checksum = LE32(job->old->src.checksum);
+                        job->state = CACHE_JOB_REUSE;
                     }
                     else {
-                        if((dat = read_and_dec_qst(fn1, &dat_sz, j))) {
-                            cache_quest_enemies(fn2, dat, dat_sz, q->episode);
-                            free(dat);
-                        }
+                        ++pending;
                     }
 
-                    free(fn2);
-                    free(fn1);
-
                     break;
                 }
             }
         }
+
+        if(!count) {
+            quest_cache_unref(old);
+            quest_cache_clear(mdir, j);
+            continue;
+        }
+
+        /* If nothing at all changed, the old cache can be used as it is. */
+        if(!pending && old && old->count == (uint32_t)count) {
+            quest_cache_set(old, j);
+            quest_cache_unref(old);
+
+            for(n = 0; n < count; ++n) {
+                free(w.jobs[n].fn);
+            }
+
+            debug(DBG_LOG, "%s map cache is up to date (%d quests)\n",
+                  version_codes[j], count);
+            continue;
+        }
+
+        nthds = pending ? cache_run_jobs(&w, pending) : 0;
+        reused = parsed = 0;
+
+        /* Put everything together, in the same order as the quests. */
+        for(n = 0; n < count; ++n) {
+            job = &w.jobs[n];
+
+            if(job->state == CACHE_JOB_REUSE) {
+                if(!quest_cache_copy(&b, old, job->old, &job->src))
+                    ++reused;
+            }
+            else if(job->state == CACHE_JOB_BUILT) {
+                if(!quest_cache_merge(&b, &job->b))
+                    ++parsed;
+            }
+
+            quest_cache_build_free(&job->b);
+            free(job->fn);
+            job->fn = NULL;
+        }
+
+        quest_cache_unref(old);
+
+        gettimeofday(&end, NULL);
+        msecs = (end.tv_sec - start.tv_sec) * 1000 +
+            (end.tv_usec - start.tv_usec) / 1000;
+
+        debug(DBG_LOG, "Built %s map cache in %ld ms: %d quests, %d reused, "
+              "%d parsed on %d threads, %d failed\n", version_codes[j],
+              msecs, count, reused, parsed, nthds, count - reused - parsed);
+
+        /* If none of the quests could be used, don't leave the old cache
+           around with maps for quests that aren't there anymore. */
+        if(!b.count) {
+            quest_cache_clear(mdir, j);
+            continue;
+        }
+
+        if(quest_cache_finish(&b, mdir, j))
+            debug(DBG_WARN, "Unable to build %s map cache\n",
+                  version_codes[j]);
+    }
+
+    goto out;
+
+err:
+    for(n = 0; n < count; ++n) {
+        quest_cache_build_free(&w.jobs[n].b);
+        free(w.jobs[n].fn);
+    }
+
+    quest_cache_unref(old);
+
+out:
+    free(w.jobs);
+    pthread_mutex_destroy(&w.mutex);
+
+    return rv;
+}
+
+/* Which menu formats each version's quest lists are needed in. The v1 and v2
+   lists both get used by PC clients too. */
+static const int menu_formats[CLIENT_VERSION_COUNT] = {
+    (1 << QUEST_MENU_DC) | (1 << QUEST_MENU_PC),    /* DCv1 */
+    (1 << QUEST_MENU_DC) | (1 << QUEST_MENU_PC),    /* DCv2 */
+    (1 << QUEST_MENU_PC),                           /* PC */
+    (1 << QUEST_MENU_DC),                           /* GC */
+    0,                                              /* Episode 3 */
+    (1 << QUEST_MENU_BB)                            /* BB */
+};
+
+static const uint32_t menu_types[QUEST_MENU_TYPES] = {
+    SYLVERANT_QUEST_NORMAL, SYLVERANT_QUEST_BATTLE, SYLVERANT_QUEST_CHALLENGE
+};
+
+static const int menu_hdr_size[QUEST_MENU_FORMATS] = { 0x04, 0x04, 0x08 };
+static const int menu_ent_size[QUEST_MENU_FORMATS] = { 0x98, 0x128, 0x13C };
+
+typedef struct menu_iconv {
+    iconv_t sjis;
+    iconv_t l1;
+    iconv_t utf16;
+} menu_iconv_t;
+
+/* Fill in one entry of a quest menu packet. */
+static void menu_entry(menu_iconv_t *ic, int fmt, uint8_t *buf, int i,
+                       uint32_t menu_id, uint32_t item_id, char *name,
+                       char *desc, int lang) {
+    dc_quest_list_pkt *dc = (dc_quest_list_pkt *)buf;
+    pc_quest_list_pkt *pc = (pc_quest_list_pkt *)buf;
+    bb_quest_list_pkt *bb = (bb_quest_list_pkt *)buf;
+    iconv_t ic8 = lang == CLIENT_LANG_JAPANESE ? ic->sjis : ic->l1;
+    char lc = lang == CLIENT_LANG_JAPANESE ? 'J' : 'E';
+    size_t in, out;
+    ICONV_CONST char *inptr;
+    char *outptr;
+
+    switch(fmt) {
+        case QUEST_MENU_DC:
+            memset(dc->entries + i, 0, 0x98);
+            dc->entries[i].menu_id = LE32(menu_id);
+            dc->entries[i].item_id = LE32(item_id);
+
+            /* Convert the name and the description to the appropriate
+               encoding */
+            in = 32;
+            out = 30;
+            inptr = name;
+            outptr = &dc->entries[i].name[2];
+            iconv(ic8, &inptr, &in, &outptr, &out);
+            dc->entries[i].name[0] = '\t';
+            dc->entries[i].name[1] = lc;
+
+            in = 112;
+            out = 110;
+            inptr = desc;
+            outptr = &dc->entries[i].desc[2];
+            iconv(ic8, &inptr, &in, &outptr, &out);
+            dc->entries[i].desc[0] = '\t';
+            dc->entries[i].desc[1] = lc;
+            break;
+
+        case QUEST_MENU_PC:
+            memset(pc->entries + i, 0, 0x128);
+            pc->entries[i].menu_id = LE32(menu_id);
+            pc->entries[i].item_id = LE32(item_id);
+
+            /* Convert the name and the description to UTF-16. */
+            in = 32;
+            out = 64;
+            inptr = name;
+            outptr = (char *)pc->entries[i].name;
+            iconv(ic->utf16, &inptr, &in, &outptr, &out);
+
+            in = 112;
+            out = 224;
+            inptr = desc;
+            outptr = (char *)pc->entries[i].desc;
+            iconv(ic->utf16, &inptr, &in, &outptr, &out);
+            break;
+
+        case QUEST_MENU_BB:
+            memset(bb->entries + i, 0, 0x13C);
+            bb->entries[i].menu_id = LE32(menu_id);
+            bb->entries[i].item_id = LE32(item_id);
+
+            /* Convert the name and the description to UTF-16. */
+            in = 32;
+            out = 64;
+            inptr = name;
+            outptr = (char *)bb->entries[i].name;
+            iconv(ic->utf16, &inptr, &in, &outptr, &out);
+
+            in = 112;
+            out = 244;
+            inptr = desc;
+            outptr = (char *)bb->entries[i].desc;
+            iconv(ic->utf16, &inptr, &in, &outptr, &out);
+            break;
+    }
+}
+
+static void menu_free(quest_menu_t *m) {
+    int i;
+
+    if(!m)
+        return;
+
+    for(i = 0; i < QUEST_MENU_TYPES; ++i) {
+        free(m->cat_pkts[i]);
+    }
+
+    if(m->quests) {
+        for(i = 0; i < m->cat_count; ++i) {
+            free(m->quests[i]);
+        }
+    }
+
+    free(m->quests);
+    free(m);
+}
+
+static quest_menu_t *menu_build(menu_iconv_t *ic, sylverant_quest_list_t *l,
+                                int lang, int fmt) {
+    quest_menu_t *rv;
+    sylverant_quest_category_t *cat;
+    int i, j, t, entries, len;
+    uint8_t *buf;
+
+    if(!(rv = (quest_menu_t *)calloc(1, sizeof(quest_menu_t))))
+        return NULL;
+
+    rv->cat_count = l->cat_count;
+
+    if(l->cat_count &&
+       !(rv->quests = (uint8_t **)calloc(l->cat_count, sizeof(uint8_t *))))
+        goto err;
+
+    /* Build the category list for each type of category. */
+    for(t = 0; t < QUEST_MENU_TYPES; ++t) {
+        len = menu_hdr_size[fmt];
+
+        for(i = 0; i < l->cat_count; ++i) {
+            if(l->cats[i].type == menu_types[t])
+                len += menu_ent_size[fmt];
+        }
+
+        /* Leave room for padding the packet out when it's sent. */
+        if(!(buf = (uint8_t *)calloc(1, len + 8)))
+            goto err;
+
+        rv->cat_pkts[t] = buf;
+        rv->cat_lens[t] = len;
+        entries = 0;
+
+        for(i = 0; i < l->cat_count; ++i) {
+            if(l->cats[i].type != menu_types[t])
+                continue;
+
+            menu_entry(ic, fmt, buf, entries++,
+                       MENU_ID_QCATEGORY | (lang << 24), i, l->cats[i].name,
+                       l->cats[i].desc, lang);
+        }
+
+        if(fmt == QUEST_MENU_BB) {
+            ((bb_quest_list_pkt *)buf)->hdr.pkt_type = LE16(QUEST_LIST_TYPE);
+            ((bb_quest_list_pkt *)buf)->hdr.pkt_len = LE16(len);
+            ((bb_quest_list_pkt *)buf)->hdr.flags = LE32(entries);
+        }
+        else if(fmt == QUEST_MENU_PC) {
+            ((pc_quest_list_pkt *)buf)->hdr.pkt_type = QUEST_LIST_TYPE;
+            ((pc_quest_list_pkt *)buf)->hdr.pkt_len = LE16(len);
+            ((pc_quest_list_pkt *)buf)->hdr.flags = entries;
+        }
+        else {
+            ((dc_quest_list_pkt *)buf)->hdr.pkt_type = QUEST_LIST_TYPE;
+            ((dc_quest_list_pkt *)buf)->hdr.pkt_len = LE16(len);
+            ((dc_quest_list_pkt *)buf)->hdr.flags = entries;
+        }
+    }
+
+    /* Fill in the entry of each quest in each category. */
+    for(i = 0; i < l->cat_count; ++i) {
+        cat = &l->cats[i];
+        len = menu_hdr_size[fmt] + cat->quest_count * menu_ent_size[fmt];
+
+        if(!(rv->quests[i] = (uint8_t *)malloc(len)))
+            goto err;
+
+        memset(rv->quests[i], 0, menu_hdr_size[fmt]);
+
+        for(j = 0; j < cat->quest_count; ++j) {
+            menu_entry(ic, fmt, rv->quests[i], j, 0, cat->quests[j].qid,
+                       cat->quests[j].name, cat->quests[j].desc, lang);
+        }
+    }
+
+    return rv;
+
+err:
+    menu_free(rv);
+    return NULL;
+}
+
+quest_menus_t *quest_menus_build(sylverant_quest_list_t
+                                 lists[][CLIENT_LANG_COUNT]) {
+    quest_menus_t *rv;
+    menu_iconv_t ic;
+    int i, j, k;
+
+    /* Don't share the conversion descriptors with the block threads, since
+       this runs while they are busy using them. */
+    ic.sjis = iconv_open("SHIFT_JIS", "UTF-8");
+    ic.l1 = iconv_open("ISO-8859-1", "UTF-8");
+    ic.utf16 = iconv_open("UTF-16LE", "UTF-8");
+
+    if(ic.sjis == (iconv_t)-1 || ic.l1 == (iconv_t)-1 ||
+       ic.utf16 == (iconv_t)-1) {
+        debug(DBG_ERROR, "Cannot open iconv for quest menus\n");
+        rv = NULL;
+        goto out;
+    }
+
+    if(!(rv = (quest_menus_t *)calloc(1, sizeof(quest_menus_t)))) {
+        debug(DBG_ERROR, "Cannot allocate quest menus: %s\n",
+              strerror(errno));
+        goto out;
+    }
+
+    for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
+        for(j = 0; j < CLIENT_LANG_COUNT; ++j) {
+            for(k = 0; k < QUEST_MENU_FORMATS; ++k) {
+                if(!(menu_formats[i] & (1 << k)))
+                    continue;
+
+                rv->menus[i][j][k] = menu_build(&ic, &lists[i][j], j, k);
+
+                if(!rv->menus[i][j][k]) {
+                    debug(DBG_ERROR, "Cannot build %s-%s quest menus\n",
+                          version_codes[i], language_codes[j]);
+                    quest_menus_free(rv);
+                    rv = NULL;
+                    goto out;
+                }
+            }
+        }
+    }
+
+out:
+    if(ic.utf16 != (iconv_t)-1)
+        iconv_close(ic.utf16);
+    if(ic.l1 != (iconv_t)-1)
+        iconv_close(ic.l1);
+    if(ic.sjis != (iconv_t)-1)
+        iconv_close(ic.sjis);
+
+    return rv;
+}
+
+void quest_menus_free(quest_menus_t *m) {
+    int i, j, k;
+
+    if(!m)
+        return;
+
+    for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
+        for(j = 0; j < CLIENT_LANG_COUNT; ++j) {
+            for(k = 0; k < QUEST_MENU_FORMATS; ++k) {
+                menu_free(m->menus[i][j][k]);
+            }
+        }
+    }
+
+    free(m);
+}
+
+const quest_menu_t *quest_menu_get(const quest_menus_t *m, int ver, int lang,
+                                   int fmt) {
+    if(!m || ver < 0 || ver >= CLIENT_VERSION_COUNT || lang < 0 ||
+       lang >= CLIENT_LANG_COUNT)
+        return NULL;
+
+    return m->menus[ver][lang][fmt];
+}
+
+/* Quest payloads are kept around until the cache gets too big, at which point
+   the ones that haven't been sent in the longest get dropped. */
+#define PAYLOAD_BUCKETS     256
+#define PAYLOAD_MAX_BYTES   (64 * 1024 * 1024)
+
+static quest_payload_t *payloads[PAYLOAD_BUCKETS];
+static TAILQ_HEAD(payload_queue, quest_payload) payload_lru =
+    TAILQ_HEAD_INITIALIZER(payload_lru);
+static uint32_t payload_bytes;
+static pthread_mutex_t payload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t payload_hash(int kind, const char *fn) {
+    uint32_t h = 2166136261U ^ (uint32_t)kind;
+
+    while(*fn)
+        h = (h ^ (uint8_t)*fn++) * 16777619U;
+
+    return h & (PAYLOAD_BUCKETS - 1);
+}
+
+static void payload_free(quest_payload_t *p) {
+    free(p->data);
+    free(p->name);
+    free(p->fn);
+    free(p);
+}
+
+static quest_payload_t *payload_alloc(int kind, const char *fn,
+                                      sylverant_quest_t *q, uint8_t *data,
+                                      uint32_t len) {
+    quest_payload_t *rv;
+
+    if(!(rv = (quest_payload_t *)malloc(sizeof(quest_payload_t))))
+        return NULL;
+
+    memset(rv, 0, sizeof(quest_payload_t));
+    rv->kind = kind;
+    rv->len = len;
+    rv->refcnt = 1;
+
+    if(!(rv->fn = strdup(fn)) || (q && !(rv->name = strdup(q->name))) ||
+       (!data && !(data = (uint8_t *)malloc(len)))) {
+        debug(DBG_WARN, "Cannot allocate quest payload: %s\n",
+              strerror(errno));
+        payload_free(rv);
+        return NULL;
+    }
+
+    rv->data = data;
+    return rv;
+}
+
+static void payload_file(int kind, uint8_t *ptr, sylverant_quest_t *q,
+                         const char *ext, uint32_t len) {
+    dc_quest_file_pkt *dc = (dc_quest_file_pkt *)ptr;
+    pc_quest_file_pkt *pc = (pc_quest_file_pkt *)ptr;
+    gc_quest_file_pkt *gc = (gc_quest_file_pkt *)ptr;
+
+    memset(ptr, 0, DC_QUEST_FILE_LENGTH);
+
+    switch(kind) {
+        case QUEST_PAYLOAD_DC:
+            sprintf(dc->name, "PSO/%s", q->name);
+            dc->hdr.pkt_type = QUEST_FILE_TYPE;
+            dc->hdr.flags = 0x02; /* ??? */
+            dc->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
+            sprintf(dc->filename, "%s.%s", q->prefix, ext);
+            dc->length = LE32(len);
+            break;
+
+        case QUEST_PAYLOAD_PC:
+            sprintf(pc->name, "PSO/%s", q->name);
+            pc->hdr.pkt_type = QUEST_FILE_TYPE;
+            pc->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
+            pc->flags = 0x0002; /* ??? */
+            sprintf(pc->filename, "%s.%s", q->prefix, ext);
+            pc->length = LE32(len);
+            break;
+
+        case QUEST_PAYLOAD_GC:
+            sprintf(gc->name, "PSO/%s", q->name);
+            gc->hdr.pkt_type = QUEST_FILE_TYPE;
+            gc->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
+            gc->flags = 0x0002; /* ??? */
+            sprintf(gc->filename, "%s.%s", q->prefix, ext);
+            gc->length = LE32(len);
+            break;
+    }
+}
+
+static void payload_chunk(int kind, uint8_t *ptr, sylverant_quest_t *q,
+                          const char *ext, int num, const uint8_t *data,
+                          uint32_t len) {
+    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)ptr;
+
+    memset(ptr, 0, DC_QUEST_CHUNK_LENGTH);
+
+    if(kind == QUEST_PAYLOAD_PC) {
+        chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
+        chunk->hdr.pc.flags = (uint8_t)num;
+        chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
+    }
+    else {
+        chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
+        chunk->hdr.dc.flags = (uint8_t)num;
+        chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
+    }
+
+    sprintf(chunk->filename, "%s.%s", q->prefix, ext);
+    memcpy(chunk->data, data, len);
+    chunk->length = LE32(len);
+}
+
+/* Build the packets for a .bin/.dat quest: a file packet for each of the two
+   files, then their chunks, interleaved. Each file always ends with a chunk
+   that isn't full, even if that means sending an empty one. */
+static quest_payload_t *payload_bindat(int kind, const char *fn,
+                                       sylverant_quest_t *q) {
+    char filename[strlen(fn) + 5];
+    uint8_t *bin = NULL, *dat = NULL, *ptr;
+    uint32_t binlen, datlen, binct, datct, i, amt;
+    quest_payload_t *rv = NULL;
+
+    sprintf(filename, "%s.bin", fn);
+
+    if(!(bin = read_quest_file(filename, &binlen)))
+        goto out;
+
+    sprintf(filename, "%s.dat", fn);
+
+    if(!(dat = read_quest_file(filename, &datlen)))
+        goto out;
+
+    binct = binlen / 0x400 + 1;
+    datct = datlen / 0x400 + 1;
+
+    if(!(rv = payload_alloc(kind, fn, q, NULL, DC_QUEST_FILE_LENGTH * 2 +
+                            (binct + datct) * DC_QUEST_CHUNK_LENGTH)))
+        goto out;
+
+    ptr = rv->data;
+    payload_file(kind, ptr, q, "dat", datlen);
+    ptr += DC_QUEST_FILE_LENGTH;
+    payload_file(kind, ptr, q, "bin", binlen);
+    ptr += DC_QUEST_FILE_LENGTH;
+
+    for(i = 0; i < binct || i < datct; ++i) {
+        if(i < datct) {
+            amt = datlen - i * 0x400 > 0x400 ? 0x400 : datlen - i * 0x400;
+            payload_chunk(kind, ptr, q, "dat", i, dat + i * 0x400, amt);
+            ptr += DC_QUEST_CHUNK_LENGTH;
+        }
+
+        if(i < binct) {
+            amt = binlen - i * 0x400 > 0x400 ? 0x400 : binlen - i * 0x400;
+            payload_chunk(kind, ptr, q, "bin", i, bin + i * 0x400, amt);
+            ptr += DC_QUEST_CHUNK_LENGTH;
+        }
+    }
+
+out:
+    free(dat);
+    free(bin);
+    return rv;
+}
+
+/* Make sure a .qst file is made up of nothing but whole packets, since it gets
+   sent out a packet at a time just as it is. */
+static int qst_check(int kind, const char *fn, const uint8_t *buf,
+                     uint32_t len) {
+    uint32_t pos = 0, plen;
+
+    while(pos < len) {
+        if(len - pos < 4)
+            goto bad;
+
+        if(kind == QUEST_PAYLOAD_QST_PC)
+            plen = buf[pos] | (buf[pos + 1] << 8);
+        else
+            plen = buf[pos + 2] | (buf[pos + 3] << 8);
+
+        plen = (plen + 3) & ~3;
+
+        if(plen < 4 || plen > len - pos)
+            goto bad;
+
+        pos += plen;
     }
 
     return 0;
+
+bad:
+    debug(DBG_WARN, "Bad packet at offset %" PRIu32 " in quest %s\n", pos,
+          fn);
+    return -1;
+}
+
+/* A .qst file is already a string of packets, so it just gets read in. */
+static quest_payload_t *payload_qst(int kind, const char *fn) {
+    quest_payload_t *rv;
+    uint8_t *buf;
+    uint32_t len;
+
+    if(!(buf = read_quest_file(fn, &len)))
+        return NULL;
+
+    if(qst_check(kind, fn, buf, len)) {
+        free(buf);
+        return NULL;
+    }
+
+    if(!(rv = payload_alloc(kind, fn, NULL, buf, len)))
+        free(buf);
+
+    return rv;
+}
+
+static quest_payload_t *payload_find(int kind, const char *fn,
+                                     sylverant_quest_t *q, uint32_t h) {
+    quest_payload_t *i;
+
+    for(i = payloads[h]; i; i = i->next) {
+        if(i->kind == kind && !strcmp(i->fn, fn) &&
+           (!q || !strcmp(i->name, q->name)))
+            return i;
+    }
+
+    return NULL;
+}
+
+/* Take a payload out of the cache. The payload mutex must be held. */
+static void payload_evict(quest_payload_t *p) {
+    quest_payload_t **i;
+    uint32_t h = payload_hash(p->kind, p->fn);
+
+    for(i = &payloads[h]; *i; i = &(*i)->next) {
+        if(*i == p) {
+            *i = p->next;
+            break;
+        }
+    }
+
+    TAILQ_REMOVE(&payload_lru, p, qentry);
+    payload_bytes -= p->len;
+
+    if(!--p->refcnt)
+        payload_free(p);
+}
+
+quest_payload_t *quest_payload_get(int kind, const char *fn,
+                                   sylverant_quest_t *q) {
+    uint32_t h = payload_hash(kind, fn);
+    quest_payload_t *rv, *tmp;
+
+    if(kind == QUEST_PAYLOAD_QST || kind == QUEST_PAYLOAD_QST_PC)
+        q = NULL;
+
+    pthread_mutex_lock(&payload_mutex);
+
+    if((rv = payload_find(kind, fn, q, h))) {
+        ++rv->refcnt;
+        TAILQ_REMOVE(&payload_lru, rv, qentry);
+        TAILQ_INSERT_TAIL(&payload_lru, rv, qentry);
+        pthread_mutex_unlock(&payload_mutex);
+        return rv;
+    }
+
+    pthread_mutex_unlock(&payload_mutex);
+
+    /* Build it without holding the lock, so nobody else has to wait on the
+       disk for it. */
+    if(kind == QUEST_PAYLOAD_QST || kind == QUEST_PAYLOAD_QST_PC)
+        rv = payload_qst(kind, fn);
+    else
+        rv = payload_bindat(kind, fn, q);
+
+    if(!rv)
+        return NULL;
+
+    pthread_mutex_lock(&payload_mutex);
+
+    /* Someone else might have beaten us to it, if so use theirs. */
+    if((tmp = payload_find(kind, fn, q, h))) {
+        ++tmp->refcnt;
+        pthread_mutex_unlock(&payload_mutex);
+        payload_free(rv);
+        return tmp;
+    }
+
+    ++rv->refcnt;
+    rv->next = payloads[h];
+    payloads[h] = rv;
+    TAILQ_INSERT_TAIL(&payload_lru, rv, qentry);
+    payload_bytes += rv->len;
+
+    while(payload_bytes > PAYLOAD_MAX_BYTES &&
+          (tmp = TAILQ_FIRST(&payload_lru)) != rv) {
+        payload_evict(tmp);
+    }
+
+    pthread_mutex_unlock(&payload_mutex);
+
+    return rv;
+}
+
+void quest_payload_unref(quest_payload_t *p) {
+    int refcnt;
+
+    if(!p)
+        return;
+
+    pthread_mutex_lock(&payload_mutex);
+    refcnt = --p->refcnt;
+    pthread_mutex_unlock(&payload_mutex);
+
+    if(!refcnt)
+        payload_free(p);
+}
+
+void quest_payload_flush(void) {
+    quest_payload_t *i;
+
+    pthread_mutex_lock(&payload_mutex);
+
+    while((i = TAILQ_FIRST(&payload_lru)))
+        payload_evict(i);
+
+    pthread_mutex_unlock(&payload_mutex);
 }
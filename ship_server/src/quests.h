@@ -35,13 +35,83 @@ typedef struct ship ship_t;
 
 typedef struct quest_map_elem {
     TAILQ_ENTRY(quest_map_elem) qentry;
+    struct quest_map_elem *hnext;
     uint32_t qid;
 
     sylverant_quest_t *qptr[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT];
 } quest_map_elem_t;
 
-TAILQ_HEAD(quest_map, quest_map_elem);
-typedef struct quest_map quest_map_t;
+TAILQ_HEAD(quest_map_list, quest_map_elem);
+
+/* Every quest we know about. The list keeps them in the order they were read
+   in, and the hash table (chained by the hnext pointers) is for finding them
+   by ID. */
+typedef struct quest_map {
+    struct quest_map_list list;
+    quest_map_elem_t **hash;
+    uint32_t hash_mask;
+    uint32_t count;
+} quest_map_t;
+
+/* The formats of the quest menu packets. */
+#define QUEST_MENU_DC       0
+#define QUEST_MENU_PC       1
+#define QUEST_MENU_BB       2
+#define QUEST_MENU_FORMATS  3
+
+/* The types of categories that get their own menu. */
+#define QUEST_MENU_NORMAL       0
+#define QUEST_MENU_BATTLE       1
+#define QUEST_MENU_CHALLENGE    2
+#define QUEST_MENU_TYPES        3
+
+/* The quest menus for one quest list, already built in one client format. */
+typedef struct quest_menu {
+    /* The whole category list packet for each type of category. */
+    uint8_t *cat_pkts[QUEST_MENU_TYPES];
+    int cat_lens[QUEST_MENU_TYPES];
+
+    /* For each category, a quest list packet with the entries of every quest
+       in the category (in order) filled in, other than their menu ids. The
+       header isn't filled in, since the entries that actually get sent depend
+       on who is in the team. */
+    uint8_t **quests;
+    int cat_count;
+} quest_menu_t;
+
+/* The quest menus for all of the lists, by list version and language. Each
+   list only gets menus in the formats of the clients that can use it. */
+typedef struct quest_menus {
+    quest_menu_t *menus[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT]
+        [QUEST_MENU_FORMATS];
+} quest_menus_t;
+
+/* The kinds of packets a quest payload can be made of. */
+#define QUEST_PAYLOAD_DC    0       /* .bin/.dat, in DCv1/DCv2 packets */
+#define QUEST_PAYLOAD_PC    1       /* .bin/.dat, in PC packets */
+#define QUEST_PAYLOAD_GC    2       /* .bin/.dat, in Gamecube packets */
+#define QUEST_PAYLOAD_QST   3       /* .qst, with DC/Gamecube headers */
+#define QUEST_PAYLOAD_QST_PC 4      /* .qst, with PC headers */
+
+/* A quest, all ready to send to a client: the file and chunk packets one after
+   another (unencrypted), just as they go out. Anyone sending the quest holds a
+   reference to it, so it can't go away from under them if it falls out of the
+   cache or the quests are reloaded. */
+typedef struct quest_payload {
+    TAILQ_ENTRY(quest_payload) qentry;
+    struct quest_payload *next;
+
+    int refcnt;
+    int kind;
+    char *fn;
+    char *name;
+
+    uint8_t *data;
+    uint32_t len;
+} quest_payload_t;
+
+/* Set up an empty quest map. */
+void quest_map_init(quest_map_t *map);
 
 /* Find a quest by ID, if it exists */
 quest_map_elem_t *quest_lookup(quest_map_t *map, uint32_t qid);
@@ -59,4 +129,29 @@ int quest_map(quest_map_t *map, sylverant_quest_list_t *list, int version,
 /* Build/rebuild the quest enemy/object data cache. */
 int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir);
 
+/* Build the quest menus for a full set of quest lists. */
+quest_menus_t *quest_menus_build(sylverant_quest_list_t
+                                 lists[][CLIENT_LANG_COUNT]);
+
+/* Free a set of quest menus. */
+void quest_menus_free(quest_menus_t *m);
+
+/* Find the menus for a list in a given format. Returns NULL if there aren't
+   any. */
+const quest_menu_t *quest_menu_get(const quest_menus_t *m, int ver, int lang,
+                                   int fmt);
+
+/* Get the payload for a quest, reading it in if it isn't in the cache. For
+   the .bin/.dat kinds, fn is the path of the files without the extension and
+   q is the quest they're for, otherwise fn is the full path of the .qst file.
+   Returns a new reference, or NULL on error. */
+quest_payload_t *quest_payload_get(int kind, const char *fn,
+                                   sylverant_quest_t *q);
+
+/* Drop a reference to a quest payload. */
+void quest_payload_unref(quest_payload_t *p);
+
+/* Empty out the quest payload cache. */
+void quest_payload_flush(void);
+
 #endif /* !QUESTS_H */
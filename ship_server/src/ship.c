@@ -280,8 +280,7 @@ static void *ship_thd(void *d) {
                                                         addr_p, len))) {
                         close(sock);
                     }
-
-                    if(s->shutdown_time) {
+                    else if(s->shutdown_time) {
                         send_message_box(tmp, "%s\n\n%s\n%s",
                                          __(tmp, "\tEShip is going down for "
                                             "shutdown."),
@@ -307,8 +306,7 @@ static void *ship_thd(void *d) {
                                                         addr_p, len))) {
                         close(sock);
                     }
-
-                    if(s->shutdown_time) {
+                    else if(s->shutdown_time) {
                         send_message_box(tmp, "%s\n\n%s\n%s",
                                          __(tmp, "\tEShip is going down for "
                                             "shutdown."),
@@ -334,8 +332,7 @@ static void *ship_thd(void *d) {
                                                         addr_p, len))) {
                         close(sock);
                     }
-
-                    if(s->shutdown_time) {
+                    else if(s->shutdown_time) {
                         send_message_box(tmp, "%s\n\n%s\n%s",
                                          __(tmp, "\tEShip is going down for "
                                             "shutdown."),
@@ -362,8 +359,7 @@ static void *ship_thd(void *d) {
                                                         addr_p, len))) {
                         close(sock);
                     }
-
-                    if(s->shutdown_time) {
+                    else if(s->shutdown_time) {
                         send_message_box(tmp, "%s\n\n%s\n%s",
                                          __(tmp, "\tEShip is going down for "
                                             "shutdown."),
@@ -390,8 +386,7 @@ static void *ship_thd(void *d) {
                                                         addr_p, len))) {
                         close(sock);
                     }
-
-                    if(s->shutdown_time) {
+                    else if(s->shutdown_time) {
                         send_message_box(tmp, "%s\n\n%s\n%s",
                                          __(tmp, "\tEShip is going down for "
                                             "shutdown."),
@@ -409,10 +404,7 @@ static void *ship_thd(void *d) {
                           s->cfg->name);
 
                     /* Close the connection so we can attempt to reconnect */
-                    gnutls_bye(s->sg.session, GNUTLS_SHUT_RDWR);
-                    close(s->sg.sock);
-                    gnutls_deinit(s->sg.session);
-                    s->sg.sock = -1;
+                    shipgate_close(&s->sg);
 
                     if(rv < -1) {
                         debug(DBG_WARN, "%s: Fatal shipgate error, bailing!\n",
@@ -428,10 +420,7 @@ static void *ship_thd(void *d) {
                           s->cfg->name);
 
                     /* Close the connection so we can attempt to reconnect */
-                    gnutls_bye(s->sg.session, GNUTLS_SHUT_RDWR);
-                    close(s->sg.sock);
-                    gnutls_deinit(s->sg.session);
-                    s->sg.sock = -1;
+                    shipgate_close(&s->sg);
                 }
             }
 
@@ -779,7 +768,7 @@ void ship_check_cfg(sylverant_ship_t *s) {
 
     /* Clear it out */
     memset(rv, 0, sizeof(ship_t));
-    TAILQ_INIT(&rv->qmap);
+    quest_map_init(&rv->qmap);
 
     /* Attempt to read the quest list in. */
     if(s->quests_file && s->quests_file[0]) {
@@ -912,6 +901,10 @@ static int dcnte_process_login(ship_client_t *c, dcnte_login_8b_pkt *pkt) {
         return -1;
     }
 
+    /* The client is logged in, so it doesn't count against anyone else that
+       is trying to log in anymore. */
+    client_admit_done(c);
+
     if(send_block_list(c, ship)) {
         return -2;
     }
@@ -945,6 +938,8 @@ static int dc_process_login(ship_client_t *c, dc_login_93_pkt *pkt) {
         return -1;
     }
 
+    client_admit_done(c);
+
     if(send_block_list(c, ship)) {
         return -2;
     }
@@ -989,6 +984,8 @@ static int dcv2_process_login(ship_client_t *c, dcv2_login_9d_pkt *pkt) {
         return -1;
     }
 
+    client_admit_done(c);
+
     if(send_block_list(c, ship)) {
         return -2;
     }
@@ -1034,6 +1031,8 @@ static int gc_process_login(ship_client_t *c, gc_login_9e_pkt *pkt) {
         return -1;
     }
 
+    client_admit_done(c);
+
     if(send_block_list(c, ship)) {
         return -2;
     }
@@ -1079,6 +1078,8 @@ static int bb_process_login(ship_client_t *c, bb_login_93_pkt *pkt) {
         return -2;
     }
 
+    client_admit_done(c);
+
     if(send_block_list(c, ship)) {
         return -3;
     }
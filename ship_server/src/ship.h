@@ -94,6 +94,7 @@ struct ship {
 
     sylverant_quest_list_t qlist[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT];
     quest_map_t qmap;
+    quest_menus_t *qmenus;
 
     shipgate_conn_t sg;
     pthread_rwlock_t qlock;
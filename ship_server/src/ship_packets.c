@@ -75,6 +75,9 @@ static cs_opt_t cs_options[] = {
 
 #define CS_OPTIONS_COUNT 23
 
+/* Size of the per-thread buffer packets are built in. */
+#define SENDBUF_SIZE 65536
+
 /* Definition of the options in each menu of the GM menu */
 typedef struct gm_opt {
     uint32_t menu_id;
@@ -229,6 +232,30 @@ static int send_raw(ship_client_t *c, int len, uint8_t *sendbuf) {
     return 0;
 }
 
+/* Hold onto a packet until the quest that is being sent to the client is done.
+   The packet isn't encrypted yet, so that it gets encrypted in the order it is
+   actually sent. */
+static int defer_pkt(ship_client_t *c, int len, const uint8_t *sendbuf) {
+    void *tmp;
+
+    if(c->qdefer_cur + len > c->qdefer_size) {
+        tmp = realloc(c->qdefer, c->qdefer_cur + len);
+
+        /* If we can't allocate the space, bail. */
+        if(tmp == NULL) {
+            return -1;
+        }
+
+        c->qdefer_size = c->qdefer_cur + len;
+        c->qdefer = (unsigned char *)tmp;
+    }
+
+    memcpy(c->qdefer + c->qdefer_cur, sendbuf, len);
+    c->qdefer_cur += len;
+
+    return 0;
+}
+
 /* Encrypt and send a packet away. */
 int crypt_send(ship_client_t *c, int len, uint8_t *sendbuf) {
     /* Expand it to be a multiple of 8/4 bytes long */
@@ -241,6 +268,13 @@ int crypt_send(ship_client_t *c, int len, uint8_t *sendbuf) {
         fprint_packet(c->logfile, sendbuf, len, 0);
     }
 
+    /* While a quest is being sent, nothing else can go out until it's done,
+       or the client could end up with other packets (like the one telling the
+       game to start the quest) before it has the whole quest. */
+    if(c->qstream) {
+        return defer_pkt(c, len, sendbuf);
+    }
+
     /* Encrypt the packet */
     CRYPT_CryptData(&c->skey, sendbuf, len, 1);
 
@@ -254,7 +288,7 @@ uint8_t *get_sendbuf() {
     /* If we haven't initialized the sendbuf pointer yet for this thread, then
        we need to do that now. */
     if(!sendbuf) {
-        sendbuf = (uint8_t *)malloc(65536);
+        sendbuf = (uint8_t *)malloc(SENDBUF_SIZE);
 
         if(!sendbuf) {
             perror("malloc");
@@ -4774,276 +4808,79 @@ int send_message_box(ship_client_t *c, const char *fmt, ...) {
     return rv;
 }
 
-/* Send the list of quest categories to the client. */
-static int send_dc_quest_categories(ship_client_t *c, int lang) {
+/* Send one of the prebuilt quest category lists to the client. */
+static int send_quest_menu_cats(ship_client_t *c, int ver, int lang, int fmt) {
     uint8_t *sendbuf = get_sendbuf();
-    dc_quest_list_pkt *pkt = (dc_quest_list_pkt *)sendbuf;
-    int i, len = 0x04, entries = 0;
-    uint32_t type = SYLVERANT_QUEST_NORMAL;
-    size_t in, out;
-    ICONV_CONST char *inptr;
-    char *outptr;
-    sylverant_quest_list_t *qlist;
-    lobby_t *l = c->cur_lobby;
-
-    if(l->version == CLIENT_VERSION_GC || c->version == CLIENT_VERSION_EP3) {
-        qlist = &ship->qlist[CLIENT_VERSION_GC][lang];
-    }
-    else if(!l->v2) {
-        qlist = &ship->qlist[CLIENT_VERSION_DCV1][lang];
-    }
-    else {
-        qlist = &ship->qlist[CLIENT_VERSION_DCV2][lang];
-    }
+    const quest_menu_t *m = quest_menu_get(ship->qmenus, ver, lang, fmt);
+    int type = QUEST_MENU_NORMAL;
 
-    /* Fall back to English if there's no list for this language... */
-    if(!qlist->cat_count) {
-        lang = CLIENT_LANG_ENGLISH;
-
-        if(l->version == CLIENT_VERSION_GC ||
-           c->version == CLIENT_VERSION_EP3) {
-            qlist = &ship->qlist[CLIENT_VERSION_GC][lang];
-        }
-        else if(!l->v2) {
-            qlist = &ship->qlist[CLIENT_VERSION_DCV1][lang];
-        }
-        else {
-            qlist = &ship->qlist[CLIENT_VERSION_DCV2][lang];
-        }
-    }
-
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
+    /* Verify we got the sendbuf and the menu. */
+    if(!sendbuf || !m) {
         return -1;
     }
 
     if(c->cur_lobby->battle) {
-        type = SYLVERANT_QUEST_BATTLE;
+        type = QUEST_MENU_BATTLE;
     }
     else if(c->cur_lobby->challenge) {
-        type = SYLVERANT_QUEST_CHALLENGE;
+        type = QUEST_MENU_CHALLENGE;
     }
 
-    /* Clear out the header */
-    memset(pkt, 0, 0x04);
-
-    /* Fill in the header */
-    pkt->hdr.pkt_type = QUEST_LIST_TYPE;
-
-    for(i = 0; i < qlist->cat_count; ++i) {
-        /* Skip quests not of the right type. */
-        if(qlist->cats[i].type != type) {
-            continue;
-        }
-
-        /* Clear the entry */
-        memset(pkt->entries + entries, 0, 0x98);
-
-        /* Copy the category's information over to the packet */
-        pkt->entries[entries].menu_id = LE32((MENU_ID_QCATEGORY |
-                                              (lang << 24)));
-        pkt->entries[entries].item_id = LE32(i);
-
-        /* Convert the name and the description to the appropriate encoding */
-        in = 32;
-        out = 30;
-        inptr = qlist->cats[i].name;
-        outptr = &pkt->entries[entries].name[2];
-
-        if(lang == CLIENT_LANG_JAPANESE) {
-            iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-            pkt->entries[entries].name[0] = '\t';
-            pkt->entries[entries].name[1] = 'J';
-        }
-        else {
-            iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-            pkt->entries[entries].name[0] = '\t';
-            pkt->entries[entries].name[1] = 'E';
-        }
-
-        in = 112;
-        out = 110;
-        inptr = qlist->cats[i].desc;
-        outptr = &pkt->entries[entries].desc[2];
-
-        if(lang == CLIENT_LANG_JAPANESE) {
-            iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-            pkt->entries[entries].desc[0] = '\t';
-            pkt->entries[entries].desc[1] = 'J';
-        }
-        else {
-            iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-            pkt->entries[entries].desc[0] = '\t';
-            pkt->entries[entries].desc[1] = 'E';
-        }
-
-        ++entries;
-        len += 0x98;
-    }
-
-    /* Fill in the rest of the header */
-    pkt->hdr.flags = entries;
-    pkt->hdr.pkt_len = LE16(len);
+    memcpy(sendbuf, m->cat_pkts[type], m->cat_lens[type]);
 
     /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return crypt_send(c, m->cat_lens[type], sendbuf);
 }
 
-static int send_pc_quest_categories(ship_client_t *c, int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    pc_quest_list_pkt *pkt = (pc_quest_list_pkt *)sendbuf;
-    int i, len = 0x04, entries = 0;
-    size_t in, out;
-    ICONV_CONST char *inptr;
-    char *outptr;
-    uint32_t type = SYLVERANT_QUEST_NORMAL;
-    sylverant_quest_list_t *qlist;
+/* Send the list of quest categories to the client. */
+static int send_dc_quest_categories(ship_client_t *c, int lang) {
     lobby_t *l = c->cur_lobby;
+    int ver;
 
-    if(!l->v2) {
-        qlist = &ship->qlist[CLIENT_VERSION_DCV1][lang];
+    if(l->version == CLIENT_VERSION_GC || c->version == CLIENT_VERSION_EP3) {
+        ver = CLIENT_VERSION_GC;
+    }
+    else if(!l->v2) {
+        ver = CLIENT_VERSION_DCV1;
     }
     else {
-        qlist = &ship->qlist[CLIENT_VERSION_PC][lang];
+        ver = CLIENT_VERSION_DCV2;
     }
 
     /* Fall back to English if there's no list for this language... */
-    if(!qlist->cat_count) {
+    if(!ship->qlist[ver][lang].cat_count) {
         lang = CLIENT_LANG_ENGLISH;
-
-        if(!l->v2) {
-            qlist = &ship->qlist[CLIENT_VERSION_DCV1][lang];
-        }
-        else {
-            qlist = &ship->qlist[CLIENT_VERSION_DCV2][lang];
-        }
-    }
-
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
     }
 
-    if(c->cur_lobby->battle) {
-        type = SYLVERANT_QUEST_BATTLE;
-    }
-    else if(c->cur_lobby->challenge) {
-        type = SYLVERANT_QUEST_CHALLENGE;
-    }
+    return send_quest_menu_cats(c, ver, lang, QUEST_MENU_DC);
+}
 
-    /* Clear out the header */
-    memset(pkt, 0, 0x04);
+static int send_pc_quest_categories(ship_client_t *c, int lang) {
+    lobby_t *l = c->cur_lobby;
+    int ver = l->v2 ? CLIENT_VERSION_PC : CLIENT_VERSION_DCV1;
 
-    /* Fill in the header */
-    pkt->hdr.pkt_type = QUEST_LIST_TYPE;
+    /* Fall back to English if there's no list for this language... */
+    if(!ship->qlist[ver][lang].cat_count) {
+        lang = CLIENT_LANG_ENGLISH;
 
-    for(i = 0; i < qlist->cat_count; ++i) {
-        /* Skip quests not of the right type. */
-        if(qlist->cats[i].type != type) {
-            continue;
+        if(l->v2) {
+            ver = CLIENT_VERSION_DCV2;
         }
-
-        /* Clear the entry */
-        memset(pkt->entries + i, 0, 0x128);
-
-        /* Copy the category's information over to the packet */
-        pkt->entries[entries].menu_id = LE32((MENU_ID_QCATEGORY |
-                                              (lang << 24)));
-        pkt->entries[entries].item_id = LE32(i);
-
-        /* Convert the name and the description to UTF-16. */
-        in = 32;
-        out = 64;
-        inptr = qlist->cats[i].name;
-        outptr = (char *)pkt->entries[entries].name;
-        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
-
-        in = 112;
-        out = 224;
-        inptr = qlist->cats[i].desc;
-        outptr = (char *)pkt->entries[entries].desc;
-        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
-
-        ++entries;
-        len += 0x128;
     }
 
-    /* Fill in the rest of the header */
-    pkt->hdr.flags = entries;
-    pkt->hdr.pkt_len = LE16(len);
-
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return send_quest_menu_cats(c, ver, lang, QUEST_MENU_PC);
 }
 
 static int send_bb_quest_categories(ship_client_t *c, int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    bb_quest_list_pkt *pkt = (bb_quest_list_pkt *)sendbuf;
-    int i, len = 0x08, entries = 0;
-    size_t in, out;
-    ICONV_CONST char *inptr;
-    char *outptr;
-    uint32_t type = SYLVERANT_QUEST_NORMAL;
-    sylverant_quest_list_t *qlist = &ship->qlist[CLIENT_VERSION_BB][lang];
-
     /* Fall back to English if there's no list for this language... */
-    if(!qlist->cat_count) {
+    if(!ship->qlist[CLIENT_VERSION_BB][lang].cat_count)
         lang = CLIENT_LANG_ENGLISH;
-        qlist = &ship->qlist[CLIENT_VERSION_BB][lang];
-    }
 
     /* If we still don't have a list, then bail out... */
-    if(!qlist->cat_count)
+    if(!ship->qlist[CLIENT_VERSION_BB][lang].cat_count)
         return -1;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf)
-        return -1;
-
-    if(c->cur_lobby->battle)
-        type = SYLVERANT_QUEST_BATTLE;
-    else if(c->cur_lobby->challenge)
-        type = SYLVERANT_QUEST_CHALLENGE;
-
-    /* Fill in the header */
-    pkt->hdr.pkt_type = LE16(QUEST_LIST_TYPE);
-
-    for(i = 0; i < qlist->cat_count; ++i) {
-        /* Skip quests not of the right type. */
-        if(qlist->cats[i].type != type)
-            continue;
-
-        /* Clear the entry */
-        memset(pkt->entries + i, 0, 0x13C);
-
-        /* Copy the category's information over to the packet */
-        pkt->entries[entries].menu_id = LE32((MENU_ID_QCATEGORY |
-                                              (lang << 24)));
-        pkt->entries[entries].item_id = LE32(i);
-
-        /* Convert the name and the description to UTF-16. */
-        in = 32;
-        out = 64;
-        inptr = qlist->cats[i].name;
-        outptr = (char *)pkt->entries[entries].name;
-        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
-
-        in = 112;
-        out = 244;
-        inptr = qlist->cats[i].desc;
-        outptr = (char *)pkt->entries[entries].desc;
-        iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
-
-        ++entries;
-        len += 0x13C;
-    }
-
-    /* Fill in the rest of the header */
-    pkt->hdr.flags = LE32(entries);
-    pkt->hdr.pkt_len = LE16(len);
-
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return send_quest_menu_cats(c, CLIENT_VERSION_BB, lang, QUEST_MENU_BB);
 }
 
 int send_quest_categories(ship_client_t *c, int lang) {
@@ -5074,15 +4911,14 @@ static int send_dc_quest_list(ship_client_t *c, int cn, int lang) {
     uint8_t *sendbuf = get_sendbuf();
     dc_quest_list_pkt *pkt = (dc_quest_list_pkt *)sendbuf;
     int i, len = 0x04, entries = 0, max = INT_MAX, j, k, ver;
-    size_t in, out;
-    ICONV_CONST char *inptr;
-    char *outptr;
     sylverant_quest_list_t *qlist, *qlisten;
     lobby_t *l = c->cur_lobby;
     sylverant_quest_category_t *cat, *caten;
     sylverant_quest_t *quest;
     quest_map_elem_t *elem;
     ship_client_t *tmp;
+    const quest_menu_t *m, *men;
+    const dc_quest_list_pkt *ents;
 
     /* Verify we got the sendbuf. */
     if(!sendbuf) {
@@ -5117,6 +4953,15 @@ static int send_dc_quest_list(ship_client_t *c, int cn, int lang) {
     cat = &qlist->cats[cn];
     caten = &qlisten->cats[cn];
 
+    /* Grab the prebuilt entries for the quests in the category. */
+    m = quest_menu_get(ship->qmenus, ver, lang, QUEST_MENU_DC);
+    men = quest_menu_get(ship->qmenus, ver, CLIENT_LANG_ENGLISH, QUEST_MENU_DC);
+
+    if(!m || !men)
+        return -1;
+
+    ents = (const dc_quest_list_pkt *)m->quests[cn];
+
     /* Clear out the header */
     memset(pkt, 0, 0x04);
 
@@ -5170,57 +5015,22 @@ static int send_dc_quest_list(ship_client_t *c, int cn, int lang) {
                 continue;
             }
 
-            /* Clear the entry */
-            memset(pkt->entries + entries, 0, 0x98);
-
-            /* Copy the category's information over to the packet */
+            /* Copy the quest's entry over, and fill in the menu id */
+            memcpy(&pkt->entries[entries], &ents->entries[i], 0x98);
             pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) | (cn << 8) |
                                                   (lang << 24)));
-            pkt->entries[entries].item_id = LE32(quest->qid);
-
-            /* Convert the name and the description to the appropriate
-               encoding */
-            in = 32;
-            out = 30;
-            inptr = quest->name;
-            outptr = &pkt->entries[entries].name[2];
-
-            if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].name[0] = '\t';
-                pkt->entries[entries].name[1] = 'J';
-            }
-            else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].name[0] = '\t';
-                pkt->entries[entries].name[1] = 'E';
-            }
-
-            in = 112;
-            out = 110;
-            inptr = quest->desc;
-            outptr = &pkt->entries[entries].desc[2];
-
-            if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].desc[0] = '\t';
-                pkt->entries[entries].desc[1] = 'J';
-            }
-            else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].desc[0] = '\t';
-                pkt->entries[entries].desc[1] = 'E';
-            }
 
             ++entries;
             len += 0x98;
         }
 
-        /* If we already did English, then we're done. */
-        if(cat == caten)
+        /* If we already did English (or it doesn't have the category), then
+           we're done. */
+        if(cat == caten || men->cat_count <= cn)
             break;
 
         cat = caten;
+        ents = (const dc_quest_list_pkt *)men->quests[cn];
     }
 
     /* Fill in the rest of the header */
@@ -5235,15 +5045,14 @@ static int send_pc_quest_list(ship_client_t *c, int cn, int lang) {
     uint8_t *sendbuf = get_sendbuf();
     pc_quest_list_pkt *pkt = (pc_quest_list_pkt *)sendbuf;
     int i, len = 0x04, entries = 0, max = INT_MAX, j, k, ver;
-    size_t in, out;
-    ICONV_CONST char *inptr;
-    char *outptr;
     sylverant_quest_list_t *qlist, *qlisten;
     lobby_t *l = c->cur_lobby;
     sylverant_quest_category_t *cat, *caten;
     sylverant_quest_t *quest;
     quest_map_elem_t *elem;
     ship_client_t *tmp;
+    const quest_menu_t *m, *men;
+    const pc_quest_list_pkt *ents;
 
     /* Verify we got the sendbuf. */
     if(!sendbuf) {
@@ -5278,6 +5087,15 @@ static int send_pc_quest_list(ship_client_t *c, int cn, int lang) {
     cat = &qlist->cats[cn];
     caten = &qlisten->cats[cn];
 
+    /* Grab the prebuilt entries for the quests in the category. */
+    m = quest_menu_get(ship->qmenus, ver, lang, QUEST_MENU_PC);
+    men = quest_menu_get(ship->qmenus, ver, CLIENT_LANG_ENGLISH, QUEST_MENU_PC);
+
+    if(!m || !men)
+        return -1;
+
+    ents = (const pc_quest_list_pkt *)m->quests[cn];
+
     /* Clear out the header */
     memset(pkt, 0, 0x04);
 
@@ -5331,36 +5149,22 @@ static int send_pc_quest_list(ship_client_t *c, int cn, int lang) {
                 continue;
             }
 
-            /* Clear the entry */
-            memset(pkt->entries + entries, 0, 0x128);
-
-            /* Copy the category's information over to the packet */
+            /* Copy the quest's entry over, and fill in the menu id */
+            memcpy(&pkt->entries[entries], &ents->entries[i], 0x128);
             pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) | (cn << 8) |
                                                   (lang << 24)));
-            pkt->entries[entries].item_id = LE32(quest->qid);
-
-            /* Convert the name and the description to UTF-16. */
-            in = 32;
-            out = 64;
-            inptr = quest->name;
-            outptr = (char *)pkt->entries[entries].name;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
-
-            in = 112;
-            out = 224;
-            inptr = quest->desc;
-            outptr = (char *)pkt->entries[entries].desc;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
             ++entries;
             len += 0x128;
         }
 
-        /* If we already did English, then we're done. */
-        if(cat == caten)
+        /* If we already did English (or it doesn't have the category), then
+           we're done. */
+        if(cat == caten || men->cat_count <= cn)
             break;
 
         cat = caten;
+        ents = (const pc_quest_list_pkt *)men->quests[cn];
     }
 
     /* Fill in the rest of the header */
@@ -5375,15 +5179,14 @@ static int send_gc_quest_list(ship_client_t *c, int cn, int lang) {
     uint8_t *sendbuf = get_sendbuf();
     dc_quest_list_pkt *pkt = (dc_quest_list_pkt *)sendbuf;
     int i, len = 0x04, entries = 0, max = INT_MAX, j, k, ver;
-    size_t in, out;
-    ICONV_CONST char *inptr;
-    char *outptr;
     sylverant_quest_list_t *qlist, *qlisten;
     lobby_t *l = c->cur_lobby;
     sylverant_quest_category_t *cat, *caten;
     sylverant_quest_t *quest;
     quest_map_elem_t *elem;
     ship_client_t *tmp;
+    const quest_menu_t *m, *men;
+    const dc_quest_list_pkt *ents;
 
     /* Verify we got the sendbuf. */
     if(!sendbuf) {
@@ -5423,6 +5226,15 @@ static int send_gc_quest_list(ship_client_t *c, int cn, int lang) {
     cat = &qlist->cats[cn];
     caten = &qlisten->cats[cn];
 
+    /* Grab the prebuilt entries for the quests in the category. */
+    m = quest_menu_get(ship->qmenus, ver, lang, QUEST_MENU_DC);
+    men = quest_menu_get(ship->qmenus, ver, CLIENT_LANG_ENGLISH, QUEST_MENU_DC);
+
+    if(!m || !men)
+        return -1;
+
+    ents = (const dc_quest_list_pkt *)m->quests[cn];
+
     /* Clear out the header */
     memset(pkt, 0, 0x04);
 
@@ -5481,57 +5293,22 @@ static int send_gc_quest_list(ship_client_t *c, int cn, int lang) {
                 continue;
             }
 
-            /* Clear the entry */
-            memset(pkt->entries + entries, 0, 0x98);
-
-            /* Copy the category's information over to the packet */
+            /* Copy the quest's entry over, and fill in the menu id */
+            memcpy(&pkt->entries[entries], &ents->entries[i], 0x98);
             pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) | (cn << 8) |
                                                   (lang << 24)));
-            pkt->entries[entries].item_id = LE32(quest->qid);
-
-            /* Convert the name and the description to the appropriate
-               encoding */
-            in = 32;
-            out = 30;
-            inptr = quest->name;
-            outptr = &pkt->entries[entries].name[2];
-
-            if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].name[0] = '\t';
-                pkt->entries[entries].name[1] = 'J';
-            }
-            else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].name[0] = '\t';
-                pkt->entries[entries].name[1] = 'E';
-            }
-
-            in = 112;
-            out = 110;
-            inptr = quest->desc;
-            outptr = &pkt->entries[entries].desc[2];
-
-            if(lang == CLIENT_LANG_JAPANESE && !k) {
-                iconv(ic_utf8_to_sjis, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].desc[0] = '\t';
-                pkt->entries[entries].desc[1] = 'J';
-            }
-            else {
-                iconv(ic_utf8_to_8859, &inptr, &in, &outptr, &out);
-                pkt->entries[entries].desc[0] = '\t';
-                pkt->entries[entries].desc[1] = 'E';
-            }
 
             ++entries;
             len += 0x98;
         }
 
-        /* If we already did English, then we're done. */
-        if(cat == caten)
+        /* If we already did English (or it doesn't have the category), then
+           we're done. */
+        if(cat == caten || men->cat_count <= cn)
             break;
 
         cat = caten;
+        ents = (const dc_quest_list_pkt *)men->quests[cn];
     }
 
     /* Fill in the rest of the header */
@@ -5546,15 +5323,14 @@ static int send_bb_quest_list(ship_client_t *c, int cn, int lang) {
     uint8_t *sendbuf = get_sendbuf();
     bb_quest_list_pkt *pkt = (bb_quest_list_pkt *)sendbuf;
     int i, len = 0x08, entries = 0, max = INT_MAX, j, k;
-    size_t in, out;
-    ICONV_CONST char *inptr;
-    char *outptr;
     sylverant_quest_list_t *qlist, *qlisten;
     lobby_t *l = c->cur_lobby;
     sylverant_quest_category_t *cat, *caten;
     sylverant_quest_t *quest;
     quest_map_elem_t *elem;
     ship_client_t *tmp;
+    const quest_menu_t *m, *men;
+    const bb_quest_list_pkt *ents;
 
     /* Verify we got the sendbuf. */
     if(!sendbuf)
@@ -5580,6 +5356,16 @@ static int send_bb_quest_list(ship_client_t *c, int cn, int lang) {
     cat = &qlist->cats[cn];
     caten = &qlisten->cats[cn];
 
+    /* Grab the prebuilt entries for the quests in the category. */
+    m = quest_menu_get(ship->qmenus, CLIENT_VERSION_BB, lang, QUEST_MENU_BB);
+    men = quest_menu_get(ship->qmenus, CLIENT_VERSION_BB, CLIENT_LANG_ENGLISH,
+                         QUEST_MENU_BB);
+
+    if(!m || !men)
+        return -1;
+
+    ents = (const bb_quest_list_pkt *)m->quests[cn];
+
     /* If this is for challenge mode, figure out our limit. */
     if(c->cur_lobby->challenge)
         max = c->cur_lobby->max_chal;
@@ -5624,36 +5410,22 @@ static int send_bb_quest_list(ship_client_t *c, int cn, int lang) {
             if(j != l->max_clients)
                 continue;
 
-            /* Clear the entry */
-            memset(pkt->entries + entries, 0, 0x13C);
-
-            /* Copy the category's information over to the packet */
+            /* Copy the quest's entry over, and fill in the menu id */
+            memcpy(&pkt->entries[entries], &ents->entries[i], 0x13C);
             pkt->entries[entries].menu_id = LE32(((MENU_ID_QUEST) | (cn << 8) |
                                                   (lang << 24)));
-            pkt->entries[entries].item_id = LE32(quest->qid);
-
-            /* Convert the name and the description to UTF-16. */
-            in = 32;
-            out = 64;
-            inptr = quest->name;
-            outptr = (char *)pkt->entries[entries].name;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
-
-            in = 112;
-            out = 244;
-            inptr = quest->desc;
-            outptr = (char *)pkt->entries[entries].desc;
-            iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
             ++entries;
             len += 0x13C;
         }
 
-        /* If we already did English, then we're done. */
-        if(cat == caten)
+        /* If we already did English (or it doesn't have the category), then
+           we're done. */
+        if(cat == caten || men->cat_count <= cn)
             break;
 
         cat = caten;
+        ents = (const bb_quest_list_pkt *)men->quests[cn];
     }
 
     /* Fill in the rest of the header */
@@ -5865,188 +5637,134 @@ int send_quest_info(lobby_t *l, uint32_t qid, int lang) {
     return 0;
 }
 
-/* Send a quest to everyone in a lobby. */
-static int send_dcv1_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                           int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    dc_quest_file_pkt *file = (dc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
-    sylverant_quest_t *q = qm->qptr[c->version][lang];
+/* How much of a quest to send to a client at once. This is kept fairly small
+   so that one client getting a quest doesn't hold up everyone else on the
+   block for long. */
+#define QUEST_STREAM_PIECE  0x4000
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
-        return -1;
-    }
+static uint32_t quest_stream_pkt_len(ship_client_t *c, const uint8_t *ptr) {
+    uint32_t len;
 
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
-    sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
-            version_codes[CLIENT_VERSION_DCV1], language_codes[lang],
-            q->prefix);
+    if(c->version == CLIENT_VERSION_PC || c->version == CLIENT_VERSION_BB)
+        len = ptr[0] | (ptr[1] << 8);
+    else
+        len = ptr[2] | (ptr[3] << 8);
 
-    sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
+    return (len + c->hdr_size - 1) & ~(c->hdr_size - 1);
+}
 
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
-    }
+/* Send the next piece of whatever quest the client is being sent. Only whole
+   packets are sent in each piece. Anything else that gets sent to the client in
+   the meantime is held back until the whole quest is out. */
+int send_quest_stream(ship_client_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
+    quest_payload_t *p = c->qstream;
+    uint32_t left, len = 0, plen;
+    int rv = 0;
 
-    sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
+    if(!p)
+        return 0;
 
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
+    if(!sendbuf)
         return -1;
-    }
 
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
+    left = p->len - c->qstream_pos;
 
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
+    while(len < left) {
+        if(left - len < (uint32_t)c->hdr_size)
+            plen = left - len;
+        else
+            plen = quest_stream_pkt_len(c, p->data + c->qstream_pos + len);
 
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
+        /* Quest files are checked when they're read in, so this shouldn't
+           ever happen, but don't go past the end of anything if it does. */
+        if(!plen || plen > left - len || plen > SENDBUF_SIZE) {
+            debug(DBG_WARN, "Bad packet in quest %s\n", p->fn);
+            return -1;
+        }
 
-    sprintf(file->name, "PSO/%s", q->name);
+        /* A single packet bigger than a piece still has to go out whole. */
+        if(len + plen > QUEST_STREAM_PIECE) {
+            if(!len)
+                len = plen;
 
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
+            break;
+        }
 
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
+        len += plen;
     }
 
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
+    memcpy(sendbuf, p->data + c->qstream_pos, len);
 
-    sprintf(file->name, "PSO/%s", q->name);
+    if(c->logfile) {
+        fprint_packet(c->logfile, sendbuf, len, 0);
+    }
 
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
+    CRYPT_CryptData(&c->skey, sendbuf, len, 1);
 
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
+    if(send_raw(c, len, sendbuf)) {
+        debug(DBG_WARN, "Error sending quest %s: %s\n", p->fn,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
+        return -1;
+    }
 
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
+    c->qstream_pos += len;
 
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
+    if(c->qstream_pos >= p->len) {
+        quest_payload_unref(p);
+        c->qstream = NULL;
+        c->qstream_pos = 0;
 
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
+        /* Now everything that was held back can go out. */
+        if(c->qdefer_cur) {
+            CRYPT_CryptData(&c->skey, c->qdefer, c->qdefer_cur, 1);
+            rv = send_raw(c, c->qdefer_cur, c->qdefer);
+            c->qdefer_cur = 0;
         }
+    }
 
-        ++chunknum;
+    return rv;
+}
+
+/* Start sending a quest to a client. Only the first piece goes out now, the
+   rest gets sent by the block as the client's socket drains. */
+static int send_quest_payload(ship_client_t *c, quest_payload_t *p) {
+    if(!p)
+        return -1;
+
+    quest_payload_unref(c->qstream);
+    c->qstream = p;
+    c->qstream_pos = 0;
+
+    return send_quest_stream(c);
+}
+
+static int send_dcv1_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
+                           int lang) {
+    char fn_base[256];
+    sylverant_quest_t *q = qm->qptr[c->version][lang];
+
+    if(!q) {
+        return -1;
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
+    sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
+            version_codes[CLIENT_VERSION_DCV1], language_codes[lang],
+            q->prefix);
 
-    return 0;
+    return send_quest_payload(c, quest_payload_get(QUEST_PAYLOAD_DC, fn_base,
+                                                   q));
 }
 
 static int send_dcv2_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                            int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    dc_quest_file_pkt *file = (dc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
+    char fn_base[256];
     sylverant_quest_t *q = qm->qptr[c->version][lang];
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
+    if(!q) {
         return -1;
     }
 
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
     if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
         sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
                 version_codes[c->version], language_codes[lang], q->prefix);
@@ -6057,164 +5775,19 @@ static int send_dcv2_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                 q->prefix);
     }
 
-    sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
-    }
-
-    sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
-    }
-
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
-
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
-
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
-
-        ++chunknum;
-    }
-
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
-    return 0;
+    return send_quest_payload(c, quest_payload_get(QUEST_PAYLOAD_DC, fn_base,
+                                                   q));
 }
 
 static int send_pc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                          int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    pc_quest_file_pkt *file = (pc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
+    char fn_base[256];
     sylverant_quest_t *q = qm->qptr[c->version][lang];
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
+    if(!q) {
         return -1;
     }
 
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
     if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
         sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
                 version_codes[c->version], language_codes[lang], q->prefix);
@@ -6224,166 +5797,19 @@ static int send_pc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                 version_codes[c->version], language_codes[lang], q->prefix);
     }
 
-    sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
-    }
-
-    sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
-    }
-
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
-
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(pc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
-    file->flags = 0x0002;
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(pc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
-    file->flags = 0x0002;
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.pc.flags = (uint8_t)chunknum;
-            chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
-
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.pc.flags = (uint8_t)chunknum;
-            chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
-
-        ++chunknum;
-    }
-
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
-    return 0;
+    return send_quest_payload(c, quest_payload_get(QUEST_PAYLOAD_PC, fn_base,
+                                                   q));
 }
 
 static int send_gc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                          int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    gc_quest_file_pkt *file = (gc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
+    char fn_base[256];
     sylverant_quest_t *q = qm->qptr[c->version][lang];
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
+    if(!q) {
         return -1;
     }
 
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
     if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
         sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
                 version_codes[c->version], language_codes[lang], q->prefix);
@@ -6393,158 +5819,18 @@ static int send_gc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                 version_codes[c->version], language_codes[lang], q->prefix);
     }
 
-    sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
-    }
-
-    sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
-    }
-
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
-
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(gc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
-    file->flags = 0x0002;
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(gc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
-    file->flags = 0x0002;
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
-
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
-
-        ++chunknum;
-    }
-
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
-    return 0;
+    return send_quest_payload(c, quest_payload_get(QUEST_PAYLOAD_GC, fn_base,
+                                                   q));
 }
 
 static int send_qst_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
                           int lang, int ver) {
     char filename[256];
-    FILE *fp;
-    long len;
-    size_t read;
-    uint8_t *sendbuf = get_sendbuf();
     sylverant_quest_t *q = qm->qptr[ver][lang];
+    int kind;
 
-    /* Make sure we got the sendbuf and the quest */
-    if(!sendbuf || !q)
+    /* Make sure we got the quest */
+    if(!q)
         return -1;
 
     /* Figure out what file we're going to send. */
@@ -6570,54 +5856,10 @@ static int send_qst_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
         }
     }
 
-    fp = fopen(filename, "rb");
-
-    if(!fp) {
-        debug(DBG_WARN, "Cannot open qst file %s: %s\n", filename,
-              strerror(errno));
-        return -1;
-    }
-
-    /* Figure out how long the file is. */
-    fseek(fp, 0, SEEK_END);
-    len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    /* Copy the file (in chunks if necessary) to the sendbuf to actually send
-       away. */
-    while(len) {
-        read = fread(sendbuf, 1, 65536, fp);
-
-        /* If we can't read from the file, bail. */
-        if(!read) {
-            debug(DBG_WARN, "Error reading qst file %s: %s\n", filename,
-                  strerror(errno));
-            fclose(fp);
-            return -2;
-        }
-
-        /* Make sure we read up to a header-size boundary. */
-        if((read & (c->hdr_size - 1)) && !feof(fp)) {
-            long amt = (read & (c->hdr_size - 1));
-
-            fseek(fp, -amt, SEEK_CUR);
-            read -= amt;
-        }
-
-        /* Send this chunk away. */
-        if(crypt_send(c, read, sendbuf)) {
-            debug(DBG_WARN, "Error sending qst file %s: %s\n", filename,
-                  strerror(errno));
-            fclose(fp);
-            return -3;
-        }
+    kind = c->version == CLIENT_VERSION_PC ? QUEST_PAYLOAD_QST_PC :
+        QUEST_PAYLOAD_QST;
 
-        len -= read;
-    }
-
-    /* We're finished. */
-    fclose(fp);
-    return 0;
+    return send_quest_payload(c, quest_payload_get(kind, filename, NULL));
 }
 
 int send_quest(lobby_t *l, uint32_t qid, int lc) {
@@ -186,6 +186,9 @@ int send_quest_info(lobby_t *l, uint32_t qid, int lang);
 /* Send a quest to everyone in a lobby. */
 int send_quest(lobby_t *l, uint32_t qid, int lc);
 
+/* Send the next piece of the quest a client is being sent, if any. */
+int send_quest_stream(ship_client_t *c);
+
 /* Send the lobby name to the client. */
 int send_lobby_name(ship_client_t *c, lobby_t *l);
 
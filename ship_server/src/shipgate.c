@@ -245,6 +245,13 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
         return -3;
     }
 
+    /* If we've talked to the shipgate before, try to pick up the old session
+       where we left off. */
+    if(reconn && rv->resume_data.data) {
+        gnutls_session_set_data(rv->session, rv->resume_data.data,
+                                rv->resume_data.size);
+    }
+
 #if (SIZEOF_INT != SIZEOF_VOID_P) && (SIZEOF_LONG_INT == SIZEOF_VOID_P)
     gnutls_transport_set_ptr(rv->session, (gnutls_transport_ptr_t)((long)sock));
 #else
@@ -261,6 +268,10 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
         return -3;
     }
 
+    if(gnutls_session_is_resumed(rv->session)) {
+        debug(DBG_LOG, "%s: Resumed TLS session\n", s->cfg->name);
+    }
+
     /* Verify that the peer has a valid certificate */
     irv = gnutls_certificate_verify_peers2(rv->session, &peer_status);
 
@@ -311,6 +322,22 @@ int shipgate_reconnect(shipgate_conn_t *conn) {
     return shipgate_conn(conn->ship, conn, 1);
 }
 
+/* Close the connection to the shipgate, holding onto the TLS session data so
+   that the session can be resumed when we reconnect. */
+void shipgate_close(shipgate_conn_t *c) {
+    gnutls_free(c->resume_data.data);
+
+    if(gnutls_session_get_data2(c->session, &c->resume_data) < 0) {
+        c->resume_data.data = NULL;
+        c->resume_data.size = 0;
+    }
+
+    gnutls_bye(c->session, GNUTLS_SHUT_RDWR);
+    close(c->sock);
+    gnutls_deinit(c->session);
+    c->sock = -1;
+}
+
 /* Clean up a shipgate connection. */
 void shipgate_cleanup(shipgate_conn_t *c) {
     if(c->sock > 0) {
@@ -319,6 +346,7 @@ void shipgate_cleanup(shipgate_conn_t *c) {
         gnutls_deinit(c->session);
     }
 
+    gnutls_free(c->resume_data.data);
     free(c->recvbuf);
     free(c->sendbuf);
 }
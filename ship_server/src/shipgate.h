@@ -78,6 +78,7 @@ struct shipgate_conn {
     ship_t *ship;
 
     gnutls_session_t session;
+    gnutls_datum_t resume_data;
 
     uint16_t key_idx;
 
@@ -530,6 +531,10 @@ int shipgate_connect(ship_t *s, shipgate_conn_t *rv);
 /* Reconnect to the shipgate if we are disconnected for some reason. */
 int shipgate_reconnect(shipgate_conn_t *conn);
 
+/* Close the connection to the shipgate, keeping what is needed to resume the
+   TLS session when we reconnect. */
+void shipgate_close(shipgate_conn_t *c);
+
 /* Clean up a shipgate connection. */
 void shipgate_cleanup(shipgate_conn_t *c);
 
@@ -2150,7 +2150,8 @@ static int handle_bb_sort_inv(ship_client_t *c, subcmd_bb_sort_inv_t *pkt) {
 static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
     lobby_t *l = c->cur_lobby;
     uint16_t mid;
-    game_enemy_t *en;
+    game_enemy_state_t *en;
+    game_enemy_t data;
     uint32_t flags;
 
     /* We can't get these in default lobbies without someone messing with
@@ -2175,7 +2176,7 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
 
     /* Make sure the enemy is in range. */
     mid = LE16(pkt->enemy_id);
-    if(mid > l->map_enemies->count) {
+    if(game_enemy_lookup(l->map_enemies, mid, &data)) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " hit invalid enemy (%d -- max: "
               "%d)!\n"
               "Episode: %d, Floor: %d, Map: (%d, %d)\n", c->guildcard, mid,
@@ -2191,7 +2192,7 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
     }
 
     /* Save the hit, assuming the enemy isn't already dead. */
-    en = &l->map_enemies->enemies[mid];
+    en = &l->map_enemies->state[mid];
     if(!(en->clients_hit & 0x80)) {
         en->clients_hit |= (1 << c->client_id);
         en->last_client = c->client_id;
@@ -2208,8 +2209,8 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
         if(flags & 0x00000800) {
             en->clients_hit |= 0x80;
 
-            if(en->bp_entry < 0x60)
-                ++c->enemy_kills[en->bp_entry];
+            if(data.bp_entry < 0x60)
+                ++c->enemy_kills[data.bp_entry];
         }
     }
 
@@ -2238,16 +2239,16 @@ static int handle_bb_mhit(ship_client_t *c, subcmd_bb_mhit_pkt_t *pkt) {
 
     /* Make sure the enemy is in range. */
     mid = LE16(pkt->enemy_id);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " hit invalid enemy (%d -- max: "
               "%d)!\n", c->guildcard, mid, l->map_enemies->count);
         return -1;
     }
 
     /* Save the hit, assuming the enemy isn't already dead. */
-    if(!(l->map_enemies->enemies[mid].clients_hit & 0x80)) {
-        l->map_enemies->enemies[mid].clients_hit |= (1 << c->client_id);
-        l->map_enemies->enemies[mid].last_client = c->client_id;
+    if(!(l->map_enemies->state[mid].clients_hit & 0x80)) {
+        l->map_enemies->state[mid].clients_hit |= (1 << c->client_id);
+        l->map_enemies->state[mid].last_client = c->client_id;
     }
 
     return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
@@ -2257,7 +2258,8 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
     lobby_t *l = c->cur_lobby;
     uint16_t mid;
     uint32_t bp, exp;
-    game_enemy_t *en;
+    game_enemy_state_t *en;
+    game_enemy_t data;
 
     /* We can't get these in default lobbies without someone messing with
        something that they shouldn't be... Disconnect anyone that tries. */
@@ -2277,7 +2279,7 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
 
     /* Make sure the enemy is in range. */
     mid = LE16(pkt->enemy_id);
-    if(mid > l->map_enemies->count) {
+    if(game_enemy_lookup(l->map_enemies, mid, &data)) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " killed invalid enemy (%d -- "
               "max: %d)!\n", c->guildcard, mid, l->map_enemies->count);
         return -1;
@@ -2285,7 +2287,7 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
 
     /* Make sure this client actually hit the enemy and that the client didn't
        already claim their experience. */
-    en = &l->map_enemies->enemies[mid];
+    en = &l->map_enemies->state[mid];
 
     if(!(en->clients_hit & (1 << c->client_id))) {
         return 0;
@@ -2296,7 +2298,7 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
     en->clients_hit = (en->clients_hit & (~(1 << c->client_id))) | 0x80;
 
     /* Give the client their experience! */
-    bp = en->bp_entry;
+    bp = data.bp_entry;
     exp = l->bb_params[bp].exp;
 
     if(!pkt->last_hitter) {
@@ -19,19 +19,61 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 
+#include <sylverant/debug.h>
+
 #include "shipgate.h"
 #include "ship.h"
+#include "worker.h"
+
+/* Count a relayed packet that has just been sent in the calling thread's
+   latency histogram. */
+static void fw_hist_record(const fw_relay_t *r) {
+    struct timeval now;
+    int64_t usecs;
+    int i = 0;
+
+    gettimeofday(&now, NULL);
+    usecs = (int64_t)(now.tv_sec - r->start.tv_sec) * 1000000 +
+        (now.tv_usec - r->start.tv_usec);
+
+    while(i < FW_HIST_BUCKETS - 1 && usecs >= (1 << i))
+        ++i;
+
+    ++get_tdata()->fw_hist[r->ver][r->type][i];
+}
+
+/* Remember that a relayed packet was just put in a ship's forward queue, so
+   the owner of the ship can time it once it is sent. The caller must hold the
+   ship's mutex. */
+static void queue_relay(ship_t *c, const fw_relay_t *r) {
+    void *tmp;
+
+    if(c->fwdrelay_cur == c->fwdrelay_size) {
+        tmp = realloc(c->fwdrelay, (c->fwdrelay_size + 16) *
+                      sizeof(fw_relay_t));
+
+        /* If we can't allocate the space, the packet just won't get timed. */
+        if(!tmp)
+            return;
+
+        c->fwdrelay_size += 16;
+        c->fwdrelay = (fw_relay_t *)tmp;
+    }
 
-static uint8_t sendbuf[65536];
+    c->fwdrelay[c->fwdrelay_cur] = *r;
+    c->fwdrelay[c->fwdrelay_cur++].end = c->fwdbuf_cur;
+}
 
 static ssize_t ship_send(ship_t *c, const void *buffer, size_t len) {
     return gnutls_record_send(c->session, buffer, len);
 }
 
-/* Send a raw packet away. */
-static int send_raw(ship_t *c, int len) {
+/* Send a raw packet away. This must only be called by the thread that owns the
+   ship (or before the ship has been handed off to a worker). */
+static int send_raw(ship_t *c, const uint8_t *sendbuf, int len) {
     ssize_t rv, total = 0;
     void *tmp;
 
@@ -53,6 +95,8 @@ static int send_raw(ship_t *c, int len) {
         }
     }
 
+    ++c->pkts_sent;
+    c->bytes_sent += len;
     rv = len - total;
 
     if(rv) {
@@ -61,6 +105,7 @@ static int send_raw(ship_t *c, int len) {
             memmove(c->sendbuf, c->sendbuf + c->sendbuf_start,
                     c->sendbuf_cur - c->sendbuf_start);
             c->sendbuf_cur -= c->sendbuf_start;
+            c->sendbuf_start = 0;
         }
 
         /* See if we need to reallocate the buffer. */
@@ -78,22 +123,159 @@ static int send_raw(ship_t *c, int len) {
         /* Copy what's left of the packet into the output buffer. */
         memcpy(c->sendbuf + c->sendbuf_cur, sendbuf + total, rv);
         c->sendbuf_cur += rv;
+
+        if(c->sendbuf_cur > c->sendbuf_peak)
+            c->sendbuf_peak = c->sendbuf_cur;
+
+        if(c->sendbuf_cur > c->sendbuf_hwm)
+            c->sendbuf_hwm = c->sendbuf_cur;
     }
 
     return 0;
 }
 
-/* Encrypt a packet, and send it away. */
-static int send_crypt(ship_t *c, int len) {
+/* Queue a packet for a ship owned by another worker thread. The owner will
+   pick it up and send it the next time it runs through its loop. */
+static int queue_pkt(ship_t *c, const uint8_t *sendbuf, int len) {
+    void *tmp;
+
+    pthread_mutex_lock(&c->mutex);
+
+    /* See if we need to reallocate the buffer. */
+    if(c->fwdbuf_cur + len > c->fwdbuf_size) {
+        tmp = realloc(c->fwdbuf, c->fwdbuf_cur + len);
+
+        /* If we can't allocate the space, bail. */
+        if(tmp == NULL) {
+            pthread_mutex_unlock(&c->mutex);
+            return -1;
+        }
+
+        c->fwdbuf_size = c->fwdbuf_cur + len;
+        c->fwdbuf = (unsigned char *)tmp;
+    }
+
+    memcpy(c->fwdbuf + c->fwdbuf_cur, sendbuf, len);
+    c->fwdbuf_cur += len;
+    ++c->pkts_fwd;
+    c->bytes_fwd += len;
+
+    if(get_tdata()->relay)
+        queue_relay(c, get_tdata()->relay);
+
+    if(c->fwdbuf_cur > c->fwdbuf_peak)
+        c->fwdbuf_peak = c->fwdbuf_cur;
+
+    if(c->fwdbuf_cur > c->fwdbuf_hwm)
+        c->fwdbuf_hwm = c->fwdbuf_cur;
+
+    /* Complain (once) if the ship is falling way behind. */
+    if(c->fwdbuf_cur > SHIP_BACKLOG_WARN && !c->backlogged) {
+        debug(DBG_WARN, "%s is backed up: %d bytes waiting to be sent\n",
+              c->name, c->fwdbuf_cur);
+        c->backlogged = 1;
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+
+    worker_wake(c->worker);
+    return 0;
+}
+
+/* Encrypt a packet from the given buffer, and send it away. */
+static int send_crypt_buf(ship_t *c, const uint8_t *buf, int len) {
+    sg_tdata_t *td = get_tdata();
+
     /* Make sure its at least a header in length. */
     if(len < 8)
         return -1;
 
-    return send_raw(c, len);
+    /* If the ship belongs to another thread, let that thread do the work of
+       actually sending the packet. */
+    if(c->worker && c->worker != td->worker)
+        return queue_pkt(c, buf, len);
+
+    if(send_raw(c, buf, len))
+        return -1;
+
+    if(td->relay)
+        fw_hist_record(td->relay);
+
+    return 0;
+}
+
+/* Encrypt a packet, and send it away. */
+static int send_crypt(ship_t *c, int len) {
+    return send_crypt_buf(c, get_sendbuf(), len);
+}
+
+/* Send any packets other threads have queued up for the given ship. */
+int send_queued(ship_t *c) {
+    unsigned char *buf;
+    fw_relay_t *relay;
+    int len, rv, count, i;
+
+    pthread_mutex_lock(&c->mutex);
+    buf = c->fwdbuf;
+    len = c->fwdbuf_cur;
+    c->fwdbuf = NULL;
+    c->fwdbuf_cur = 0;
+    c->fwdbuf_size = 0;
+
+    relay = c->fwdrelay;
+    count = c->fwdrelay_cur;
+    c->fwdrelay = NULL;
+    c->fwdrelay_cur = 0;
+    c->fwdrelay_size = 0;
+
+    if(c->backlogged) {
+        debug(DBG_LOG, "%s has caught up (%d bytes sent)\n", c->name, len);
+        c->backlogged = 0;
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    if(!buf) {
+        free(relay);
+        return 0;
+    }
+
+    rv = send_raw(c, buf, len);
+    free(buf);
+
+    /* Everything went out at once, so all of the relayed packets in there are
+       done now. */
+    if(!rv) {
+        for(i = 0; i < count; ++i) {
+            fw_hist_record(&relay[i]);
+        }
+    }
+
+    free(relay);
+    return rv;
+}
+
+void log_send_stats(ship_t *c) {
+    int fwd_cur, fwd_hwm, send_cur;
+
+    pthread_mutex_lock(&c->mutex);
+    fwd_cur = c->fwdbuf_cur;
+    fwd_hwm = c->fwdbuf_hwm;
+    c->fwdbuf_hwm = fwd_cur;
+    pthread_mutex_unlock(&c->mutex);
+
+    send_cur = c->sendbuf_cur - c->sendbuf_start;
+
+    debug(DBG_LOG, "%s: %d bytes queued by other threads (high %d, peak %d), "
+          "%d bytes waiting to be sent (high %d, peak %d)\n",
+          c->name[0] ? c->name : "Unknown ship", fwd_cur, fwd_hwm,
+          c->fwdbuf_peak, send_cur, c->sendbuf_hwm, c->sendbuf_peak);
+
+    c->sendbuf_hwm = send_cur;
 }
 
 int forward_dreamcast(ship_t *c, dc_pkt_hdr_t *dc, uint32_t sender,
                       uint32_t gc, uint32_t block) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_fw_9_pkt *pkt = (shipgate_fw_9_pkt *)sendbuf;
     int dc_len = LE16(dc->pkt_len);
     int full_len = sizeof(shipgate_fw_9_pkt) + dc_len;
@@ -126,6 +308,7 @@ int forward_dreamcast(ship_t *c, dc_pkt_hdr_t *dc, uint32_t sender,
 
 int forward_pc(ship_t *c, dc_pkt_hdr_t *pc, uint32_t sender, uint32_t gc,
                uint32_t block) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_fw_9_pkt *pkt = (shipgate_fw_9_pkt *)sendbuf;
     int pc_len = LE16(pc->pkt_len);
     int full_len = sizeof(shipgate_fw_9_pkt) + pc_len;
@@ -158,6 +341,7 @@ int forward_pc(ship_t *c, dc_pkt_hdr_t *pc, uint32_t sender, uint32_t gc,
 
 int forward_bb(ship_t *c, bb_pkt_hdr_t *bb, uint32_t sender, uint32_t gc,
                uint32_t block) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_fw_9_pkt *pkt = (shipgate_fw_9_pkt *)sendbuf;
     int bb_len = LE16(bb->pkt_len);
     int full_len = sizeof(shipgate_fw_9_pkt) + bb_len;
@@ -188,8 +372,95 @@ int forward_bb(ship_t *c, bb_pkt_hdr_t *bb, uint32_t sender, uint32_t gc,
     return send_crypt(c, full_len);
 }
 
+static int relay_send(ship_t *c, shipgate_fw_9_pkt *pkt, uint32_t sender) {
+    dc_pkt_hdr_t *dc = (dc_pkt_hdr_t *)pkt->pkt;
+    bb_pkt_hdr_t *bb = (bb_pkt_hdr_t *)pkt->pkt;
+    int full_len = ntohs(pkt->hdr.pkt_len);
+    int len;
+
+    /* Figure out how long the packet should be, to make sure the ship that
+       sent it didn't pad it strangely. */
+    if(pkt->hdr.pkt_type == htons(SHDR_TYPE_BB))
+        len = sizeof(shipgate_fw_9_pkt) + LE16(bb->pkt_len);
+    else
+        len = sizeof(shipgate_fw_9_pkt) + LE16(dc->pkt_len);
+
+    /* If it doesn't match up, fall back to building the packet over. */
+    if(((len + 7) & 0xFFF8) != full_len) {
+        switch(ntohs(pkt->hdr.pkt_type)) {
+            case SHDR_TYPE_DC:
+                return forward_dreamcast(c, dc, sender, 0, 0);
+
+            case SHDR_TYPE_PC:
+                return forward_pc(c, dc, sender, 0, 0);
+
+            case SHDR_TYPE_BB:
+                return forward_bb(c, bb, sender, 0, 0);
+        }
+
+        return -1;
+    }
+
+    /* Fill in the shipgate header */
+    pkt->hdr.flags = 0;
+    pkt->hdr.reserved = 0;
+    pkt->hdr.version = 0;
+
+    /* Fill in the metadata */
+    pkt->ship_id = htonl(sender);
+    pkt->fw_flags = 0;
+    pkt->guildcard = 0;
+    pkt->block = 0;
+
+    /* Scrub whatever the sending ship left in the padding. */
+    memset((uint8_t *)pkt + len, 0, full_len - len);
+
+    /* Send the packet away */
+    return send_crypt_buf(c, (uint8_t *)pkt, full_len);
+}
+
+/* Relay a forwarded packet that came in from one ship on to another. The
+   packet is sent straight out of the buffer it was received in, only the
+   metadata in the shipgate header is rewritten. How long it takes from the
+   packet being read in until it is sent to the other ship (including any time
+   spent waiting in that ship's forward queue) is counted in the relay latency
+   histogram. */
+int relay_fw_pkt(ship_t *c, shipgate_fw_9_pkt *pkt, uint32_t sender) {
+    sg_tdata_t *td = get_tdata();
+    dc_pkt_hdr_t *dc = (dc_pkt_hdr_t *)pkt->pkt;
+    bb_pkt_hdr_t *bb = (bb_pkt_hdr_t *)pkt->pkt;
+    fw_relay_t r;
+    int rv;
+
+    r.start = td->recv_time;
+
+    switch(ntohs(pkt->hdr.pkt_type)) {
+        case SHDR_TYPE_DC:
+            r.ver = FW_HIST_DC;
+            r.type = dc->pkt_type;
+            break;
+
+        case SHDR_TYPE_PC:
+            r.ver = FW_HIST_PC;
+            r.type = dc->pkt_type;
+            break;
+
+        default:
+            r.ver = FW_HIST_BB;
+            r.type = (uint8_t)LE16(bb->pkt_type);
+            break;
+    }
+
+    td->relay = &r;
+    rv = relay_send(c, pkt, sender);
+    td->relay = NULL;
+
+    return rv;
+}
+
 /* Send a welcome packet to the given ship. */
 int send_welcome(ship_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_login_pkt *pkt = (shipgate_login_pkt *)sendbuf;
 
     /* Scrub the buffer */
@@ -215,10 +486,11 @@ int send_welcome(ship_t *c) {
     memcpy(pkt->gate_nonce, c->gate_nonce, 4);
 
     /* Send the packet away */
-    return send_raw(c, sizeof(shipgate_login_pkt));
+    return send_raw(c, sendbuf, sizeof(shipgate_login_pkt));
 }
 
 int send_ship_status(ship_t *c, ship_t *o, uint16_t status) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_ship_status6_pkt *pkt = (shipgate_ship_status6_pkt *)sendbuf;
 
     /* If the ship hasn't finished logging in yet, don't send this. */
@@ -254,6 +526,7 @@ int send_ship_status(ship_t *c, ship_t *o, uint16_t status) {
 
 /* Send a ping packet to a client. */
 int send_ping(ship_t *c, int reply) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_hdr_t *pkt = (shipgate_hdr_t *)sendbuf;
 
     /* Fill in the header. */
@@ -274,6 +547,7 @@ int send_ping(ship_t *c, int reply) {
 /* Send the ship a character data restore. */
 int send_cdata(ship_t *c, uint32_t gc, uint32_t slot, void *cdata, int sz,
                uint32_t block) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_char_data_pkt *pkt = (shipgate_char_data_pkt *)sendbuf;
 
     /* Fill in the header. */
@@ -295,6 +569,7 @@ int send_cdata(ship_t *c, uint32_t gc, uint32_t slot, void *cdata, int sz,
 
 /* Send a reply to a GM login request. */
 int send_gmreply(ship_t *c, uint32_t gc, uint32_t block, int good, uint8_t p) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_gmlogin_reply_pkt *pkt = (shipgate_gmlogin_reply_pkt *)sendbuf;
     uint16_t flags = good ? SHDR_RESPONSE : SHDR_FAILURE;
 
@@ -317,6 +592,7 @@ int send_gmreply(ship_t *c, uint32_t gc, uint32_t block, int good, uint8_t p) {
 
 /* Send a client/game update packet. */
 int send_counts(ship_t *c, uint32_t ship_id, uint16_t clients, uint16_t games) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_cnt_pkt *pkt = (shipgate_cnt_pkt *)sendbuf;
 
     /* Clear the packet first */
@@ -339,6 +615,7 @@ int send_counts(ship_t *c, uint32_t ship_id, uint16_t clients, uint16_t games) {
 /* Send an error packet to a ship */
 int send_error(ship_t *c, uint16_t type, uint16_t flags, uint32_t err,
                const uint8_t *data, int data_sz) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_error_pkt *pkt = (shipgate_error_pkt *)sendbuf;
     uint16_t sz;
 
@@ -368,6 +645,7 @@ int send_friend_message(ship_t *c, int on, uint32_t dest_gc,
                         uint32_t dest_block, uint32_t friend_gc,
                         uint32_t friend_block, uint32_t friend_ship,
                         const char *friend_name, const char *nickname) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_friend_login_4_pkt *pkt = (shipgate_friend_login_4_pkt *)sendbuf;
 
     /* Clear the packet */
@@ -400,6 +678,7 @@ int send_friend_message(ship_t *c, int on, uint32_t dest_gc,
 /* Send a kick packet */
 int send_kick(ship_t *c, uint32_t requester, uint32_t user, uint32_t block,
               const char *reason) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_kick_pkt *pkt = (shipgate_kick_pkt *)sendbuf;
 
     /* Scrub the buffer */
@@ -426,6 +705,7 @@ int send_kick(ship_t *c, uint32_t requester, uint32_t user, uint32_t block,
 /* Send a portion of a user's friendlist to the user */
 int send_friendlist(ship_t *c, uint32_t requester, uint32_t block,
                     int count, const friendlist_data_t *entries) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_friend_list_pkt *pkt = (shipgate_friend_list_pkt *)sendbuf;
     uint16_t len = sizeof(shipgate_friend_list_pkt) +
         sizeof(friendlist_data_t) * count;
@@ -450,6 +730,7 @@ int send_friendlist(ship_t *c, uint32_t requester, uint32_t block,
 /* Send a global message packet to a ship */
 int send_global_msg(ship_t *c, uint32_t requester, const char *text,
                     uint16_t text_len) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_global_msg_pkt *pkt = (shipgate_global_msg_pkt *)sendbuf;
     uint16_t len = sizeof(shipgate_global_msg_pkt) + text_len;
 
@@ -470,6 +751,7 @@ int send_global_msg(ship_t *c, uint32_t requester, const char *text,
 
 /* Begin an options packet */
 void *user_options_begin(uint32_t guildcard, uint32_t block) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_user_opt_pkt *pkt = (shipgate_user_opt_pkt *)sendbuf;
 
     /* Fill in the packet */
@@ -491,6 +773,7 @@ void *user_options_begin(uint32_t guildcard, uint32_t block) {
 /* Append an option value to the options packet */
 void *user_options_append(void *p, uint32_t opt, uint32_t len,
                           const uint8_t *data) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_user_opt_pkt *pkt = (shipgate_user_opt_pkt *)sendbuf;
     shipgate_user_opt_t *o = (shipgate_user_opt_t *)p;
     int padding = 8 - (len & 7);
@@ -515,6 +798,7 @@ void *user_options_append(void *p, uint32_t opt, uint32_t len,
 
 /* Finish off a user options packet and send it along */
 int send_user_options(ship_t *c) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_user_opt_pkt *pkt = (shipgate_user_opt_pkt *)sendbuf;
     uint16_t len = pkt->hdr.pkt_len;
 
@@ -533,6 +817,7 @@ int send_user_options(ship_t *c) {
 /* Send a packet containing a user's Blue Burst options */
 int send_bb_opts(ship_t *c, uint32_t gc, uint32_t block,
                  sylverant_bb_db_opts_t *opts) {
+    uint8_t *sendbuf = get_sendbuf();
     shipgate_bb_opts_pkt *pkt = (shipgate_bb_opts_pkt *)sendbuf;
 
     /* Fill in the packet */
@@ -0,0 +1,282 @@
+/*
+    Sylverant Shipgate
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include <sylverant/debug.h>
+#include <sylverant/database.h>
+
+#include "privcache.h"
+
+#define PRIV_CACHE_BUCKETS  1024
+#define PRIV_HASH(gc)       ((gc) & (PRIV_CACHE_BUCKETS - 1))
+
+typedef struct priv_entry {
+    TAILQ_ENTRY(priv_entry) qentry;
+    uint32_t guildcard;
+    uint16_t ship_id;
+    int account_id;
+    int priv;
+    time_t fetched;
+} priv_entry_t;
+
+TAILQ_HEAD(priv_queue, priv_entry);
+
+/* The cache is shared between all the worker threads, so everything in here is
+   protected by the mutex. */
+static struct priv_queue priv_cache[PRIV_CACHE_BUCKETS];
+static int priv_cache_inited = 0;
+static pthread_mutex_t priv_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The last privilege version read from the database. Only the main thread
+   touches these. */
+static unsigned long priv_version = 0;
+static int priv_version_ok = 0;
+static int priv_version_warned = 0;
+
+/* The caller must hold priv_mutex. */
+static priv_entry_t *find_entry(uint32_t gc) {
+    priv_entry_t *i;
+    int j;
+
+    if(!priv_cache_inited) {
+        for(j = 0; j < PRIV_CACHE_BUCKETS; ++j) {
+            TAILQ_INIT(&priv_cache[j]);
+        }
+
+        priv_cache_inited = 1;
+    }
+
+    TAILQ_FOREACH(i, &priv_cache[PRIV_HASH(gc)], qentry) {
+        if(i->guildcard == gc)
+            return i;
+    }
+
+    return NULL;
+}
+
+void priv_cache_add(uint32_t gc, uint16_t ship_id, int account_id, int priv) {
+    priv_entry_t *ent;
+
+    pthread_mutex_lock(&priv_mutex);
+
+    if(!(ent = find_entry(gc))) {
+        if(!(ent = (priv_entry_t *)malloc(sizeof(priv_entry_t)))) {
+            pthread_mutex_unlock(&priv_mutex);
+            debug(DBG_WARN, "Couldn't cache privileges for %u\n", gc);
+            return;
+        }
+
+        ent->guildcard = gc;
+        TAILQ_INSERT_TAIL(&priv_cache[PRIV_HASH(gc)], ent, qentry);
+    }
+
+    ent->ship_id = ship_id;
+    ent->account_id = account_id;
+    ent->priv = priv;
+    ent->fetched = time(NULL);
+
+    pthread_mutex_unlock(&priv_mutex);
+}
+
+void priv_cache_update(uint32_t gc, int account_id, int priv) {
+    priv_entry_t *ent;
+
+    pthread_mutex_lock(&priv_mutex);
+
+    if((ent = find_entry(gc))) {
+        ent->account_id = account_id;
+        ent->priv = priv;
+        ent->fetched = time(NULL);
+    }
+
+    pthread_mutex_unlock(&priv_mutex);
+}
+
+void priv_cache_expire(uint32_t gc) {
+    priv_entry_t *ent;
+
+    pthread_mutex_lock(&priv_mutex);
+
+    if((ent = find_entry(gc)))
+        ent->fetched = 0;
+
+    pthread_mutex_unlock(&priv_mutex);
+}
+
+void priv_cache_expire_all(void) {
+    priv_entry_t *i;
+    int j;
+
+    pthread_mutex_lock(&priv_mutex);
+
+    if(priv_cache_inited) {
+        for(j = 0; j < PRIV_CACHE_BUCKETS; ++j) {
+            TAILQ_FOREACH(i, &priv_cache[j], qentry) {
+                i->fetched = 0;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&priv_mutex);
+}
+
+void priv_cache_del(uint32_t gc) {
+    priv_entry_t *ent;
+
+    pthread_mutex_lock(&priv_mutex);
+
+    if((ent = find_entry(gc))) {
+        TAILQ_REMOVE(&priv_cache[PRIV_HASH(gc)], ent, qentry);
+        free(ent);
+    }
+
+    pthread_mutex_unlock(&priv_mutex);
+}
+
+void priv_cache_del_ship(uint16_t ship_id) {
+    priv_entry_t *i, *tmp;
+    int j;
+
+    pthread_mutex_lock(&priv_mutex);
+
+    if(priv_cache_inited) {
+        for(j = 0; j < PRIV_CACHE_BUCKETS; ++j) {
+            i = TAILQ_FIRST(&priv_cache[j]);
+
+            while(i) {
+                tmp = TAILQ_NEXT(i, qentry);
+
+                if(i->ship_id == ship_id) {
+                    TAILQ_REMOVE(&priv_cache[j], i, qentry);
+                    free(i);
+                }
+
+                i = tmp;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&priv_mutex);
+}
+
+int priv_lookup(sg_tdata_t *td, uint32_t gc, int *account_id, int *priv) {
+    priv_entry_t *ent;
+    char query[256];
+    void *result;
+    char **row;
+    int acc = -1, p = 0;
+
+    /* See if we have fresh enough data in the cache first. */
+    pthread_mutex_lock(&priv_mutex);
+
+    if((ent = find_entry(gc)) && time(NULL) < ent->fetched + PRIV_CACHE_TTL) {
+        acc = ent->account_id;
+        p = ent->priv;
+        pthread_mutex_unlock(&priv_mutex);
+        goto out;
+    }
+
+    pthread_mutex_unlock(&priv_mutex);
+
+    /* Nope, go to the database for it. */
+    sprintf(query, "SELECT account_id, privlevel FROM guildcards NATURAL JOIN "
+            "account_data WHERE guildcard='%u'", gc);
+
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "Couldn't fetch account data (%u)\n", gc);
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+        return -1;
+    }
+
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
+        debug(DBG_WARN, "Couldn't fetch account data (%u)\n", gc);
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+        return -1;
+    }
+
+    if((row = sylverant_db_result_fetch(result))) {
+        acc = atoi(row[0]);
+        p = atoi(row[1]);
+    }
+
+    sylverant_db_result_free(result);
+
+    /* Refresh the cached copy, if the user is logged in. */
+    priv_cache_update(gc, acc, p);
+
+out:
+    *account_id = acc;
+    *priv = p;
+
+    return acc == -1 ? 1 : 0;
+}
+
+void priv_cache_poll(sg_tdata_t *td) {
+    void *result;
+    char **row;
+    unsigned long ver = 0;
+
+    if(sylverant_db_query(&td->conn, "SELECT version FROM privilege_version") ||
+       (result = sylverant_db_result_store(&td->conn)) == NULL) {
+        /* Only complain once, not every time this gets called. */
+        if(!priv_version_warned) {
+            debug(DBG_WARN, "Couldn't fetch privilege version\n");
+            debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+            priv_version_warned = 1;
+        }
+
+        priv_cache_expire_all();
+        priv_version_ok = 0;
+        return;
+    }
+
+    if((row = sylverant_db_result_fetch(result)) && row[0])
+        ver = strtoul(row[0], NULL, 0);
+
+    sylverant_db_result_free(result);
+
+    if(!priv_version_ok || ver != priv_version) {
+        priv_cache_expire_all();
+        priv_version = ver;
+        priv_version_ok = 1;
+    }
+
+    priv_version_warned = 0;
+}
+
+void priv_cache_cleanup(void) {
+    priv_entry_t *i;
+    int j;
+
+    pthread_mutex_lock(&priv_mutex);
+
+    if(priv_cache_inited) {
+        for(j = 0; j < PRIV_CACHE_BUCKETS; ++j) {
+            while((i = TAILQ_FIRST(&priv_cache[j]))) {
+                TAILQ_REMOVE(&priv_cache[j], i, qentry);
+                free(i);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&priv_mutex);
+}
@@ -0,0 +1,70 @@
+/*
+    Sylverant Shipgate
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PRIVCACHE_H
+#define PRIVCACHE_H
+
+#include <stdint.h>
+
+#include "worker.h"
+
+/* How long (in seconds) a cached privilege level is trusted before it gets
+   checked against the database again. Privilege changes are normally noticed
+   much sooner than this, through the privilege version (see below). */
+#define PRIV_CACHE_TTL      3600
+
+/* How often (in seconds) the privilege version is checked. The version is
+   bumped in the database whenever a privilege level changes, and the whole
+   cache is expired when it does. If the version can't be read, the cache is
+   expired every time instead, so a change is never missed for longer than
+   this. */
+#define PRIV_VERSION_POLL   5
+
+/* Add (or update) the cached account/privilege data for a guildcard that has
+   logged in on the given ship. An account_id of -1 means the guildcard isn't
+   tied to an account. */
+void priv_cache_add(uint32_t gc, uint16_t ship_id, int account_id, int priv);
+
+/* Update the cached data for a guildcard, but only if it is already cached. */
+void priv_cache_update(uint32_t gc, int account_id, int priv);
+
+/* Make the next lookup of a guildcard go to the database, without taking it
+   out of the cache. */
+void priv_cache_expire(uint32_t gc);
+
+/* Same as above, but for everything in the cache. */
+void priv_cache_expire_all(void);
+
+/* Remove a guildcard from the cache (when it logs off). */
+void priv_cache_del(uint32_t gc);
+
+/* Remove everything that was logged in on the given ship. */
+void priv_cache_del_ship(uint16_t ship_id);
+
+/* Look up the account and privilege level for a guildcard, going to the
+   database if it isn't cached (or the cached data is too old). Returns 0 on
+   success, 1 if the guildcard isn't tied to an account, or -1 on error. */
+int priv_lookup(sg_tdata_t *td, uint32_t gc, int *account_id, int *priv);
+
+/* Check the privilege version in the database, expiring everything in the
+   cache if it has changed. Only the main thread calls this. */
+void priv_cache_poll(sg_tdata_t *td);
+
+/* Clean up everything in the cache. */
+void priv_cache_cleanup(void);
+
+#endif /* !PRIVCACHE_H */
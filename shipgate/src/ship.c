@@ -23,6 +23,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <iconv.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 
 #include <gnutls/gnutls.h>
@@ -37,6 +38,8 @@
 
 #include "ship.h"
 #include "shipgate.h"
+#include "worker.h"
+#include "privcache.h"
 
 #define CLIENT_PRIV_LOCAL_GM    0x00000001
 #define CLIENT_PRIV_GLOBAL_GM   0x00000002
@@ -49,36 +52,94 @@
 #define VERSION_EP3             3
 #define VERSION_BB              4
 
-/* Database connection */
-extern sylverant_dbconn_t conn;
-
-/* iconv contexts */
-extern iconv_t ic_utf8_to_utf16;
-extern iconv_t ic_utf16_to_utf8;
-extern iconv_t ic_sjis_to_utf8;
-extern iconv_t ic_8859_to_utf8;
-
 /* GnuTLS data... */
 extern gnutls_certificate_credentials_t tls_cred;
 extern gnutls_priority_t tls_prio;
+extern gnutls_datum_t tls_ticket_key;
 
 /* Events... */
 extern uint32_t event_count;
 extern monster_event_t *events;
 
-static uint8_t recvbuf[65536];
+/* Routing table of connected ships, indexed by ship id. Only modified with the
+   write lock on ships_lock held. */
+static ship_t *ship_routes[65536];
+
+void ship_route_add(ship_t *c) {
+    /* If a ship with this id is already connected (i.e, it reconnected before
+       the old connection timed out), leave the old one in the table. It'll get
+       replaced when the old connection goes away. */
+    if(c->key_idx && !ship_routes[c->key_idx])
+        ship_routes[c->key_idx] = c;
+}
 
-/* Find a ship by its id */
-static ship_t *find_ship(uint16_t id) {
+static void ship_route_del(ship_t *c) {
     ship_t *i;
 
+    if(ship_routes[c->key_idx] != c)
+        return;
+
+    ship_routes[c->key_idx] = NULL;
+
+    /* Look for another connection with the same id to take over. */
     TAILQ_FOREACH(i, &ships, qentry) {
-        if(i->key_idx == id) {
-            return i;
+        if(i->key_idx == c->key_idx) {
+            ship_routes[c->key_idx] = i;
+            break;
         }
     }
+}
 
-    return NULL;
+static void ship_ref(ship_t *c) {
+    pthread_mutex_lock(&c->mutex);
+    ++c->refcnt;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+/* Find a ship by its id, taking a reference to it. The reference keeps the
+   ship from being freed (even if it disconnects), so it can be sent to without
+   holding ships_lock. Drop it with ship_put when done. */
+static ship_t *ship_get(uint16_t id) {
+    ship_t *rv;
+
+    pthread_rwlock_rdlock(&ships_lock);
+
+    if((rv = ship_routes[id]))
+        ship_ref(rv);
+
+    pthread_rwlock_unlock(&ships_lock);
+
+    return rv;
+}
+
+void ship_put(ship_t *c) {
+    int refcnt;
+
+    pthread_mutex_lock(&c->mutex);
+    refcnt = --c->refcnt;
+    pthread_mutex_unlock(&c->mutex);
+
+    if(refcnt)
+        return;
+
+    if(c->recvbuf) {
+        free(c->recvbuf);
+    }
+
+    if(c->sendbuf) {
+        free(c->sendbuf);
+    }
+
+    if(c->fwdbuf) {
+        free(c->fwdbuf);
+    }
+
+    if(c->fwdrelay) {
+        free(c->fwdrelay);
+    }
+
+    pthread_mutex_destroy(&c->mutex);
+    free(c);
 }
 
 static inline void pack_ipv6(struct in6_addr *addr, uint64_t *hi,
@@ -152,6 +213,114 @@ static monster_event_t *find_current_event(uint8_t difficulty, uint8_t ver) {
     return NULL;
 }
 
+/* Cache of the certificate fingerprints we've approved recently, so that a
+   ship reconnecting doesn't have to wait on the database to get back in. */
+typedef struct fp_entry {
+    TAILQ_ENTRY(fp_entry) qentry;
+    uint8_t hash[20];
+    uint16_t key_idx;
+    time_t fetched;
+} fp_entry_t;
+
+TAILQ_HEAD(fp_queue, fp_entry);
+static struct fp_queue fp_cache = TAILQ_HEAD_INITIALIZER(fp_cache);
+static pthread_mutex_t fp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The last ship key version read from the database. Only the main thread
+   touches these. */
+static unsigned long fp_version = 0;
+static int fp_version_ok = 0;
+static int fp_version_warned = 0;
+
+static int fp_cache_lookup(const uint8_t hash[20], uint16_t *key_idx) {
+    fp_entry_t *i;
+    time_t now = time(NULL);
+    int rv = -1;
+
+    pthread_mutex_lock(&fp_mutex);
+
+    TAILQ_FOREACH(i, &fp_cache, qentry) {
+        if(!memcmp(i->hash, hash, 20)) {
+            /* If it's gotten too old, throw it out so it gets checked against
+               the database again. */
+            if(now >= i->fetched + FP_CACHE_TTL) {
+                TAILQ_REMOVE(&fp_cache, i, qentry);
+                free(i);
+            }
+            else {
+                *key_idx = i->key_idx;
+                rv = 0;
+            }
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&fp_mutex);
+    return rv;
+}
+
+static void fp_cache_add(const uint8_t hash[20], uint16_t key_idx) {
+    fp_entry_t *ent;
+
+    if(!(ent = (fp_entry_t *)malloc(sizeof(fp_entry_t))))
+        return;
+
+    memcpy(ent->hash, hash, 20);
+    ent->key_idx = key_idx;
+    ent->fetched = time(NULL);
+
+    pthread_mutex_lock(&fp_mutex);
+    TAILQ_INSERT_TAIL(&fp_cache, ent, qentry);
+    pthread_mutex_unlock(&fp_mutex);
+}
+
+void fp_cache_cleanup(void) {
+    fp_entry_t *i;
+
+    pthread_mutex_lock(&fp_mutex);
+
+    while((i = TAILQ_FIRST(&fp_cache))) {
+        TAILQ_REMOVE(&fp_cache, i, qentry);
+        free(i);
+    }
+
+    pthread_mutex_unlock(&fp_mutex);
+}
+
+void fp_cache_poll(sg_tdata_t *td) {
+    void *result;
+    char **row;
+    unsigned long ver = 0;
+
+    if(sylverant_db_query(&td->conn, "SELECT version FROM ship_key_version") ||
+       (result = sylverant_db_result_store(&td->conn)) == NULL) {
+        /* Only complain once, not every time this gets called. */
+        if(!fp_version_warned) {
+            debug(DBG_WARN, "Couldn't fetch ship key version\n");
+            debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+            fp_version_warned = 1;
+        }
+
+        fp_cache_cleanup();
+        fp_version_ok = 0;
+        return;
+    }
+
+    if((row = sylverant_db_result_fetch(result)) && row[0])
+        ver = strtoul(row[0], NULL, 0);
+
+    sylverant_db_result_free(result);
+
+    if(!fp_version_ok || ver != fp_version) {
+        fp_cache_cleanup();
+        fp_version = ver;
+        fp_version_ok = 1;
+    }
+
+    fp_version_warned = 0;
+}
+
 /* Create a new connection, storing it in the list of ships. */
 ship_t *create_connection_tls(int sock, struct sockaddr *addr, socklen_t size) {
     ship_t *rv;
@@ -164,6 +333,7 @@ ship_t *create_connection_tls(int sock, struct sockaddr *addr, socklen_t size) {
     char query[256], fingerprint[40];
     void *result;
     char **row;
+    sg_tdata_t *td = get_tdata();
 
     rv = (ship_t *)malloc(sizeof(ship_t));
 
@@ -179,6 +349,8 @@ ship_t *create_connection_tls(int sock, struct sockaddr *addr, socklen_t size) {
     rv->sock = sock;
     rv->last_message = time(NULL);
     memcpy(&rv->conn_addr, addr, size);
+    rv->refcnt = 1;
+    pthread_mutex_init(&rv->mutex, NULL);
 
     /* Create the TLS session */
     gnutls_init(&rv->session, GNUTLS_SERVER);
@@ -186,6 +358,7 @@ ship_t *create_connection_tls(int sock, struct sockaddr *addr, socklen_t size) {
     gnutls_credentials_set(rv->session, GNUTLS_CRD_CERTIFICATE, tls_cred);
 
     gnutls_certificate_server_set_request(rv->session, GNUTLS_CERT_REQUIRE);
+    gnutls_session_ticket_enable_server(rv->session, &tls_ticket_key);
 
 #if (SIZEOF_INT != SIZEOF_VOIDP) && (SIZEOF_LONG_INT == SIZEOF_VOIDP)
     gnutls_transport_set_ptr(rv->session, (gnutls_transport_ptr_t)((long)sock));
@@ -199,11 +372,16 @@ ship_t *create_connection_tls(int sock, struct sockaddr *addr, socklen_t size) {
     if(tmp < 0) {
         close(sock);
         gnutls_deinit(rv->session);
+        pthread_mutex_destroy(&rv->mutex);
         free(rv);
         debug(DBG_WARN, "TLS Handshake failed: %s\n", gnutls_strerror(tmp));
         return NULL;
     }
 
+    if(gnutls_session_is_resumed(rv->session)) {
+        debug(DBG_LOG, "Resumed TLS session\n");
+    }
+
     /* Verify that the peer has a valid certificate */
     tmp = gnutls_certificate_verify_peers2(rv->session, &peer_status);
 
@@ -265,27 +443,32 @@ ship_t *create_connection_tls(int sock, struct sockaddr *addr, socklen_t size) {
         goto err;
     }
 
-    /* Figure out what ship is connecting by the fingerprint */
-    sylverant_db_escape_str(&conn, fingerprint, (char *)hash, 20);
+    /* Figure out what ship is connecting by the fingerprint, checking the
+       cache before going to the database. */
+    if(fp_cache_lookup(hash, &rv->key_idx)) {
+        sylverant_db_escape_str(&td->conn, fingerprint, (char *)hash, 20);
 
-    sprintf(query, "SELECT idx FROM ship_data WHERE sha1_fingerprint='%s'",
-           fingerprint);
+        sprintf(query, "SELECT idx FROM ship_data WHERE "
+                "sha1_fingerprint='%s'", fingerprint);
 
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "Couldn't query the database\n");
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-        goto err;
-    }
+        if(sylverant_db_query(&td->conn, query)) {
+            debug(DBG_WARN, "Couldn't query the database\n");
+            debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+            goto err;
+        }
 
-    if((result = sylverant_db_result_store(&conn)) == NULL ||
-       (row = sylverant_db_result_fetch(result)) == NULL) {
-        debug(DBG_WARN, "Unknown SHA1 fingerprint");
-        goto err;
+        if((result = sylverant_db_result_store(&td->conn)) == NULL ||
+           (row = sylverant_db_result_fetch(result)) == NULL) {
+            debug(DBG_WARN, "Unknown SHA1 fingerprint");
+            goto err;
+        }
+
+        /* Store the ship ID */
+        rv->key_idx = atoi(row[0]);
+        sylverant_db_result_free(result);
+        fp_cache_add(hash, rv->key_idx);
     }
 
-    /* Store the ship ID */
-    rv->key_idx = atoi(row[0]);
-    sylverant_db_result_free(result);
     gnutls_x509_crt_deinit(cert);
 
     /* Send the client the welcome packet, or die trying. */
@@ -293,22 +476,34 @@ ship_t *create_connection_tls(int sock, struct sockaddr *addr, socklen_t size) {
         goto err;
     }
 
-    /* Insert it at the end of our list, and we're done. */
-    TAILQ_INSERT_TAIL(&ships, rv, qentry);
+    /* We're done, the caller will hand it off to a worker thread. */
     return rv;
 
 err:
     gnutls_bye(rv->session, GNUTLS_SHUT_RDWR);
     close(sock);
     gnutls_deinit(rv->session);
+    pthread_mutex_destroy(&rv->mutex);
     free(rv);
     return NULL;
 }
 
-/* Destroy a connection, closing the socket and removing it from the list. */
+/* Take a ship out of the lists, so nobody else can find it any more. */
+void ship_unlink(ship_t *c) {
+    /* Ships only end up in the lists once they've been given to a worker. */
+    if(c->worker) {
+        TAILQ_REMOVE(&ships, c, qentry);
+        TAILQ_REMOVE(&c->worker->ships, c, wentry);
+        --c->worker->ship_count;
+        ship_route_del(c);
+    }
+}
+
+/* Destroy a connection, closing the socket and cleaning up after it. */
 void destroy_connection(ship_t *c) {
     char query[256];
     ship_t *i;
+    sg_tdata_t *td = get_tdata();
 
     if(c->name[0]) {
         debug(DBG_LOG, "Closing connection with %s\n", c->name);
@@ -317,19 +512,28 @@ void destroy_connection(ship_t *c) {
         debug(DBG_LOG, "Closing connection with unknown ship\n");
     }
 
-    TAILQ_REMOVE(&ships, c, qentry);
+    if(c->worker) {
+        debug(DBG_LOG, "Sent %" PRIu64 " packets (%" PRIu64 " bytes), %"
+              PRIu64 " packets (%" PRIu64 " bytes) queued by other threads, "
+              "queue peak %d bytes\n", c->pkts_sent, c->bytes_sent,
+              c->pkts_fwd, c->bytes_fwd, c->fwdbuf_peak);
+    }
 
     if(c->key_idx) {
         /* Send a status packet to everyone telling them its gone away */
+        pthread_rwlock_rdlock(&ships_lock);
+
         TAILQ_FOREACH(i, &ships, qentry) {
             send_ship_status(i, c, 0);
         }
 
+        pthread_rwlock_unlock(&ships_lock);
+
         /* Remove the ship from the online_ships table. */
         sprintf(query, "DELETE FROM online_ships WHERE ship_id='%hu'",
                 c->key_idx);
 
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             debug(DBG_ERROR, "Couldn't clear %s from the online_ships table\n",
                   c->name);
         }
@@ -338,9 +542,12 @@ void destroy_connection(ship_t *c) {
         sprintf(query, "DELETE FROM online_clients WHERE ship_id='%hu'",
                 c->key_idx);
 
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             debug(DBG_ERROR, "Couldn't clear %s online_clients\n", c->name);
         }
+
+        /* ...and from the privilege cache. */
+        priv_cache_del_ship(c->key_idx);
     }
 
     /* Clean up the TLS resources and the socket. */
@@ -351,15 +558,9 @@ void destroy_connection(ship_t *c) {
         c->sock = -1;
     }
 
-    if(c->recvbuf) {
-        free(c->recvbuf);
-    }
-
-    if(c->sendbuf) {
-        free(c->sendbuf);
-    }
-
-    free(c);
+    /* Anyone else still holding onto the ship only ever queues packets for
+       it, so the rest of it can stick around until they let go. */
+    ship_put(c);
 }
 
 /* Handle a ship's login response. */
@@ -373,6 +574,7 @@ static int handle_shipgate_login6t(ship_t *c, shipgate_login6_reply_pkt *pkt) {
     int ship_number;
     uint64_t ip6_hi, ip6_lo;
     uint32_t clients = 0;
+    sg_tdata_t *td = get_tdata();
 
     /* Check the protocol version for support (TLS first supported in v10) */
     if(pver < SHIPGATE_MINIMUM_PROTO_VER || pver > SHIPGATE_MAXIMUM_PROTO_VER) {
@@ -387,15 +589,15 @@ static int handle_shipgate_login6t(ship_t *c, shipgate_login6_reply_pkt *pkt) {
     sprintf(query, "SELECT main_menu, ship_number FROM ship_data WHERE "
             "idx='%u'", c->key_idx);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't query the database\n");
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         send_error(c, SHDR_TYPE_LOGIN6, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, NULL, 0);
         return -1;
     }
 
-    if((result = sylverant_db_result_store(&conn)) == NULL ||
+    if((result = sylverant_db_result_store(&td->conn)) == NULL ||
        (row = sylverant_db_result_fetch(result)) == NULL) {
         debug(DBG_WARN, "Invalid index %d\n", c->key_idx);
         send_error(c, SHDR_TYPE_LOGIN6, SHDR_RESPONSE | SHDR_FAILURE,
@@ -445,10 +647,10 @@ static int handle_shipgate_login6t(ship_t *c, shipgate_login6_reply_pkt *pkt) {
             c->menu_code, c->flags, ship_number, (unsigned long long)ip6_hi,
             (unsigned long long)ip6_lo, pver);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't add %s to the online_ships table.\n",
               c->name);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         send_error(c, SHDR_TYPE_LOGIN6, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, NULL, 0);
         return -1;
@@ -460,6 +662,8 @@ static int handle_shipgate_login6t(ship_t *c, shipgate_login6_reply_pkt *pkt) {
     }
 
     /* Send a status packet to each of the ships. */
+    pthread_rwlock_rdlock(&ships_lock);
+
     TAILQ_FOREACH(j, &ships, qentry) {
         send_ship_status(j, c, 1);
 
@@ -472,12 +676,14 @@ static int handle_shipgate_login6t(ship_t *c, shipgate_login6_reply_pkt *pkt) {
         clients += j->clients;
     }
 
+    pthread_rwlock_unlock(&ships_lock);
+
     /* Update the table of client counts, if it might have actually changed from
        this update packet. */
     if(c->clients) {
         sprintf(query, "INSERT INTO client_count (clients) VALUES('%" PRIu32
                 "') ON DUPLICATE KEY UPDATE clients=VALUES(clients)", clients);
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             debug(DBG_WARN, "Couldn't update global player/game count");
         }
     }
@@ -491,29 +697,34 @@ static int handle_count(ship_t *c, shipgate_cnt_pkt *pkt) {
     ship_t *j;
     uint32_t clients = 0;
     uint16_t sclients = c->clients;
+    sg_tdata_t *td = get_tdata();
 
     c->clients = ntohs(pkt->clients);
     c->games = ntohs(pkt->games);
 
     sprintf(query, "UPDATE online_ships SET players='%hu', games='%hu' WHERE "
             "ship_id='%u'", c->clients, c->games, c->key_idx);
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't update ship %s player/game count", c->name);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
     }
 
     /* Update all of the ships */
+    pthread_rwlock_rdlock(&ships_lock);
+
     TAILQ_FOREACH(j, &ships, qentry) {
         send_counts(j, c->key_idx, c->clients, c->games);
         clients += j->clients;
     }
 
+    pthread_rwlock_unlock(&ships_lock);
+
     /* Update the table of client counts, if the number actually changed from
        this update packet. */
     if(sclients != c->clients) {
         sprintf(query, "INSERT INTO client_count (clients) VALUES('%" PRIu32
                 "') ON DUPLICATE KEY UPDATE clients=VALUES(clients)", clients);
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&td->conn, query)) {
             debug(DBG_WARN, "Couldn't update global player/game count");
         }
     }
@@ -530,7 +741,7 @@ static size_t strlen16(const uint16_t *str) {
 
 static int save_mail(uint32_t gc, uint32_t from, void *pkt, int version) {
     char msg[512], name[64];
-    static char query[2048];
+    char query[2048];
     void *result;
     char **row;
     size_t in, out, nmlen;
@@ -539,20 +750,21 @@ static int save_mail(uint32_t gc, uint32_t from, void *pkt, int version) {
     dc_simple_mail_pkt *dcpkt = (dc_simple_mail_pkt *)pkt;
     pc_simple_mail_pkt *pcpkt = (pc_simple_mail_pkt *)pkt;
     bb_simple_mail_pkt *bbpkt = (bb_simple_mail_pkt *)pkt;
+    sg_tdata_t *td = get_tdata();
 
     /* See if the user is registered first. */
     sprintf(query, "SELECT account_id FROM guildcards WHERE guildcard='%u'",
             gc);
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "save_mail: cannot query for account: %s\n",
-              sylverant_db_error(&conn));
+              sylverant_db_error(&td->conn));
         return 0;
     }
 
     /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "save_mail: Cannot fetch result: %s\n",
-              sylverant_db_error(&conn));
+              sylverant_db_error(&td->conn));
         return 0;
     }
 
@@ -586,9 +798,9 @@ static int save_mail(uint32_t gc, uint32_t from, void *pkt, int version) {
             outptr = msg;
 
             if(inptr[0] == '\t' && inptr[1] == 'J')
-                iconv(ic_sjis_to_utf8, &inptr, &in, &outptr, &out);
+                iconv(td->ic_sjis_to_utf8, &inptr, &in, &outptr, &out);
             else
-                iconv(ic_8859_to_utf8, &inptr, &in, &outptr, &out);
+                iconv(td->ic_8859_to_utf8, &inptr, &in, &outptr, &out);
 
             msg[511 - out] = 0;
             memcpy(name, dcpkt->name, 16);
@@ -604,7 +816,7 @@ static int save_mail(uint32_t gc, uint32_t from, void *pkt, int version) {
             inptr = (char *)pcpkt->stuff;
             outptr = msg;
 
-            iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
+            iconv(td->ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
 
             msg[511 - out] = 0;
 
@@ -613,7 +825,7 @@ static int save_mail(uint32_t gc, uint32_t from, void *pkt, int version) {
             inptr = (char *)pcpkt->name;
             outptr = name;
 
-            iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &nmlen);
+            iconv(td->ic_utf16_to_utf8, &inptr, &in, &outptr, &nmlen);
             nmlen = 64 - nmlen;
             name[nmlen] = 0;
             break;
@@ -626,7 +838,7 @@ static int save_mail(uint32_t gc, uint32_t from, void *pkt, int version) {
             inptr = (char *)bbpkt->message;
             outptr = msg;
 
-            iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
+            iconv(td->ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
 
             msg[511 - out] = 0;
 
@@ -635,7 +847,7 @@ static int save_mail(uint32_t gc, uint32_t from, void *pkt, int version) {
             inptr = (char *)&bbpkt->name[2];
             outptr = name;
 
-            iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &nmlen);
+            iconv(td->ic_utf16_to_utf8, &inptr, &in, &outptr, &nmlen);
             nmlen = 64 - nmlen;
             name[nmlen] = 0;
             break;
@@ -649,17 +861,17 @@ static int save_mail(uint32_t gc, uint32_t from, void *pkt, int version) {
     sprintf(query, "INSERT INTO simple_mail(recipient, sender, sent_time, "
             "sender_name, message) VALUES ('%u', '%u', UNIX_TIMESTAMP(), '", gc,
             from);
-    sylverant_db_escape_str(&conn, query + strlen(query), name, nmlen);
+    sylverant_db_escape_str(&td->conn, query + strlen(query), name, nmlen);
 
     strcat(query, "', '");
-    sylverant_db_escape_str(&conn, query + strlen(query), msg, 511 - out);
+    sylverant_db_escape_str(&td->conn, query + strlen(query), msg, 511 - out);
     strcat(query, "');");
 
     /* Execute the query on the db. */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't save simple mail (to: %" PRIu32 " from: %"
               PRIu32 ")\n", gc, from);
-        debug(DBG_WARN, "    %s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "    %s\n", sylverant_db_error(&td->conn));
         return 0;
     }
 
@@ -667,26 +879,28 @@ static int save_mail(uint32_t gc, uint32_t from, void *pkt, int version) {
     return 0;
 }
 
-static int handle_dc_mail(ship_t *c, dc_simple_mail_pkt *pkt) {
+static int handle_dc_mail(ship_t *c, shipgate_fw_9_pkt *fw) {
+    dc_simple_mail_pkt *pkt = (dc_simple_mail_pkt *)fw->pkt;
     uint32_t guildcard = LE32(pkt->gc_dest);
     char query[256];
     void *result;
     char **row;
     uint16_t ship_id;
     ship_t *s;
+    sg_tdata_t *td = get_tdata();
 
     /* Figure out where the user requested is */
     sprintf(query, "SELECT ship_id FROM online_clients WHERE guildcard='%u'",
             guildcard);
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "DC Mail Error: %s", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "DC Mail Error: %s", sylverant_db_error(&td->conn));
         return 0;
     }
 
     /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch DC mail result: %s\n",
-              sylverant_db_error(&conn));
+              sylverant_db_error(&td->conn));
         return 0;
     }
 
@@ -707,37 +921,40 @@ static int handle_dc_mail(ship_t *c, dc_simple_mail_pkt *pkt) {
     }
 
     /* If we've got this far, we should have the ship we need to send to */
-    s = find_ship(ship_id);
+    s = ship_get(ship_id);
     if(!s) {
         debug(DBG_WARN, "Invalid ship?!?!\n");
         return 0;
     }
 
     /* Send it on, and finish up... */
-    forward_dreamcast(s, (dc_pkt_hdr_t *)pkt, c->key_idx, 0, 0);
+    relay_fw_pkt(s, fw, c->key_idx);
+    ship_put(s);
     return 0;
 }
 
-static int handle_pc_mail(ship_t *c, pc_simple_mail_pkt *pkt) {
+static int handle_pc_mail(ship_t *c, shipgate_fw_9_pkt *fw) {
+    pc_simple_mail_pkt *pkt = (pc_simple_mail_pkt *)fw->pkt;
     uint32_t guildcard = LE32(pkt->gc_dest);
     char query[256];
     void *result;
     char **row;
     uint16_t ship_id;
     ship_t *s;
+    sg_tdata_t *td = get_tdata();
 
     /* Figure out where the user requested is */
     sprintf(query, "SELECT ship_id FROM online_clients WHERE guildcard='%u'",
             guildcard);
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "PC Mail Error: %s", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "PC Mail Error: %s", sylverant_db_error(&td->conn));
         return 0;
     }
 
     /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch PC mail result: %s\n",
-              sylverant_db_error(&conn));
+              sylverant_db_error(&td->conn));
         return 0;
     }
 
@@ -758,37 +975,40 @@ static int handle_pc_mail(ship_t *c, pc_simple_mail_pkt *pkt) {
     }
 
     /* If we've got this far, we should have the ship we need to send to */
-    s = find_ship(ship_id);
+    s = ship_get(ship_id);
     if(!s) {
         debug(DBG_WARN, "Invalid ship?!?!?\n");
         return 0;
     }
 
     /* Send it on, and finish up... */
-    forward_pc(s, (dc_pkt_hdr_t *)pkt, c->key_idx, 0, 0);
+    relay_fw_pkt(s, fw, c->key_idx);
+    ship_put(s);
     return 0;
 }
 
-static int handle_bb_mail(ship_t *c, bb_simple_mail_pkt *pkt) {
+static int handle_bb_mail(ship_t *c, shipgate_fw_9_pkt *fw) {
+    bb_simple_mail_pkt *pkt = (bb_simple_mail_pkt *)fw->pkt;
     uint32_t guildcard = LE32(pkt->gc_dest);
     char query[256];
     void *result;
     char **row;
     uint16_t ship_id;
     ship_t *s;
+    sg_tdata_t *td = get_tdata();
 
     /* Figure out where the user requested is */
     sprintf(query, "SELECT ship_id FROM online_clients WHERE guildcard='%u'",
             guildcard);
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "BB Mail Error: %s", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "BB Mail Error: %s", sylverant_db_error(&td->conn));
         return 0;
     }
 
     /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch BB mail result: %s\n",
-              sylverant_db_error(&conn));
+              sylverant_db_error(&td->conn));
         return 0;
     }
 
@@ -809,14 +1029,15 @@ static int handle_bb_mail(ship_t *c, bb_simple_mail_pkt *pkt) {
     }
 
     /* If we've got this far, we should have the ship we need to send to */
-    s = find_ship(ship_id);
+    s = ship_get(ship_id);
     if(!s) {
         debug(DBG_WARN, "Invalid ship?!?!?\n");
         return 0;
     }
 
     /* Send it on, and finish up... */
-    forward_bb(s, (bb_pkt_hdr_t *)pkt, c->key_idx, 0, 0);
+    relay_fw_pkt(s, fw, c->key_idx);
+    ship_put(s);
     return 0;
 }
 
@@ -833,6 +1054,7 @@ static int handle_guild_search(ship_t *c, dc_guild_search_pkt *pkt,
     dc_guild_reply_pkt reply;
     dc_guild_reply6_pkt reply6;
     char lobby_name[32], gname[17];
+    sg_tdata_t *td = get_tdata();
 
     /* Figure out where the user requested is */
     sprintf(query, "SELECT online_clients.name, online_clients.ship_id, block, "
@@ -840,15 +1062,16 @@ static int handle_guild_search(ship_t *c, dc_guild_search_pkt *pkt,
             "ship_ip6_high, ship_ip6_low, dlobby_id FROM online_clients INNER "
             "JOIN online_ships ON online_clients.ship_id = "
             "online_ships.ship_id WHERE guildcard='%u'", guildcard);
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "Guild Search Error: %s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "Guild Search Error: %s\n",
+              sylverant_db_error(&td->conn));
         return 0;
     }
 
     /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch Guild Search result: %s\n",
-              sylverant_db_error(&conn));
+              sylverant_db_error(&td->conn));
         return 0;
     }
 
@@ -872,12 +1095,14 @@ static int handle_guild_search(ship_t *c, dc_guild_search_pkt *pkt,
     }
 
     /* If we've got this far, we should have the ship we need to send to */
-    s = find_ship(ship_id);
+    s = ship_get(ship_id);
     if(!s) {
         debug(DBG_WARN, "Invalid ship?!?!?!\n");
         goto out;
     }
 
+    ship_put(s);
+
     /* If any of these are NULL, the user is not in a lobby. Thus, the client
        doesn't really exist just yet. */
     if(row[4] == NULL || row[3] == NULL || row[11] == NULL) {
@@ -1035,6 +1260,7 @@ static int handle_bb_guild_search(ship_t *c, shipgate_fw_9_pkt *pkt) {
     ICONV_CONST char *inptr;
     char *outptr;
     char lobby_name[32], gname[17];
+    sg_tdata_t *td = get_tdata();
 
     /* Figure out where the user requested is */
     sprintf(query, "SELECT online_clients.name, online_clients.ship_id, block, "
@@ -1042,15 +1268,16 @@ static int handle_bb_guild_search(ship_t *c, shipgate_fw_9_pkt *pkt) {
             "ship_ip6_high, ship_ip6_low, dlobby_id FROM online_clients INNER "
             "JOIN online_ships ON online_clients.ship_id = "
             "online_ships.ship_id WHERE guildcard='%u'", guildcard);
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "Guild Search Error: %s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "Guild Search Error: %s\n",
+              sylverant_db_error(&td->conn));
         return 0;
     }
 
     /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch Guild Search result: %s\n",
-              sylverant_db_error(&conn));
+              sylverant_db_error(&td->conn));
         return 0;
     }
 
@@ -1074,12 +1301,14 @@ static int handle_bb_guild_search(ship_t *c, shipgate_fw_9_pkt *pkt) {
     }
 
     /* If we've got this far, we should have the ship we need to send to */
-    s = find_ship(ship_id);
+    s = ship_get(ship_id);
     if(!s) {
         debug(DBG_WARN, "Invalid ship?!?!?!\n");
         goto out;
     }
 
+    ship_put(s);
+
     /* If any of these are NULL, the user is not in a lobby. Thus, the client
        doesn't really exist just yet. */
     if(row[4] == NULL || row[3] == NULL || row[11] == NULL) {
@@ -1130,7 +1359,7 @@ static int handle_bb_guild_search(ship_t *c, shipgate_fw_9_pkt *pkt) {
         out = 0x3C;
     }
 
-    iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+    iconv(td->ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Build the location string, and convert it */
     if(dlobby_id != lobby_id) {
@@ -1155,7 +1384,7 @@ static int handle_bb_guild_search(ship_t *c, shipgate_fw_9_pkt *pkt) {
     inptr = query;
     out = 0x88;
     outptr = (char *)reply.location;
-    iconv(ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
+    iconv(td->ic_utf8_to_utf16, &inptr, &in, &outptr, &out);
 
     /* Send it away */
     forward_bb(c, (bb_pkt_hdr_t *)&reply, c->key_idx, gc_sender, b_sender);
@@ -1167,6 +1396,24 @@ out:
     return 0;
 }
 
+/* Bump the version stamp on a Blue Burst user's guildcard data, so that the
+   login server knows to throw away any copy of it that it has cached. This must
+   be done after the data itself is changed. */
+static void bump_bb_gc_version(uint32_t gc) {
+    char query[256];
+    sg_tdata_t *td = get_tdata();
+
+    sprintf(query, "INSERT INTO blueburst_gc_versions (guildcard, version) "
+            "VALUES ('%" PRIu32 "', '1') ON DUPLICATE KEY UPDATE "
+            "version=version+1", gc);
+
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "Couldn't bump guildcard version (%" PRIu32 ")\n",
+              gc);
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+    }
+}
+
 /* Handle a Blue Burst user's request to add a guildcard to their list */
 static int handle_bb_gcadd(ship_t *c, shipgate_fw_9_pkt *pkt) {
     bb_guildcard_add_pkt *gc = (bb_guildcard_add_pkt *)pkt->pkt;
@@ -1177,6 +1424,7 @@ static int handle_bb_gcadd(ship_t *c, shipgate_fw_9_pkt *pkt) {
     char name[97];
     char team_name[65];
     char text[373];
+    sg_tdata_t *td = get_tdata();
 
     /* Make sure the packet is sane */
     if(len != 0x0110) {
@@ -1184,9 +1432,9 @@ static int handle_bb_gcadd(ship_t *c, shipgate_fw_9_pkt *pkt) {
     }
 
     /* Escape all the strings first */
-    sylverant_db_escape_str(&conn, name, (char *)gc->name, 48);
-    sylverant_db_escape_str(&conn, team_name, (char *)gc->team_name, 32);
-    sylverant_db_escape_str(&conn, text, (char *)gc->text, 176);
+    sylverant_db_escape_str(&td->conn, name, (char *)gc->name, 48);
+    sylverant_db_escape_str(&td->conn, team_name, (char *)gc->team_name, 32);
+    sylverant_db_escape_str(&td->conn, text, (char *)gc->text, 176);
 
     /* Add the entry in the db... */
     sprintf(query, "INSERT INTO blueburst_guildcards (guildcard, friend_gc, "
@@ -1198,16 +1446,18 @@ static int handle_bb_gcadd(ship_t *c, shipgate_fw_9_pkt *pkt) {
             fr_gc, name, team_name, text, gc->language, gc->section,
             gc->char_class);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't add bb guildcard (%" PRIu32 ": %" PRIu32
               ")\n", sender, fr_gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_BB, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)gc, len);
         return 0;
     }
 
+    bump_bb_gc_version(sender);
+
     /* And, we're done... */
     return 0;
 }
@@ -1219,6 +1469,7 @@ static int handle_bb_gcdel(ship_t *c, shipgate_fw_9_pkt *pkt) {
     uint32_t sender = ntohl(pkt->guildcard);
     uint32_t fr_gc = LE32(gc->guildcard);
     char query[256];
+    sg_tdata_t *td = get_tdata();
 
     if(len != 0x000C) {
         return -1;
@@ -1228,16 +1479,18 @@ static int handle_bb_gcdel(ship_t *c, shipgate_fw_9_pkt *pkt) {
     sprintf(query, "CALL blueburst_guildcard_delete('%" PRIu32 "', '%" PRIu32
             "')", sender, fr_gc);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't delete bb guildcard (%" PRIu32 ": %" PRIu32
               ")\n", sender, fr_gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_BB, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)gc, len);
         return 0;
     }
 
+    bump_bb_gc_version(sender);
+
     /* And, we're done... */
     return 0;
 }
@@ -1250,6 +1503,7 @@ static int handle_bb_gcsort(ship_t *c, shipgate_fw_9_pkt *pkt) {
     uint32_t fr_gc1 = LE32(gc->guildcard1);
     uint32_t fr_gc2 = LE32(gc->guildcard2);
     char query[256];
+    sg_tdata_t *td = get_tdata();
 
     if(len != 0x0010) {
         return -1;
@@ -1259,16 +1513,18 @@ static int handle_bb_gcsort(ship_t *c, shipgate_fw_9_pkt *pkt) {
     sprintf(query, "CALL blueburst_guildcard_sort('%" PRIu32 "', '%" PRIu32
             "', '%" PRIu32 "')", sender, fr_gc1, fr_gc2);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't sort bb guildcards (%" PRIu32 ": %" PRIu32
               " - %" PRIu32 ")\n", sender, fr_gc1, fr_gc2);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_BB, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)gc, len);
         return 0;
     }
 
+    bump_bb_gc_version(sender);
+
     /* And, we're done... */
     return 0;
 }
@@ -1283,6 +1539,7 @@ static int handle_bb_blacklistadd(ship_t *c, shipgate_fw_9_pkt *pkt) {
     char name[97];
     char team_name[65];
     char text[373];
+    sg_tdata_t *td = get_tdata();
 
     /* Make sure the packet is sane */
     if(len != 0x0110) {
@@ -1290,9 +1547,9 @@ static int handle_bb_blacklistadd(ship_t *c, shipgate_fw_9_pkt *pkt) {
     }
 
     /* Escape all the strings first */
-    sylverant_db_escape_str(&conn, name, (char *)gc->name, 48);
-    sylverant_db_escape_str(&conn, team_name, (char *)gc->team_name, 32);
-    sylverant_db_escape_str(&conn, text, (char *)gc->text, 176);
+    sylverant_db_escape_str(&td->conn, name, (char *)gc->name, 48);
+    sylverant_db_escape_str(&td->conn, team_name, (char *)gc->team_name, 32);
+    sylverant_db_escape_str(&td->conn, text, (char *)gc->text, 176);
 
     /* Add the entry in the db... */
     sprintf(query, "INSERT INTO blueburst_blacklist (guildcard, blocked_gc, "
@@ -1304,16 +1561,18 @@ static int handle_bb_blacklistadd(ship_t *c, shipgate_fw_9_pkt *pkt) {
             bl_gc, name, team_name, text, gc->language, gc->section,
             gc->char_class);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't add blacklist entry (%" PRIu32 ": %" PRIu32
               ")\n", sender, bl_gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_BB, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)gc, len);
         return 0;
     }
 
+    bump_bb_gc_version(sender);
+
     /* And, we're done... */
     return 0;
 }
@@ -1325,6 +1584,7 @@ static int handle_bb_blacklistdel(ship_t *c, shipgate_fw_9_pkt *pkt) {
     uint32_t sender = ntohl(pkt->guildcard);
     uint32_t bl_gc = LE32(gc->guildcard);
     char query[256];
+    sg_tdata_t *td = get_tdata();
 
     if(len != 0x000C) {
         return -1;
@@ -1334,16 +1594,18 @@ static int handle_bb_blacklistdel(ship_t *c, shipgate_fw_9_pkt *pkt) {
     sprintf(query, "DELETE FROM blueburst_blacklist WHERE guildcard='%" PRIu32
             "' AND blocked_gc='%" PRIu32 "'", sender, bl_gc);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't delete blacklist entry (%" PRIu32 ": %"
               PRIu32 ")\n", sender, bl_gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_BB, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)gc, len);
         return 0;
     }
 
+    bump_bb_gc_version(sender);
+
     /* And, we're done... */
     return 0;
 }
@@ -1357,6 +1619,7 @@ static int handle_bb_set_comment(ship_t *c, shipgate_fw_9_pkt *pkt) {
     char query[512];
     char comment[0x88 * 4 + 1];
     int len = 0;
+    sg_tdata_t *td = get_tdata();
 
     if(pkt_len != 0x00BC) {
         return -1;
@@ -1367,23 +1630,25 @@ static int handle_bb_set_comment(ship_t *c, shipgate_fw_9_pkt *pkt) {
     memset(&gc->text[len], 0, (0x88 - len) * 2);
     len = (len + 1) * 2;
 
-    sylverant_db_escape_str(&conn, comment, (char *)gc->text, len);
+    sylverant_db_escape_str(&td->conn, comment, (char *)gc->text, len);
 
     /* Build the query and run it */
     sprintf(query, "UPDATE blueburst_guildcards SET comment='%s' WHERE "
             "guildcard='%" PRIu32"' AND friend_gc='%" PRIu32 "'", comment,
             sender, fr_gc);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't update guildcard comment (%" PRIu32 ": %"
               PRIu32 ")\n", sender, fr_gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_BB, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)gc, len);
         return 0;
     }
 
+    bump_bb_gc_version(sender);
+
     /* And, we're done... */
     return 0;
 }
@@ -1400,7 +1665,7 @@ static int handle_dreamcast(ship_t *c, shipgate_fw_9_pkt *pkt) {
             return handle_guild_search(c, (dc_guild_search_pkt *)hdr, tmp);
 
         case SIMPLE_MAIL_TYPE:
-            return handle_dc_mail(c, (dc_simple_mail_pkt *)hdr);
+            return handle_dc_mail(c, pkt);
 
         case GUILD_REPLY_TYPE:
             /* We shouldn't get these anymore (as of protocol v3)... */
@@ -1419,7 +1684,7 @@ static int handle_pc(ship_t *c, shipgate_fw_9_pkt *pkt) {
 
     switch(type) {
         case SIMPLE_MAIL_TYPE:
-            return handle_pc_mail(c, (pc_simple_mail_pkt *)hdr);
+            return handle_pc_mail(c, pkt);
 
         default:
             /* Warn the ship that sent the packet, then drop it */
@@ -1451,7 +1716,7 @@ static int handle_bb(ship_t *c, shipgate_fw_9_pkt *pkt) {
             return handle_bb_blacklistdel(c, pkt);
 
         case SIMPLE_MAIL_TYPE:
-            return handle_bb_mail(c, (bb_simple_mail_pkt *)hdr);
+            return handle_bb_mail(c, pkt);
 
         case GUILD_SEARCH_TYPE:
             return handle_bb_guild_search(c, pkt);
@@ -1467,14 +1732,60 @@ static int handle_bb(ship_t *c, shipgate_fw_9_pkt *pkt) {
     }
 }
 
+/* Update the stored character select preview for a Blue Burst character. If
+   data is NULL, the preview is just removed. If the new preview can't be
+   stored, the old one is removed too, so the login server rebuilds it from the
+   character data. */
+static int save_bb_preview(uint32_t gc, uint32_t slot,
+                           const sylverant_bb_db_char_t *data) {
+    char query[sizeof(sylverant_bb_mini_char_t) * 2 + 256];
+    sylverant_bb_mini_char_t mc;
+    sg_tdata_t *td = get_tdata();
+
+    if(!data) {
+        sprintf(query, "DELETE FROM character_preview WHERE guildcard='%u' "
+                "AND slot='%u'", gc, slot);
+    }
+    else {
+        memset(&mc, 0, sizeof(sylverant_bb_mini_char_t));
+        memcpy(mc.guildcard_str, data->character.guildcard_str, 0x70);
+        mc.level = data->character.level;
+        mc.exp = data->character.exp;
+        mc.play_time = data->character.play_time;
+
+        sprintf(query, "REPLACE INTO character_preview (guildcard, slot, "
+                "data) VALUES ('%u', '%u', '", gc, slot);
+        sylverant_db_escape_str(&td->conn, query + strlen(query), (char *)&mc,
+                                sizeof(sylverant_bb_mini_char_t));
+        strcat(query, "')");
+    }
+
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "Couldn't update character preview (%u: %u)\n", gc,
+              slot);
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+
+        if(data) {
+            sprintf(query, "DELETE FROM character_preview WHERE guildcard="
+                    "'%u' AND slot='%u'", gc, slot);
+            sylverant_db_query(&td->conn, query);
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Handle a ship's save character data packet. */
 static int handle_cdata(ship_t *c, shipgate_char_data_pkt *pkt) {
     uint32_t gc, slot;
     uint16_t len = ntohs(pkt->hdr.pkt_len) - sizeof(shipgate_char_data_pkt);
-    static char query[16384];
+    char query[16384];
     Bytef *cmp_buf;
     uLong cmp_sz;
     int compressed = ~Z_OK;
+    sg_tdata_t *td = get_tdata();
 
     gc = ntohl(pkt->guildcard);
     slot = ntohl(pkt->slot);
@@ -1487,18 +1798,24 @@ static int handle_cdata(ship_t *c, shipgate_char_data_pkt *pkt) {
         len = 1052;
     }
 
+    /* The character data and its preview should change together, otherwise
+       the character select screen could show something that isn't there. This
+       needs the tables to be InnoDB, otherwise it isn't atomic. */
+    if(sylverant_db_query(&td->conn, "START TRANSACTION")) {
+        debug(DBG_WARN, "Couldn't start transaction (%u: %u)\n", gc, slot);
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+        goto err;
+    }
+
     /* Delete any character data already exising in that slot. */
     sprintf(query, "DELETE FROM character_data WHERE guildcard='%u' AND "
             "slot='%u'", gc, slot);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't remove old character data (%u: %u)\n",
               gc, slot);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-
-        send_error(c, SHDR_TYPE_CDATA, SHDR_RESPONSE | SHDR_FAILURE,
-                   ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
-        return 0;
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+        goto err_rollback;
     }
 
     /* Compress the character data */
@@ -1514,31 +1831,50 @@ static int handle_cdata(ship_t *c, shipgate_char_data_pkt *pkt) {
         sprintf(query, "INSERT INTO character_data(guildcard, slot, size, "
                 "data) VALUES ('%u', '%u', '%u', '", gc, slot,
                 (unsigned)len);
-        sylverant_db_escape_str(&conn, query + strlen(query), (char *)cmp_buf,
-                                cmp_sz);
+        sylverant_db_escape_str(&td->conn, query + strlen(query),
+                                (char *)cmp_buf, cmp_sz);
     }
     else {
         sprintf(query, "INSERT INTO character_data(guildcard, slot, data) "
                 "VALUES ('%u', '%u', '", gc, slot);
-        sylverant_db_escape_str(&conn, query + strlen(query), (char *)pkt->data,
-                                len);
+        sylverant_db_escape_str(&td->conn, query + strlen(query),
+                                (char *)pkt->data, len);
     }
 
     strcat(query, "')");
     free(cmp_buf);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't save character data (%u: %u)\n", gc, slot);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+        goto err_rollback;
+    }
 
-        send_error(c, SHDR_TYPE_CDATA, SHDR_RESPONSE | SHDR_FAILURE,
-                   ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
-        return 0;
+    /* Keep the preview for the login server's character select up to date.
+       The preview can always be rebuilt from the character data, so the save
+       still goes through if this fails. */
+    if(len == sizeof(sylverant_bb_db_char_t))
+        save_bb_preview(gc, slot, (sylverant_bb_db_char_t *)pkt->data);
+    else
+        save_bb_preview(gc, slot, NULL);
+
+    if(sylverant_db_query(&td->conn, "COMMIT")) {
+        debug(DBG_WARN, "Couldn't commit character data (%u: %u)\n", gc,
+              slot);
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
+        goto err_rollback;
     }
 
     /* Return success (yeah, bad use of this function, but whatever). */
     return send_error(c, SHDR_TYPE_CDATA, SHDR_RESPONSE, ERR_NO_ERROR,
                       (uint8_t *)&pkt->guildcard, 8);
+
+err_rollback:
+    sylverant_db_query(&td->conn, "ROLLBACK");
+err:
+    send_error(c, SHDR_TYPE_CDATA, SHDR_RESPONSE | SHDR_FAILURE,
+               ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
+    return 0;
 }
 
 static int handle_cbkup_req(ship_t *c, shipgate_char_bkup_pkt *pkt, uint32_t gc,
@@ -1551,15 +1887,16 @@ static int handle_cbkup_req(ship_t *c, shipgate_char_bkup_pkt *pkt, uint32_t gc,
     unsigned long *len;
     int sz, rv;
     uLong sz2, csz;
+    sg_tdata_t *td = get_tdata();
 
     /* Build the query asking for the data. */
-    sylverant_db_escape_str(&conn, name2, name, strlen(name));
+    sylverant_db_escape_str(&td->conn, name2, name, strlen(name));
     sprintf(query, "SELECT data, size FROM character_backup WHERE "
             "guildcard='%u' AND name='%s'", gc, name2);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't fetch character backup (%u: %s)\n", gc, name);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_CBKUP, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
@@ -1567,9 +1904,9 @@ static int handle_cbkup_req(ship_t *c, shipgate_char_bkup_pkt *pkt, uint32_t gc,
     }
 
     /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch character backup (%u: %s)\n", gc, name);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_CBKUP, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
@@ -1579,7 +1916,7 @@ static int handle_cbkup_req(ship_t *c, shipgate_char_bkup_pkt *pkt, uint32_t gc,
     if((row = sylverant_db_result_fetch(result)) == NULL) {
         sylverant_db_result_free(result);
         debug(DBG_WARN, "No saved character backup (%u: %s)\n", gc, name);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_CBKUP, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_CREQ_NO_DATA, (uint8_t *)&pkt->guildcard, 8);
@@ -1590,7 +1927,7 @@ static int handle_cbkup_req(ship_t *c, shipgate_char_bkup_pkt *pkt, uint32_t gc,
     if(!(len = sylverant_db_result_lengths(result))) {
         sylverant_db_result_free(result);
         debug(DBG_WARN, "Couldn't get length of character backup\n");
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_CBKUP, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
@@ -1656,13 +1993,14 @@ static int handle_cbkup_req(ship_t *c, shipgate_char_bkup_pkt *pkt, uint32_t gc,
 }
 
 static int handle_cbkup(ship_t *c, shipgate_char_bkup_pkt *pkt) {
-    static char query[16384];
+    char query[16384];
     uint32_t gc, block;
     uint16_t len = ntohs(pkt->hdr.pkt_len) - sizeof(shipgate_char_bkup_pkt);
     char name[32], name2[65];
     Bytef *cmp_buf;
     uLong cmp_sz;
     int compressed = ~Z_OK;
+    sg_tdata_t *td = get_tdata();
 
     gc = ntohl(pkt->guildcard);
     block = ntohl(pkt->block);
@@ -1689,7 +2027,7 @@ static int handle_cbkup(ship_t *c, shipgate_char_bkup_pkt *pkt) {
         len = 1052;
     }
 
-    sylverant_db_escape_str(&conn, name2, name, strlen(name));
+    sylverant_db_escape_str(&td->conn, name2, name, strlen(name));
 
     /* Compress the character data */
     cmp_sz = compressBound((uLong)len);
@@ -1703,22 +2041,22 @@ static int handle_cbkup(ship_t *c, shipgate_char_bkup_pkt *pkt) {
     if(compressed == Z_OK && cmp_sz < len) {
         sprintf(query, "INSERT INTO character_backup(guildcard, size, name, "
                 "data) VALUES ('%u', '%u', '%s', '", gc, (unsigned)len, name2);
-        sylverant_db_escape_str(&conn, query + strlen(query), (char *)cmp_buf,
-                                cmp_sz);
+        sylverant_db_escape_str(&td->conn, query + strlen(query),
+                                (char *)cmp_buf, cmp_sz);
     }
     else {
         sprintf(query, "INSERT INTO character_backup(guildcard, name, data) "
                 "VALUES ('%u', '%s', '", gc, name2);
-        sylverant_db_escape_str(&conn, query + strlen(query), (char *)pkt->data,
-                                len);
+        sylverant_db_escape_str(&td->conn, query + strlen(query),
+                                (char *)pkt->data, len);
     }
 
     strcat(query, "') ON DUPLICATE KEY UPDATE data=VALUES(data)");
     free(cmp_buf);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't save character backup (%u: %s)\n", gc, name);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_CBKUP, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
@@ -1740,6 +2078,7 @@ static int handle_creq(ship_t *c, shipgate_char_req_pkt *pkt) {
     unsigned long *len;
     int sz, rv;
     uLong sz2, csz;
+    sg_tdata_t *td = get_tdata();
 
     gc = ntohl(pkt->guildcard);
     slot = ntohl(pkt->slot);
@@ -1748,9 +2087,9 @@ static int handle_creq(ship_t *c, shipgate_char_req_pkt *pkt) {
     sprintf(query, "SELECT data, size FROM character_data WHERE guildcard='%u' "
             "AND slot='%u'", gc, slot);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't fetch character data (%u: %u)\n", gc, slot);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_CREQ, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
@@ -1758,9 +2097,9 @@ static int handle_creq(ship_t *c, shipgate_char_req_pkt *pkt) {
     }
 
     /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch character data (%u: %u)\n", gc, slot);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_CREQ, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
@@ -1770,7 +2109,7 @@ static int handle_creq(ship_t *c, shipgate_char_req_pkt *pkt) {
     if((row = sylverant_db_result_fetch(result)) == NULL) {
         sylverant_db_result_free(result);
         debug(DBG_WARN, "No saved character data (%u: %u)\n", gc, slot);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_CREQ, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_CREQ_NO_DATA, (uint8_t *)&pkt->guildcard, 8);
@@ -1781,7 +2120,7 @@ static int handle_creq(ship_t *c, shipgate_char_req_pkt *pkt) {
     if(!(len = sylverant_db_result_lengths(result))) {
         sylverant_db_result_free(result);
         debug(DBG_WARN, "Couldn't get length of character data\n");
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         send_error(c, SHDR_TYPE_CREQ, SHDR_RESPONSE | SHDR_FAILURE,
                    ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
@@ -1857,6 +2196,7 @@ static int handle_gmlogin(ship_t *c, shipgate_gmlogin_req_pkt *pkt) {
     char esc[65];
     uint16_t len;
     uint8_t priv;
+    sg_tdata_t *td = get_tdata();
 
     /* Check the sanity of the packet. Disconnect the ship if there's some odd
        issue with the packet's sanity. */
@@ -1872,29 +2212,30 @@ static int handle_gmlogin(ship_t *c, shipgate_gmlogin_req_pkt *pkt) {
     }
 
     /* Escape the username and grab the data we need. */
-    sylverant_db_escape_str(&conn, esc, pkt->username, strlen(pkt->username));
+    sylverant_db_escape_str(&td->conn, esc, pkt->username,
+                            strlen(pkt->username));
     gc = ntohl(pkt->guildcard);
     block = ntohl(pkt->block);
 
     /* Build the query asking for the data. */
-    sprintf(query, "SELECT password, regtime, privlevel FROM guildcards "
-            "NATURAL JOIN account_data WHERE guildcard='%u' AND username='%s'",
-            gc, esc);
+    sprintf(query, "SELECT password, regtime, privlevel, account_id FROM "
+            "guildcards NATURAL JOIN account_data WHERE guildcard='%u' AND "
+            "username='%s'", gc, esc);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't lookup account data (user: %s, gc: %u)\n",
               pkt->username, gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         return send_error(c, SHDR_TYPE_GMLOGIN, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->guildcard, 8);
     }
 
     /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch account data (user: %s, gc: %u)\n",
               pkt->username, gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         return send_error(c, SHDR_TYPE_GMLOGIN, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->guildcard, 8);
@@ -1948,6 +2289,10 @@ static int handle_gmlogin(ship_t *c, shipgate_gmlogin_req_pkt *pkt) {
                           (uint8_t *)&pkt->guildcard, 8);
     }
 
+    /* We just read the privileges fresh from the database, so refresh the
+       cached copy while we're at it. */
+    priv_cache_update(gc, atoi(row[3]), priv);
+
     /* We're done if we got this far. */
     sylverant_db_result_free(result);
 
@@ -1959,97 +2304,52 @@ static int handle_gmlogin(ship_t *c, shipgate_gmlogin_req_pkt *pkt) {
 static int handle_ban(ship_t *c, shipgate_ban_req_pkt *pkt, uint16_t type) {
     uint32_t req, target, until;
     char query[1024];
-    void *result;
-    char **row;
-    int account_id;
-    int priv, priv2;
+    int account_id, account_id2;
+    int priv, priv2, rv;
+    sg_tdata_t *td = get_tdata();
 
     req = ntohl(pkt->req_gc);
     target = ntohl(pkt->target);
     until = ntohl(pkt->until);
 
     /* Make sure the requester has permission. */
-    sprintf(query, "SELECT account_id, privlevel FROM guildcards NATURAL JOIN "
-            "account_data WHERE guildcard='%u' AND privlevel>'2'", req);
-
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "Couldn't fetch account data (%u)\n", req);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-
-        return send_error(c, type, SHDR_FAILURE, ERR_BAD_ERROR,
-                          (uint8_t *)&pkt->req_gc, 16);
-    }
-
-    /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        debug(DBG_WARN, "Couldn't fetch account data (%u)\n", req);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-
+    if((rv = priv_lookup(td, req, &account_id, &priv)) < 0) {
         return send_error(c, type, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->req_gc, 16);
     }
 
-    if((row = sylverant_db_result_fetch(result)) == NULL) {
-        sylverant_db_result_free(result);
+    if(rv || priv <= 2) {
         debug(DBG_WARN, "No account data or not gm (%u)\n", req);
 
         return send_error(c, type, SHDR_FAILURE, ERR_BAN_NOT_GM,
                           (uint8_t *)&pkt->req_gc, 16);
     }
 
-    /* We've verified they're legit, continue on. */
-    account_id = atoi(row[0]);
-    priv = atoi(row[1]);
-    sylverant_db_result_free(result);
-
     /* Make sure the user isn't trying to ban someone with a higher privilege
        level than them... */
-    sprintf(query, "SELECT privlevel FROM guildcards NATURAL JOIN account_data "
-            "WHERE guildcard='%u'", target);
-
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "Couldn't fetch account data (%u)\n", target);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-
+    if((rv = priv_lookup(td, target, &account_id2, &priv2)) < 0) {
         return send_error(c, type, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->req_gc, 16);
     }
 
-    /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        debug(DBG_WARN, "Couldn't fetch account data (%u)\n", target);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(!rv && priv2 >= priv) {
+        debug(DBG_WARN, "Attempt by %u to ban %u overturned by privilege\n",
+              req, target);
 
-        return send_error(c, type, SHDR_FAILURE, ERR_BAD_ERROR,
+        return send_error(c, type, SHDR_FAILURE, ERR_BAN_PRIVILEGE,
                           (uint8_t *)&pkt->req_gc, 16);
     }
 
-    if((row = sylverant_db_result_fetch(result))) {
-        priv2 = atoi(row[0]);
-
-        if(priv2 >= priv) {
-            sylverant_db_result_free(result);
-            debug(DBG_WARN, "Attempt by %u to ban %u overturned by privilege\n",
-                  req, target);
-
-            return send_error(c, type, SHDR_FAILURE, ERR_BAN_PRIVILEGE,
-                              (uint8_t *)&pkt->req_gc, 16);
-        }
-    }
-
-    /* We're done with that... */
-    sylverant_db_result_free(result);
-
     /* Build up the ban insert query. */
     sprintf(query, "INSERT INTO bans(enddate, setby, reason) VALUES "
             "('%u', '%u', '", until, account_id);
-    sylverant_db_escape_str(&conn, query + strlen(query), (char *)pkt->message,
-                            strlen(pkt->message));
+    sylverant_db_escape_str(&td->conn, query + strlen(query),
+                            (char *)pkt->message, strlen(pkt->message));
     strcat(query, "')");
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Could not insert ban into database\n");
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         return send_error(c, type, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->req_gc, 16);
@@ -2072,14 +2372,22 @@ static int handle_ban(ship_t *c, shipgate_ban_req_pkt *pkt, uint16_t type) {
                               (uint8_t *)&pkt->req_gc, 16);
     }
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Could not insert ban into database (part 2)\n");
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         return send_error(c, type, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->req_gc, 16);
     }
 
+    /* Don't let anything cached about whoever was banned hang around. There's
+       no telling which guildcards an IP ban covers, so that clears out the
+       whole cache. */
+    if(type == SHDR_TYPE_GCBAN)
+        priv_cache_expire(target);
+    else
+        priv_cache_expire_all();
+
     /* Another misuse of the error function, but whatever */
     return send_error(c, type, SHDR_RESPONSE, ERR_NO_ERROR,
                       (uint8_t *)&pkt->req_gc, 16);
@@ -2099,6 +2407,7 @@ static int handle_blocklogin(ship_t *c, shipgate_block_login_pkt *pkt) {
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
+    sg_tdata_t *td = get_tdata();
 
     /* Is the name a Blue Burst-style (UTF-16) name or not? */
     if(pkt->ch_name[0] == '\t') {
@@ -2108,7 +2417,7 @@ static int handle_blocklogin(ship_t *c, shipgate_block_login_pkt *pkt) {
         inptr = pkt->ch_name;
         outptr = name;
 
-        iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
+        iconv(td->ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
     }
     else {
         /* Make sure the name is terminated properly */
@@ -2127,13 +2436,13 @@ static int handle_blocklogin(ship_t *c, shipgate_block_login_pkt *pkt) {
     bl = ntohl(pkt->blocknum);
 
     /* Insert the client into the online_clients table */
-    sylverant_db_escape_str(&conn, tmp, name, strlen(name));
+    sylverant_db_escape_str(&td->conn, tmp, name, strlen(name));
     sprintf(query, "INSERT INTO online_clients(guildcard, name, ship_id, "
             "block) VALUES('%u', '%s', '%hu', '%u')", gc, tmp, c->key_idx, bl);
 
     /* If the query fails, most likely its a primary key violation, so assume
        the user is already logged in */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         return send_error(c, SHDR_TYPE_BLKLOGIN, SHDR_FAILURE,
                           ERR_BLOGIN_ONLINE, (uint8_t *)&pkt->guildcard, 8);
     }
@@ -2146,16 +2455,16 @@ static int handle_blocklogin(ship_t *c, shipgate_block_login_pkt *pkt) {
             "friendlist.friend = '%u'", gc);
 
     /* Query for any results */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         /* Silently fail here (to the ship anyway), since this doesn't spell
            doom at all for the logged in user */
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         goto skip_friends;
     }
 
     /* Grab any results we got */
-    if(!(result = sylverant_db_result_store(&conn))) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(!(result = sylverant_db_result_store(&td->conn))) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         goto skip_friends;
     }
 
@@ -2164,11 +2473,12 @@ static int handle_blocklogin(ship_t *c, shipgate_block_login_pkt *pkt) {
         gc2 = (uint32_t)strtoul(row[0], NULL, 0);
         bl2 = (uint32_t)strtoul(row[1], NULL, 0);
         ship_id = (uint16_t)strtoul(row[2], NULL, 0);
-        c2 = find_ship(ship_id);
+        c2 = ship_get(ship_id);
 
         if(c2) {
             send_friend_message(c2, 1, gc2, bl2, gc, bl, c->key_idx, name,
                                 row[3]);
+            ship_put(c2);
         }
     }
 
@@ -2180,17 +2490,17 @@ skip_friends:
             "guildcard='%u'", gc);
 
     /* Query for any results */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         /* Silently fail here (to the ship anyway), since this doesn't spell
            doom at all for the logged in user (although, it might spell some
            inconvenience, potentially) */
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         goto skip_opts;
     }
 
     /* Grab any results we got */
-    if(!(result = sylverant_db_result_store(&conn))) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(!(result = sylverant_db_result_store(&td->conn))) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         goto skip_opts;
     }
 
@@ -2212,28 +2522,41 @@ skip_friends:
     send_user_options(c);
 
 skip_opts:
-    /* See if the user has an account or not. */
-    sprintf(query, "SELECT account_id FROM guildcards WHERE guildcard='%"
-            PRIu32 "'", gc);
+    /* See if the user has an account or not (and grab their privilege level
+       for the cache while we're at it). */
+    sprintf(query, "SELECT guildcards.account_id, privlevel FROM guildcards "
+            "LEFT OUTER JOIN account_data ON guildcards.account_id = "
+            "account_data.account_id WHERE guildcard='%" PRIu32 "'", gc);
 
     /* Query for any results */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         /* Silently fail here (to the ship anyway), since this doesn't spell
            doom at all for the logged in user (although, it might spell some
            inconvenience, potentially) */
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         goto skip_mail;
     }
 
     /* Grab any results we got */
-    if(!(result = sylverant_db_result_store(&conn))) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(!(result = sylverant_db_result_store(&td->conn))) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         goto skip_mail;
     }
 
     /* Find the account_id, if any. */
-    if(!(row = sylverant_db_result_fetch(result)) || !row[0])
+    if(!(row = sylverant_db_result_fetch(result))) {
+        sylverant_db_result_free(result);
+        goto skip_mail;
+    }
+
+    if(!row[0]) {
+        priv_cache_add(gc, c->key_idx, -1, 0);
+        sylverant_db_result_free(result);
         goto skip_mail;
+    }
+
+    /* An account without a privilege level set is just a normal user. */
+    priv_cache_add(gc, c->key_idx, atoi(row[0]), row[1] ? atoi(row[1]) : 0);
 
     gc2 = (uint32_t)strtoul(row[0], NULL, 0);
     sylverant_db_result_free(result);
@@ -2245,16 +2568,16 @@ skip_opts:
             gc2);
 
     /* Query for any results */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         /* Silently fail here (to the ship anyway), since this doesn't spell
            doom for the logged in user */
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         goto skip_mail;
     }
 
     /* Grab any results we got */
-    if(!(result = sylverant_db_result_store(&conn))) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(!(result = sylverant_db_result_store(&td->conn))) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         goto skip_mail;
     }
 
@@ -2292,6 +2615,7 @@ static int handle_blocklogout(ship_t *c, shipgate_block_login_pkt *pkt) {
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
+    sg_tdata_t *td = get_tdata();
 
     /* Is the name a Blue Burst-style (UTF-16) name or not? */
     if(pkt->ch_name[0] == '\t') {
@@ -2301,7 +2625,7 @@ static int handle_blocklogout(ship_t *c, shipgate_block_login_pkt *pkt) {
         inptr = pkt->ch_name;
         outptr = name;
 
-        iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
+        iconv(td->ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
     }
     else {
         /* Make sure the name is terminated properly */
@@ -2318,11 +2642,14 @@ static int handle_blocklogout(ship_t *c, shipgate_block_login_pkt *pkt) {
     gc = ntohl(pkt->guildcard);
     bl = ntohl(pkt->blocknum);
 
+    /* They don't need to be in the privilege cache anymore. */
+    priv_cache_del(gc);
+
     /* Delete the client from the online_clients table */
     sprintf(query, "DELETE FROM online_clients WHERE guildcard='%u' AND "
             "ship_id='%hu'", gc, c->key_idx);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         return 0;
     }
 
@@ -2334,16 +2661,16 @@ static int handle_blocklogout(ship_t *c, shipgate_block_login_pkt *pkt) {
             "friendlist.friend = '%u'", gc);
 
     /* Query for any results */
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         /* Silently fail here (to the ship anyway), since this doesn't spell
            doom at all for the logged in user */
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return 0;
     }
 
     /* Grab any results we got */
-    if(!(result = sylverant_db_result_store(&conn))) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(!(result = sylverant_db_result_store(&td->conn))) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return 0;
     }
 
@@ -2352,11 +2679,12 @@ static int handle_blocklogout(ship_t *c, shipgate_block_login_pkt *pkt) {
         gc2 = (uint32_t)strtoul(row[0], NULL, 0);
         bl2 = (uint32_t)strtoul(row[1], NULL, 0);
         ship_id = (uint16_t)strtoul(row[2], NULL, 0);
-        c2 = find_ship(ship_id);
+        c2 = ship_get(ship_id);
 
         if(c2) {
             send_friend_message(c2, 0, gc2, bl2, gc, bl, c->key_idx, name,
                                 row[3]);
+            ship_put(c2);
         }
     }
 
@@ -2370,6 +2698,7 @@ static int handle_friendlist_add(ship_t *c, shipgate_friend_add_pkt *pkt) {
     uint32_t ugc, fgc;
     char query[256];
     char nickname[64];
+    sg_tdata_t *td = get_tdata();
 
     /* Make sure the length is sane */
     if(pkt->hdr.pkt_len != htons(sizeof(shipgate_friend_add_pkt))) {
@@ -2382,7 +2711,7 @@ static int handle_friendlist_add(ship_t *c, shipgate_friend_add_pkt *pkt) {
 
     /* Escape the name string */
     pkt->friend_nick[31] = 0;
-    sylverant_db_escape_str(&conn, nickname, pkt->friend_nick,
+    sylverant_db_escape_str(&td->conn, nickname, pkt->friend_nick,
                             strlen(pkt->friend_nick));
 
     /* Build the db query */
@@ -2390,8 +2719,8 @@ static int handle_friendlist_add(ship_t *c, shipgate_friend_add_pkt *pkt) {
             "VALUES('%u', '%u', '%s')", ugc, fgc, nickname);
 
     /* Execute the query */
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return send_error(c, SHDR_TYPE_ADDFRIEND, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->user_guildcard, 8);
     }
@@ -2404,6 +2733,7 @@ static int handle_friendlist_add(ship_t *c, shipgate_friend_add_pkt *pkt) {
 static int handle_friendlist_del(ship_t *c, shipgate_friend_upd_pkt *pkt) {
     uint32_t ugc, fgc;
     char query[256];
+    sg_tdata_t *td = get_tdata();
 
     /* Make sure the length is sane */
     if(pkt->hdr.pkt_len != htons(sizeof(shipgate_friend_upd_pkt))) {
@@ -2419,8 +2749,8 @@ static int handle_friendlist_del(ship_t *c, shipgate_friend_upd_pkt *pkt) {
             ugc, fgc);
 
     /* Execute the query */
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return send_error(c, SHDR_TYPE_DELFRIEND, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->user_guildcard, 8);
     }
@@ -2434,6 +2764,7 @@ static int handle_lobby_chg(ship_t *c, shipgate_lobby_change_pkt *pkt) {
     char query[512];
     char tmp[128];
     uint32_t gc, lid;
+    sg_tdata_t *td = get_tdata();
 
     /* Make sure the name is terminated properly */
     pkt->lobby_name[31] = 0;
@@ -2443,7 +2774,7 @@ static int handle_lobby_chg(ship_t *c, shipgate_lobby_change_pkt *pkt) {
     lid = ntohl(pkt->lobby_id);
 
     /* Update the client's entry */
-    sylverant_db_escape_str(&conn, tmp, pkt->lobby_name,
+    sylverant_db_escape_str(&td->conn, tmp, pkt->lobby_name,
                             strlen(pkt->lobby_name));
     if(lid > 20) {
         sprintf(query, "UPDATE online_clients SET lobby_id='%u', lobby='%s' "
@@ -2457,8 +2788,8 @@ static int handle_lobby_chg(ship_t *c, shipgate_lobby_change_pkt *pkt) {
     }
 
     /* This shouldn't ever "fail" so to speak... */
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return 0;
     }
 
@@ -2474,6 +2805,7 @@ static int handle_block_clients(ship_t *c, shipgate_bclients_pkt *pkt) {
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
+    sg_tdata_t *td = get_tdata();
 
     /* Verify the length is right */
     count = ntohl(pkt->count);
@@ -2490,8 +2822,8 @@ static int handle_block_clients(ship_t *c, shipgate_bclients_pkt *pkt) {
     /* Make sure there's nothing for this ship/block in the db */
     sprintf(query, "DELETE FROM online_clients WHERE ship_id='%hu' AND "
             "block='%u'", c->key_idx, bl);
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return -1;
     }
 
@@ -2505,7 +2837,7 @@ static int handle_block_clients(ship_t *c, shipgate_bclients_pkt *pkt) {
             inptr = pkt->entries[i].ch_name;
             outptr = name;
 
-            iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
+            iconv(td->ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
         }
         else {
             /* Make sure the name is terminated properly */
@@ -2527,7 +2859,7 @@ static int handle_block_clients(ship_t *c, shipgate_bclients_pkt *pkt) {
         lid = ntohl(pkt->entries[i].lobby);
 
         /* Escape the name string */
-        sylverant_db_escape_str(&conn, tmp, name, strlen(name));
+        sylverant_db_escape_str(&td->conn, tmp, name, strlen(name));
 
         /* If we're not in a lobby, that's all we need */
         if(lid == 0) {
@@ -2536,7 +2868,7 @@ static int handle_block_clients(ship_t *c, shipgate_bclients_pkt *pkt) {
                     c->key_idx, bl);
         }
         else if(lid <= 20) {
-            sylverant_db_escape_str(&conn, tmp2, pkt->entries[i].lobby_name,
+            sylverant_db_escape_str(&td->conn, tmp2, pkt->entries[i].lobby_name,
                                     strlen(pkt->entries[i].lobby_name));
             sprintf(query, "INSERT INTO online_clients(guildcard, name, "
                     "ship_id, block, lobby_id, lobby, dlobby_id) VALUES('%u', "
@@ -2544,7 +2876,7 @@ static int handle_block_clients(ship_t *c, shipgate_bclients_pkt *pkt) {
                     bl, lid, tmp2, lid);
         }
         else {
-            sylverant_db_escape_str(&conn, tmp2, pkt->entries[i].lobby_name,
+            sylverant_db_escape_str(&td->conn, tmp2, pkt->entries[i].lobby_name,
                                     strlen(pkt->entries[i].lobby_name));
             sprintf(query, "INSERT INTO online_clients(guildcard, name, "
                     "ship_id, block, lobby_id, lobby, dlobby_id) VALUES('%u', "
@@ -2553,8 +2885,8 @@ static int handle_block_clients(ship_t *c, shipgate_bclients_pkt *pkt) {
         }
 
         /* Run the query */
-        if(sylverant_db_query(&conn, query)) {
-            debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        if(sylverant_db_query(&td->conn, query)) {
+            debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
             continue;
         }
     }
@@ -2571,6 +2903,7 @@ static int handle_clients12(ship_t *c, shipgate_bclients_12_pkt *pkt) {
     size_t in, out;
     ICONV_CONST char *inptr;
     char *outptr;
+    sg_tdata_t *td = get_tdata();
 
     /* Verify the length is right */
     count = ntohl(pkt->count);
@@ -2587,8 +2920,8 @@ static int handle_clients12(ship_t *c, shipgate_bclients_12_pkt *pkt) {
     /* Make sure there's nothing for this ship/block in the db */
     sprintf(query, "DELETE FROM online_clients WHERE ship_id='%hu' AND "
             "block='%u'", c->key_idx, bl);
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return -1;
     }
 
@@ -2602,7 +2935,7 @@ static int handle_clients12(ship_t *c, shipgate_bclients_12_pkt *pkt) {
             inptr = pkt->entries[i].ch_name;
             outptr = name;
 
-            iconv(ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
+            iconv(td->ic_utf16_to_utf8, &inptr, &in, &outptr, &out);
         }
         else {
             /* Make sure the name is terminated properly */
@@ -2625,7 +2958,7 @@ static int handle_clients12(ship_t *c, shipgate_bclients_12_pkt *pkt) {
         dlid = ntohl(pkt->entries[i].dlobby);
 
         /* Escape the name string */
-        sylverant_db_escape_str(&conn, tmp, name, strlen(name));
+        sylverant_db_escape_str(&td->conn, tmp, name, strlen(name));
 
         /* If we're not in a lobby, that's all we need */
         if(lid == 0) {
@@ -2634,7 +2967,7 @@ static int handle_clients12(ship_t *c, shipgate_bclients_12_pkt *pkt) {
                     c->key_idx, bl);
         }
         else {
-            sylverant_db_escape_str(&conn, tmp2, pkt->entries[i].lobby_name,
+            sylverant_db_escape_str(&td->conn, tmp2, pkt->entries[i].lobby_name,
                                     strlen(pkt->entries[i].lobby_name));
             sprintf(query, "INSERT INTO online_clients(guildcard, name, "
                     "ship_id, block, lobby_id, lobby, dlobby_id) VALUES('%u', "
@@ -2643,8 +2976,8 @@ static int handle_clients12(ship_t *c, shipgate_bclients_12_pkt *pkt) {
         }
 
         /* Run the query */
-        if(sylverant_db_query(&conn, query)) {
-            debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        if(sylverant_db_query(&td->conn, query)) {
+            debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
             continue;
         }
     }
@@ -2660,92 +2993,52 @@ static int handle_kick(ship_t *c, shipgate_kick_pkt *pkt) {
     void *result;
     char **row;
     ship_t *c2;
-    int priv, priv2;
+    int account_id, priv, priv2, rv;
+    sg_tdata_t *td = get_tdata();
 
     /* Parse out what we care about */
     gcr = ntohl(pkt->requester);
     gc = ntohl(pkt->guildcard);
 
     /* Make sure the requester is a GM */
-    sprintf(query, "SELECT privlevel FROM account_data NATURAL JOIN guildcards "
-            "WHERE privlevel>'1' AND guildcard='%u'", gcr);
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-        return 0;
-    }
-
-    /* Grab the data from the DB */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        debug(DBG_WARN, "Couldn't fetch GM data (%u)\n", gcr);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-
+    if((rv = priv_lookup(td, gcr, &account_id, &priv)) < 0) {
         return 0;
     }
 
-    /* Make sure we actually have a row, if not the ship is possibly trying to
-       trick us into giving someone without GM privileges GM abilities... */
-    if((row = sylverant_db_result_fetch(result)) == NULL) {
-        sylverant_db_result_free(result);
+    /* If not, the ship is possibly trying to trick us into giving someone
+       without GM privileges GM abilities... */
+    if(rv || priv <= 1) {
         debug(DBG_WARN, "Failed kick - not gm (gc: %u ship: %hu)\n", gcr,
               c->key_idx);
 
         return -1;
     }
 
-    /* Grab the privilege level of the GM doing the kick */
-    priv = atoi(row[0]);
-
-    /* We're done with the data we got */
-    sylverant_db_result_free(result);
-
     /* Make sure the user isn't trying to kick someone with a higher privilege
        level than them... */
-    sprintf(query, "SELECT privlevel FROM guildcards NATURAL JOIN account_data "
-            "WHERE guildcard='%u'", gc);
-
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "Couldn't fetch account data (%u)\n", gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-
+    if((rv = priv_lookup(td, gc, &account_id, &priv2)) < 0) {
         return 0;
     }
 
-    /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        debug(DBG_WARN, "Couldn't fetch account data (%u)\n", gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(!rv && priv2 >= priv) {
+        debug(DBG_WARN, "Attempt by %u to kick %u overturned by priv\n",
+              gcr, gc);
 
         return 0;
     }
 
-    /* See if we got anything */
-    if((row = sylverant_db_result_fetch(result))) {
-        priv2 = atoi(row[0]);
-
-        if(priv2 >= priv) {
-            sylverant_db_result_free(result);
-            debug(DBG_WARN, "Attempt by %u to kick %u overturned by priv\n",
-                  gcr, gc);
-
-            return 0;
-        }
-    }
-
-    /* We're done with that... */
-    sylverant_db_result_free(result);
-
     /* Now that we're done with that, work on the kick */
     sprintf(query, "SELECT ship_id, block FROM online_clients WHERE "
             "guildcard='%u'", gc);
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return 0;
     }
 
     /* Grab the data from the DB */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch online data (%u)\n", gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         return 0;
     }
@@ -2768,13 +3061,14 @@ static int handle_kick(ship_t *c, shipgate_kick_pkt *pkt) {
     }
 
     /* Grab the ship we need to send this to */
-    if(!(c2 = find_ship(sid))) {
+    if(!(c2 = ship_get(sid))) {
         debug(DBG_WARN, "Invalid ship?!?\n");
         return -1;
     }
 
     /* Send off the message */
     send_kick(c2, gcr, gc, bl, pkt->reason);
+    ship_put(c2);
     return 0;
 }
 
@@ -2785,6 +3079,7 @@ static int handle_frlist_req(ship_t *c, shipgate_friend_list_req *pkt) {
     char **row;
     friendlist_data_t entries[5];
     int i;
+    sg_tdata_t *td = get_tdata();
 
     /* Parse out what we need */
     gcr = ntohl(pkt->requester);
@@ -2796,16 +3091,16 @@ static int handle_frlist_req(ship_t *c, shipgate_friend_list_req *pkt) {
             "LEFT OUTER JOIN online_clients ON friendlist.friend = "
             "online_clients.guildcard WHERE owner='%u' ORDER BY friend "
             "LIMIT 5 OFFSET %u", gcr, start);
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't select friendlist for %u\n", gcr);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return 0;
     }
 
     /* Grab the data from the DB */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch friendlist for %u\n", gcr);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         return 0;
     }
@@ -2846,10 +3141,9 @@ static int handle_frlist_req(ship_t *c, shipgate_friend_list_req *pkt) {
 static int handle_globalmsg(ship_t *c, shipgate_global_msg_pkt *pkt) {
     uint32_t gcr;
     uint16_t text_len;
-    char query[256];
-    void *result;
-    char **row;
     ship_t *i;
+    int account_id, priv, rv;
+    sg_tdata_t *td = get_tdata();
 
     /* Parse out what we really need */
     gcr = ntohl(pkt->requester);
@@ -2862,41 +3156,30 @@ static int handle_globalmsg(ship_t *c, shipgate_global_msg_pkt *pkt) {
     }
 
     /* Make sure the requester is a GM */
-    sprintf(query, "SELECT privlevel FROM account_data NATURAL JOIN guildcards "
-            "WHERE privlevel>'1' AND guildcard='%u'", gcr);
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-        return 0;
-    }
-
-    /* Grab the data from the DB */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
-        debug(DBG_WARN, "Couldn't fetch GM data (%u)\n", gcr);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
-
+    if((rv = priv_lookup(td, gcr, &account_id, &priv)) < 0) {
         return 0;
     }
 
-    /* Make sure we actually have a row, if not the ship is possibly trying to
-       trick us into giving someone without GM privileges GM abilities... */
-    if((row = sylverant_db_result_fetch(result)) == NULL) {
-        sylverant_db_result_free(result);
+    /* If not, the ship is possibly trying to trick us into giving someone
+       without GM privileges GM abilities... */
+    if(rv || priv <= 1) {
         debug(DBG_WARN, "Failed global msg - not gm (gc: %u ship: %hu)\n", gcr,
               c->key_idx);
 
         return -1;
     }
 
-    /* We're done with that... */
-    sylverant_db_result_free(result);
-
     /* Send the packet along to all the ships that support it */
+    pthread_rwlock_rdlock(&ships_lock);
+
     TAILQ_FOREACH(i, &ships, qentry) {
         if(send_global_msg(i, gcr, pkt->text, text_len)) {
             i->disconnected = 1;
         }
     }
 
+    pthread_rwlock_unlock(&ships_lock);
+
     return 0;
 }
 
@@ -2906,6 +3189,7 @@ static int handle_useropt(ship_t *c, shipgate_user_opt_pkt *pkt) {
     uint16_t len = htons(pkt->hdr.pkt_len);
     uint32_t ugc, optlen, opttype;
     int realoptlen;
+    sg_tdata_t *td = get_tdata();
 
     /* Make sure the length is sane */
     if(len < sizeof(shipgate_user_opt_pkt) + 16) {
@@ -2943,7 +3227,7 @@ static int handle_useropt(ship_t *c, shipgate_user_opt_pkt *pkt) {
     }
 
     /* Escape the data */
-    sylverant_db_escape_str(&conn, data, (const char *)pkt->options[0].data,
+    sylverant_db_escape_str(&td->conn, data, (const char *)pkt->options[0].data,
                             realoptlen);
 
     /* Build the db query... This uses a MySQL extension, so will have to be
@@ -2953,8 +3237,8 @@ static int handle_useropt(ship_t *c, shipgate_user_opt_pkt *pkt) {
             "value=VALUES(value)", ugc, opttype, data);
 
     /* Execute the query */
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return send_error(c, SHDR_TYPE_USEROPT, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->guildcard, 24);
     }
@@ -2970,6 +3254,7 @@ static int handle_bbopt_req(ship_t *c, shipgate_bb_opts_req_pkt *pkt) {
     void *result;
     char **row;
     sylverant_bb_db_opts_t opts;
+    sg_tdata_t *td = get_tdata();
 
     /* Parse out the guildcard */
     gc = ntohl(pkt->guildcard);
@@ -2980,20 +3265,20 @@ static int handle_bbopt_req(ship_t *c, shipgate_bb_opts_req_pkt *pkt) {
             PRIu32 "'", gc);
 
     /* Execute the query */
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return send_error(c, SHDR_TYPE_BBOPTS, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->guildcard, 8);
     }
 
-    if(!(result = sylverant_db_result_store(&conn))) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(!(result = sylverant_db_result_store(&td->conn))) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return send_error(c, SHDR_TYPE_BBOPTS, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->guildcard, 8);
     }
 
     if(!(row = sylverant_db_result_fetch(result))) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         sylverant_db_result_free(result);
         return send_error(c, SHDR_TYPE_BBOPTS, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->guildcard, 8);
@@ -3008,21 +3293,22 @@ static int handle_bbopt_req(ship_t *c, shipgate_bb_opts_req_pkt *pkt) {
 }
 
 static int handle_bbopts(ship_t *c, shipgate_bb_opts_pkt *pkt) {
-    static char query[sizeof(sylverant_bb_db_opts_t) * 2 + 256];
+    char query[sizeof(sylverant_bb_db_opts_t) * 2 + 256];
     uint32_t gc;
+    sg_tdata_t *td = get_tdata();
 
     /* Parse out the guildcard */
     gc = ntohl(pkt->guildcard);
 
     /* Build the db query */
     strcpy(query, "UPDATE blueburst_options SET options='");
-    sylverant_db_escape_str(&conn, query + strlen(query), (char *)&pkt->opts,
-                            sizeof(sylverant_bb_db_opts_t));
+    sylverant_db_escape_str(&td->conn, query + strlen(query),
+                            (char *)&pkt->opts, sizeof(sylverant_bb_db_opts_t));
     sprintf(query + strlen(query), "' WHERE guildcard='%" PRIu32 "'", gc);
 
     /* Execute the query */
-    if(sylverant_db_query(&conn, query)) {
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+    if(sylverant_db_query(&td->conn, query)) {
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
         return send_error(c, SHDR_TYPE_BBOPTS, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->guildcard, 8);
     }
@@ -3037,6 +3323,7 @@ static int handle_mkill(ship_t *c, shipgate_mkill_pkt *pkt) {
     void *result;
     char **row;
     monster_event_t *ev;
+    sg_tdata_t *td = get_tdata();
 
     /* Ignore any packets that aren't version 1 or later. They're useless. */
     if(pkt->hdr.version < 1)
@@ -3054,18 +3341,18 @@ static int handle_mkill(ship_t *c, shipgate_mkill_pkt *pkt) {
     sprintf(query, "SELECT account_id FROM guildcards WHERE guildcard='%"
             PRIu32 "'", gc);
 
-    if(sylverant_db_query(&conn, query)) {
+    if(sylverant_db_query(&td->conn, query)) {
         debug(DBG_WARN, "Couldn't fetch account data (%" PRIu32 ")\n", gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         return send_error(c, SHDR_TYPE_MKILL, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->guildcard, 16);
     }
 
     /* Grab the data we got. */
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&td->conn)) == NULL) {
         debug(DBG_WARN, "Couldn't fetch account data (%" PRIu32 ")\n", gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         return send_error(c, SHDR_TYPE_MKILL, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->guildcard, 8);
@@ -3074,7 +3361,7 @@ static int handle_mkill(ship_t *c, shipgate_mkill_pkt *pkt) {
     if((row = sylverant_db_result_fetch(result)) == NULL) {
         sylverant_db_result_free(result);
         debug(DBG_WARN, "Couldn't fetch account data (%" PRIu32 ")\n", gc);
-        debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
 
         return send_error(c, SHDR_TYPE_MKILL, SHDR_FAILURE, ERR_BAD_ERROR,
                           (uint8_t *)&pkt->guildcard, 8);
@@ -3111,8 +3398,8 @@ static int handle_mkill(ship_t *c, shipgate_mkill_pkt *pkt) {
                     ev->monsters[i].monster, ct);
 
             /* Execute the query */
-            if(sylverant_db_query(&conn, query)) {
-                debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+            if(sylverant_db_query(&td->conn, query)) {
+                debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
                 return send_error(c, SHDR_TYPE_MKILL, SHDR_FAILURE,
                                   ERR_BAD_ERROR, (uint8_t *)&pkt->guildcard, 8);
             }
@@ -3137,8 +3424,8 @@ static int handle_mkill(ship_t *c, shipgate_mkill_pkt *pkt) {
                 i, ct);
 
         /* Execute the query */
-        if(sylverant_db_query(&conn, query)) {
-            debug(DBG_WARN, "%s\n", sylverant_db_error(&conn));
+        if(sylverant_db_query(&td->conn, query)) {
+            debug(DBG_WARN, "%s\n", sylverant_db_error(&td->conn));
             return send_error(c, SHDR_TYPE_MKILL, SHDR_FAILURE, ERR_BAD_ERROR,
                               (uint8_t *)&pkt->guildcard, 8);
         }
@@ -3147,6 +3434,45 @@ static int handle_mkill(ship_t *c, shipgate_mkill_pkt *pkt) {
     return 0;
 }
 
+void fw_hist_dump(void) {
+    static const char *vers[FW_HIST_VERSIONS] = { "DC", "PC", "BB" };
+    static uint32_t hist[FW_HIST_VERSIONS][256][FW_HIST_BUCKETS];
+    char buf[512];
+    int i, j, k, len;
+    uint32_t total;
+
+    memset(hist, 0, sizeof(hist));
+    workers_fw_hist(hist);
+
+    for(i = 0; i < FW_HIST_VERSIONS; ++i) {
+        for(j = 0; j < 256; ++j) {
+            total = 0;
+            len = 0;
+
+            for(k = 0; k < FW_HIST_BUCKETS; ++k) {
+                if(!hist[i][j][k])
+                    continue;
+
+                total += hist[i][j][k];
+
+                if(k == FW_HIST_BUCKETS - 1)
+                    len += snprintf(buf + len, sizeof(buf) - len,
+                                    " >=%dus:%" PRIu32, 1 << (k - 1),
+                                    hist[i][j][k]);
+                else
+                    len += snprintf(buf + len, sizeof(buf) - len,
+                                    " <%dus:%" PRIu32, 1 << k,
+                                    hist[i][j][k]);
+            }
+
+            if(total) {
+                debug(DBG_LOG, "Relayed %s 0x%02x: %" PRIu32 " packets,%s\n",
+                      vers[i], j, total, buf);
+            }
+        }
+    }
+}
+
 /* Process one ship packet. */
 int process_ship_pkt(ship_t *c, shipgate_hdr_t *pkt) {
     uint16_t type = ntohs(pkt->pkt_type);
@@ -3261,6 +3587,7 @@ int handle_pkt(ship_t *c) {
     int rv = 0;
     unsigned char *rbp;
     void *tmp;
+    uint8_t *recvbuf = get_recvbuf();
 
     /* If we've got anything buffered, copy it out to the main buffer to make
        the rest of this a bit easier. */
@@ -3279,6 +3606,10 @@ int handle_pkt(ship_t *c) {
         return -1;
     }
 
+    /* Remember when this came in, so we can tell how long it takes for any
+       packets in here to be relayed to other ships. */
+    gettimeofday(&get_tdata()->recv_time, NULL);
+
     sz += c->recvbuf_cur;
     c->recvbuf_cur = 0;
     rbp = recvbuf;
@@ -22,6 +22,8 @@
 #include <inttypes.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <sys/queue.h>
 
 #include <gnutls/gnutls.h>
@@ -71,8 +73,32 @@ typedef struct monster_event {
 
 #undef PACKED
 
+struct sg_worker;
+struct sg_tdata;
+
+/* A packet being relayed from one ship to another, for keeping track of how
+   long that takes. In a ship's forward queue, end is where the packet ends. */
+typedef struct fw_relay {
+    struct timeval start;
+    int end;
+    uint8_t ver;
+    uint8_t type;
+} fw_relay_t;
+
+/* How much data can be waiting in a ship's forward queue before we start
+   complaining about it. */
+#define SHIP_BACKLOG_WARN   65536
+
+/* How often (in seconds) the send queue depths of each ship get logged. */
+#define SHIP_STATS_INTERVAL 300
+
 typedef struct ship {
     TAILQ_ENTRY(ship) qentry;
+    TAILQ_ENTRY(ship) wentry;
+
+    /* The worker thread that owns this ship's connection. Only that thread
+       ever touches the TLS session once the ship has been handed off. */
+    struct sg_worker *worker;
 
     int sock;
     int disconnected;
@@ -109,6 +135,35 @@ typedef struct ship {
     int sendbuf_size;
     int sendbuf_start;
 
+    /* Packets queued up by other worker threads, waiting for the owner of the
+       ship to send them out, and the count of references to the ship. Both are
+       protected by the mutex. */
+    pthread_mutex_t mutex;
+    int refcnt;
+    unsigned char *fwdbuf;
+    int fwdbuf_cur;
+    int fwdbuf_size;
+
+    /* The relayed packets in the forward queue, also protected by the
+       mutex. */
+    fw_relay_t *fwdrelay;
+    int fwdrelay_cur;
+    int fwdrelay_size;
+
+    /* Send statistics, so that a ship that isn't keeping up can be spotted.
+       The forward queue counters are protected by the mutex, the rest are only
+       touched by the owning worker. The peaks are for the life of the
+       connection, the high-water marks are since they were last logged. */
+    uint64_t pkts_sent;
+    uint64_t bytes_sent;
+    uint64_t pkts_fwd;
+    uint64_t bytes_fwd;
+    int fwdbuf_peak;
+    int fwdbuf_hwm;
+    int sendbuf_peak;
+    int sendbuf_hwm;
+    int backlogged;
+
     gnutls_session_t session;
 
     char name[12];
@@ -117,13 +172,47 @@ typedef struct ship {
 TAILQ_HEAD(ship_queue, ship);
 extern struct ship_queue ships;
 
-/* Create a new connection, storing it in the list of ships. */
+/* Lock for the list of ships. The read lock is needed to look through the
+   list (or the routing table), and the write lock to add or remove ships. Only
+   hold it for as long as that takes, never across database queries. */
+extern pthread_rwlock_t ships_lock;
+
+/* Add a ship to the routing table, so ship_get can look it up by its id. The
+   caller must hold the write lock on ships_lock. */
+void ship_route_add(ship_t *c);
+
+/* How long (in seconds) an approved certificate fingerprint is remembered
+   before it has to be checked against the database again. Revoked keys are
+   normally dropped much sooner than this, through the ship key version. */
+#define FP_CACHE_TTL        3600
+
+/* Clean up the cache of approved certificate fingerprints. */
+void fp_cache_cleanup(void);
+
+/* Check the ship key version in the database, emptying the fingerprint cache
+   if it has changed (or can't be read). Only the main thread calls this, along
+   with priv_cache_poll. */
+void fp_cache_poll(struct sg_tdata *td);
+
+/* Create a new connection. The ship is not added to the list of ships until it
+   is handed off to a worker thread. */
 ship_t *create_connection_tls(int sock, struct sockaddr *addr, socklen_t size);
 
-/* Destroy a connection, closing the socket and removing it from the list. */
+/* Take a ship out of the list of ships and the routing table. The caller must
+   hold the write lock on the list of ships. */
+void ship_unlink(ship_t *c);
+
+/* Destroy a connection that has been taken out of the list, closing the socket
+   and cleaning up the database. Don't hold ships_lock when calling this. */
 void destroy_connection(ship_t *c);
 
+/* Drop a reference to a ship, freeing it if that was the last one. */
+void ship_put(ship_t *c);
+
 /* Handle incoming data to the shipgate. */
 int handle_pkt(ship_t *s);
 
+/* Write the relayed packet latency histogram out to the log. */
+void fw_hist_dump(void);
+
 #endif /* !SHIP_H */
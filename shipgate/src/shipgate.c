@@ -23,6 +23,7 @@
 #include <time.h>
 #include <pthread.h>
 #include <iconv.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -35,24 +36,28 @@
 
 #include "shipgate.h"
 #include "ship.h"
+#include "worker.h"
+#include "privcache.h"
 
 /* Storage for our list of ships. */
 struct ship_queue ships = TAILQ_HEAD_INITIALIZER(ships);
+pthread_rwlock_t ships_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-/* Configuration/database connections. */
+/* Configuration data. */
 sylverant_config_t *cfg;
-sylverant_dbconn_t conn;
 
-/* Various iconv contexts we'll use */
-iconv_t ic_utf8_to_utf16;
-iconv_t ic_utf16_to_utf8;
-iconv_t ic_sjis_to_utf8;
-iconv_t ic_8859_to_utf8;
+/* Per-thread data (database connection, iconv contexts, etc) for the main
+   thread. Each worker thread has its own. */
+static sg_tdata_t main_td;
 
 /* GnuTLS data... */
 gnutls_certificate_credentials_t tls_cred;
 gnutls_priority_t tls_prio;
+gnutls_datum_t tls_ticket_key;
+
+#if GNUTLS_VERSION_NUMBER < 0x030506
 static gnutls_dh_params_t dh_params;
+#endif
 
 int shutting_down = 0;
 
@@ -63,6 +68,7 @@ monster_event_t *events;
 static const char *config_file = NULL;
 static const char *custom_dir = NULL;
 static int dont_daemonize = 0;
+static int worker_threads = 0;
 
 /* Print information about this program to stdout. */
 static void print_program_info() {
@@ -91,6 +97,8 @@ static void print_help(const char *bin) {
            "-C configfile   Use the specified configuration instead of the\n"
            "                default one.\n"
            "-D directory    Use the specified directory as the root\n"
+           "-T threads      Use the specified number of worker threads for\n"
+           "                ship connections (default: one per CPU).\n"
            "--nodaemon      Don't daemonize\n"
            "--help          Print this help and exit\n\n"
            "Note that if more than one verbosity level is specified, the last\n"
@@ -123,6 +131,10 @@ static void parse_command_line(int argc, char *argv[]) {
             /* Save the custom dir */
             custom_dir = argv[++i];
         }
+        else if(!strcmp(argv[i], "-T")) {
+            /* Save the number of worker threads */
+            worker_threads = atoi(argv[++i]);
+        }
         else if(!strcmp(argv[i], "--nodaemon")) {
             dont_daemonize = 1;
         }
@@ -161,6 +173,12 @@ static void init_gnutls() {
                                               cfg->shipgate_key,
                                               GNUTLS_X509_FMT_PEM);
 
+#if GNUTLS_VERSION_NUMBER >= 0x030506
+    /* Use one of the well-known groups for DHE, rather than generating our own
+       at startup. Anything new enough to have these will use ECDHE first. */
+    rv = gnutls_certificate_set_known_dh_params(tls_cred,
+                                                GNUTLS_SEC_PARAM_MEDIUM);
+#else
     /* Generate Diffie-Hellman parameters */
     debug(DBG_LOG, "Generating Diffie-Hellman parameters...\n"
           "This may take a little while.\n");
@@ -168,13 +186,73 @@ static void init_gnutls() {
     rv = gnutls_dh_params_generate2(dh_params, 1024);
     debug(DBG_LOG, "Done!\n");
 
+    gnutls_certificate_set_dh_params(tls_cred, dh_params);
+#endif
+
     rv = gnutls_priority_init(&tls_prio, "NORMAL:+COMP-DEFLATE", NULL);
+}
 
-    gnutls_certificate_set_dh_params(tls_cred, dh_params);
+/* Set up the key used to encrypt session tickets, so that ships can resume
+   their sessions when they reconnect. If a key file is configured, the key is
+   read from there (or saved there, if the file doesn't exist yet), so that
+   ships can still resume their sessions after a restart. Delete the file to
+   change the key. */
+static void init_ticket_key() {
+    const char *fn = cfg->shipgate_ticket_key;
+    FILE *fp;
+    size_t len;
+    int fd;
+
+    if(gnutls_session_ticket_key_generate(&tls_ticket_key) < 0) {
+        debug(DBG_ERROR, "Cannot generate session ticket key\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(!fn) {
+        debug(DBG_LOG, "No session ticket key file configured, ships won't be "
+              "able to resume their sessions after a restart\n");
+        return;
+    }
+
+    if((fp = fopen(fn, "rb"))) {
+        len = fread(tls_ticket_key.data, 1, tls_ticket_key.size, fp);
+
+        if(len != tls_ticket_key.size || fgetc(fp) != EOF) {
+            debug(DBG_ERROR, "Invalid session ticket key file: %s\n", fn);
+            exit(EXIT_FAILURE);
+        }
+
+        fclose(fp);
+        return;
+    }
+
+    if(errno != ENOENT) {
+        debug(DBG_ERROR, "Cannot read session ticket key file %s: %s\n", fn,
+              strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* There's no key saved yet, so save the one we just made. */
+    if((fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) {
+        debug(DBG_WARN, "Cannot create session ticket key file %s: %s\n", fn,
+              strerror(errno));
+        return;
+    }
+
+    if(write(fd, tls_ticket_key.data, tls_ticket_key.size) !=
+       (ssize_t)tls_ticket_key.size) {
+        debug(DBG_WARN, "Cannot write session ticket key file %s\n", fn);
+        unlink(fn);
+    }
+
+    close(fd);
 }
 
 static void cleanup_gnutls() {
+#if GNUTLS_VERSION_NUMBER < 0x030506
     gnutls_dh_params_deinit(dh_params);
+#endif
+    gnutls_free(tls_ticket_key.data);
     gnutls_certificate_free_credentials(tls_cred);
     gnutls_priority_deinit(tls_prio);
     gnutls_global_deinit();
@@ -197,7 +275,7 @@ static int read_events_table() {
     char query[256];
 
     debug(DBG_LOG, "Reading events from the database...\n");
-    if(sylverant_db_query(&conn, "SELECT event_id, title, start_time, "
+    if(sylverant_db_query(&main_td.conn, "SELECT event_id, title, start_time, "
                                  "end_time, difficulties, versions, "
                                  "allow_quests FROM monster_events WHERE "
                                  "end_time > UNIX_TIMESTAMP() ORDER BY "
@@ -206,7 +284,7 @@ static int read_events_table() {
         return -1;
     }
 
-    if((result = sylverant_db_result_store(&conn)) == NULL) {
+    if((result = sylverant_db_result_store(&main_td.conn)) == NULL) {
         debug(DBG_WARN, "Could not store results of event select!\n");
         return -1;
     }
@@ -278,13 +356,13 @@ static int read_events_table() {
                        "monster_event_monsters WHERE event_id= '%" PRIu32 "'",
                 events[i].event_id);
 
-        if(sylverant_db_query(&conn, query)) {
+        if(sylverant_db_query(&main_td.conn, query)) {
             debug(DBG_WARN, "Couldn't fetch monsters from database!\n");
             free_events();
             return -1;
         }
 
-        if((result = sylverant_db_result_store(&conn)) == NULL) {
+        if((result = sylverant_db_result_store(&main_td.conn)) == NULL) {
             debug(DBG_WARN, "Could not store results of monster select!");
             free_events();
             return -1;
@@ -355,19 +433,18 @@ static int read_events_table() {
 static void open_db() {
     debug(DBG_LOG, "Connecting to the database...\n");
 
-    if(sylverant_db_open(&cfg->dbcfg, &conn)) {
-        debug(DBG_ERROR, "Can't connect to the database\n");
+    if(tdata_init(&main_td, NULL) || tdata_attach(&main_td)) {
         exit(EXIT_FAILURE);
     }
 
     debug(DBG_LOG, "Clearing online_ships...\n");
-    if(sylverant_db_query(&conn, "DELETE FROM online_ships")) {
+    if(sylverant_db_query(&main_td.conn, "DELETE FROM online_ships")) {
         debug(DBG_ERROR, "Error clearing online_ships\n");
         exit(EXIT_FAILURE);
     }
 
     debug(DBG_LOG, "Clearing online_clients...\n");
-    if(sylverant_db_query(&conn, "DELETE FROM online_clients")) {
+    if(sylverant_db_query(&main_td.conn, "DELETE FROM online_clients")) {
         debug(DBG_ERROR, "Error clearing online_clients\n");
         exit(EXIT_FAILURE);
     }
@@ -384,60 +461,35 @@ void run_server(int tsock, int tsock6) {
     int asock;
     socklen_t len;
     struct timeval timeout;
-    fd_set readfds, writefds;
-    ship_t *i, *tmp;
-    ssize_t sent;
-    time_t now;
+    fd_set readfds;
     char ipstr[INET6_ADDRSTRLEN];
+    time_t last_dump = time(NULL), last_poll = 0, now;
 
+    /* All the work of dealing with the ships themselves is done by the worker
+       threads, all we do here is accept new connections and hand them off. */
     for(;;) {
-        /* Clear the fd_sets so we can use them. */
+        /* Clear the fd_set so we can use it. */
         FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
         nfds = 0;
-        timeout.tv_sec = 30;
+        timeout.tv_sec = PRIV_VERSION_POLL;
         timeout.tv_usec = 0;
-        now = time(NULL);
 
         if(shutting_down) {
             return;
         }
 
-        /* Fill the sockets into the fd_set so we can use select below. */
-        i = TAILQ_FIRST(&ships);
-        while(i) {
-            tmp = TAILQ_NEXT(i, qentry);
-
-            /* If we haven't heard from a ship in 2 minutes, its dead.
-               Disconnect it. */
-            if(now > i->last_message + 120 && i->last_ping &&
-               now > i->last_ping + 60) {
-                destroy_connection(i);
-                i = tmp;
-                continue;
-            }
-            /* Otherwise, if we haven't heard from it in a minute, ping it. */
-            else if(now > i->last_message + 60 && now > i->last_ping + 10) {
-                send_ping(i, 0);
-                i->last_ping = now;
-            }
-
-            FD_SET(i->sock, &readfds);
-
-            if(i->sendbuf_cur) {
-                FD_SET(i->sock, &writefds);
-            }
-
-            nfds = nfds > i->sock ? nfds : i->sock;
-
-            /* Check GnuTLS' buffer for the connection. */
-            if(gnutls_record_check_pending(i->session)) {
-                if(handle_pkt(i)) {
-                    i->disconnected = 1;
-                }
-            }
+        /* Every so often, dump the forwarding statistics to the log. */
+        now = time(NULL);
+        if(now > last_dump + 3600) {
+            fw_hist_dump();
+            last_dump = now;
+        }
 
-            i = tmp;
+        /* Check if any privilege levels or ship keys have changed. */
+        if(now >= last_poll + PRIV_VERSION_POLL) {
+            priv_cache_poll(&main_td);
+            fp_cache_poll(&main_td);
+            last_poll = now;
         }
 
         /* Add the main listening sockets to the read fd_set */
@@ -451,66 +503,7 @@ void run_server(int tsock, int tsock6) {
             nfds = nfds > tsock6 ? nfds : tsock6;
         }
 
-        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
-            /* Check each ship's socket for activity. */
-            TAILQ_FOREACH(i, &ships, qentry) {
-                if(i->disconnected) {
-                    continue;
-                }
-
-                /* Check if this ship was trying to send us anything. */
-                if(FD_ISSET(i->sock, &readfds)) {
-                    if(handle_pkt(i)) {
-                        i->disconnected = 1;
-                        continue;
-                    }
-
-                    i->last_ping = 0;
-                }
-
-                /* If we have anything to write, check if we can. */
-                if(FD_ISSET(i->sock, &writefds)) {
-                    if(i->sendbuf_cur) {
-                        sent = send(i->sock, i->sendbuf + i->sendbuf_start,
-                                    i->sendbuf_cur - i->sendbuf_start, 0);
-
-                        /* If we fail to send, and the error isn't EAGAIN,
-                           bail. */
-                        if(sent == -1) {
-                            if(errno != EAGAIN) {
-                                i->disconnected = 1;
-                            }
-                        }
-                        else {
-                            i->sendbuf_start += sent;
-
-                            /* If we've sent everything, free the buffer. */
-                            if(i->sendbuf_start == i->sendbuf_cur) {
-                                free(i->sendbuf);
-                                i->sendbuf = NULL;
-                                i->sendbuf_cur = 0;
-                                i->sendbuf_size = 0;
-                                i->sendbuf_start = 0;
-                            }
-                        }
-                    }
-                }
-            }
-
-            /* Clean up any dead connections (its not safe to do a TAILQ_REMOVE
-               in the middle of a TAILQ_FOREACH, and destroy_connection does
-               indeed use TAILQ_REMOVE). */
-            i = TAILQ_FIRST(&ships);
-            while(i) {
-                tmp = TAILQ_NEXT(i, qentry);
-
-                if(i->disconnected) {
-                    destroy_connection(i);
-                }
-
-                i = tmp;
-            }
-
+        if(select(nfds + 1, &readfds, NULL, NULL, &timeout) > 0) {
             /* Check the listening port to see if we have a ship. */
             if(tsock > -1 && FD_ISSET(tsock, &readfds)) {
                 len = sizeof(struct sockaddr_in);
@@ -521,8 +514,7 @@ void run_server(int tsock, int tsock6) {
                     continue;
                 }
 
-                if(!create_connection_tls(asock, (struct sockaddr *)&addr,
-                                          len)) {
+                if(handshake_queue(asock, (struct sockaddr *)&addr, len)) {
                     continue;
                 }
 
@@ -545,8 +537,7 @@ void run_server(int tsock, int tsock6) {
                     continue;
                 }
 
-                if(!create_connection_tls(asock, (struct sockaddr *)&addr6,
-                                          len)) {
+                if(handshake_queue(asock, (struct sockaddr *)&addr6, len)) {
                     continue;
                 }
 
@@ -692,31 +683,7 @@ int main(int argc, char *argv[]) {
 
     /* Initialize GnuTLS */
     init_gnutls();
-
-    /* Create the iconv contexts we'll use */
-    ic_utf8_to_utf16 = iconv_open("UTF-16LE", "UTF-8");
-    if(ic_utf8_to_utf16 == (iconv_t)-1) {
-        debug(DBG_ERROR, "Cannot create iconv context (UTF-8 to UTF-16)\n");
-        exit(EXIT_FAILURE);
-    }
-
-    ic_utf16_to_utf8 = iconv_open("UTF-8", "UTF-16LE");
-    if(ic_utf16_to_utf8 == (iconv_t)-1) {
-        debug(DBG_ERROR, "Cannot create iconv context (UTF-16 to UTF-8)\n");
-        exit(EXIT_FAILURE);
-    }
-
-    ic_sjis_to_utf8 = iconv_open("UTF-8", "SHIFT_JIS");
-    if(ic_sjis_to_utf8 == (iconv_t)-1) {
-        debug(DBG_ERROR, "Cannot create iconv context (Shift-JIS to UTF-8)\n");
-        exit(EXIT_FAILURE);
-    }
-
-    ic_8859_to_utf8 = iconv_open("UTF-8", "ISO-8859-1");
-    if(ic_8859_to_utf8 == (iconv_t)-1) {
-        debug(DBG_ERROR, "Cannot create iconv context (ISO-8859-1 to UTF-8)\n");
-        exit(EXIT_FAILURE);
-    }
+    init_ticket_key();
 
     /* Create the socket and listen for TLS connections. */
     tsock = open_sock(AF_INET, cfg->shipgate_port);
@@ -730,16 +697,28 @@ int main(int argc, char *argv[]) {
     /* Clean up the DB now that we've done everything else that might fail... */
     open_db();
 
+    /* Start up the threads that will deal with the ships. */
+    if(worker_threads <= 0) {
+        worker_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if(workers_start(worker_threads) ||
+       handshake_start(MAX_HANDSHAKE_THREADS)) {
+        exit(EXIT_FAILURE);
+    }
+
     /* Run the shipgate server. */
     run_server(tsock, tsock6);
 
     /* Clean up. */
     close(tsock);
     close(tsock6);
+    handshake_stop();
+    workers_stop();
+    priv_cache_cleanup();
+    fp_cache_cleanup();
     free_events();
-    iconv_close(ic_utf8_to_utf16);
-    iconv_close(ic_utf16_to_utf8);
-    sylverant_db_close(&conn);
+    tdata_cleanup(&main_td);
     cleanup_gnutls();
     sylverant_free_config(cfg);
 
@@ -511,6 +511,15 @@ static const char shipgate_login_msg[] =
 /* Send a welcome packet to the given ship. */
 int send_welcome(ship_t *c);
 
+/* Send any packets other threads have queued up for the given ship. This must
+   only be called by the worker thread that owns the ship. */
+int send_queued(ship_t *c);
+
+/* Log the current and high-water send queue depths of the given ship, and
+   start the high-water marks over. This must only be called by the worker
+   thread that owns the ship. */
+void log_send_stats(ship_t *c);
+
 /* Forward a Dreamcast packet to the given ship, with additional metadata. */
 int forward_dreamcast(ship_t *c, dc_pkt_hdr_t *pkt, uint32_t sender,
                       uint32_t gc, uint32_t block);
@@ -523,6 +532,10 @@ int forward_pc(ship_t *c, dc_pkt_hdr_t *pc, uint32_t sender, uint32_t gc,
 int forward_bb(ship_t *c, bb_pkt_hdr_t *bb, uint32_t sender, uint32_t gc,
                uint32_t block);
 
+/* Relay a forwarded packet received from one ship on to another, without
+   copying it out of the buffer it was received in. */
+int relay_fw_pkt(ship_t *c, shipgate_fw_9_pkt *pkt, uint32_t sender);
+
 /* Send a ship up/down message to the given ship. */
 int send_ship_status(ship_t *c, ship_t *o, uint16_t status);
 
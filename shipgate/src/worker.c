@@ -0,0 +1,646 @@
+/*
+    Sylverant Shipgate
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include <gnutls/gnutls.h>
+
+#include <sylverant/config.h>
+#include <sylverant/debug.h>
+
+#include "worker.h"
+#include "shipgate.h"
+
+/* Configuration data (from shipgate.c) */
+extern sylverant_config_t *cfg;
+
+/* The key for accessing our thread-specific data. */
+static pthread_key_t tdata_key;
+static pthread_once_t tdata_once = PTHREAD_ONCE_INIT;
+
+/* The worker threads that are running. */
+static sg_worker_t *workers[MAX_WORKERS];
+static int worker_count = 0;
+
+static void make_tdata_key(void) {
+    if(pthread_key_create(&tdata_key, NULL)) {
+        perror("pthread_key_create");
+    }
+}
+
+/* Set up a set of per-thread data. */
+int tdata_init(sg_tdata_t *td, sg_worker_t *w) {
+    pthread_once(&tdata_once, &make_tdata_key);
+
+    td->worker = w;
+
+    /* Each thread gets its own connection to the database, since a connection
+       can't be used by more than one thread at a time. */
+    if(sylverant_db_open(&cfg->dbcfg, &td->conn)) {
+        debug(DBG_ERROR, "Can't connect to the database\n");
+        return -1;
+    }
+
+    /* Create the iconv contexts we'll use */
+    td->ic_utf8_to_utf16 = iconv_open("UTF-16LE", "UTF-8");
+    if(td->ic_utf8_to_utf16 == (iconv_t)-1) {
+        debug(DBG_ERROR, "Cannot create iconv context (UTF-8 to UTF-16)\n");
+        goto err_db;
+    }
+
+    td->ic_utf16_to_utf8 = iconv_open("UTF-8", "UTF-16LE");
+    if(td->ic_utf16_to_utf8 == (iconv_t)-1) {
+        debug(DBG_ERROR, "Cannot create iconv context (UTF-16 to UTF-8)\n");
+        goto err_utf8_to_utf16;
+    }
+
+    td->ic_sjis_to_utf8 = iconv_open("UTF-8", "SHIFT_JIS");
+    if(td->ic_sjis_to_utf8 == (iconv_t)-1) {
+        debug(DBG_ERROR, "Cannot create iconv context (Shift-JIS to UTF-8)\n");
+        goto err_utf16_to_utf8;
+    }
+
+    td->ic_8859_to_utf8 = iconv_open("UTF-8", "ISO-8859-1");
+    if(td->ic_8859_to_utf8 == (iconv_t)-1) {
+        debug(DBG_ERROR, "Cannot create iconv context (ISO-8859-1 to UTF-8)\n");
+        goto err_sjis_to_utf8;
+    }
+
+    return 0;
+
+err_sjis_to_utf8:
+    iconv_close(td->ic_sjis_to_utf8);
+err_utf16_to_utf8:
+    iconv_close(td->ic_utf16_to_utf8);
+err_utf8_to_utf16:
+    iconv_close(td->ic_utf8_to_utf16);
+err_db:
+    sylverant_db_close(&td->conn);
+    return -1;
+}
+
+/* Clean up the per-thread data set up with tdata_init. */
+void tdata_cleanup(sg_tdata_t *td) {
+    iconv_close(td->ic_utf8_to_utf16);
+    iconv_close(td->ic_utf16_to_utf8);
+    iconv_close(td->ic_sjis_to_utf8);
+    iconv_close(td->ic_8859_to_utf8);
+    sylverant_db_close(&td->conn);
+}
+
+/* Make the given per-thread data the calling thread's own. */
+int tdata_attach(sg_tdata_t *td) {
+    if(pthread_setspecific(tdata_key, td)) {
+        perror("pthread_setspecific");
+        return -1;
+    }
+
+    return 0;
+}
+
+sg_tdata_t *get_tdata(void) {
+    return (sg_tdata_t *)pthread_getspecific(tdata_key);
+}
+
+uint8_t *get_sendbuf(void) {
+    return get_tdata()->sendbuf;
+}
+
+uint8_t *get_recvbuf(void) {
+    return get_tdata()->recvbuf;
+}
+
+/* Wake up the worker that owns the given ship. */
+void worker_wake(sg_worker_t *w) {
+    /* The pipe is non-blocking, so if it is full, there's already a wake up
+       pending anyway, so we don't care if this fails. */
+    if(write(w->pipes[1], "\xFF", 1) < 0 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+/* Take a copy of the list of ships the worker owns, so that they can be
+   worked on without holding onto ships_lock. Nobody but the worker itself takes
+   its ships away, so everything in the copy stays around until the worker gets
+   rid of it. Returns the number of ships, or -1 on error. */
+static int worker_snapshot(sg_worker_t *w) {
+    ship_t *i, **tmp;
+    int count = 0;
+
+    pthread_rwlock_rdlock(&ships_lock);
+
+    if(w->ship_count > w->snap_size) {
+        tmp = (ship_t **)realloc(w->snap, w->ship_count * sizeof(ship_t *));
+
+        if(!tmp) {
+            pthread_rwlock_unlock(&ships_lock);
+            return -1;
+        }
+
+        w->snap = tmp;
+        w->snap_size = w->ship_count;
+    }
+
+    TAILQ_FOREACH(i, &w->ships, wentry) {
+        w->snap[count++] = i;
+    }
+
+    pthread_rwlock_unlock(&ships_lock);
+
+    return count;
+}
+
+/* Get rid of any ships in the snapshot that have been disconnected. They're
+   taken out of the lists with the write lock held, but the rest of the clean
+   up (which hits the database) is done without it. */
+static void worker_reap(sg_worker_t *w, int count) {
+    int j, dead = 0;
+
+    for(j = 0; j < count; ++j) {
+        if(w->snap[j]->disconnected)
+            break;
+    }
+
+    if(j == count)
+        return;
+
+    pthread_rwlock_wrlock(&ships_lock);
+
+    for(; j < count; ++j) {
+        if(w->snap[j]->disconnected) {
+            ship_unlink(w->snap[j]);
+            w->snap[dead++] = w->snap[j];
+        }
+    }
+
+    pthread_rwlock_unlock(&ships_lock);
+
+    for(j = 0; j < dead; ++j) {
+        destroy_connection(w->snap[j]);
+    }
+}
+
+static void *worker_thd(void *d) {
+    sg_worker_t *w = (sg_worker_t *)d;
+    int nfds, count, j;
+    struct timeval timeout;
+    fd_set readfds, writefds;
+    ship_t *i;
+    ssize_t sent;
+    time_t now;
+    char junk[64];
+
+    if(tdata_attach(&w->td)) {
+        pthread_exit(NULL);
+    }
+
+    debug(DBG_LOG, "Worker %d: Up and running\n", w->idx);
+
+    while(w->run) {
+        /* Clear the fd_sets so we can use them. */
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        nfds = 0;
+        timeout.tv_sec = 30;
+        timeout.tv_usec = 0;
+        now = time(NULL);
+
+        if((count = worker_snapshot(w)) < 0) {
+            debug(DBG_ERROR, "Worker %d: Cannot allocate memory!\n", w->idx);
+            sleep(1);
+            continue;
+        }
+
+        /* Every so often, log how far behind each of the ships is. */
+        if(now >= w->next_stats) {
+            for(j = 0; j < count; ++j) {
+                log_send_stats(w->snap[j]);
+            }
+
+            w->next_stats = now + SHIP_STATS_INTERVAL;
+        }
+
+        /* Fill the sockets into the fd_set so we can use select below. */
+        for(j = 0; j < count; ++j) {
+            i = w->snap[j];
+
+            if(i->disconnected) {
+                timeout.tv_sec = 0;
+                continue;
+            }
+
+            /* If we haven't heard from a ship in 2 minutes, its dead.
+               Disconnect it. */
+            if(now > i->last_message + 120 && i->last_ping &&
+               now > i->last_ping + 60) {
+                i->disconnected = 1;
+                timeout.tv_sec = 0;
+                continue;
+            }
+            /* Otherwise, if we haven't heard from it in a minute, ping it. */
+            else if(now > i->last_message + 60 && now > i->last_ping + 10) {
+                send_ping(i, 0);
+                i->last_ping = now;
+            }
+
+            /* Send out anything other threads have queued up for us. */
+            if(send_queued(i)) {
+                i->disconnected = 1;
+                timeout.tv_sec = 0;
+                continue;
+            }
+
+            FD_SET(i->sock, &readfds);
+
+            if(i->sendbuf_cur) {
+                FD_SET(i->sock, &writefds);
+            }
+
+            nfds = nfds > i->sock ? nfds : i->sock;
+
+            /* Check GnuTLS' buffer for the connection. */
+            if(gnutls_record_check_pending(i->session)) {
+                if(handle_pkt(i)) {
+                    i->disconnected = 1;
+                    timeout.tv_sec = 0;
+                }
+            }
+        }
+
+        FD_SET(w->pipes[0], &readfds);
+        nfds = nfds > w->pipes[0] ? nfds : w->pipes[0];
+
+        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
+            /* Empty out the pipe, the actual work for whatever woke us up gets
+               done at the top of the loop. */
+            if(FD_ISSET(w->pipes[0], &readfds)) {
+                while(read(w->pipes[0], junk, 64) > 0) {
+                }
+            }
+
+            /* Check each ship's socket for activity. */
+            for(j = 0; j < count; ++j) {
+                i = w->snap[j];
+
+                if(i->disconnected) {
+                    continue;
+                }
+
+                /* Check if this ship was trying to send us anything. */
+                if(FD_ISSET(i->sock, &readfds)) {
+                    if(handle_pkt(i)) {
+                        i->disconnected = 1;
+                        continue;
+                    }
+
+                    i->last_ping = 0;
+                }
+
+                /* If we have anything to write, check if we can. */
+                if(FD_ISSET(i->sock, &writefds)) {
+                    if(i->sendbuf_cur) {
+                        sent = send(i->sock, i->sendbuf + i->sendbuf_start,
+                                    i->sendbuf_cur - i->sendbuf_start, 0);
+
+                        /* If we fail to send, and the error isn't EAGAIN,
+                           bail. */
+                        if(sent == -1) {
+                            if(errno != EAGAIN) {
+                                i->disconnected = 1;
+                            }
+                        }
+                        else {
+                            i->sendbuf_start += sent;
+
+                            /* If we've sent everything, free the buffer. */
+                            if(i->sendbuf_start == i->sendbuf_cur) {
+                                free(i->sendbuf);
+                                i->sendbuf = NULL;
+                                i->sendbuf_cur = 0;
+                                i->sendbuf_size = 0;
+                                i->sendbuf_start = 0;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        /* Clean up any dead connections. */
+        worker_reap(w, count);
+    }
+
+    pthread_exit(NULL);
+}
+
+/* Start up the given number of worker threads. */
+int workers_start(int count) {
+    sg_worker_t *w;
+    int i;
+
+    if(count < 1)
+        count = 1;
+    else if(count > MAX_WORKERS)
+        count = MAX_WORKERS;
+
+    debug(DBG_LOG, "Starting %d worker threads...\n", count);
+
+    for(i = 0; i < count; ++i) {
+        if(!(w = (sg_worker_t *)malloc(sizeof(sg_worker_t)))) {
+            debug(DBG_ERROR, "Cannot allocate memory for worker!\n");
+            return -1;
+        }
+
+        memset(w, 0, sizeof(sg_worker_t));
+        TAILQ_INIT(&w->ships);
+        w->idx = i;
+        w->run = 1;
+        w->next_stats = time(NULL) + SHIP_STATS_INTERVAL;
+
+        /* Make our pipe */
+        if(pipe(w->pipes) == -1) {
+            debug(DBG_ERROR, "Cannot create pipe for worker %d!\n", i);
+            free(w);
+            return -1;
+        }
+
+        fcntl(w->pipes[0], F_SETFL, O_NONBLOCK);
+        fcntl(w->pipes[1], F_SETFL, O_NONBLOCK);
+
+        if(tdata_init(&w->td, w)) {
+            goto err_pipes;
+        }
+
+        if(pthread_create(&w->thd, NULL, &worker_thd, w)) {
+            debug(DBG_ERROR, "Cannot start worker thread %d!\n", i);
+            tdata_cleanup(&w->td);
+            goto err_pipes;
+        }
+
+        workers[worker_count++] = w;
+    }
+
+    return 0;
+
+err_pipes:
+    close(w->pipes[0]);
+    close(w->pipes[1]);
+    free(w);
+    return -1;
+}
+
+/* Stop all worker threads, disconnecting any ships they own. */
+void workers_stop(void) {
+    int i;
+    ship_t *s;
+    struct ship_queue dead = TAILQ_HEAD_INITIALIZER(dead);
+
+    /* Tell each thread to stop and wait for them all to actually do so. */
+    for(i = 0; i < worker_count; ++i) {
+        workers[i]->run = 0;
+        worker_wake(workers[i]);
+    }
+
+    for(i = 0; i < worker_count; ++i) {
+        pthread_join(workers[i]->thd, NULL);
+    }
+
+    /* Log the relay statistics while the workers' counts are still around. */
+    fw_hist_dump();
+
+    /* Disconnect any ships that are still around. */
+    pthread_rwlock_wrlock(&ships_lock);
+
+    while((s = TAILQ_FIRST(&ships))) {
+        ship_unlink(s);
+        TAILQ_INSERT_TAIL(&dead, s, qentry);
+    }
+
+    pthread_rwlock_unlock(&ships_lock);
+
+    while((s = TAILQ_FIRST(&dead))) {
+        TAILQ_REMOVE(&dead, s, qentry);
+        destroy_connection(s);
+    }
+
+    /* Clean up the workers themselves. */
+    for(i = 0; i < worker_count; ++i) {
+        tdata_cleanup(&workers[i]->td);
+        close(workers[i]->pipes[0]);
+        close(workers[i]->pipes[1]);
+        free(workers[i]->snap);
+        free(workers[i]);
+        workers[i] = NULL;
+    }
+
+    worker_count = 0;
+}
+
+void workers_fw_hist(uint32_t hist[FW_HIST_VERSIONS][256][FW_HIST_BUCKETS]) {
+    int i, j, k, l;
+
+    /* The counts are read without any locking, so one that is being bumped
+       right now might or might not make it in. That's fine for statistics. */
+    for(i = 0; i < worker_count; ++i) {
+        for(j = 0; j < FW_HIST_VERSIONS; ++j) {
+            for(k = 0; k < 256; ++k) {
+                for(l = 0; l < FW_HIST_BUCKETS; ++l) {
+                    hist[j][k][l] += workers[i]->td.fw_hist[j][k][l];
+                }
+            }
+        }
+    }
+}
+
+/* Hand off a newly connected ship to the least loaded worker thread. */
+void worker_add_ship(ship_t *s) {
+    sg_worker_t *w = NULL;
+    int i;
+
+    pthread_rwlock_wrlock(&ships_lock);
+
+    for(i = 0; i < worker_count; ++i) {
+        if(!w || workers[i]->ship_count < w->ship_count) {
+            w = workers[i];
+        }
+    }
+
+    s->worker = w;
+    TAILQ_INSERT_TAIL(&ships, s, qentry);
+    TAILQ_INSERT_TAIL(&w->ships, s, wentry);
+    ++w->ship_count;
+    ship_route_add(s);
+
+    pthread_rwlock_unlock(&ships_lock);
+
+    /* Poke the worker so it starts listening to the new ship right away. */
+    worker_wake(w);
+}
+
+/* A connection that has been accepted, but not gone through the TLS handshake
+   yet. */
+typedef struct pending_conn {
+    TAILQ_ENTRY(pending_conn) qentry;
+    int sock;
+    socklen_t len;
+    struct sockaddr_storage addr;
+} pending_conn_t;
+
+TAILQ_HEAD(pending_queue, pending_conn);
+
+/* The threads doing the handshakes and the connections waiting on them. */
+static pthread_t hs_thds[MAX_HANDSHAKE_THREADS];
+static sg_tdata_t hs_td[MAX_HANDSHAKE_THREADS];
+static int hs_count = 0;
+static volatile int hs_run = 0;
+static struct pending_queue pending = TAILQ_HEAD_INITIALIZER(pending);
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+
+static void set_sock_timeout(int sock, int secs) {
+    struct timeval tv;
+
+    tv.tv_sec = secs;
+    tv.tv_usec = 0;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void *handshake_thd(void *d) {
+    sg_tdata_t *td = (sg_tdata_t *)d;
+    pending_conn_t *p;
+    ship_t *s;
+
+    if(tdata_attach(td)) {
+        pthread_exit(NULL);
+    }
+
+    for(;;) {
+        pthread_mutex_lock(&pending_mutex);
+
+        while(hs_run && !TAILQ_FIRST(&pending)) {
+            pthread_cond_wait(&pending_cond, &pending_mutex);
+        }
+
+        if(!hs_run) {
+            pthread_mutex_unlock(&pending_mutex);
+            break;
+        }
+
+        p = TAILQ_FIRST(&pending);
+        TAILQ_REMOVE(&pending, p, qentry);
+        pthread_mutex_unlock(&pending_mutex);
+
+        /* Don't let a ship that stops talking halfway through the handshake
+           tie this thread up forever. */
+        set_sock_timeout(p->sock, HANDSHAKE_TIMEOUT);
+
+        if((s = create_connection_tls(p->sock, (struct sockaddr *)&p->addr,
+                                      p->len))) {
+            set_sock_timeout(p->sock, 0);
+            worker_add_ship(s);
+        }
+
+        free(p);
+    }
+
+    pthread_exit(NULL);
+}
+
+/* Start up the threads that do the TLS handshakes for new connections. */
+int handshake_start(int count) {
+    int i;
+
+    if(count < 1)
+        count = 1;
+    else if(count > MAX_HANDSHAKE_THREADS)
+        count = MAX_HANDSHAKE_THREADS;
+
+    hs_run = 1;
+
+    for(i = 0; i < count; ++i) {
+        if(tdata_init(&hs_td[i], NULL)) {
+            return -1;
+        }
+
+        if(pthread_create(&hs_thds[i], NULL, &handshake_thd, &hs_td[i])) {
+            debug(DBG_ERROR, "Cannot start handshake thread %d!\n", i);
+            tdata_cleanup(&hs_td[i]);
+            return -1;
+        }
+
+        ++hs_count;
+    }
+
+    return 0;
+}
+
+/* Stop the handshake threads, dropping any connections still waiting. */
+void handshake_stop(void) {
+    pending_conn_t *p;
+    int i;
+
+    pthread_mutex_lock(&pending_mutex);
+    hs_run = 0;
+    pthread_cond_broadcast(&pending_cond);
+    pthread_mutex_unlock(&pending_mutex);
+
+    for(i = 0; i < hs_count; ++i) {
+        pthread_join(hs_thds[i], NULL);
+        tdata_cleanup(&hs_td[i]);
+    }
+
+    hs_count = 0;
+
+    while((p = TAILQ_FIRST(&pending))) {
+        TAILQ_REMOVE(&pending, p, qentry);
+        close(p->sock);
+        free(p);
+    }
+}
+
+/* Queue up a newly accepted connection for its TLS handshake. */
+int handshake_queue(int sock, struct sockaddr *addr, socklen_t len) {
+    pending_conn_t *p;
+
+    if(!(p = (pending_conn_t *)malloc(sizeof(pending_conn_t)))) {
+        debug(DBG_WARN, "Cannot allocate memory for new connection!\n");
+        close(sock);
+        return -1;
+    }
+
+    p->sock = sock;
+    p->len = len;
+    memcpy(&p->addr, addr, len);
+
+    pthread_mutex_lock(&pending_mutex);
+    TAILQ_INSERT_TAIL(&pending, p, qentry);
+    pthread_cond_signal(&pending_cond);
+    pthread_mutex_unlock(&pending_mutex);
+
+    return 0;
+}
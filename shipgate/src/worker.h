@@ -0,0 +1,145 @@
+/*
+    Sylverant Shipgate
+    Copyright (C) 2014 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+#include <iconv.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include <sylverant/database.h>
+
+#include "ship.h"
+
+/* The most worker threads we'll ever start up. */
+#define MAX_WORKERS 64
+
+/* The number of threads doing TLS handshakes for new connections, and how long
+   (in seconds) a ship has to finish its handshake. */
+#define MAX_HANDSHAKE_THREADS   2
+#define HANDSHAKE_TIMEOUT       10
+
+/* Relayed packet latency histogram, by version and packet type. Bucket i counts
+   the packets that took less than 2^i microseconds to get from being read off
+   of one ship's connection to being sent on another's, and the last bucket
+   counts everything slower than that. Blue Burst types are counted by their
+   low byte. */
+#define FW_HIST_DC          0
+#define FW_HIST_PC          1
+#define FW_HIST_BB          2
+#define FW_HIST_VERSIONS    3
+#define FW_HIST_BUCKETS     20
+
+struct sg_worker;
+
+/* Per-thread data. None of the things in here are safe to share between
+   threads, so the main thread and each worker thread get their own copy. */
+typedef struct sg_tdata {
+    sylverant_dbconn_t conn;
+
+    iconv_t ic_utf8_to_utf16;
+    iconv_t ic_utf16_to_utf8;
+    iconv_t ic_sjis_to_utf8;
+    iconv_t ic_8859_to_utf8;
+
+    uint8_t recvbuf[65536];
+    uint8_t sendbuf[65536];
+
+    /* The worker this data belongs to (NULL for the main thread). */
+    struct sg_worker *worker;
+
+    /* When data was last read from a ship, and the packet being relayed right
+       now (if any), for timing relayed packets. */
+    struct timeval recv_time;
+    fw_relay_t *relay;
+
+    /* Relay latency counts for the packets this thread has sent out. Only this
+       thread ever updates them, they're just added up when they get logged. */
+    uint32_t fw_hist[FW_HIST_VERSIONS][256][FW_HIST_BUCKETS];
+} sg_tdata_t;
+
+TAILQ_HEAD(worker_ship_queue, ship);
+
+typedef struct sg_worker {
+    pthread_t thd;
+    int idx;
+    volatile int run;
+
+    /* Used to wake the thread up when another thread queues a packet for one
+       of its ships (or hands it a new ship). */
+    int pipes[2];
+
+    /* The ships this worker owns. Protected by ships_lock. */
+    struct worker_ship_queue ships;
+    int ship_count;
+
+    /* A copy of the list of ships, so they can be worked on without holding
+       ships_lock. Only the worker itself ever touches this. */
+    ship_t **snap;
+    int snap_size;
+
+    /* When the send queue depths of the ships should be logged next. */
+    time_t next_stats;
+
+    sg_tdata_t td;
+} sg_worker_t;
+
+/* Set up a set of per-thread data for the given worker (or NULL for a thread
+   that isn't a worker). */
+int tdata_init(sg_tdata_t *td, sg_worker_t *w);
+
+/* Make the given per-thread data the calling thread's own. */
+int tdata_attach(sg_tdata_t *td);
+
+/* Clean up the per-thread data set up with tdata_init. */
+void tdata_cleanup(sg_tdata_t *td);
+
+/* Grab the calling thread's per-thread data. */
+sg_tdata_t *get_tdata(void);
+
+/* Grab the calling thread's packet buffers. */
+uint8_t *get_sendbuf(void);
+uint8_t *get_recvbuf(void);
+
+/* Start up the given number of worker threads. */
+int workers_start(int count);
+
+/* Stop all worker threads, disconnecting any ships they own. */
+void workers_stop(void);
+
+/* Add up the relay latency counts of all the worker threads into hist. */
+void workers_fw_hist(uint32_t hist[FW_HIST_VERSIONS][256][FW_HIST_BUCKETS]);
+
+/* Hand off a newly connected ship to the least loaded worker thread. */
+void worker_add_ship(ship_t *s);
+
+/* Wake up the worker that owns the given ship. */
+void worker_wake(sg_worker_t *w);
+
+/* Start up the threads that do the TLS handshakes for new connections. */
+int handshake_start(int count);
+
+/* Stop the handshake threads, dropping any connections still waiting. */
+void handshake_stop(void);
+
+/* Queue up a newly accepted connection for its TLS handshake. */
+int handshake_queue(int sock, struct sockaddr *addr, socklen_t len);
+
+#endif /* !WORKER_H */